@@ -14,104 +14,509 @@
 
 #include <string>
 #include <vector>
-#include <stdlib.h>     /* srand, rand */
-#include <time.h>       /* time */
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include "index.h"
+#include "random.h"
+#include "sampler.h"
+#include "reservoir.h"
+#include "chain.h"
+#include "results.h"
+#include "groups.h"
+#include "montecarlo.h"
 #include "models/models.h"
 #include <json/json.h>
 
 
 using namespace std;
 
+
+/**
+ *  A filtered set of relations materialized once per query along with the instance count weights
+ *  and their running total.  Counts, probabilities and samplers for a query are all derived from it.
+ */
+struct RelationSet {
+    std::vector<Json::Value> relations;
+    std::vector<double> weights;
+    long total;
+
+    RelationSet() : total(0) {}
+    void add(Json::Value&);
+};
+
+/** Append a relation and accumulate its instance count */
+void RelationSet::add(Json::Value& relation) {
+    this->relations.push_back(relation);
+    this->weights.push_back(relation[JSON_ATTR_REL_COUNT].asDouble());
+    this->total += relation[JSON_ATTR_REL_COUNT].asInt();
+}
+
+/**
+ *  An estimated probability or expected value with its bounds.  Approximate answers lie within the
+ *  bounds with at least the given confidence, exact answers have equal bounds and a confidence of 1.
+ */
+struct Estimate {
+    float value;
+    float lower;
+    float upper;
+    float confidence;
+    bool approximate;
+
+    Estimate() : value(0), lower(0), upper(0), confidence(1), approximate(false) {}
+    Estimate(float exact) : value(exact), lower(exact), upper(exact), confidence(1),
+        approximate(false) {}
+    Json::Value toJson(std::string);
+};
+
+/** Json form of the estimate, "field" names the estimated quantity */
+Json::Value Estimate::toJson(std::string field) {
+    Json::Value json;
+    json[field] = this->value;
+    json["lower"] = this->lower;
+    json["upper"] = this->upper;
+    json["confidence"] = this->confidence;
+    json["approximate"] = this->approximate;
+    return json;
+}
+
+
 class Bayes {
     IndexHandler* indexHandler;
 
+    // Alias tables for repeated sampling from the same relation set
+    SamplerCache samplerCache;
+    std::mutex samplerLock;
+
+    // Memoized hops of chain queries
+    ChainCache chainCache;
+    std::mutex chainLock;
+
+    // Results of probability and attribute queries, validated on pair versions
+    ResultCache resultCache;
+    std::mutex resultLock;
+
+    // Random stream for the draws of the creating thread, split from its stream - other threads
+    // draw from streams of their own
+    std::thread::id owner;
+    RandomStream rng;
+
+    // Pairs with more distinct relations than this are estimated from their reservoirs
+    long sampleThreshold;
+
+    void collectRelations(RelationSet&, std::vector<Json::Value>&,
+        AttributeBucket&, std::string, std::string);
+    std::shared_ptr<SamplerEntry> fetchSampler(std::string, std::string, std::string,
+        std::string, AttributeBucket&, std::string, std::string);
+    bool fetchResult(std::string, std::string, ResultEntry&);
+    void storeResult(std::string, std::string, double, std::string = "");
+    RandomStream& stream(RandomStream*);
+    Relation drawFromSampler(SamplerEntry*, RandomStream&);
+    std::vector<Relation> drawManyFromSampler(SamplerEntry*, long, bool, RandomStream&);
+    bool sampleDynamic(std::string, std::string, long, std::vector<Relation>&, RandomStream&);
+    bool fetchTableCells(AttributeTuple&, AttributeBucket&, std::string,
+        std::vector<TableCell>&);
+    bool countFromCube(std::string, std::string, AttributeBucket&,
+        std::string, long&);
+    std::vector<ValueCount> topOfCounts(Json::Value&, long);
+    bool isNumericAttribute(AttributeTuple&);
+    bool sketchFilter(std::string, std::string, AttributeBucket&, std::string,
+        AttributeTuple&);
+    bool isSampledPair(std::string);
+    long fetchPairSample(std::string, std::vector<Json::Value>&, long&);
+    Estimate fromRatio(RatioEstimator&, float, float);
+    bool propagateChain(std::vector<std::string>&, AttributeBucket&, std::string,
+        std::vector<ChainFrontier>&);
+
 public:
-    Bayes() { this->indexHandler = new IndexHandler(); }
+    Bayes() : owner(std::this_thread::get_id()), rng(RandomStream::local().split()),
+        sampleThreshold(RESERVOIR_THRESHOLD) {
+        this->indexHandler = new IndexHandler(); }
     ~Bayes() { delete this->indexHandler; }
 
+    void seed(uint64_t seed) { this->rng.seed(seed); }    // the stream of the creating thread
+    void setSampleThreshold(long threshold) { this->sampleThreshold = threshold; }
+    Json::Value resultCacheStats() {
+        std::lock_guard<std::mutex> guard(this->resultLock);
+        return this->resultCache.stats();
+    }
+
     float computeMarginal(std::string, AttributeBucket&, std::string);
     float computeConditional(std::string, std::string, AttributeBucket&,
         std::string);
     float computePairwise(std::string, std::string, AttributeBucket&,
         std::string);
 
-    // Sample relations
-    Relation sampleMarginal(std::string, AttributeBucket&, std::string);
-    Relation sampleMarginal(Entity&, AttributeBucket&, std::string);
+    // Sample relations, from the given stream or the stream of the instance
+    Relation sampleMarginal(std::string, AttributeBucket&, std::string,
+        RandomStream* = NULL);
+    Relation sampleMarginal(Entity&, AttributeBucket&, std::string,
+        RandomStream* = NULL);
+    std::vector<Relation> sampleMarginal(std::string, AttributeBucket&,
+        std::string, long, bool = true, RandomStream* = NULL);
     Relation samplePairwise(std::string, std::string, AttributeBucket&,
-        std::string);
-    Relation samplePairwise(Entity&, Entity&, AttributeBucket&, std::string);
+        std::string, RandomStream* = NULL);
+    Relation samplePairwise(Entity&, Entity&, AttributeBucket&, std::string,
+        RandomStream* = NULL);
+    std::vector<Relation> samplePairwise(std::string, std::string,
+        AttributeBucket&, std::string, long, bool = true, RandomStream* = NULL);
     Relation samplePairwiseCausal(std::string, std::string, AttributeBucket&,
-        std::string);
+        std::string, RandomStream* = NULL);
     Relation samplePairwiseCausal(Entity&, Entity&, AttributeBucket&,
+        std::string, RandomStream* = NULL);
+
+    // Approximate probabilities from the count-min sketch, exact where the
+    // sketch cannot answer the filter
+    Estimate approxMarginal(std::string, AttributeBucket&, std::string);
+    Estimate approxConditional(std::string, std::string,
+        AttributeBucket&, std::string);
+    Estimate approxPairwise(std::string, std::string,
+        AttributeBucket&, std::string);
+
+    // Estimates from the pair reservoirs, exact when no pair is over the
+    // sample threshold
+    Estimate estimateConditional(std::string, std::string, AttributeBucket&,
+        std::string);
+    Estimate estimateExpected(AttributeTuple&, AttributeBucket&, std::string);
+
+    // Queries over a chain of entities E0 <- E1 <- ... <- En, the filter
+    // holds the evidence on En
+    float chainConditional(std::vector<std::string>&, AttributeBucket&,
         std::string);
+    float chainExpected(AttributeTuple&, std::vector<std::string>&,
+        AttributeBucket&, std::string);
+    std::vector<std::vector<Relation>> sampleChain(std::vector<std::string>&,
+        AttributeBucket&, std::string, long, RandomStream* = NULL);
+
+    // Monte Carlo estimates along a chain run on a work-stealing pool, the
+    // probability of E0 without an attribute and its expected value with one
+    MonteCarloEstimate monteCarloChain(AttributeTuple&,
+        std::vector<std::string>&, AttributeBucket&, std::string, double,
+        long, long = 0);
 
     // Compute expected values and mode for an attribute conditioned on filter
     // values
     float expectedAttribute(AttributeTuple&, AttributeBucket&, std::string);
+    float varianceAttribute(AttributeTuple&, AttributeBucket&, std::string);
+    float stddevAttribute(AttributeTuple&, AttributeBucket&, std::string);
+    float quantileAttribute(AttributeTuple&, AttributeBucket&, std::string, double);
+    bool momentsAttribute(AttributeTuple&, AttributeBucket&, std::string,
+        Moments&);
     std::string modeAttribute(AttributeTuple&, AttributeBucket&, std::string);
+    std::vector<ValueCount> topAttribute(AttributeTuple&, AttributeBucket&,
+        std::string, long);
+
+    // Counts, probabilities and means per value of an attribute of the given
+    // entity from one scan of its relations
+    GroupTable groupRelations(std::string, std::string, std::string,
+        std::string, AttributeBucket&, std::string, bool = false);
+    std::vector<std::pair<std::string, std::vector<Relation>>> sampleGroups(
+        std::string, std::string, std::string, AttributeBucket&, std::string,
+        long, bool = true, RandomStream* = NULL);
+
+    // Naive Bayes classifiers over the relations of an entity pair
+    bool compileClassifier(std::string, Json::Value&);
+    bool classify(std::string, std::vector<valpair>&, std::vector<Classification>&);
+
+    // Materialize the filtered relations for a query - one fetch per relation set
+    RelationSet fetchRelationSet(std::string, std::string, AttributeBucket&,
+        std::string, std::string = "");
+    RelationSet fetchMarginalSet(std::string, AttributeBucket&, std::string,
+        std::string = "");
 
     long countEntityInRelations(std::string, AttributeBucket&,
         std::string, bool);
     long countRelations(std::string, std::string, AttributeBucket&,
         std::string);
 
+    std::string samplerKey(std::string, std::string, std::string,
+        AttributeBucket&, std::string);
+
 };
 
-/** Count the occurrences of a relation subject to a set of attribute filters */
-long Bayes::countRelations(std::string e1, std::string e2,
+/** Key for a cached sampler or result - operation, entities, canonical filter and comparator */
+std::string Bayes::samplerKey(std::string mode, std::string e1, std::string e2,
     AttributeBucket& attrs, std::string compare) {
+    return mode + std::string("|") + e1 + std::string("|") + e2 +
+        std::string("|") + attrs.signature() + std::string("|") + compare;
+}
+
+/**
+ *  Filter relations on the attribute bucket and add them to a set.  Relations not caused by
+ *  "cause" are dropped when "cause" is non-empty.
+ */
+void Bayes::collectRelations(RelationSet& set, std::vector<Json::Value>& relations,
+    AttributeBucket& attrs, std::string compare, std::string cause) {
+    this->indexHandler->filterRelations(relations, attrs, compare);
+    for (std::vector<Json::Value>::iterator it = relations.begin();
+        it != relations.end(); ++it) {
+        if (cause.length() > 0 &&
+            std::strcmp((*it)[JSON_ATTR_REL_CAUSE].asCString(), cause.c_str()) != 0)
+            continue;
+        set.add(*it);
+    }
+}
+
+/** Materialize the filtered relations between two entities */
+RelationSet Bayes::fetchRelationSet(std::string e1, std::string e2,
+    AttributeBucket& attrs, std::string compare, std::string cause) {
+    RelationSet set;
     std::vector<Json::Value> relations =
         this->indexHandler->fetchRelationPrefix(e1, e2);
-    this->indexHandler->filterRelations(relations, attrs, compare);
-    long total_relations = 0;
+    this->collectRelations(set, relations, attrs, compare, cause);
+    return set;
+}
+
+/** Materialize the filtered relations containing an entity on either side */
+RelationSet Bayes::fetchMarginalSet(std::string e, AttributeBucket& attrs,
+    std::string compare, std::string cause) {
+    RelationSet set;
+    std::vector<Json::Value> relations =
+        this->indexHandler->fetchEntityRelations(e);
+    this->collectRelations(set, relations, attrs, compare, cause);
+    return set;
+}
+
+/**
+ *  Fetch the cached sampler for a key, building it from a materialized relation set if it is
+ *  missing or any of the pairs it was built from has changed.  An empty "e2" samples the marginal
+ *  over "e1".  Storage is only read on a cache miss.
+ */
+std::shared_ptr<SamplerEntry> Bayes::fetchSampler(std::string key, std::string versions,
+    std::string e1, std::string e2, AttributeBucket& attrs, std::string compare,
+    std::string cause) {
+
+    std::unique_lock<std::mutex> guard(this->samplerLock);
+    std::shared_ptr<SamplerEntry> entry = this->samplerCache.fetch(key, versions);
+    if (entry) return entry;
+    guard.unlock();     // other threads may sample while the relations are read
+
+    RelationSet set = e2.length() > 0 ?
+        this->fetchRelationSet(e1, e2, attrs, compare, cause) :
+        this->fetchMarginalSet(e1, attrs, compare, cause);
+    guard.lock();
+    return this->samplerCache.store(key, versions, set.relations, set.weights);
+}
+
+/** Copy out a cached result if one is current for the versions */
+bool Bayes::fetchResult(std::string key, std::string versions, ResultEntry& result) {
+    std::lock_guard<std::mutex> guard(this->resultLock);
+    ResultEntry* cached = this->resultCache.fetch(key, versions);
+    if (cached == NULL) return false;
+    result = *cached;
+    return true;
+}
+
+/** Cache a result computed from the versions */
+void Bayes::storeResult(std::string key, std::string versions, double number, std::string text) {
+    std::lock_guard<std::mutex> guard(this->resultLock);
+    this->resultCache.store(key, versions, number, text);
+}
+
+/**
+ *  The stream to draw from - one passed for the request, e.g. seeded, or else the stream of the
+ *  instance on the thread that created it and the stream of the thread on any other
+ */
+RandomStream& Bayes::stream(RandomStream* rng) {
+    if (rng != NULL) return *rng;
+    return std::this_thread::get_id() == this->owner ? this->rng : RandomStream::local();
+}
+
+/** Draw a relation from a sampler in proportion to instance counts */
+Relation Bayes::drawFromSampler(SamplerEntry* entry, RandomStream& rng) {
+    double u1 = rng.uniform();
+    double u2 = rng.uniform();
+    long index = entry->table.sample(u1, u2);
+    if (index < 0) return Relation();   // Empty relation set
+    return Relation(entry->relations[index]);
+}
+
+/**
+ *  Draw a batch of relations from a sampler.  With replacement every draw is independent.  Without
+ *  replacement each draw consumes one instance of the relation drawn, draws are proposed from the
+ *  alias table and accepted in proportion to the instances left, the table is rebuilt over the
+ *  remaining instances once the acceptance rate drops below one half.
+ */
+std::vector<Relation> Bayes::drawManyFromSampler(SamplerEntry* entry, long n,
+    bool replacement, RandomStream& rng) {
+    std::vector<Relation> samples;
+    long index;
+    double u1, u2;
+
+    if (replacement) {
+        for (long i = 0; i < n; i++) {
+            u1 = rng.uniform();
+            u2 = rng.uniform();
+            index = entry->table.sample(u1, u2);
+            if (index < 0) break;   // Empty relation set
+            samples.push_back(Relation(entry->relations[index]));
+        }
+        return samples;
+    }
+
+    std::vector<double> remaining = entry->weights;
+    std::vector<double> proposal = entry->weights;
+    AliasTable table = entry->table;
+    double remainingTotal = table.getTotal();
+    double proposalTotal = remainingTotal;
+
+    while (samples.size() < n && remainingTotal >= 1.0) {
+        if (remainingTotal < 0.5 * proposalTotal) {
+            proposal = remaining;
+            table.build(proposal);
+            proposalTotal = remainingTotal;
+        }
+        u1 = rng.uniform();
+        u2 = rng.uniform();
+        index = table.sample(u1, u2);
+        if (index < 0) break;
+
+        // Accept in proportion to the remaining instances of the proposed relation
+        if (rng.uniform() * proposal[index] >= remaining[index])
+            continue;
+        remaining[index] -= 1.0;
+        remainingTotal -= 1.0;
+        samples.push_back(Relation(entry->relations[index]));
+    }
+    return samples;
+}
+
+/**
+ *  Draw n relations with replacement from the dynamic sampler of a single entity pair.  The sampler
+ *  is kept current by the write path and only rebuilt when the pair has been changed by another
+ *  process.  Returns false if the entities are patterns spanning several pairs.
+ */
+bool Bayes::sampleDynamic(std::string x, std::string y, long n,
+    std::vector<Relation>& samples, RandomStream& rng) {
+    if (x.find_first_of("*?[") != std::string::npos ||
+        y.find_first_of("*?[") != std::string::npos)
+        return false;
+
+    DynamicSamplerRegistry& registry = DynamicSamplerRegistry::instance();
+    std::string pair = this->indexHandler->orderPairAlphaNumeric(x, y);
+    long version = this->indexHandler->fetchPairVersion(pair);
+
+    if (!registry.isCurrent(pair, version)) {
+        std::vector<std::string> keys;
+        std::vector<Json::Value> relations;
+        this->indexHandler->fetchPairRelations(pair, keys, relations);
+        registry.build(pair, version, keys, relations);
+    }
+
+    std::vector<double> variates;
+    for (long i = 0; i < n; i++)
+        variates.push_back(rng.uniform());
+    std::vector<Json::Value> relations = registry.sample(pair, variates);
     for (std::vector<Json::Value>::iterator it = relations.begin();
         it != relations.end(); ++it)
-        total_relations += (*it)[JSON_ATTR_REL_COUNT].asInt();
-    return total_relations;
+        samples.push_back(Relation(*it));
+    return true;
+}
+
+/** Count the occurrences of a relation subject to a set of attribute filters */
+long Bayes::countRelations(std::string e1, std::string e2,
+    AttributeBucket& attrs, std::string compare) {
+    long count;
+    if (this->countFromCube(e1, e2, attrs, compare, count)) return count;
+    return this->fetchRelationSet(e1, e2, attrs, compare).total;
 }
 
 /** Count the occurrences of an entity among relevant relations */
 long Bayes::countEntityInRelations(std::string e, AttributeBucket& attrs,
     std::string compare, bool causal=false) {
-    std::vector<Json::Value> relations_left =
-        this->indexHandler->fetchRelationPrefix(e, "*");
-    std::vector<Json::Value> relations_right =
-        this->indexHandler->fetchRelationPrefix("*", e);
-
-    // Filter on attribute conditions in AttributeBucket
-    this->indexHandler->filterRelations(relations_left, attrs, compare);
-    this->indexHandler->filterRelations(relations_right, attrs, compare);
-
-    // Count the relations
-    long total_relations = 0;
-    for (std::vector<Json::Value>::iterator it = relations_left.begin();
-        it != relations_left.end(); ++it) {
-        if (std::strcmp((*it)[JSON_ATTR_REL_CAUSE].asCString(),
-            e.c_str()) != 0 && causal) continue;
-        total_relations += (*it)[JSON_ATTR_REL_COUNT].asInt();
-    }
+    long count;
+    if (!causal && this->countFromCube(e, "", attrs, compare, count)) return count;
+    return this->fetchMarginalSet(e, attrs, compare, causal ? e : "").total;
+}
+
+/**
+ *  Count filtered relations between two entities, or on one entity when the second is empty, from
+ *  an aggregate cube.  The cube must be over the pair and hold every filtered attribute of its two
+ *  entities, filters on other entities do not apply to relations of the pair.  A count on one
+ *  entity also needs the pair to be the only one the entity has relations in.
+ */
+bool Bayes::countFromCube(std::string e1, std::string e2, AttributeBucket& attrs,
+    std::string compare, long& count) {
+
+    std::unordered_map<std::string, std::vector<std::string>> hash =
+        attrs.getAttributeHash();
+    if (hash.size() == 0 || e1.find_first_of("*?[") != std::string::npos ||
+        e2.find_first_of("*?[") != std::string::npos)
+        return false;
+
+    std::vector<Json::Value> definitions = this->indexHandler->fetchCubes();
+    if (definitions.size() == 0) return false;
 
-    for (std::vector<Json::Value>::iterator it = relations_right.begin();
-        it != relations_right.end(); ++it) {
-        if (std::strcmp((*it)[JSON_ATTR_REL_CAUSE].asCString(),
-            e.c_str()) != 0 && causal) continue;
-        total_relations+= (*it)[JSON_ATTR_REL_COUNT].asInt();
+    std::string pair;
+    if (e2.length() > 0)
+        pair = this->indexHandler->orderPairAlphaNumeric(e1, e2);
+    else {
+        std::vector<std::string> pairs = this->indexHandler->fetchEntityPairs(e1);
+        if (pairs.size() != 1) return false;
+        pair = pairs[0];
     }
 
-    return total_relations;
+    std::vector<AttributeTuple> filters;
+    for (std::unordered_map<std::string, std::vector<std::string>>::iterator
+        it = hash.begin(); it != hash.end(); ++it)
+        for (std::vector<std::string>::iterator itTuple = it->second.begin();
+            itTuple != it->second.end(); ++itTuple)
+            filters.push_back(AttributeTuple(*itTuple));
+
+    AggregateCube cube;
+    std::string first, second;
+    bool covered;
+    for (std::vector<Json::Value>::iterator it = definitions.begin();
+        it != definitions.end(); ++it) {
+        first = (*it)[JSON_ATTR_CUBE_ENTITIES][0].asString();
+        second = (*it)[JSON_ATTR_CUBE_ENTITIES][1].asString();
+        if ((first.compare(e1) != 0 && second.compare(e1) != 0) ||
+            this->indexHandler->orderPairAlphaNumeric(first, second).compare(pair) != 0)
+            continue;
+
+        covered = true;
+        for (std::vector<AttributeTuple>::iterator itFilter = filters.begin();
+            itFilter != filters.end() && covered; ++itFilter)
+            if (itFilter->entity.compare(first) == 0 || itFilter->entity.compare(second) == 0)
+                covered = AggregateCube::covers(*it, itFilter->entity, itFilter->attribute);
+        if (!covered || !this->indexHandler->loadCube((*it)[JSON_ATTR_CUBE_NAME].asString(), cube))
+            continue;
+
+        std::vector<std::vector<bool>> masks = cube.masks();
+        long dim;
+        for (std::vector<AttributeTuple>::iterator itFilter = filters.begin();
+            itFilter != filters.end(); ++itFilter) {
+            dim = cube.dimension(itFilter->entity, itFilter->attribute);
+            if (dim >= 0)
+                cube.restrict(masks[dim], dim, *itFilter, compare);
+        }
+        count = cube.sum(masks);
+        return true;
+    }
+    return false;
 }
 
-/** Marginal probability of an entities determined by occurrences
-    present in relations */
+/**
+ *  Marginal probability of an entities determined by occurrences present in
+ *  relations.  The relation total divides every marginal so it is part of the
+ *  versions of a cached result.
+ */
 float Bayes::computeMarginal(std::string e, AttributeBucket& attrs,
     std::string compare) {
     long total = this->indexHandler->getRelationCountTotal();
-    if (total > 0)
-        return (float)this->countEntityInRelations(e, attrs, compare) /
+    std::string key = this->samplerKey("marginal", e, "", attrs, compare);
+    std::string versions = this->indexHandler->fetchEntityPairVersions(e) +
+        std::to_string(total);
+    ResultEntry cached;
+    if (this->fetchResult(key, versions, cached)) return cached.number;
+
+    if (total > 0) {
+        float marginal = (float)this->countEntityInRelations(e, attrs, compare) /
             (float)total;
-    else {
+        this->storeResult(key, versions, marginal);
+        return marginal;
+    } else {
         cout << "DEBUG -- Bad total relation count: " << total << endl;
         return 0;
     }
@@ -121,27 +526,565 @@ float Bayes::computeMarginal(std::string e, AttributeBucket& attrs,
 float Bayes::computePairwise(std::string e1, std::string e2,
     AttributeBucket& attrs, std::string compare) {
     long total = this->indexHandler->getRelationCountTotal();
-    if (total > 0)
-        return (float)this->countRelations(e1, e2, attrs, compare) /
+    std::string key = this->samplerKey("pairwise", e1, e2, attrs, compare);
+    std::string versions = this->indexHandler->fetchPairVersions(e1, e2) +
+        std::to_string(total);
+    ResultEntry cached;
+    if (this->fetchResult(key, versions, cached)) return cached.number;
+
+    if (total > 0) {
+        float pairwise = (float)this->countRelations(e1, e2, attrs, compare) /
             (float)total;
-    else {
+        this->storeResult(key, versions, pairwise);
+        return pairwise;
+    } else {
         cout << "DEBUG -- Bad total relation count: " << total << endl;
         return 0;
     }
 }
 
-/** Conditional Probabilities among entities */
+/**
+ *  Conditional Probabilities among entities.  The relation total divides both the pairwise and
+ *  the marginal probability so the ratio of counts is used directly, and only the pairs on "e2"
+ *  are read.
+ */
 float Bayes::computeConditional(std::string e1, std::string e2,
     AttributeBucket& attrs, std::string compare) {
-    float pairwise = this->computePairwise(e1, e2, attrs, compare);
-    float marginal = this->computeMarginal(e2, attrs, compare);
+    std::string key = this->samplerKey("conditional", e1, e2, attrs, compare);
+    std::string versions = this->indexHandler->fetchEntityPairVersions(e2);
+    ResultEntry cached;
+    if (this->fetchResult(key, versions, cached)) return cached.number;
 
-    if (marginal > 0)
-        return pairwise / marginal;
-    else {
+    long pairwise = this->countRelations(e1, e2, attrs, compare);
+    long marginal = this->countEntityInRelations(e2, attrs, compare);
+
+    if (marginal > 0) {
+        this->storeResult(key, versions, (float)pairwise / (float)marginal);
+        return (float)pairwise / (float)marginal;
+    } else {
         cout << "DEBUG -- marginal likelihood is 0" << endl;
+        this->storeResult(key, versions, 0);
+        return 0;
+    }
+}
+
+/**
+ *  Propagate the evidence on the last entity of a chain back to the first.  Each hop conditions
+ *  on the states reached on the nearer entity, the first hop on the evidence itself, and the
+ *  probability of a hop from a state is the share of the instances on the nearer entity in that
+ *  state that are relations with the farther entity, as in computeConditional.  Steps missing from
+ *  the cache for one hop are built in parallel.
+ *
+ *  @param chain        entity names E0 ... En
+ *  @param frontiers    receives the states reached on En ... E0, En holding one empty state
+ *
+ *  @returns            false if the chain is shorter than two entities, holds patterns or
+ *                      repeats an entity on consecutive hops
+ **/
+bool Bayes::propagateChain(std::vector<std::string>& chain,
+    AttributeBucket& evidence, std::string compare,
+    std::vector<ChainFrontier>& frontiers) {
+
+    if (chain.size() < 2) return false;
+    for (long i = 0; i < chain.size(); i++)
+        if (chain[i].find_first_of("*?[") != std::string::npos ||
+            (i > 0 && chain[i].compare(chain[i - 1]) == 0))
+            return false;
+
+    frontiers.clear();
+    frontiers.push_back(ChainFrontier());
+    frontiers.back()[""].mass = 1.0;
+
+    for (long hop = chain.size() - 1; hop > 0; hop--) {
+        std::string nearer = chain[hop], farther = chain[hop - 1];
+        std::string versions =
+            this->indexHandler->fetchPairVersions(farther, nearer) +
+            std::string("|") +
+            this->indexHandler->fetchEntityPairVersions(nearer);
+        ChainFrontier& frontier = frontiers.back();
+
+        // Memoized steps are reused, the rest are built together
+        std::vector<ChainTask> tasks;
+        std::vector<std::string> keys;
+        for (ChainFrontier::iterator it = frontier.begin();
+            it != frontier.end(); ++it) {
+            ChainTask task;
+            task.filter = hop == chain.size() - 1 ? evidence :
+                it->second.state.bucket(nearer);
+            task.compare = hop == chain.size() - 1 ? compare :
+                ATTR_TUPLE_COMPARE_EQ;
+            std::string key = ChainCache::stepKey(farther, nearer,
+                task.filter, task.compare);
+            std::unique_lock<std::mutex> guard(this->chainLock);
+            it->second.step = this->chainCache.fetch(key, versions);
+            guard.unlock();
+            if (it->second.step) continue;
+
+            task.step = std::make_shared<ChainStep>();
+            task.step->versions = versions;
+            it->second.step = task.step;
+            tasks.push_back(task);
+            keys.push_back(key);
+        }
+        ChainCache::build(farther, nearer, tasks);
+        std::unique_lock<std::mutex> guard(this->chainLock);
+        for (long i = 0; i < tasks.size(); i++)
+            this->chainCache.store(keys[i], tasks[i].step);
+        guard.unlock();
+
+        ChainFrontier next;
+        for (ChainFrontier::iterator it = frontier.begin();
+            it != frontier.end(); ++it) {
+            ChainStep& step = *(it->second.step);
+            if (step.marginal <= 0) continue;
+            for (long i = 0; i < step.relations.size(); i++) {
+                ChainNode& node = next[step.states[i].key];
+                node.state = step.states[i];
+                node.mass += it->second.mass * step.weights[i] / step.marginal;
+            }
+        }
+        frontiers.push_back(next);
+    }
+
+    // Chains complete from every state on E0, the reach of the others
+    // follows back along the steps
+    for (ChainFrontier::iterator it = frontiers.back().begin();
+        it != frontiers.back().end(); ++it)
+        it->second.reach = 1.0;
+    for (long h = frontiers.size() - 2; h >= 0; h--)
+        for (ChainFrontier::iterator it = frontiers[h].begin();
+            it != frontiers[h].end(); ++it) {
+            ChainStep& step = *(it->second.step);
+            if (step.marginal <= 0) continue;
+            for (long i = 0; i < step.relations.size(); i++)
+                it->second.reach += step.weights[i] / step.marginal *
+                    frontiers[h + 1][step.states[i].key].reach;
+        }
+    return true;
+}
+
+/**
+ *  Probability of the first entity of a chain given the last, chaining the
+ *  conditional probability of each hop over the states reached in between
+ *
+ *  @param chain    entity names E0 ... En
+ *  @param attrs    evidence on En
+ **/
+float Bayes::chainConditional(std::vector<std::string>& chain,
+    AttributeBucket& attrs, std::string compare) {
+    std::vector<ChainFrontier> frontiers;
+    if (!this->propagateChain(chain, attrs, compare, frontiers)) return 0;
+    return frontiers[0][""].reach;
+}
+
+/**
+ *  Expected value of an attribute of the first entity of a chain given the
+ *  evidence on the last, over the instances carrying the attribute
+ *
+ *  @param attr     attribute of E0
+ *  @param chain    entity names E0 ... En
+ *  @param attrs    evidence on En
+ **/
+float Bayes::chainExpected(AttributeTuple& attr,
+    std::vector<std::string>& chain, AttributeBucket& attrs,
+    std::string compare) {
+
+    std::vector<ChainFrontier> frontiers;
+    if (chain.size() == 0 || attr.entity.compare(chain[0]) != 0 ||
+        !this->isNumericAttribute(attr))
         return 0;
+    if (!this->propagateChain(chain, attrs, compare, frontiers)) return 0;
+
+    double sum = 0.0, mass = 0.0;
+    for (ChainFrontier::iterator it = frontiers.back().begin();
+        it != frontiers.back().end(); ++it) {
+        if (!it->second.state.fields.isMember(attr.attribute)) continue;
+        sum += it->second.mass *
+            std::atof(it->second.state.fields[attr.attribute].asCString());
+        mass += it->second.mass;
+    }
+    return mass > 0.0 ? (float)(sum / mass) : 0;
+}
+
+/**
+ *  Draw paths along a chain given the evidence on its last entity.  Each
+ *  path is drawn ancestrally from the evidence, one relation per hop, with
+ *  draws weighted by the reach of the state they lead to so that paths are
+ *  drawn from the chains that complete.  Relations are returned in chain
+ *  order, the first relating E0 and E1.
+ *
+ *  @param chain    entity names E0 ... En
+ *  @param attrs    evidence on En
+ *  @param n        number of paths
+ *  @param rng      stream to draw from, NULL for the stream of the instance
+ **/
+std::vector<std::vector<Relation>> Bayes::sampleChain(
+    std::vector<std::string>& chain, AttributeBucket& attrs,
+    std::string compare, long n, RandomStream* rng) {
+
+    std::vector<std::vector<Relation>> paths;
+    std::vector<ChainFrontier> frontiers;
+    if (!this->propagateChain(chain, attrs, compare, frontiers)) return paths;
+    if (frontiers[0][""].reach <= 0.0) return paths;
+
+    // Onward weights of each state reached, built once for all draws
+    std::vector<double> weights;
+    for (long h = 0; h < frontiers.size() - 1; h++)
+        for (ChainFrontier::iterator it = frontiers[h].begin();
+            it != frontiers[h].end(); ++it) {
+            ChainStep& step = *(it->second.step);
+            weights.clear();
+            for (long i = 0; i < step.relations.size(); i++)
+                weights.push_back(step.weights[i] *
+                    frontiers[h + 1][step.states[i].key].reach);
+            it->second.table.build(weights);
+        }
+
+    RandomStream& draws = this->stream(rng);
+    long index;
+    double u1, u2;
+    for (long s = 0; s < n; s++) {
+        std::vector<Relation> path;
+        ChainNode* node = &(frontiers[0][""]);
+        for (long h = 0; h < frontiers.size() - 1; h++) {
+            u1 = draws.uniform();
+            u2 = draws.uniform();
+            index = node->table.sample(u1, u2);
+            path.insert(path.begin(), Relation(node->step->relations[index]));
+            node = &(frontiers[h + 1][node->step->states[index].key]);
+        }
+        paths.push_back(path);
+    }
+    return paths;
+}
+
+/**
+ *  Estimate the probability of the first entity of a chain, or the expected
+ *  value of its attribute, from draws along the chain.  The states reached
+ *  are flattened into nodes once and the draws run in parallel until the
+ *  standard error reaches the precision or the budget runs out.  Value draws
+ *  are weighted by reach as in sampleChain, indicator draws follow the
+ *  conditional probability of each hop and stop on the first miss.
+ *
+ *  @param attr         attribute of E0, an empty attribute for the probability
+ *  @param chain        entity names E0 ... En, two for a pair
+ *  @param attrs        evidence on En
+ *  @param precision    target standard error, 0 to use the whole budget
+ *  @param budget       milliseconds
+ *  @param workers      pool size, 0 to size it to the machine
+ **/
+MonteCarloEstimate Bayes::monteCarloChain(AttributeTuple& attr,
+    std::vector<std::string>& chain, AttributeBucket& attrs,
+    std::string compare, double precision, long budget, long workers) {
+
+    std::vector<ChainFrontier> frontiers;
+    bool values = attr.attribute.compare("") != 0;
+    if (values && (chain.size() == 0 || attr.entity.compare(chain[0]) != 0 ||
+        !this->isNumericAttribute(attr)))
+        return MonteCarloEstimate();
+    if (!this->propagateChain(chain, attrs, compare, frontiers))
+        return MonteCarloEstimate();
+
+    // Number the states level by level, the root first
+    std::vector<std::map<std::string, long>> index(frontiers.size());
+    long count = 0;
+    for (long h = 0; h < frontiers.size(); h++)
+        for (ChainFrontier::iterator it = frontiers[h].begin();
+            it != frontiers[h].end(); ++it)
+            index[h][it->first] = count++;
+
+    std::vector<MonteCarloNode> nodes(count);
+    std::vector<double> weights;
+    for (long h = 0; h < frontiers.size(); h++)
+        for (ChainFrontier::iterator it = frontiers[h].begin();
+            it != frontiers[h].end(); ++it) {
+            MonteCarloNode& node = nodes[index[h][it->first]];
+
+            if (h == frontiers.size() - 1) {
+                node.terminal = true;
+                node.hasValue = values &&
+                    it->second.state.fields.isMember(attr.attribute);
+                if (node.hasValue)
+                    node.value = std::atof(
+                        it->second.state.fields[attr.attribute].asCString());
+                continue;
+            }
+
+            ChainStep& step = *(it->second.step);
+            weights.clear();
+            for (long i = 0; i < step.relations.size(); i++) {
+                weights.push_back(step.weights[i] * (values ?
+                    frontiers[h + 1][step.states[i].key].reach : 1.0));
+                node.next.push_back(index[h + 1][step.states[i].key]);
+            }
+            node.table.build(weights);
+            node.proceed = step.marginal > 0 ?
+                (double)step.total / step.marginal : 0.0;
+        }
+
+    MonteCarlo mc(nodes, values);
+    return mc.run(this->stream(NULL), precision, budget, workers);
+}
+
+/**
+ *  Determine whether the sketch can answer a query - an equality filter on at most one attribute,
+ *  literal entity names and no entity removals pending whose relations are still counted.
+ *
+ *  @param filter   receives the filter tuple, its attribute is empty for an unfiltered query
+ */
+bool Bayes::sketchFilter(std::string e1, std::string e2, AttributeBucket& attrs,
+    std::string compare, AttributeTuple& filter) {
+
+    if (e1.find_first_of("*?[") != std::string::npos ||
+        e2.find_first_of("*?[") != std::string::npos)
+        return false;
+    if (compare.compare(ATTR_TUPLE_COMPARE_EQ) != 0) return false;
+    if (this->indexHandler->fetchTombstones().size() > 0) return false;
+
+    std::unordered_map<std::string, std::vector<std::string>> hash =
+        attrs.getAttributeHash();
+    filter = AttributeTuple();
+    if (hash.size() == 0) return true;
+    if (hash.size() > 1 || hash.begin()->second.size() != 1) return false;
+
+    filter = AttributeTuple(hash.begin()->second[0]);
+    return filter.type.compare(COLTYPE_NAME_INT) == 0 ||
+        filter.type.compare(COLTYPE_NAME_FLOAT) == 0 ||
+        filter.type.compare(COLTYPE_NAME_STR) == 0;
+}
+
+/** Approximate marginal probability of an entity among all relation instances */
+Estimate Bayes::approxMarginal(std::string e, AttributeBucket& attrs,
+    std::string compare) {
+    AttributeTuple filter;
+    SketchEstimate count;
+    if (!this->sketchFilter(e, e, attrs, compare, filter) ||
+        !this->indexHandler->estimateCount(CountSketch::entityScope(e), filter, count))
+        return Estimate(this->computeMarginal(e, attrs, compare));
+
+    Estimate estimate;
+    estimate.approximate = filter.attribute.length() > 0;
+    if (estimate.approximate) estimate.confidence = CountSketch::confidence();
+
+    long total = this->indexHandler->getRelationCountTotal();
+    if (total <= 0) return estimate;
+    estimate.value = (float)count.count / total;
+    estimate.lower = (float)(count.count - count.error) / total;
+    estimate.upper = estimate.value;
+    return estimate;
+}
+
+/** Approximate probability of a relation on a pair among all relation instances */
+Estimate Bayes::approxPairwise(std::string e1, std::string e2,
+    AttributeBucket& attrs, std::string compare) {
+    AttributeTuple filter;
+    SketchEstimate count;
+    if (!this->sketchFilter(e1, e2, attrs, compare, filter) ||
+        !this->indexHandler->estimateCount(CountSketch::pairScope(
+            this->indexHandler->orderPairAlphaNumeric(e1, e2)), filter, count))
+        return Estimate(this->computePairwise(e1, e2, attrs, compare));
+
+    Estimate estimate;
+    estimate.approximate = filter.attribute.length() > 0;
+    if (estimate.approximate) estimate.confidence = CountSketch::confidence();
+
+    long total = this->indexHandler->getRelationCountTotal();
+    if (total <= 0) return estimate;
+    estimate.value = (float)count.count / total;
+    estimate.lower = (float)(count.count - count.error) / total;
+    estimate.upper = estimate.value;
+    return estimate;
+}
+
+/**
+ *  Approximate conditional probability of "e1" given "e2".  The pairwise and the marginal count
+ *  are both overestimates, so the bounds take each at both ends of its error range and hold when
+ *  both estimates do.  Filters the sketch cannot answer are estimated from the pair reservoirs.
+ */
+Estimate Bayes::approxConditional(std::string e1, std::string e2,
+    AttributeBucket& attrs, std::string compare) {
+    AttributeTuple filter;
+    SketchEstimate pairwise, marginal;
+    if (!this->sketchFilter(e1, e2, attrs, compare, filter) ||
+        !this->indexHandler->estimateCount(CountSketch::pairScope(
+            this->indexHandler->orderPairAlphaNumeric(e1, e2)), filter, pairwise) ||
+        !this->indexHandler->estimateCount(CountSketch::entityScope(e2), filter,
+            marginal))
+        return this->estimateConditional(e1, e2, attrs, compare);
+
+    Estimate estimate;
+    estimate.approximate = filter.attribute.length() > 0;
+    if (estimate.approximate)
+        estimate.confidence = 1.0 - 2.0 * (1.0 - CountSketch::confidence());
+
+    if (marginal.count <= 0) return estimate;
+    estimate.value = std::min(1.0f, (float)pairwise.count / marginal.count);
+    estimate.lower = (float)(pairwise.count - pairwise.error) / marginal.count;
+    estimate.upper = marginal.count - marginal.error > 0 ?
+        std::min(1.0f, (float)pairwise.count / (marginal.count - marginal.error)) : 1.0f;
+    return estimate;
+}
+
+/** Is the pair large enough to be estimated from its reservoir rather than read */
+bool Bayes::isSampledPair(std::string pair) {
+    return this->sampleThreshold >= 0 &&
+        this->indexHandler->fetchPairDistinct(pair) > this->sampleThreshold;
+}
+
+/**
+ *  Fetch the sampled relations of a pair, building its reservoir if it is missing or has missed a
+ *  change.  Returns the number of instances on the pair, "n" receives the number sampled.
+ */
+long Bayes::fetchPairSample(std::string pair, std::vector<Json::Value>& relations,
+    long& n) {
+    ReservoirRegistry& registry = ReservoirRegistry::instance();
+    long version = this->indexHandler->fetchPairVersion(pair);
+
+    if (!registry.isCurrent(pair, version)) {
+        std::vector<std::string> keys;
+        std::vector<Json::Value> all;
+        this->indexHandler->fetchPairRelations(pair, keys, all);
+        registry.build(pair, version, keys, all);
+    }
+
+    long population = registry.sample(pair, relations);
+    n = 0;
+    for (std::vector<Json::Value>::iterator it = relations.begin();
+        it != relations.end(); ++it)
+        n += (*it)[JSON_ATTR_REL_COUNT].asInt();
+    return population;
+}
+
+/** Turn a ratio estimate into bounds clamped to [lowest, highest] */
+Estimate Bayes::fromRatio(RatioEstimator& estimator, float lowest, float highest) {
+    Estimate estimate;
+    double ratio, halfWidth;
+    estimate.approximate = estimator.isSampled();
+    if (estimate.approximate) estimate.confidence = RESERVOIR_CONFIDENCE;
+    if (!estimator.estimate(ratio, halfWidth)) return estimate;
+
+    estimate.value = ratio;
+    estimate.lower = std::max((double)lowest, ratio - halfWidth);
+    estimate.upper = std::min((double)highest, ratio + halfWidth);
+    return estimate;
+}
+
+/**
+ *  Estimate the conditional probability of "e1" given "e2" from the reservoirs of the pairs on
+ *  "e2", pairs under the sample threshold are read in full.  Each pair is a stratum of the ratio
+ *  of filtered instances on the pair (e1, e2) to all filtered instances on "e2".
+ */
+Estimate Bayes::estimateConditional(std::string e1, std::string e2,
+    AttributeBucket& attrs, std::string compare) {
+
+    std::vector<std::string> pairs;
+    bool sampled = false;
+    if (e1.find_first_of("*?[") == std::string::npos &&
+        e2.find_first_of("*?[") == std::string::npos &&
+        this->indexHandler->fetchTombstones().size() == 0) {
+        pairs = this->indexHandler->fetchEntityPairs(e2);
+        for (std::vector<std::string>::iterator it = pairs.begin();
+            it != pairs.end() && !sampled; ++it)
+            sampled = this->isSampledPair(*it);
+    }
+    if (!sampled)
+        return Estimate(this->computeConditional(e1, e2, attrs, compare));
+
+    std::string target = this->indexHandler->orderPairAlphaNumeric(e1, e2);
+    RatioEstimator estimator;
+    std::vector<std::string> keys;
+    std::vector<Json::Value> relations;
+    long n, matched;
+
+    for (std::vector<std::string>::iterator it = pairs.begin(); it != pairs.end();
+        ++it) {
+        keys.clear();
+        relations.clear();
+        bool isTarget = it->compare(target) == 0;
+
+        if (this->isSampledPair(*it)) {
+            estimator.addStratum(this->fetchPairSample(*it, relations, n));
+            this->indexHandler->filterRelations(relations, attrs, compare);
+            matched = 0;
+            for (std::vector<Json::Value>::iterator itRel = relations.begin();
+                itRel != relations.end(); ++itRel)
+                matched += (*itRel)[JSON_ATTR_REL_COUNT].asInt();
+            estimator.addUnit(isTarget ? 1.0 : 0.0, 1.0, matched);
+            estimator.addUnit(0.0, 0.0, n - matched);
+        } else {
+            this->indexHandler->fetchPairRelations(*it, keys, relations);
+            this->indexHandler->filterRelations(relations, attrs, compare);
+            matched = 0;
+            for (std::vector<Json::Value>::iterator itRel = relations.begin();
+                itRel != relations.end(); ++itRel)
+                matched += (*itRel)[JSON_ATTR_REL_COUNT].asInt();
+            estimator.addExact(isTarget ? matched : 0, matched);
+        }
+    }
+    return this->fromRatio(estimator, 0.0, 1.0);
+}
+
+/**
+ *  Estimate the expected value of an attribute from the reservoirs of the pairs on its entity,
+ *  pairs under the sample threshold are read in full.  Each pair is a stratum of the ratio of the
+ *  sum of the attribute to the number of instances carrying it.
+ */
+Estimate Bayes::estimateExpected(AttributeTuple& attr, AttributeBucket& filter,
+    std::string compare) {
+
+    if (!this->isNumericAttribute(attr)) return Estimate(-1.0);
+
+    std::vector<std::string> pairs;
+    bool sampled = false;
+    if (attr.entity.find_first_of("*?[") == std::string::npos &&
+        this->indexHandler->fetchTombstones().size() == 0) {
+        pairs = this->indexHandler->fetchEntityPairs(attr.entity);
+        for (std::vector<std::string>::iterator it = pairs.begin();
+            it != pairs.end() && !sampled; ++it)
+            sampled = this->isSampledPair(*it);
+    }
+    if (!sampled)
+        return Estimate(this->expectedAttribute(attr, filter, compare));
+
+    const char* sides[2][2] = { { JSON_ATTR_REL_ENTL, JSON_ATTR_REL_FIELDSL },
+        { JSON_ATTR_REL_ENTR, JSON_ATTR_REL_FIELDSR } };
+    RatioEstimator estimator;
+    std::vector<std::string> keys;
+    std::vector<Json::Value> relations;
+    long n, matched;
+
+    for (std::vector<std::string>::iterator it = pairs.begin(); it != pairs.end();
+        ++it) {
+        keys.clear();
+        relations.clear();
+        bool isSampled = this->isSampledPair(*it);
+
+        if (isSampled)
+            estimator.addStratum(this->fetchPairSample(*it, relations, n));
+        else
+            this->indexHandler->fetchPairRelations(*it, keys, relations);
+        this->indexHandler->filterRelations(relations, filter, compare);
+
+        matched = 0;
+        for (std::vector<Json::Value>::iterator itRel = relations.begin();
+            itRel != relations.end(); ++itRel) {
+            double sum = 0.0, carried = 0.0;
+            for (int i = 0; i < 2; i++)
+                if ((*itRel)[sides[i][0]].asString().compare(attr.entity) == 0 &&
+                    (*itRel)[sides[i][1]].isMember(attr.attribute)) {
+                    sum += std::atof((*itRel)[sides[i][1]][attr.attribute].asCString());
+                    carried += 1.0;
+                }
+            long count = (*itRel)[JSON_ATTR_REL_COUNT].asInt();
+            matched += count;
+            if (isSampled)
+                estimator.addUnit(sum, carried, count);
+            else
+                estimator.addExact(sum * count, carried * count);
+        }
+        if (isSampled) estimator.addUnit(0.0, 0.0, n - matched);
     }
+    return this->fromRatio(estimator, -HUGE_VAL, HUGE_VAL);
 }
 
 /*
@@ -151,8 +1094,8 @@ float Bayes::computeConditional(std::string e1, std::string e2,
  *  args:   the entity models & filter attributes
  **/
 Relation Bayes::sampleMarginal(Entity& e, AttributeBucket& attrs,
-    std::string compare) {
-    return this->sampleMarginal(e.name, attrs, compare);
+    std::string compare, RandomStream* rng) {
+    return this->sampleMarginal(e.name, attrs, compare, rng);
 }
 
 /*
@@ -162,43 +1105,32 @@ Relation Bayes::sampleMarginal(Entity& e, AttributeBucket& attrs,
  *  args:   the entity names & filter attributes
  **/
 Relation Bayes::sampleMarginal(std::string e, AttributeBucket& attrs,
-    std::string compare) {
+    std::string compare, RandomStream* rng) {
 
-    // Find all relations with containing "e"
-    std::vector<Json::Value> relations_left =
-    this->indexHandler->fetchRelationPrefix(e, "*");
-    std::vector<Json::Value> relations_right =
-        this->indexHandler->fetchRelationPrefix("*", e);
-
-    // Filter on attribute conditions in AttributeBucket
-    this->indexHandler->filterRelations(relations_left, attrs, compare);
-    this->indexHandler->filterRelations(relations_right, attrs, compare);
-
-    // Randomly select a sample paying attention to frequency of relations
-    long count = this->countEntityInRelations(e, attrs, compare);
-    long index = 0;
-    long pivot = rand() % count + 1;
-
-    // Iterate through relations and pick out candidate
-    for (std::vector<Json::Value>::iterator it = relations_left.begin();
-        it != relations_left.end(); ++it) {
-        index += (*it)[JSON_ATTR_REL_COUNT].asInt();
-        if (index >= pivot) {
-            Relation r = Relation(*it);
-            return r;
-        }
-    }
+    std::string key = this->samplerKey("marginal", e, "", attrs, compare);
+    std::string versions = this->indexHandler->fetchEntityPairVersions(e);
 
-    for (std::vector<Json::Value>::iterator it = relations_right.begin();
-        it != relations_right.end(); ++it) {
-        index += (*it)[JSON_ATTR_REL_COUNT].asInt();
-        if (index >= pivot) {
-            Relation r = Relation(*it);
-            return r;
-        }
-    }
+    // Relations containing "e" are only fetched if the cached sampler is stale
+    return this->drawFromSampler(this->fetchSampler(key, versions, e, "",
+        attrs, compare, "").get(), this->stream(rng));
+}
 
-    return Relation(relations_right.back());
+/*
+ *  Samples a batch of relations from the marginal distribution with respect to
+ *  the filter attributes.  The relation set is materialized once for the batch.
+ *
+ *  args:   the entity name, filter attributes, sample count and whether to
+ *          sample with replacement
+ **/
+std::vector<Relation> Bayes::sampleMarginal(std::string e,
+    AttributeBucket& attrs, std::string compare, long n, bool replacement,
+    RandomStream* rng) {
+
+    std::string key = this->samplerKey("marginal", e, "", attrs, compare);
+    std::string versions = this->indexHandler->fetchEntityPairVersions(e);
+
+    return this->drawManyFromSampler(this->fetchSampler(key, versions, e, "",
+        attrs, compare, "").get(), n, replacement, this->stream(rng));
 }
 
 /*
@@ -208,8 +1140,8 @@ Relation Bayes::sampleMarginal(std::string e, AttributeBucket& attrs,
  *  args:   the entity models & filter attributes
  **/
 Relation Bayes::samplePairwise(Entity& x, Entity& y, AttributeBucket& attrs,
-    std::string compare) {
-    return this->samplePairwise(x.name, y.name, attrs, compare);
+    std::string compare, RandomStream* rng) {
+    return this->samplePairwise(x.name, y.name, attrs, compare, rng);
 }
 
 /*
@@ -219,29 +1151,43 @@ Relation Bayes::samplePairwise(Entity& x, Entity& y, AttributeBucket& attrs,
  *  args:   the entity names & filter attributes
  **/
 Relation Bayes::samplePairwise(std::string x, std::string y,
-    AttributeBucket& attrs, std::string compare) {
+    AttributeBucket& attrs, std::string compare, RandomStream* rng) {
 
-    // Find all relations with containing "x" and "y"
-    std::vector<Json::Value> relations =
-        this->indexHandler->fetchRelationPrefix(x, y);
+    // Unfiltered samples over one pair come from the dynamic sampler
+    std::vector<Relation> samples;
+    if (attrs.getAttributeHash().empty() &&
+        this->sampleDynamic(x, y, 1, samples, this->stream(rng)))
+        return samples.size() > 0 ? samples[0] : Relation();
 
-    // Filter relations based on "attrs"
-    this->indexHandler->filterRelations(relations, attrs, compare);
+    std::string key = this->samplerKey("pairwise", x, y, attrs, compare);
+    std::string versions = this->indexHandler->fetchPairVersions(x, y);
 
-    // Randomly select a sample paying attention to frequency of relations
-    long count = this->countRelations(x, y, attrs, compare);
-    long index = 0;
-    long pivot = rand() % count + 1;
+    // Relations containing "x" and "y" are only fetched if the cached sampler is stale
+    return this->drawFromSampler(this->fetchSampler(key, versions, x, y,
+        attrs, compare, "").get(), this->stream(rng));
+}
 
-    // Iterate through relations and pick out candidate
-    for (std::vector<Json::Value>::iterator it = relations.begin();
-        it != relations.end(); ++it) {
-        index += (*it)[JSON_ATTR_REL_COUNT].asInt();
-        if (index >= pivot)
-            return Relation(*it);
-    }
+/*
+ *  Samples a batch of relations from the pairwise distribution with respect to
+ *  the filter attributes.  The relation set is materialized once for the batch.
+ *
+ *  args:   the entity names, filter attributes, sample count and whether to
+ *          sample with replacement
+ **/
+std::vector<Relation> Bayes::samplePairwise(std::string x, std::string y,
+    AttributeBucket& attrs, std::string compare, long n, bool replacement,
+    RandomStream* rng) {
+
+    std::vector<Relation> samples;
+    if (replacement && attrs.getAttributeHash().empty() &&
+        this->sampleDynamic(x, y, n, samples, this->stream(rng)))
+        return samples;
+
+    std::string key = this->samplerKey("pairwise", x, y, attrs, compare);
+    std::string versions = this->indexHandler->fetchPairVersions(x, y);
 
-    return Relation(relations.back());
+    return this->drawManyFromSampler(this->fetchSampler(key, versions, x, y,
+        attrs, compare, "").get(), n, replacement, this->stream(rng));
 }
 
 /*
@@ -251,8 +1197,8 @@ Relation Bayes::samplePairwise(std::string x, std::string y,
  *  args:   the entity models & filter attributes
  **/
 Relation Bayes::samplePairwiseCausal(Entity& x, Entity& y,
-    AttributeBucket& attrs, std::string compare) {
-    return this->samplePairwiseCausal(x.name, y.name, attrs, compare);
+    AttributeBucket& attrs, std::string compare, RandomStream* rng) {
+    return this->samplePairwiseCausal(x.name, y.name, attrs, compare, rng);
 }
 
 /*
@@ -262,56 +1208,101 @@ Relation Bayes::samplePairwiseCausal(Entity& x, Entity& y,
  *  args:   the entity names & filter attributes
  **/
 Relation Bayes::samplePairwiseCausal(std::string x, std::string y,
-    AttributeBucket& attrs, std::string compare) {
+    AttributeBucket& attrs, std::string compare, RandomStream* rng) {
 
-    // Find all relations with containing "x" primary and "y" secondary
-    std::vector<Json::Value> relations =
-        this->indexHandler->fetchRelationPrefix(x, y);
+    std::string key = this->samplerKey("causal", x, y, attrs, compare);
+    std::string versions = this->indexHandler->fetchPairVersions(x, y);
 
-    // Filter relations based on "attrs"
-    this->indexHandler->filterRelations(relations, attrs, compare);
+    // only consider elements in which x is the "cause"
+    return this->drawFromSampler(this->fetchSampler(key, versions, x, y,
+        attrs, compare, x).get(), this->stream(rng));
+}
+
+/**
+ *  Fetch the cells of the conditional table answering a query on an attribute given a filter, if
+ *  one is declared.  The filter must hold a single value on an attribute of another entity, and
+ *  that entity must be the only one the attribute's entity has relations with, so that the table
+ *  covers exactly the relations the query would read.  Cells matching the filter are returned,
+ *  cells missing the filter attribute match as relations missing it pass the filter.
+ */
+bool Bayes::fetchTableCells(AttributeTuple& attr, AttributeBucket& filter,
+    std::string compare, std::vector<TableCell>& cells) {
 
-    // Randomly select a sample paying attention to frequency of relations
-    long count = this->countEntityInRelations(x, attrs, compare, true);
-    long index = 0;
-    long pivot = rand() % count + 1;
+    std::unordered_map<std::string, std::vector<std::string>> hash =
+        filter.getAttributeHash();
+    if (hash.size() != 1 || hash.begin()->second.size() != 1) return false;
 
-    for (std::vector<Json::Value>::iterator it = relations.begin();
-        it != relations.end(); ++it) {
-        Relation r = Relation(*it);
+    AttributeTuple given(hash.begin()->second[0]);
+    if (given.entity.compare(attr.entity) == 0) return false;
+    if (given.type.compare(COLTYPE_NAME_INT) != 0 &&
+        given.type.compare(COLTYPE_NAME_FLOAT) != 0 &&
+        given.type.compare(COLTYPE_NAME_STR) != 0) return false;
 
-        // only consider elements in which x is the "cause"
-        if (std::strcmp((*it)[JSON_ATTR_REL_CAUSE].asCString(), x.c_str()) != 0)
-            continue;
+    std::vector<std::string> pairs =
+        this->indexHandler->fetchEntityPairs(attr.entity);
+    if (pairs.size() > 1 || (pairs.size() == 1 && pairs[0].compare(
+        this->indexHandler->orderPairAlphaNumeric(attr.entity, given.entity)) != 0))
+        return false;
+
+    std::vector<TableCell> table;
+    if (!this->indexHandler->fetchTableCells(ConditionalTable::tableName(
+        attr.entity, attr.attribute, given.entity, given.attribute), table))
+        return false;
 
-        index += (*it)[JSON_ATTR_REL_COUNT].asInt();
-        if (index >= pivot) {
-            return r;
+    AttributeTuple value;
+    bool match;
+    for (std::vector<TableCell>::iterator it = table.begin();
+        it != table.end(); ++it) {
+        if (it->hasGiven) {
+            value = AttributeTuple(given.entity, given.attribute, it->given,
+                given.type);
+            if (given.type.compare(COLTYPE_NAME_INT) == 0)
+                match = AttributeTuple::compare<IntegerColumn>(value, given, compare);
+            else if (given.type.compare(COLTYPE_NAME_FLOAT) == 0)
+                match = AttributeTuple::compare<FloatColumn>(value, given, compare);
+            else
+                match = AttributeTuple::compare<StringColumn>(value, given, compare);
+            if (!match) continue;
         }
+        cells.push_back(*it);
     }
-    return Relation(relations.back());
+    return true;
 }
 
 /**
- *  Produce the expected value for an attribute given a set of filter criteria
+ *  Accumulate the count, sum and sum of squares of a numeric attribute over
+ *  the instances carrying it given a set of filter criteria.  Unfiltered
+ *  queries read the moment accumulators directly, filtered queries use a
+ *  conditional table where one is declared and otherwise the relations.
  *
  *  @param attr     the attribute to compute
  *  @param filter   filter criteria
+ *  @param moments  receives the moments of the attribute
  *
- *  @returns        The expected value for this attribute
- *                  TODO - handle error modes
+ *  @returns        false if the attribute is not numeric
  **/
-float Bayes::expectedAttribute(AttributeTuple& attr, AttributeBucket& filter,
-    std::string compare) {
+bool Bayes::momentsAttribute(AttributeTuple& attr, AttributeBucket& filter,
+    std::string compare, Moments& moments) {
 
-    // Ensure that the attribute is a numeric type
-    Json::Value json;
-    this->indexHandler->fetchEntity(attr.entity, json);
-    if (!json[JSON_ATTR_ENT_FIELDS].isMember(attr.attribute)) return -1.0;
-    if (std::strcmp(json[JSON_ATTR_ENT_FIELDS][attr.attribute].asCString(),
-        "integer") != 0 &&
-        std::strcmp(json[JSON_ATTR_ENT_FIELDS][attr.attribute].asCString(),
-            "float") != 0) return -1.0;
+    if (!this->isNumericAttribute(attr)) return false;
+    moments = Moments();
+
+    // The accumulators still hold relations of entities pending removal
+    if (filter.getAttributeHash().size() == 0 &&
+        this->indexHandler->fetchTombstones().size() == 0) {
+        this->indexHandler->fetchMoments(attr.entity, attr.attribute, moments);
+        return true;
+    }
+
+    // Answer from a conditional table where one is declared
+    std::vector<TableCell> cells;
+    if (this->fetchTableCells(attr, filter, compare, cells)) {
+        for (std::vector<TableCell>::iterator it = cells.begin();
+            it != cells.end(); ++it)
+            if (it->hasValue)
+                moments.add(std::atof(it->value.c_str()), it->count);
+        return true;
+    }
 
     // Fetch all matching attributes
     std::vector<Json::Value> relations =
@@ -320,20 +1311,137 @@ float Bayes::expectedAttribute(AttributeTuple& attr, AttributeBucket& filter,
     // Filter relations based on filter bucket
     this->indexHandler->filterRelations(relations, filter, compare);
 
-    long count = 0;
-    float expected = 0.0;
-
     for (std::vector<Json::Value>::iterator it = relations.begin();
         it != relations.end(); ++it) {
-        if ((*it)[JSON_ATTR_REL_FIELDSL].isMember(attr.attribute))
-            expected += (*it)[JSON_ATTR_REL_FIELDSL][attr.attribute].asFloat() *
-            (*it)[JSON_ATTR_REL_COUNT].asFloat();
-        if ((*it)[JSON_ATTR_REL_FIELDSR].isMember(attr.attribute))
-            expected += (*it)[JSON_ATTR_REL_FIELDSL][attr.attribute].asFloat() *
-            (*it)[JSON_ATTR_REL_COUNT].asFloat();
-        count += (*it)[JSON_ATTR_REL_COUNT].asInt();
+        if ((*it)[JSON_ATTR_REL_ENTL].asString().compare(attr.entity) == 0 &&
+            (*it)[JSON_ATTR_REL_FIELDSL].isMember(attr.attribute))
+            moments.add(std::atof((*it)[JSON_ATTR_REL_FIELDSL][attr.attribute].asCString()),
+                (*it)[JSON_ATTR_REL_COUNT].asInt());
+        if ((*it)[JSON_ATTR_REL_ENTR].asString().compare(attr.entity) == 0 &&
+            (*it)[JSON_ATTR_REL_FIELDSR].isMember(attr.attribute))
+            moments.add(std::atof((*it)[JSON_ATTR_REL_FIELDSR][attr.attribute].asCString()),
+                (*it)[JSON_ATTR_REL_COUNT].asInt());
+    }
+    return true;
+}
+
+/**
+ *  Compute the expected value of an attribute given a set of filter criteria
+ *
+ *  @param attr     the attribute to compute
+ *  @param filter   filter criteria
+ *
+ *  @returns        The expected value of the attribute, -1.0 if the attribute
+ *                  is not numeric
+ **/
+float Bayes::expectedAttribute(AttributeTuple& attr, AttributeBucket& filter,
+    std::string compare) {
+    std::string key = this->samplerKey("expected",
+        attr.entity + std::string(".") + attr.attribute, "", filter, compare);
+    std::string versions = this->indexHandler->fetchEntityPairVersions(attr.entity);
+    ResultEntry cached;
+    if (this->fetchResult(key, versions, cached)) return cached.number;
+
+    Moments moments;
+    float expected = this->momentsAttribute(attr, filter, compare, moments) ?
+        moments.mean() : -1.0;
+    this->storeResult(key, versions, expected);
+    return expected;
+}
+
+/**
+ *  Compute the variance of an attribute given a set of filter criteria
+ *
+ *  @returns        The population variance of the attribute, -1.0 if the
+ *                  attribute is not numeric
+ **/
+float Bayes::varianceAttribute(AttributeTuple& attr, AttributeBucket& filter,
+    std::string compare) {
+    Moments moments;
+    if (!this->momentsAttribute(attr, filter, compare, moments)) return -1.0;
+    return moments.variance();
+}
+
+/**
+ *  Compute the standard deviation of an attribute given a set of filter
+ *  criteria
+ *
+ *  @returns        The population standard deviation of the attribute, -1.0
+ *                  if the attribute is not numeric
+ **/
+float Bayes::stddevAttribute(AttributeTuple& attr, AttributeBucket& filter,
+    std::string compare) {
+    Moments moments;
+    if (!this->momentsAttribute(attr, filter, compare, moments)) return -1.0;
+    return moments.stddev();
+}
+
+/**
+ *  Compute a quantile of an attribute given a set of filter criteria.  Unfiltered queries merge
+ *  the digests of the pairs on the entity, filtered queries weigh the values of the matching
+ *  relations exactly.
+ *
+ *  @param attr     the attribute to compute
+ *  @param filter   filter criteria
+ *  @param q        quantile in [0, 1], e.g. 0.5 for the median
+ *
+ *  @returns        The quantile of the attribute, -1.0 if the attribute is not
+ *                  numeric
+ **/
+float Bayes::quantileAttribute(AttributeTuple& attr, AttributeBucket& filter,
+    std::string compare, double q) {
+
+    if (!this->isNumericAttribute(attr)) return -1.0;
+
+    if (filter.getAttributeHash().size() == 0 &&
+        attr.entity.find_first_of("*?[") == std::string::npos &&
+        this->indexHandler->fetchTombstones().size() == 0) {
+        TDigest digest;
+        this->indexHandler->fetchQuantileDigest(attr.entity, attr.attribute, digest);
+        return digest.quantile(q);
+    }
+
+    // Weighted values of the matching relations in order
+    std::vector<Json::Value> relations =
+        this->indexHandler->fetchAttribute(attr);
+    this->indexHandler->filterRelations(relations, filter, compare);
+
+    std::vector<std::pair<double, long>> values;
+    long total = 0;
+    const char* sides[2][2] = { { JSON_ATTR_REL_ENTL, JSON_ATTR_REL_FIELDSL },
+        { JSON_ATTR_REL_ENTR, JSON_ATTR_REL_FIELDSR } };
+    for (std::vector<Json::Value>::iterator it = relations.begin();
+        it != relations.end(); ++it)
+        for (int i = 0; i < 2; i++)
+            if ((*it)[sides[i][0]].asString().compare(attr.entity) == 0 &&
+                (*it)[sides[i][1]].isMember(attr.attribute)) {
+                values.push_back(std::make_pair(std::atof(
+                    (*it)[sides[i][1]][attr.attribute].asCString()),
+                    (long)(*it)[JSON_ATTR_REL_COUNT].asInt()));
+                total += values.back().second;
+            }
+    if (total == 0) return 0.0;
+    std::sort(values.begin(), values.end());
+
+    // The smallest value with at least a share q of the instances at or below it
+    long cumulative = 0;
+    for (std::vector<std::pair<double, long>>::iterator it = values.begin();
+        it != values.end(); ++it) {
+        cumulative += it->second;
+        if (cumulative >= q * total) return it->first;
     }
-    return expected / count;
+    return values.back().first;
+}
+
+/** Is the attribute declared on its entity with a numeric type */
+bool Bayes::isNumericAttribute(AttributeTuple& attr) {
+    Json::Value json;
+    this->indexHandler->fetchEntity(attr.entity, json);
+    if (!json[JSON_ATTR_ENT_FIELDS].isMember(attr.attribute)) return false;
+    return std::strcmp(json[JSON_ATTR_ENT_FIELDS][attr.attribute].asCString(),
+        "integer") == 0 ||
+        std::strcmp(json[JSON_ATTR_ENT_FIELDS][attr.attribute].asCString(),
+            "float") == 0;
 }
 
 /**
@@ -348,12 +1456,53 @@ float Bayes::expectedAttribute(AttributeTuple& attr, AttributeBucket& filter,
  **/
 std::string Bayes::modeAttribute(AttributeTuple& attr, AttributeBucket& filter,
     std::string compare) {
+    std::string key = this->samplerKey("mode",
+        attr.entity + std::string(".") + attr.attribute, "", filter, compare);
+    std::string versions = this->indexHandler->fetchEntityPairVersions(attr.entity);
+    ResultEntry cached;
+    if (this->fetchResult(key, versions, cached)) return cached.text;
+
+    std::vector<ValueCount> top = this->topAttribute(attr, filter, compare, 1);
+    std::string mode = top.size() > 0 ? top[0].value : "";
+    this->storeResult(key, versions, 0, mode);
+    return mode;
+}
+
+/**
+ *  The k most frequent values of an attribute given a set of filter criteria,
+ *  most frequent first
+ *
+ *  @param attr     the attribute to compute
+ *  @param filter   filter criteria
+ *  @param k        number of values to return
+ *
+ *  @returns        values with their instance counts, empty if the entity does
+ *                  not carry the attribute
+ **/
+std::vector<ValueCount> Bayes::topAttribute(AttributeTuple& attr,
+    AttributeBucket& filter, std::string compare, long k) {
 
     // Ensure that the attribute is present in the entity
     Json::Value json, counts;
     this->indexHandler->fetchEntity(attr.entity, json);
     if (!json[JSON_ATTR_ENT_FIELDS].isMember(attr.attribute))
-        return "";
+        return std::vector<ValueCount>();
+
+    // The value counts still hold relations of entities pending removal
+    if (filter.getAttributeHash().size() == 0 &&
+        this->indexHandler->fetchTombstones().size() == 0)
+        return this->indexHandler->fetchTopValues(attr.entity, attr.attribute, k);
+
+    // Answer from a conditional table where one is declared
+    std::vector<TableCell> cells;
+    if (this->fetchTableCells(attr, filter, compare, cells)) {
+        for (std::vector<TableCell>::iterator it = cells.begin();
+            it != cells.end(); ++it)
+            if (it->hasValue)
+                counts[it->value] = counts.get(it->value, 0).asInt() +
+                    (int)it->count;
+        return this->topOfCounts(counts, k);
+    }
 
     // Fetch all matching attributes
     std::vector<Json::Value> relations =
@@ -367,7 +1516,8 @@ std::string Bayes::modeAttribute(AttributeTuple& attr, AttributeBucket& filter,
     const char* key;
     for (std::vector<Json::Value>::iterator it = relations.begin();
         it != relations.end(); ++it) {
-        if ((*it)[JSON_ATTR_REL_FIELDSL].isMember(attr.attribute)) {
+        if ((*it)[JSON_ATTR_REL_ENTL].asString().compare(attr.entity) == 0 &&
+            (*it)[JSON_ATTR_REL_FIELDSL].isMember(attr.attribute)) {
             key = (*it)[JSON_ATTR_REL_FIELDSL][attr.attribute].asCString();
             if (counts.isMember(key))
                 counts[key] =
@@ -375,7 +1525,8 @@ std::string Bayes::modeAttribute(AttributeTuple& attr, AttributeBucket& filter,
             else
                 counts[key] = (*it)[JSON_ATTR_REL_COUNT].asInt();
         }
-        if ((*it)[JSON_ATTR_REL_FIELDSR].isMember(attr.attribute)) {
+        if ((*it)[JSON_ATTR_REL_ENTR].asString().compare(attr.entity) == 0 &&
+            (*it)[JSON_ATTR_REL_FIELDSR].isMember(attr.attribute)) {
             key = (*it)[JSON_ATTR_REL_FIELDSR][attr.attribute].asCString();
             if (counts.isMember(key))
                 counts[key] =
@@ -385,19 +1536,121 @@ std::string Bayes::modeAttribute(AttributeTuple& attr, AttributeBucket& filter,
         }
     }
 
-    // Get the key with the most occurrences - the key is across the range of
-    // values for the attribute
+    return this->topOfCounts(counts, k);
+}
+
+/**
+ *  Get the k keys with the most occurrences - the keys are across the range of
+ *  values for the attribute
+ */
+std::vector<ValueCount> Bayes::topOfCounts(Json::Value& counts, long k) {
     std::vector<std::string> keys = counts.getMemberNames();
-    int max = 0;
-    std:string value;
+    std::vector<ValueCount> top;
     for (std::vector<std::string>::iterator it = keys.begin();
-        it != keys.end(); ++it) {
-        if (counts[*it].asInt() > max) {
-            max = counts[*it].asInt();
-            value = *it;
-        }
+        it != keys.end(); ++it)
+        if (counts[*it].asInt() > 0)
+            top.push_back(ValueCount(*it, counts[*it].asInt()));
+    if (k < top.size()) {
+        std::partial_sort(top.begin(), top.begin() + k, top.end());
+        top.erase(top.begin() + k, top.end());
+    } else
+        std::sort(top.begin(), top.end());
+    return top;
+}
+
+/**
+ *  Aggregate the relations on the given entity by the value it carries for an
+ *  attribute.  The relations are read and filtered once, each group holds the
+ *  instance count on the given entity, that of its relations with the target
+ *  and the moments of the target attribute where it is numeric.
+ *
+ *  @param target           the target entity
+ *  @param targetAttribute  attribute of the target to average, may be empty
+ *  @param given            the given entity
+ *  @param groupAttribute   attribute of the given entity to group on
+ *  @param filter           filter criteria on the given entity
+ *  @param keepRelations    keep the relations with the target for sampling
+ *
+ *  @returns                the groups
+ **/
+GroupTable Bayes::groupRelations(std::string target, std::string targetAttribute,
+    std::string given, std::string groupAttribute, AttributeBucket& filter,
+    std::string compare, bool keepRelations) {
+
+    AttributeTuple attr(target, targetAttribute, "", "");
+    if (targetAttribute.compare("") != 0 && !this->isNumericAttribute(attr))
+        targetAttribute = "";
+
+    GroupTable table(target, targetAttribute, given, groupAttribute,
+        keepRelations);
+    RelationSet set = this->fetchMarginalSet(given, filter, compare);
+    for (std::vector<Json::Value>::iterator it = set.relations.begin();
+        it != set.relations.end(); ++it)
+        table.add(*it);
+    return table;
+}
+
+/**
+ *  Draw n relations between the target and given entities in each group of
+ *  the given entity, from the same scan as groupRelations.  Groups without
+ *  relations on the target are returned with no samples.
+ *
+ *  @returns        group values in order with their samples
+ **/
+std::vector<std::pair<std::string, std::vector<Relation>>> Bayes::sampleGroups(
+    std::string target, std::string given, std::string groupAttribute,
+    AttributeBucket& filter, std::string compare, long n, bool replacement,
+    RandomStream* rng) {
+
+    std::vector<std::pair<std::string, std::vector<Relation>>> samples;
+    GroupTable table = this->groupRelations(target, "", given, groupAttribute,
+        filter, compare, true);
+    std::vector<std::string> values = table.values();
+    SamplerEntry entry;
+
+    for (std::vector<std::string>::iterator it = values.begin();
+        it != values.end(); ++it) {
+        GroupAggregate& group = table.group(*it);
+        entry.relations = group.relations;
+        entry.weights = group.weights;
+        entry.table.build(entry.weights);
+        samples.push_back(std::make_pair(*it,
+            this->drawManyFromSampler(&entry, n, replacement, this->stream(rng))));
+    }
+    return samples;
+}
+
+/**
+ *  Make the model of a classifier resident and current, building it from the relations of its pair
+ *  unless the write path has kept it in step with the pair version.  The summary holds the
+ *  definition with the number of classes and features.
+ */
+bool Bayes::compileClassifier(std::string name, Json::Value& summary) {
+    Json::Value definition;
+    if (!this->indexHandler->fetchClassifier(name, definition)) return false;
+
+    ClassifierRegistry& registry = ClassifierRegistry::instance();
+    std::string pair = this->indexHandler->orderPairAlphaNumeric(
+        definition[JSON_ATTR_NB_TARGET_ENT].asString(), definition[JSON_ATTR_NB_GIVEN_ENT].asString());
+    long version = this->indexHandler->fetchPairVersion(pair);
+
+    if (!registry.isCurrent(name, version)) {
+        std::vector<std::string> keys;
+        std::vector<Json::Value> relations;
+        this->indexHandler->fetchPairRelations(pair, keys, relations);
+        registry.build(definition, pair, version, relations);
     }
-    return value;
+    summary = registry.summarize(definition);
+    return true;
+}
+
+/** Classify a batch of instances, each a set of attribute values on the given entity */
+bool Bayes::classify(std::string name, std::vector<valpair>& instances,
+    std::vector<Classification>& results) {
+    Json::Value summary;
+    if (!this->compileClassifier(name, summary)) return false;
+    results = ClassifierRegistry::instance().classify(name, instances);
+    return results.size() == instances.size();
 }
 
 #endif
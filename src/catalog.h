@@ -0,0 +1,243 @@
+/*
+ *  catalog.h
+ *
+ *  Defines the catalog of entity pairs.  For each pair of entities that has relations the catalog
+ *  keeps the total instance count, the number of distinct relations and the set of relation keys,
+ *  which allows relation sets to be fetched without globbing over the whole key space.  Each pair
+ *  also has a version counter that is bumped on every change to its relations, structures cached
+ *  in memory from a relation set use it to detect that they have gone stale.
+ *
+ *  Created by Ryan Faulkner on 2015-12-14
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _catalog_h
+#define _catalog_h
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <unordered_map>
+#include <fnmatch.h>
+#include <json/json.h>
+
+#include "redis.h"
+#include "hooks.h"
+
+#define KEY_CATALOG_COUNTS "pair_counts"
+#define KEY_CATALOG_DISTINCT "pair_distinct"
+#define KEY_CATALOG_PAIR_KEYS "pair_keys"
+#define KEY_CATALOG_VERSIONS "pair_versions"
+#define KEY_CATALOG_BUILT "pair_catalog_built"     // Set once the catalog covers every relation
+#define KEY_CATALOG_DELIMETER "+"
+
+#define JSON_ATTR_CAT_PAIR "pair"
+#define JSON_ATTR_CAT_COUNT "relations"
+#define JSON_ATTR_CAT_DISTINCT "distinct"
+
+
+/**
+ *  Interface to the entity pair catalog.  Pairs are named by the middle section of the relation
+ *  key, e.g. "rel+x+y+<hash>" belongs to pair "x+y".
+ */
+class PairCatalog {
+public:
+
+    static std::string pairFromKey(std::string);
+    static std::vector<std::string> splitPair(std::string);
+    static void relationHook(RedisHandler&, std::string, Json::Value&, int, int);
+    static void relationBatchHook(RedisHandler&, std::vector<RelationDelta>&);
+
+    static std::vector<std::string> fetchPairs(RedisHandler&);
+    static std::vector<std::string> matchPairs(RedisHandler&, std::string);
+    static std::vector<std::string> matchPairs(RedisHandler&, std::vector<std::string>&);
+    static std::vector<std::string> fetchEntityPairs(RedisHandler&, std::string);
+    static std::vector<std::string> fetchPairKeys(RedisHandler&, std::string);
+    static long fetchPairCount(RedisHandler&, std::string);
+    static long fetchPairDistinct(RedisHandler&, std::string);
+    static Json::Value fetchSummary(RedisHandler&, std::string);
+    static std::unordered_map<std::string, std::string> fetchVersions(RedisHandler&);
+    static long fetchVersion(RedisHandler&, std::string);
+    static void bumpVersion(RedisHandler&, std::string);
+    static void dropPair(RedisHandler&, std::string);
+};
+
+/** Extract the pair name from a relation key */
+std::string PairCatalog::pairFromKey(std::string key) {
+    size_t first = key.find(KEY_CATALOG_DELIMETER);
+    size_t last = key.rfind(KEY_CATALOG_DELIMETER);
+    if (first == std::string::npos || last <= first) return "";
+    return key.substr(first + 1, last - first - 1);
+}
+
+/** Split a pair name into its two entities */
+std::vector<std::string> PairCatalog::splitPair(std::string pair) {
+    std::vector<std::string> entities;
+    std::stringstream ss(pair);
+    std::string item;
+    while (std::getline(ss, item, KEY_CATALOG_DELIMETER[0]))
+        entities.push_back(item);
+    return entities;
+}
+
+/** Relation hook - keeps counts and key membership for the pair of the relation current */
+void PairCatalog::relationHook(RedisHandler& rds, std::string key, Json::Value& relation, int oldCount, int newCount) {
+    std::vector<RelationDelta> deltas(1, RelationDelta(key, &relation, oldCount, newCount));
+    PairCatalog::relationBatchHook(rds, deltas);
+}
+
+/**
+ *  Batch relation hook - the changes of the chunk are summed per pair and sent in one pipeline.
+ *  The version each pair is bumped to is set on its deltas for the hooks that run after, and pairs
+ *  left without relations are dropped once the replies are in.
+ */
+void PairCatalog::relationBatchHook(RedisHandler& rds, std::vector<RelationDelta>& deltas) {
+    std::unordered_map<std::string, std::pair<long, long>> changes;    // pair -> count, distinct
+    std::unordered_map<std::string, long> versionReplies;
+    std::vector<std::string> args, pairs, replies;
+    std::vector<long> distinctReplies;
+    std::string pair;
+    long sent = 0;
+
+    for (std::vector<RelationDelta>::iterator it = deltas.begin(); it != deltas.end(); ++it) {
+        pair = PairCatalog::pairFromKey(it->key);
+        std::pair<long, long>& change = changes[pair];
+        change.first += it->newCount - it->oldCount;
+        if (it->oldCount != 0 && it->newCount != 0) continue;
+
+        change.second += it->oldCount == 0 ? 1 : -1;
+        args.clear(); args.push_back(it->oldCount == 0 ? "SADD" : "SREM");
+        args.push_back(std::string(KEY_CATALOG_PAIR_KEYS) + KEY_CATALOG_DELIMETER + pair); args.push_back(it->key);
+        rds.appendCommand(args);
+        sent++;
+    }
+
+    // The distinct counts of pairs losing relations are read back from their replies
+    for (std::unordered_map<std::string, std::pair<long, long>>::iterator it = changes.begin(); it != changes.end(); ++it) {
+        args.clear(); args.push_back("HINCRBY"); args.push_back(KEY_CATALOG_COUNTS);
+        args.push_back(it->first); args.push_back(std::to_string(it->second.first));
+        rds.appendCommand(args);
+        args.clear(); args.push_back("HINCRBY"); args.push_back(KEY_CATALOG_VERSIONS);
+        args.push_back(it->first); args.push_back("1");
+        rds.appendCommand(args);
+        versionReplies[it->first] = sent + 1;
+        sent += 2;
+        if (it->second.second == 0) continue;
+        args.clear(); args.push_back("HINCRBY"); args.push_back(KEY_CATALOG_DISTINCT);
+        args.push_back(it->first); args.push_back(std::to_string(it->second.second));
+        rds.appendCommand(args);
+        if (it->second.second < 0) {
+            pairs.push_back(it->first);
+            distinctReplies.push_back(sent);
+        }
+        sent++;
+    }
+
+    replies = rds.flushPipeline();
+    for (std::vector<RelationDelta>::iterator it = deltas.begin(); it != deltas.end(); ++it) {
+        long reply = versionReplies[PairCatalog::pairFromKey(it->key)];
+        if (reply < replies.size())
+            it->version = std::atol(replies[reply].c_str());
+    }
+    for (size_t i = 0; i < pairs.size(); i++)
+        if (distinctReplies[i] < replies.size() && std::atol(replies[distinctReplies[i]].c_str()) <= 0)
+            PairCatalog::dropPair(rds, pairs[i]);
+}
+
+static bool catalogHookRegistered = registerRelationHook(PairCatalog::relationHook, PairCatalog::relationBatchHook);
+
+/** Fetch all pairs in the catalog */
+std::vector<std::string> PairCatalog::fetchPairs(RedisHandler& rds) {
+    std::vector<std::string> pairs;
+    std::unordered_map<std::string, std::string> counts = rds.readHashMapAll(KEY_CATALOG_COUNTS);
+    for (std::unordered_map<std::string, std::string>::iterator it = counts.begin(); it != counts.end(); ++it)
+        pairs.push_back(it->first);
+    return pairs;
+}
+
+/** Fetch all pairs matching a glob pattern on the pair name, e.g. "x+*" */
+std::vector<std::string> PairCatalog::matchPairs(RedisHandler& rds, std::string pattern) {
+    std::vector<std::string> pairs = PairCatalog::fetchPairs(rds);
+    std::vector<std::string> matches;
+    for (std::vector<std::string>::iterator it = pairs.begin(); it != pairs.end(); ++it)
+        if (fnmatch(pattern.c_str(), it->c_str(), 0) == 0)
+            matches.push_back(*it);
+    return matches;
+}
+
+/** Fetch all pairs matching any of the patterns, each pair is returned once */
+std::vector<std::string> PairCatalog::matchPairs(RedisHandler& rds, std::vector<std::string>& patterns) {
+    std::vector<std::string> pairs = PairCatalog::fetchPairs(rds);
+    std::vector<std::string> matches;
+    for (std::vector<std::string>::iterator it = pairs.begin(); it != pairs.end(); ++it)
+        for (std::vector<std::string>::iterator itPat = patterns.begin(); itPat != patterns.end(); ++itPat)
+            if (fnmatch(itPat->c_str(), it->c_str(), 0) == 0) {
+                matches.push_back(*it);
+                break;
+            }
+    return matches;
+}
+
+/** Fetch all pairs that contain the entity in either position */
+std::vector<std::string> PairCatalog::fetchEntityPairs(RedisHandler& rds, std::string entity) {
+    std::vector<std::string> pairs = PairCatalog::fetchPairs(rds);
+    std::vector<std::string> matches, entities;
+    for (std::vector<std::string>::iterator it = pairs.begin(); it != pairs.end(); ++it) {
+        entities = PairCatalog::splitPair(*it);
+        if (entities.size() == 2 && (entities[0].compare(entity) == 0 || entities[1].compare(entity) == 0))
+            matches.push_back(*it);
+    }
+    return matches;
+}
+
+/** Fetch the keys of all relations for a pair */
+std::vector<std::string> PairCatalog::fetchPairKeys(RedisHandler& rds, std::string pair) {
+    return rds.setMembers(std::string(KEY_CATALOG_PAIR_KEYS) + KEY_CATALOG_DELIMETER + pair);
+}
+
+/** Fetch the total instance count of the relations for a pair */
+long PairCatalog::fetchPairCount(RedisHandler& rds, std::string pair) {
+    return atol(rds.readHashMap(KEY_CATALOG_COUNTS, pair).c_str());
+}
+
+/** Fetch the number of distinct relations for a pair */
+long PairCatalog::fetchPairDistinct(RedisHandler& rds, std::string pair) {
+    return atol(rds.readHashMap(KEY_CATALOG_DISTINCT, pair).c_str());
+}
+
+/** Summarize a pair as json - {"pair": "x+y", "relations": <count>, "distinct": <count>} */
+Json::Value PairCatalog::fetchSummary(RedisHandler& rds, std::string pair) {
+    Json::Value json;
+    json[JSON_ATTR_CAT_PAIR] = pair;
+    json[JSON_ATTR_CAT_COUNT] = (Json::Int64)PairCatalog::fetchPairCount(rds, pair);
+    json[JSON_ATTR_CAT_DISTINCT] = (Json::Int64)PairCatalog::fetchPairDistinct(rds, pair);
+    return json;
+}
+
+/** Fetch the version counters of all pairs */
+std::unordered_map<std::string, std::string> PairCatalog::fetchVersions(RedisHandler& rds) {
+    return rds.readHashMapAll(KEY_CATALOG_VERSIONS);
+}
+
+/** Fetch the version counter of a single pair, 0 if the pair has never been written */
+long PairCatalog::fetchVersion(RedisHandler& rds, std::string pair) {
+    return atol(rds.readHashMap(KEY_CATALOG_VERSIONS, pair).c_str());
+}
+
+/** Mark everything cached from the relations of the pair as stale */
+void PairCatalog::bumpVersion(RedisHandler& rds, std::string pair) {
+    rds.incrementHashMap(KEY_CATALOG_VERSIONS, pair, 1);
+}
+
+/**
+ * Remove a pair and its key set from the catalog.  The version counter is bumped rather than
+ * removed so that it never returns to a value that has already been handed out.
+ */
+void PairCatalog::dropPair(RedisHandler& rds, std::string pair) {
+    rds.deleteHashMapField(KEY_CATALOG_COUNTS, pair);
+    rds.deleteHashMapField(KEY_CATALOG_DISTINCT, pair);
+    rds.deleteKey(std::string(KEY_CATALOG_PAIR_KEYS) + KEY_CATALOG_DELIMETER + pair);
+    PairCatalog::bumpVersion(rds, pair);
+}
+
+#endif
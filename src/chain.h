@@ -0,0 +1,235 @@
+/*
+ *  chain.h
+ *
+ *  Defines the steps of multi-hop queries over a chain of entities E0 <- E1 <- ... <- En.  The
+ *  state of an entity on a relation is the set of attribute values it carries there.  A step is
+ *  one hop from a state of the nearer entity: the relations with the farther entity that pass the
+ *  state, weighted by instance count, and the instances on the nearer entity in that state.
+ *  Chaining steps gives the distribution over the states of each entity along the chain.
+ *
+ *  Steps are memoized per hop and state, validated against the versions of the pairs they read as
+ *  with the samplers.  The steps missing for the states on one hop are independent and are built
+ *  in parallel, each worker on its own index handler and redis connection.
+ *
+ *  Created by Ryan Faulkner on 2015-12-23
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _chain_h
+#define _chain_h
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+#include <json/json.h>
+
+#include "index.h"
+#include "sampler.h"
+#include "models/models.h"
+
+#define CHAIN_CACHE_SIZE 1024       // Steps memoized per Bayes instance
+#define CHAIN_MAX_WORKERS 8         // Threads building the steps of one hop
+
+
+/**
+ *  Attribute values an entity carries on a relation.  "key" is canonical, relations giving the
+ *  entity the same values share a state.
+ */
+struct ChainState {
+    std::string key;
+    Json::Value fields;
+
+    ChainState() : fields(Json::objectValue) {}
+    ChainState(Json::Value&, std::string);
+
+    AttributeBucket bucket(std::string);
+};
+
+/** State of an entity on a relation, from the side of the relation it is on */
+ChainState::ChainState(Json::Value& relation, std::string entity) : fields(Json::objectValue) {
+    Json::Value& side = relation[JSON_ATTR_REL_ENTL].asString().compare(entity) == 0 ?
+        relation[JSON_ATTR_REL_FIELDSL] : relation[JSON_ATTR_REL_FIELDSR];
+    std::vector<std::string> members = side.getMemberNames();
+    for (std::vector<std::string>::iterator it = members.begin(); it != members.end(); ++it) {
+        if (it->compare(JSON_ATTR_FIELDS_COUNT) == 0 || it->find(JSON_ATTR_REL_TYPE_PREFIX) == 0) continue;
+        this->fields[*it] = side[*it];
+        this->fields[std::string(JSON_ATTR_REL_TYPE_PREFIX) + *it] =
+            side.get(std::string(JSON_ATTR_REL_TYPE_PREFIX) + *it, "");
+        this->key += *it + std::string("=") + side[*it].asString() + std::string(";");
+    }
+}
+
+/** Equality filter on the entity holding the state */
+AttributeBucket ChainState::bucket(std::string entity) {
+    valpair values;
+    std::unordered_map<std::string, std::string> types;
+    std::vector<std::string> members = this->fields.getMemberNames();
+    for (std::vector<std::string>::iterator it = members.begin(); it != members.end(); ++it) {
+        if (it->find(JSON_ATTR_REL_TYPE_PREFIX) == 0) continue;
+        values.push_back(std::make_pair(*it, this->fields[*it].asString()));
+        types[*it] = this->fields[std::string(JSON_ATTR_REL_TYPE_PREFIX) + *it].asString();
+    }
+    return AttributeBucket(entity, values, types);
+}
+
+
+/**
+ *  One hop from a state of the nearer entity.  "total" is the instance count of the relations with
+ *  the farther entity and "marginal" that of all relations on the nearer entity in the state, their
+ *  ratio is the conditional probability of the hop.
+ */
+struct ChainStep {
+    std::string versions;
+    std::vector<Json::Value> relations;
+    std::vector<double> weights;
+    std::vector<ChainState> states;     // state of the farther entity on each relation
+    long total;
+    long marginal;
+
+    ChainStep() : total(0), marginal(0) {}
+};
+
+/**
+ *  A state reached along a chain.  "mass" is the probability of reaching it from the evidence and
+ *  "reach" that of completing the chain from it, draws onward are weighted by the reach of the
+ *  state they lead to so that sampled paths always complete.
+ */
+struct ChainNode {
+    ChainState state;
+    double mass;
+    double reach;
+    std::shared_ptr<ChainStep> step;
+    AliasTable table;
+
+    ChainNode() : mass(0.0), reach(0.0) {}
+};
+
+/** States reached on one entity of a chain keyed by state */
+typedef std::map<std::string, ChainNode> ChainFrontier;
+
+/** Work for building one step - the filter on the nearer entity and its comparator */
+struct ChainTask {
+    AttributeBucket filter;
+    std::string compare;
+    std::shared_ptr<ChainStep> step;
+};
+
+
+/**
+ *  LRU cache of steps keyed by hop and state.  Steps are shared so those held by a query outlive
+ *  their eviction.
+ */
+class ChainCache {
+
+    long capacity;
+    std::list<std::string> order;   // most recently used first
+    std::unordered_map<std::string, std::pair<std::shared_ptr<ChainStep>, std::list<std::string>::iterator>> entries;
+
+    static void buildSteps(IndexHandler*, std::string, std::vector<Json::Value>*, std::vector<Json::Value>*,
+        std::vector<ChainTask>*, long, long);
+
+public:
+    ChainCache() { this->capacity = CHAIN_CACHE_SIZE; }
+
+    static std::string stepKey(std::string, std::string, AttributeBucket&, std::string);
+    static void build(std::string, std::string, std::vector<ChainTask>&);
+
+    std::shared_ptr<ChainStep> fetch(std::string, std::string);
+    void store(std::string, std::shared_ptr<ChainStep>);
+    void clear() { this->entries.clear(); this->order.clear(); }
+    long size() { return this->entries.size(); }
+};
+
+/** Key of the step from the farther to the nearer entity under a filter */
+std::string ChainCache::stepKey(std::string farther, std::string nearer, AttributeBucket& filter,
+        std::string compare) {
+    return farther + std::string("|") + nearer + std::string("|") + filter.signature() +
+        std::string("|") + compare;
+}
+
+/** Fetch a step if one is cached for the key and it was built from the current versions */
+std::shared_ptr<ChainStep> ChainCache::fetch(std::string key, std::string versions) {
+    std::unordered_map<std::string, std::pair<std::shared_ptr<ChainStep>, std::list<std::string>::iterator>>::iterator it =
+        this->entries.find(key);
+    if (it == this->entries.end()) return std::shared_ptr<ChainStep>();
+    if (it->second.first->versions.compare(versions) != 0) {
+        this->order.erase(it->second.second);
+        this->entries.erase(it);
+        return std::shared_ptr<ChainStep>();
+    }
+    this->order.splice(this->order.begin(), this->order, it->second.second);
+    return it->second.first;
+}
+
+/** Cache a step, evicting the least recently used entry when full */
+void ChainCache::store(std::string key, std::shared_ptr<ChainStep> step) {
+    std::unordered_map<std::string, std::pair<std::shared_ptr<ChainStep>, std::list<std::string>::iterator>>::iterator it =
+        this->entries.find(key);
+    if (it != this->entries.end()) {
+        this->order.erase(it->second.second);
+        this->entries.erase(it);
+    }
+    while (this->entries.size() >= this->capacity && !this->order.empty()) {
+        this->entries.erase(this->order.back());
+        this->order.pop_back();
+    }
+
+    this->order.push_front(key);
+    this->entries[key] = std::make_pair(step, this->order.begin());
+}
+
+/**
+ *  Worker body - builds every "stride"th task from "first" by filtering the relations of the hop,
+ *  which are read once by the caller and shared across workers.  Filtering reads no state from the
+ *  index handler so workers share it.
+ */
+void ChainCache::buildSteps(IndexHandler* ih, std::string farther, std::vector<Json::Value>* pairRelations,
+        std::vector<Json::Value>* entityRelations, std::vector<ChainTask>* tasks, long first, long stride) {
+    std::vector<Json::Value> relations;
+
+    for (long i = first; i < tasks->size(); i += stride) {
+        ChainTask& task = (*tasks)[i];
+        ChainStep& step = *(task.step);
+
+        relations = *pairRelations;
+        ih->filterRelations(relations, task.filter, task.compare);
+        for (std::vector<Json::Value>::iterator it = relations.begin(); it != relations.end(); ++it) {
+            step.relations.push_back(*it);
+            step.weights.push_back((*it)[JSON_ATTR_REL_COUNT].asDouble());
+            step.states.push_back(ChainState(*it, farther));
+            step.total += (*it)[JSON_ATTR_REL_COUNT].asInt();
+        }
+
+        relations = *entityRelations;
+        ih->filterRelations(relations, task.filter, task.compare);
+        for (std::vector<Json::Value>::iterator it = relations.begin(); it != relations.end(); ++it)
+            step.marginal += (*it)[JSON_ATTR_REL_COUNT].asInt();
+    }
+}
+
+/** Build the steps of one hop, reading its relations once and filtering on up to CHAIN_MAX_WORKERS workers */
+void ChainCache::build(std::string farther, std::string nearer, std::vector<ChainTask>& tasks) {
+    if (tasks.size() == 0) return;
+    IndexHandler ih;
+    std::vector<Json::Value> pairRelations = ih.fetchRelationPrefix(farther, nearer);
+    std::vector<Json::Value> entityRelations = ih.fetchEntityRelations(nearer);
+
+    long workers = std::min((long)CHAIN_MAX_WORKERS, (long)tasks.size());
+    if (workers <= 1) {
+        ChainCache::buildSteps(&ih, farther, &pairRelations, &entityRelations, &tasks, 0, 1);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    for (long i = 0; i < workers; i++)
+        threads.push_back(std::thread(&ChainCache::buildSteps, &ih, farther, &pairRelations,
+            &entityRelations, &tasks, i, workers));
+    for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+}
+
+#endif
@@ -0,0 +1,391 @@
+/*
+ *  classifier.h
+ *
+ *  Defines naive Bayes classifiers compiled from relation counts.  A classifier predicts an
+ *  attribute of one entity, the class, from the attributes an instance of another entity carries,
+ *  the features, e.g. x.a given y.  It holds the instance count of every class and of every
+ *  feature value within each class over the relations between the two entities.
+ *
+ *  Declarations are kept in redis.  Models are kept in memory per process, built from the relations
+ *  of their pair on first use and kept current by a relation hook as the dynamic samplers are,
+ *  writes made by another process show up as a version mismatch and the model is rebuilt.  Counts
+ *  are compiled into dense tables of log probabilities on the first classification after a change
+ *  so that an instance is scored by adding one vector per feature.
+ *
+ *  Created by Ryan Faulkner on 2015-12-27
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _classifier_h
+#define _classifier_h
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <cmath>
+#include <json/json.h>
+
+#include "redis.h"
+#include "hooks.h"
+#include "catalog.h"
+#include "models/model_def.h"
+
+#define KEY_NB_DEFINITIONS "classifiers"
+
+#define NB_SMOOTHING 1.0        // Laplace smoothing of class and feature value counts
+
+#define JSON_ATTR_NB_NAME "classifier"
+#define JSON_ATTR_NB_TARGET_ENT "target_entity"
+#define JSON_ATTR_NB_TARGET_ATTR "target_attribute"
+#define JSON_ATTR_NB_GIVEN_ENT "given_entity"
+#define JSON_ATTR_NB_CLASS "class"
+#define JSON_ATTR_NB_PROB "probability"
+#define JSON_ATTR_NB_POSTERIOR "posterior"
+
+
+/** Predicted class of an instance with the posterior probability of every class */
+struct Classification {
+    std::string label;
+    double probability;
+    std::vector<std::pair<std::string, double>> posterior;
+
+    Classification() : probability(0.0) {}
+    Json::Value toJson();
+};
+
+/** Json form of the classification */
+Json::Value Classification::toJson() {
+    Json::Value json;
+    json[JSON_ATTR_NB_CLASS] = this->label;
+    json[JSON_ATTR_NB_PROB] = this->probability;
+    json[JSON_ATTR_NB_POSTERIOR] = Json::Value(Json::objectValue);
+    for (std::vector<std::pair<std::string, double>>::iterator it = this->posterior.begin();
+            it != this->posterior.end(); ++it)
+        json[JSON_ATTR_NB_POSTERIOR][it->first] = it->second;
+    return json;
+}
+
+
+/** Log probabilities of the values of one feature, one entry per class */
+struct FeatureTable {
+    std::unordered_map<std::string, std::vector<double>> likelihoods;
+    std::vector<double> unseen;     // values not seen with the feature
+};
+
+/**
+ *  Counts of a classifier and the tables compiled from them.  Counts are sparse and updated in
+ *  place, the tables are dense over the classes with a non-zero count.
+ */
+struct NaiveBayesModel {
+    std::string target;
+    std::string attribute;
+    std::string given;
+    std::string pair;
+    long version;
+
+    std::map<std::string, long> classCounts;
+    std::map<std::string, std::unordered_map<std::string, std::unordered_map<std::string, long>>> featureCounts;
+
+    bool compiled;
+    std::vector<std::string> classes;
+    std::vector<double> priors;
+    std::unordered_map<std::string, FeatureTable> features;
+
+    NaiveBayesModel() : version(0), compiled(false) {}
+
+    void apply(Json::Value&, long);
+    void compile();
+    std::vector<Classification> classify(std::vector<valpair>&);
+};
+
+/** Add the class and feature values of a relation weighted by a change in instance count */
+void NaiveBayesModel::apply(Json::Value& relation, long delta) {
+    bool left = relation[JSON_ATTR_REL_ENTL].asString().compare(this->target) == 0;
+    Json::Value& targetSide = relation[left ? JSON_ATTR_REL_FIELDSL : JSON_ATTR_REL_FIELDSR];
+    Json::Value& givenSide = relation[left ? JSON_ATTR_REL_FIELDSR : JSON_ATTR_REL_FIELDSL];
+    if (delta == 0 || !targetSide.isMember(this->attribute)) return;
+
+    std::string label = targetSide[this->attribute].asString();
+    this->classCounts[label] += delta;
+
+    std::vector<std::string> members = givenSide.getMemberNames();
+    for (std::vector<std::string>::iterator it = members.begin(); it != members.end(); ++it) {
+        if (it->compare(JSON_ATTR_FIELDS_COUNT) == 0 || it->find(JSON_ATTR_REL_TYPE_PREFIX) == 0) continue;
+        this->featureCounts[*it][givenSide[*it].asString()][label] += delta;
+    }
+    this->compiled = false;
+}
+
+/**
+ *  Compile the counts into log probabilities with Laplace smoothing.  The likelihood of a value
+ *  within a class is normalized over the instances of the class carrying the feature and the
+ *  values seen for it, plus one for values not seen.
+ */
+void NaiveBayesModel::compile() {
+    std::unordered_map<std::string, long> index;
+    long total = 0;
+
+    this->classes.clear();
+    this->priors.clear();
+    this->features.clear();
+    for (std::map<std::string, long>::iterator it = this->classCounts.begin(); it != this->classCounts.end(); ++it)
+        if (it->second > 0) {
+            index[it->first] = this->classes.size();
+            this->classes.push_back(it->first);
+            total += it->second;
+        }
+
+    long n = this->classes.size();
+    for (long c = 0; c < n; c++)
+        this->priors.push_back(std::log(this->classCounts[this->classes[c]] + NB_SMOOTHING) -
+            std::log(total + NB_SMOOTHING * n));
+
+    std::unordered_map<std::string, std::unordered_map<std::string, long>>::iterator itValue;
+    std::unordered_map<std::string, long>::iterator itClass;
+    for (std::map<std::string, std::unordered_map<std::string, std::unordered_map<std::string, long>>>::iterator
+            it = this->featureCounts.begin(); it != this->featureCounts.end(); ++it) {
+        FeatureTable& table = this->features[it->first];
+        std::vector<double> totals(n, 0.0);
+        long values = 0;
+
+        for (itValue = it->second.begin(); itValue != it->second.end(); ++itValue) {
+            std::vector<double> counts(n, 0.0);
+            bool seen = false;
+            for (itClass = itValue->second.begin(); itClass != itValue->second.end(); ++itClass)
+                if (itClass->second > 0 && index.count(itClass->first) > 0) {
+                    counts[index[itClass->first]] = itClass->second;
+                    seen = true;
+                }
+            if (!seen) continue;
+            for (long c = 0; c < n; c++) {
+                totals[c] += counts[c];
+                counts[c] = std::log(counts[c] + NB_SMOOTHING);
+            }
+            table.likelihoods[itValue->first] = counts;
+            values++;
+        }
+
+        std::vector<double> norms(n);
+        for (long c = 0; c < n; c++)
+            norms[c] = std::log(totals[c] + NB_SMOOTHING * (values + 1));
+        for (std::unordered_map<std::string, std::vector<double>>::iterator itTable = table.likelihoods.begin();
+                itTable != table.likelihoods.end(); ++itTable)
+            for (long c = 0; c < n; c++)
+                itTable->second[c] -= norms[c];
+        table.unseen.assign(n, std::log(NB_SMOOTHING));
+        for (long c = 0; c < n; c++)
+            table.unseen[c] -= norms[c];
+    }
+    this->compiled = true;
+}
+
+/**
+ *  Score a batch of instances in log space.  The scores are one row per instance, each starts from
+ *  the class priors and has the likelihood vector of each of its feature values added, features
+ *  the model has not seen are ignored.  Posteriors are normalized from the scores.
+ */
+std::vector<Classification> NaiveBayesModel::classify(std::vector<valpair>& instances) {
+    if (!this->compiled) this->compile();
+
+    std::vector<Classification> results;
+    long n = this->classes.size();
+    std::vector<double> scores(instances.size() * n);
+    std::unordered_map<std::string, FeatureTable>::iterator itFeature;
+    std::unordered_map<std::string, std::vector<double>>::iterator itValue;
+
+    for (long i = 0; i < instances.size(); i++) {
+        double* row = scores.data() + i * n;
+        const double* likelihood;
+        for (long c = 0; c < n; c++)
+            row[c] = this->priors[c];
+
+        for (valpair::iterator it = instances[i].begin(); it != instances[i].end(); ++it) {
+            itFeature = this->features.find(it->first);
+            if (itFeature == this->features.end()) continue;
+            itValue = itFeature->second.likelihoods.find(it->second);
+            likelihood = itValue != itFeature->second.likelihoods.end() ?
+                itValue->second.data() : itFeature->second.unseen.data();
+            for (long c = 0; c < n; c++)
+                row[c] += likelihood[c];
+        }
+    }
+
+    for (long i = 0; i < instances.size(); i++) {
+        double* row = scores.data() + i * n;
+        Classification result;
+        if (n == 0) {
+            results.push_back(result);
+            continue;
+        }
+
+        long best = 0;
+        for (long c = 1; c < n; c++)
+            if (row[c] > row[best]) best = c;
+        double sum = 0.0;
+        for (long c = 0; c < n; c++)
+            sum += std::exp(row[c] - row[best]);
+
+        result.label = this->classes[best];
+        result.probability = 1.0 / sum;
+        for (long c = 0; c < n; c++)
+            result.posterior.push_back(std::make_pair(this->classes[c], std::exp(row[c] - row[best]) / sum));
+        results.push_back(result);
+    }
+    return results;
+}
+
+
+/**
+ *  Process wide registry of classifier models keyed by name.  Declarations live in redis under
+ *  KEY_NB_DEFINITIONS.
+ */
+class ClassifierRegistry {
+
+    std::mutex lock;
+    std::unordered_map<std::string, NaiveBayesModel> models;
+
+public:
+    static ClassifierRegistry& instance() {
+        static ClassifierRegistry registry;
+        return registry;
+    }
+
+    static std::string classifierName(std::string, std::string, std::string);
+    static void relationHook(RedisHandler&, std::string, Json::Value&, int, int);
+
+    static void declare(RedisHandler&, Json::Value&);
+    static bool fetchDefinition(RedisHandler&, std::string, Json::Value&);
+    static std::vector<Json::Value> fetchDefinitions(RedisHandler&);
+    static bool drop(RedisHandler&, std::string);
+    static void dropEntity(RedisHandler&, std::string);
+
+    bool isCurrent(std::string, long);
+    void build(Json::Value&, std::string, long, std::vector<Json::Value>&);
+    Json::Value summarize(Json::Value&);
+    std::vector<Classification> classify(std::string, std::vector<valpair>&);
+    void forget(std::string);
+};
+
+/** Name of the classifier of targetEntity.targetAttr given givenEntity */
+std::string ClassifierRegistry::classifierName(std::string targetEntity, std::string targetAttr,
+        std::string givenEntity) {
+    return targetEntity + std::string(".") + targetAttr + std::string("|") + givenEntity;
+}
+
+/** Does the registry hold the model built at this version of its pair? */
+bool ClassifierRegistry::isCurrent(std::string name, long version) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    std::unordered_map<std::string, NaiveBayesModel>::iterator it = this->models.find(name);
+    return it != this->models.end() && it->second.version == version;
+}
+
+/** Build a model from the relations of its pair */
+void ClassifierRegistry::build(Json::Value& definition, std::string pair, long version,
+        std::vector<Json::Value>& relations) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    NaiveBayesModel& model = this->models[definition[JSON_ATTR_NB_NAME].asString()];
+    model = NaiveBayesModel();
+    model.target = definition[JSON_ATTR_NB_TARGET_ENT].asString();
+    model.attribute = definition[JSON_ATTR_NB_TARGET_ATTR].asString();
+    model.given = definition[JSON_ATTR_NB_GIVEN_ENT].asString();
+    model.pair = pair;
+    model.version = version;
+    for (std::vector<Json::Value>::iterator it = relations.begin(); it != relations.end(); ++it)
+        model.apply(*it, (*it)[JSON_ATTR_REL_COUNT].asInt());
+    model.compile();
+}
+
+/** The definition of a resident model with its class and feature counts */
+Json::Value ClassifierRegistry::summarize(Json::Value& definition) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    Json::Value json = definition;
+    std::unordered_map<std::string, NaiveBayesModel>::iterator it =
+        this->models.find(definition[JSON_ATTR_NB_NAME].asString());
+    if (it == this->models.end()) return json;
+    if (!it->second.compiled) it->second.compile();
+    json["classes"] = (Json::Int64)it->second.classes.size();
+    json["features"] = (Json::Int64)it->second.features.size();
+    return json;
+}
+
+/** Classify a batch of instances, nothing is returned unless the model is resident */
+std::vector<Classification> ClassifierRegistry::classify(std::string name, std::vector<valpair>& instances) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    std::unordered_map<std::string, NaiveBayesModel>::iterator it = this->models.find(name);
+    if (it == this->models.end()) return std::vector<Classification>();
+    return it->second.classify(instances);
+}
+
+/** Forget the model of a classifier */
+void ClassifierRegistry::forget(std::string name) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->models.erase(name);
+}
+
+/**
+ *  Relation hook - applies the change in instance count to the resident models over the pair.  The
+ *  catalog hook runs first and bumps the pair version by one, the models follow it.
+ */
+void ClassifierRegistry::relationHook(RedisHandler& rds, std::string key, Json::Value& relation,
+        int oldCount, int newCount) {
+    ClassifierRegistry& registry = ClassifierRegistry::instance();
+    std::string pair = PairCatalog::pairFromKey(key);
+    std::lock_guard<std::mutex> guard(registry.lock);
+    for (std::unordered_map<std::string, NaiveBayesModel>::iterator it = registry.models.begin();
+            it != registry.models.end(); ++it) {
+        if (it->second.pair.compare(pair) != 0) continue;
+        it->second.apply(relation, newCount - oldCount);
+        it->second.version++;
+    }
+}
+
+static bool classifierHookRegistered = registerRelationHook(ClassifierRegistry::relationHook);
+
+/** Declare a classifier, declaring an existing classifier replaces it */
+void ClassifierRegistry::declare(RedisHandler& rds, Json::Value& definition) {
+    Json::FastWriter writer;
+    rds.writeHashMap(KEY_NB_DEFINITIONS, definition[JSON_ATTR_NB_NAME].asString(), writer.write(definition));
+}
+
+/** Fetch the definition of a classifier */
+bool ClassifierRegistry::fetchDefinition(RedisHandler& rds, std::string name, Json::Value& definition) {
+    Json::Reader reader;
+    std::string value = rds.readHashMap(KEY_NB_DEFINITIONS, name);
+    return value.length() > 0 && reader.parse(value, definition, false);
+}
+
+/** Fetch the definitions of all classifiers */
+std::vector<Json::Value> ClassifierRegistry::fetchDefinitions(RedisHandler& rds) {
+    std::vector<Json::Value> definitions;
+    std::unordered_map<std::string, std::string> values = rds.readHashMapAll(KEY_NB_DEFINITIONS);
+    Json::Reader reader;
+    Json::Value json;
+    for (std::unordered_map<std::string, std::string>::iterator it = values.begin(); it != values.end(); ++it) {
+        json = Json::Value();
+        if (reader.parse(it->second, json, false))
+            definitions.push_back(json);
+    }
+    return definitions;
+}
+
+/** Remove a classifier */
+bool ClassifierRegistry::drop(RedisHandler& rds, std::string name) {
+    Json::Value definition;
+    if (!ClassifierRegistry::fetchDefinition(rds, name, definition)) return false;
+    rds.deleteHashMapField(KEY_NB_DEFINITIONS, name);
+    ClassifierRegistry::instance().forget(name);
+    return true;
+}
+
+/** Remove all classifiers on an entity, e.g. once it is removed */
+void ClassifierRegistry::dropEntity(RedisHandler& rds, std::string entity) {
+    std::vector<Json::Value> definitions = ClassifierRegistry::fetchDefinitions(rds);
+    for (std::vector<Json::Value>::iterator it = definitions.begin(); it != definitions.end(); ++it)
+        if ((*it)[JSON_ATTR_NB_TARGET_ENT].asString().compare(entity) == 0 ||
+                (*it)[JSON_ATTR_NB_GIVEN_ENT].asString().compare(entity) == 0)
+            ClassifierRegistry::drop(rds, (*it)[JSON_ATTR_NB_NAME].asString());
+}
+
+#endif
@@ -1,4 +1,3 @@
-
 /*
  *  client.cpp
  *
@@ -9,18 +8,63 @@
  */
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <string>
 #include "parse.h"
 
+#define CLIENT_OPT_FILE "-f"
+#define CLIENT_OPT_STDIN "-b"
+
 using namespace std;
 
 bool handleUserInput(string input) {
     return true;
 }
 
-int main() {
+/**
+ *  Run a script of statements as a batch, from a file with -f or from stdin with -b
+ */
+int runBatch(Parser* parser, int argc, char** argv) {
+    stringstream script;
+    long failed = 0;
+
+    if (strcmp(argv[1], CLIENT_OPT_FILE) == 0 && argc > 2) {
+        ifstream file(argv[2]);
+        if (!file.is_open()) {
+            emitCLIError(string("Could not open ") + string(argv[2]));
+            return 1;
+        }
+        script << file.rdbuf();
+    } else if (strcmp(argv[1], CLIENT_OPT_STDIN) == 0) {
+        script << cin.rdbuf();
+    } else {
+        cout << "usage: " << argv[0] << " [-f script | -b]" << endl;
+        return 1;
+    }
+
+    Json::Value results = parser->parseBatch(script.str());
+    for (Json::Value::iterator it = results.begin(); it != results.end(); ++it)
+        if ((*it)[JSON_ATTR_BATCH_ERROR].asBool()) failed++;
+    emitCLINote(to_string(results.size()) + string(" statements run, ") + to_string(failed) + string(" failed"));
+
+    // Relations of entities removed by the script are cleared in the background
+    IndexHandler::waitForJobs();
+    return failed > 0 ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
     string line;
     Parser* parser = new Parser();
+
+    // Relations written before the pair catalog and the summaries existed need to be indexed
+    std::vector<std::string> built = IndexHandler().rebuildMissing();
+    for (std::vector<std::string>::iterator it = built.begin(); it != built.end(); ++it)
+        emitCLINote(string("Built ") + *it);
+
+    if (argc > 1)
+        return runBatch(parser, argc, argv);
+
     parser->setDebug(true);
 
     // Read the input
@@ -0,0 +1,183 @@
+/*
+ *  context.h
+ *
+ *  Defines the context of a statement being parsed - the position in the statement, the state of
+ *  the parser FSM and everything read from the statement so far.  The parser itself only holds the
+ *  grammar and the engines statements run against, so any number of threads may parse at once each
+ *  with its own context.  Contexts hold no engine handles and are cheap to make per statement.
+ *
+ *  Created by Ryan Faulkner on 2015-12-28
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _context_h
+#define _context_h
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <json/json.h>
+
+#include "column_types.h"
+#include "lexer.h"
+#include "cpt.h"
+#include "cube.h"
+#include "montecarlo.h"
+#include "models/models.h"
+
+#define STATE_START 0       // Start state
+
+
+/** Relations queued by a batch of statements along with the result of the statement queuing each */
+struct BatchState {
+    std::vector<std::pair<Json::Value, int>> pendingRelations;
+    std::vector<Json::ArrayIndex> pendingResults;
+    Json::Value results;
+
+    BatchState() : results(Json::arrayValue) {}
+};
+
+
+class ParseContext {
+
+public:
+
+    // Stores the number of symbols and the symbol index in the statement
+    int nSymbols;
+    int nSymbolIdx;
+
+    int state;
+    int macroState;
+
+    bool entityProcessed;
+    bool fieldsProcessed;
+    bool parsedIDWord;      // Flag indicating whether pending ID Syntax token has been seen
+
+    bool error;
+    std::string errStr;
+    std::string rspStr;
+
+    // Define lists that store state of newly defined fields and values
+    defpair currFields;
+    valpair currValues;
+    valpair bufferValues;
+    std::unordered_map<std::string, std::string> currTypes;
+    std::unordered_map<std::string, std::string> bufferTypes;
+
+    // Define internal state that stores entity handles
+    std::string currEntity;
+    std::string currValue;
+    std::string bufferEntity;
+
+    Keyword keyword;        // Keyword of the token being analyzed, KW_NONE if it is not one
+
+    // Modifiers for GEN/INF - a pending modifier is one still waiting on its argument
+    Keyword pendingModifier;
+    long sampleCount;
+    bool sampleReplace;
+    bool sampleSeeded;
+    uint64_t sampleSeed;
+    Keyword infStatistic;       // Statistic reported by INF - KW_NONE for the expected value
+    bool infApprox;             // Answer INF from the count-min sketch or the pair reservoirs
+    double infPercentile;       // Percentile for PCT
+    long infTopCount;           // Number of values for TOP
+    std::vector<std::string> chainEntities;     // Entities between E1 and the last GIVEN entity
+    std::string groupAttribute;     // Attribute of the given entity for GROUP BY
+    bool infMonteCarlo;         // Estimate INF from parallel draws
+    double mcPrecision;         // Target standard error, 0 to run for the whole budget
+    long mcBudget;              // Milliseconds
+    bool watching;              // Register the INF as a standing query
+
+    // Statement being prepared or executed
+    bool preparing;             // Keep the statement as a plan rather than run it
+    std::string preparedName;
+    std::string preparedText;
+    std::vector<std::string> executeValues;
+
+    // Cell limit for a conditional table declaration
+    long tableLimit;
+
+    // Attributes and cell limit for an aggregate cube declaration
+    std::vector<std::string> cubeAttributes;
+    long cubeLimit;
+
+    // Instances of the given entity to classify
+    std::vector<valpair> classifyInstances;
+
+    // Attribute values for internal state
+    std::string currAttrEntity;
+    std::string bufferAttrEntity;
+    std::string currAttribute;
+    std::string bufferAttribute;
+
+    // Batch the statement belongs to, NULL outside of batches
+    BatchState* batch;
+
+    ParseContext() : batch(NULL) { this->reset(); }
+
+    void reset();
+    void cleanup();
+};
+
+/**
+ *  Start a new statement, the batch is kept
+ */
+void ParseContext::reset() {
+    this->cleanup();
+    this->nSymbols = 0;
+    this->nSymbolIdx = 0;
+    this->state = STATE_START;
+    this->macroState = STATE_START;
+    this->error = false;
+    this->errStr = "";
+    this->rspStr = "";
+    this->fieldsProcessed = false;
+    this->entityProcessed = false;
+    this->parsedIDWord = false;
+    this->currEntity = "";
+    this->currAttribute = "";
+    this->currValue = "";
+    this->bufferEntity = "";
+    this->bufferAttribute = "";
+    this->currAttrEntity = "";
+    this->bufferAttrEntity = "";
+    this->keyword = KW_NONE;
+    this->pendingModifier = KW_NONE;
+    this->sampleCount = 0;
+    this->sampleReplace = true;
+    this->sampleSeeded = false;
+    this->sampleSeed = 0;
+    this->infStatistic = KW_NONE;
+    this->infApprox = false;
+    this->infPercentile = 0.0;
+    this->infTopCount = 0;
+    this->chainEntities.clear();
+    this->groupAttribute = "";
+    this->infMonteCarlo = false;
+    this->mcPrecision = 0.0;
+    this->mcBudget = MC_DEFAULT_BUDGET;
+    this->watching = false;
+    this->preparing = false;
+    this->preparedName = "";
+    this->preparedText = "";
+    this->executeValues.clear();
+    this->tableLimit = CPT_DEFAULT_LIMIT;
+    this->cubeAttributes.clear();
+    this->cubeLimit = CUBE_DEFAULT_LIMIT;
+    this->classifyInstances.clear();
+}
+
+/**
+ * Performs cleanup of state containers after statement processing
+ */
+void ParseContext::cleanup() {
+    for (defpair::iterator it = this->currFields.begin(); it != this->currFields.end(); ++it)
+        delete it->first;
+    this->currFields.clear();
+    this->currValues.clear();
+    this->bufferValues.clear();
+    this->currTypes.clear();
+    this->bufferTypes.clear();
+}
+
+#endif
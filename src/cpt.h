@@ -0,0 +1,278 @@
+/*
+ *  cpt.h
+ *
+ *  Defines materialized conditional probability tables.  A table is declared over an attribute of
+ *  one entity given an attribute of another, e.g. P(x.a | y.b), and holds the instance counts of
+ *  the relations between the two entities for each pair of values.  Tables are kept current by a
+ *  relation hook so conditional queries over low cardinality attributes read a handful of cells
+ *  rather than the relations.
+ *
+ *  Each table is a redis hash of cells, a table growing past its cell limit is marked as overflowed
+ *  and dropped, queries on it fall back to the relations.
+ *
+ *  Created by Ryan Faulkner on 2015-12-17
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _cpt_h
+#define _cpt_h
+
+#include <string>
+#include <vector>
+#include <json/json.h>
+
+#include "redis.h"
+#include "hooks.h"
+#include "models/model_def.h"
+
+#define KEY_CPT_DEFINITIONS "cpts"
+#define KEY_CPT_DEFINITIONS_VERSION "cpts_version"
+#define KEY_CPT_PREFIX "cpt"
+#define KEY_CPT_DELIMETER "+"
+
+#define CPT_DEFAULT_LIMIT 256
+
+#define CPT_STATUS_READY "ready"
+#define CPT_STATUS_OVERFLOW "overflow"
+
+#define JSON_ATTR_CPT_NAME "table"
+#define JSON_ATTR_CPT_TARGET_ENT "target_entity"
+#define JSON_ATTR_CPT_TARGET_ATTR "target_attribute"
+#define JSON_ATTR_CPT_GIVEN_ENT "given_entity"
+#define JSON_ATTR_CPT_GIVEN_ATTR "given_attribute"
+#define JSON_ATTR_CPT_LIMIT "limit"
+#define JSON_ATTR_CPT_STATUS "status"
+#define JSON_ATTR_CPT_CELLS "cells"
+#define JSON_ATTR_CPT_VALUE "value"
+#define JSON_ATTR_CPT_GIVEN_VALUE "given_value"
+#define JSON_ATTR_CPT_COUNT "count"
+#define JSON_ATTR_CPT_PROB "probability"
+
+
+/**
+ *  A cell of a conditional table - the instance count of relations with the pair of values.  A
+ *  relation lacking one of the attributes is counted with that value missing.
+ */
+struct TableCell {
+    bool hasValue;
+    std::string value;
+    bool hasGiven;
+    std::string given;
+    long count;
+};
+
+
+/**
+ *  Interface to the conditional tables.  Tables are named "x.a|y.b" for P(x.a | y.b).
+ */
+class ConditionalTable {
+
+    static DefinitionCache& definitionCache();
+    static std::string cellField(Json::Value&, Json::Value&);
+    static bool parseCellField(std::string, TableCell&);
+    static void updateCell(RedisHandler&, Json::Value&, Json::Value&, int);
+
+public:
+
+    static std::string tableName(std::string, std::string, std::string, std::string);
+    static std::string tableKey(std::string);
+    static void relationHook(RedisHandler&, std::string, Json::Value&, int, int);
+    static void relationBatchHook(RedisHandler&, std::vector<RelationDelta>&);
+
+    static void declare(RedisHandler&, Json::Value&, std::vector<Json::Value>&);
+    static bool fetchDefinition(RedisHandler&, std::string, Json::Value&);
+    static std::vector<Json::Value> fetchDefinitions(RedisHandler&);
+    static std::vector<TableCell> fetchCells(RedisHandler&, std::string);
+    static Json::Value fetchTable(RedisHandler&, std::string);
+    static bool drop(RedisHandler&, std::string);
+    static void dropEntity(RedisHandler&, std::string);
+};
+
+/** Name of the table for P(targetEntity.targetAttr | givenEntity.givenAttr) */
+std::string ConditionalTable::tableName(std::string targetEntity, std::string targetAttr,
+        std::string givenEntity, std::string givenAttr) {
+    return targetEntity + std::string(".") + targetAttr + std::string("|") + givenEntity + std::string(".") + givenAttr;
+}
+
+/** Redis key of the cells of a table */
+std::string ConditionalTable::tableKey(std::string name) {
+    return std::string(KEY_CPT_PREFIX) + KEY_CPT_DELIMETER + name;
+}
+
+/** Cell fields are compact json arrays - [value, given value] with null for a missing value */
+std::string ConditionalTable::cellField(Json::Value& value, Json::Value& given) {
+    Json::Value field(Json::arrayValue);
+    Json::FastWriter writer;
+    field.append(value);
+    field.append(given);
+    std::string out = writer.write(field);
+    if (out.length() > 0 && out[out.length() - 1] == '\n') out.erase(out.length() - 1);
+    return out;
+}
+
+/** Read the values of a cell from its field */
+bool ConditionalTable::parseCellField(std::string field, TableCell& cell) {
+    Json::Reader reader;
+    Json::Value json;
+    if (!reader.parse(field, json, false) || !json.isArray() || json.size() != 2) return false;
+    cell.hasValue = !json[0].isNull();
+    cell.value = cell.hasValue ? json[0].asString() : "";
+    cell.hasGiven = !json[1].isNull();
+    cell.given = cell.hasGiven ? json[1].asString() : "";
+    return true;
+}
+
+/**
+ *  Apply a change in instance count for a relation to a table.  Cells falling to zero are removed,
+ *  a new cell beyond the limit overflows the table.
+ */
+void ConditionalTable::updateCell(RedisHandler& rds, Json::Value& definition, Json::Value& relation, int delta) {
+    std::string targetEntity = definition[JSON_ATTR_CPT_TARGET_ENT].asString();
+    std::string targetSide = relation[JSON_ATTR_REL_ENTL].asString().compare(targetEntity) == 0 ?
+        JSON_ATTR_REL_FIELDSL : JSON_ATTR_REL_FIELDSR;
+    std::string givenSide = targetSide.compare(JSON_ATTR_REL_FIELDSL) == 0 ? JSON_ATTR_REL_FIELDSR : JSON_ATTR_REL_FIELDSL;
+    std::string targetAttr = definition[JSON_ATTR_CPT_TARGET_ATTR].asString();
+    std::string givenAttr = definition[JSON_ATTR_CPT_GIVEN_ATTR].asString();
+
+    Json::Value value, given;
+    if (relation[targetSide].isMember(targetAttr)) value = relation[targetSide][targetAttr].asString();
+    if (relation[givenSide].isMember(givenAttr)) given = relation[givenSide][givenAttr].asString();
+
+    std::string name = definition[JSON_ATTR_CPT_NAME].asString();
+    std::string key = ConditionalTable::tableKey(name);
+    std::string field = ConditionalTable::cellField(value, given);
+    long count = rds.incrementHashMapAndRead(key, field, delta);
+
+    if (count <= 0)
+        rds.deleteHashMapField(key, field);
+    else if (count == delta && rds.hashMapLength(key) > definition[JSON_ATTR_CPT_LIMIT].asInt64()) {
+        definition[JSON_ATTR_CPT_STATUS] = CPT_STATUS_OVERFLOW;
+        Json::FastWriter writer;
+        rds.writeHashMap(KEY_CPT_DEFINITIONS, name, writer.write(definition));
+        ConditionalTable::definitionCache().bump(rds);
+        rds.deleteKey(key);
+    }
+}
+
+/** Definitions of the tables, read once per version by the hooks */
+DefinitionCache& ConditionalTable::definitionCache() {
+    static DefinitionCache cache(KEY_CPT_DEFINITIONS, KEY_CPT_DEFINITIONS_VERSION);
+    return cache;
+}
+
+/** Relation hook - applies the change in instance count to every ready table over the pair */
+void ConditionalTable::relationHook(RedisHandler& rds, std::string key, Json::Value& relation, int oldCount, int newCount) {
+    std::vector<RelationDelta> deltas(1, RelationDelta(key, &relation, oldCount, newCount));
+    ConditionalTable::relationBatchHook(rds, deltas);
+}
+
+/** Batch relation hook - the definitions are read once for the chunk */
+void ConditionalTable::relationBatchHook(RedisHandler& rds, std::vector<RelationDelta>& deltas) {
+    std::vector<Json::Value> definitions = ConditionalTable::fetchDefinitions(rds);
+    if (definitions.size() == 0) return;
+
+    std::string left, right, target, given;
+    for (std::vector<RelationDelta>::iterator itDelta = deltas.begin(); itDelta != deltas.end(); ++itDelta) {
+        Json::Value& relation = *(itDelta->relation);
+        left = relation[JSON_ATTR_REL_ENTL].asString();
+        right = relation[JSON_ATTR_REL_ENTR].asString();
+
+        for (std::vector<Json::Value>::iterator it = definitions.begin(); it != definitions.end(); ++it) {
+            if ((*it)[JSON_ATTR_CPT_STATUS].asString().compare(CPT_STATUS_READY) != 0) continue;
+            target = (*it)[JSON_ATTR_CPT_TARGET_ENT].asString();
+            given = (*it)[JSON_ATTR_CPT_GIVEN_ENT].asString();
+            if ((left.compare(target) == 0 && right.compare(given) == 0) ||
+                    (left.compare(given) == 0 && right.compare(target) == 0))
+                ConditionalTable::updateCell(rds, *it, relation, itDelta->newCount - itDelta->oldCount);
+        }
+    }
+}
+
+static bool cptHookRegistered = registerRelationHook(ConditionalTable::relationHook, ConditionalTable::relationBatchHook);
+
+/**
+ *  Declare a table and build it from the relations currently between its entities.  Declaring an
+ *  existing table rebuilds it.
+ */
+void ConditionalTable::declare(RedisHandler& rds, Json::Value& definition, std::vector<Json::Value>& relations) {
+    std::string name = definition[JSON_ATTR_CPT_NAME].asString();
+    Json::FastWriter writer;
+
+    definition[JSON_ATTR_CPT_STATUS] = CPT_STATUS_READY;
+    rds.deleteKey(ConditionalTable::tableKey(name));
+    for (std::vector<Json::Value>::iterator it = relations.begin(); it != relations.end(); ++it) {
+        ConditionalTable::updateCell(rds, definition, *it, (*it)[JSON_ATTR_REL_COUNT].asInt());
+        if (definition[JSON_ATTR_CPT_STATUS].asString().compare(CPT_STATUS_READY) != 0) return;
+    }
+    rds.writeHashMap(KEY_CPT_DEFINITIONS, name, writer.write(definition));
+    ConditionalTable::definitionCache().bump(rds);
+}
+
+/** Fetch the definition of a table */
+bool ConditionalTable::fetchDefinition(RedisHandler& rds, std::string name, Json::Value& definition) {
+    Json::Reader reader;
+    std::string value = rds.readHashMap(KEY_CPT_DEFINITIONS, name);
+    return value.length() > 0 && reader.parse(value, definition, false);
+}
+
+/** Fetch the definitions of all tables */
+std::vector<Json::Value> ConditionalTable::fetchDefinitions(RedisHandler& rds) {
+    return ConditionalTable::definitionCache().fetch(rds);
+}
+
+/** Fetch the cells of a table */
+std::vector<TableCell> ConditionalTable::fetchCells(RedisHandler& rds, std::string name) {
+    std::vector<TableCell> cells;
+    std::unordered_map<std::string, std::string> values = rds.readHashMapAll(ConditionalTable::tableKey(name));
+    TableCell cell;
+    for (std::unordered_map<std::string, std::string>::iterator it = values.begin(); it != values.end(); ++it)
+        if (ConditionalTable::parseCellField(it->first, cell)) {
+            cell.count = atol(it->second.c_str());
+            cells.push_back(cell);
+        }
+    return cells;
+}
+
+/** A table as json - its definition along with the counts and conditional probabilities of its cells */
+Json::Value ConditionalTable::fetchTable(RedisHandler& rds, std::string name) {
+    Json::Value table;
+    if (!ConditionalTable::fetchDefinition(rds, name, table)) return table;
+
+    std::vector<TableCell> cells = ConditionalTable::fetchCells(rds, name);
+    std::unordered_map<std::string, long> givenTotals;
+    for (std::vector<TableCell>::iterator it = cells.begin(); it != cells.end(); ++it)
+        givenTotals[it->hasGiven ? "=" + it->given : ""] += it->count;
+
+    table[JSON_ATTR_CPT_CELLS] = Json::Value(Json::arrayValue);
+    Json::Value json;
+    for (std::vector<TableCell>::iterator it = cells.begin(); it != cells.end(); ++it) {
+        json = Json::Value();
+        json[JSON_ATTR_CPT_VALUE] = it->hasValue ? Json::Value(it->value) : Json::Value();
+        json[JSON_ATTR_CPT_GIVEN_VALUE] = it->hasGiven ? Json::Value(it->given) : Json::Value();
+        json[JSON_ATTR_CPT_COUNT] = (Json::Int64)it->count;
+        json[JSON_ATTR_CPT_PROB] = (double)it->count / (double)givenTotals[it->hasGiven ? "=" + it->given : ""];
+        table[JSON_ATTR_CPT_CELLS].append(json);
+    }
+    return table;
+}
+
+/** Remove a table */
+bool ConditionalTable::drop(RedisHandler& rds, std::string name) {
+    Json::Value definition;
+    if (!ConditionalTable::fetchDefinition(rds, name, definition)) return false;
+    rds.deleteHashMapField(KEY_CPT_DEFINITIONS, name);
+    ConditionalTable::definitionCache().bump(rds);
+    rds.deleteKey(ConditionalTable::tableKey(name));
+    return true;
+}
+
+/** Remove all tables on an entity, e.g. once it is removed */
+void ConditionalTable::dropEntity(RedisHandler& rds, std::string entity) {
+    std::vector<Json::Value> definitions = ConditionalTable::fetchDefinitions(rds);
+    for (std::vector<Json::Value>::iterator it = definitions.begin(); it != definitions.end(); ++it)
+        if ((*it)[JSON_ATTR_CPT_TARGET_ENT].asString().compare(entity) == 0 ||
+                (*it)[JSON_ATTR_CPT_GIVEN_ENT].asString().compare(entity) == 0)
+            ConditionalTable::drop(rds, (*it)[JSON_ATTR_CPT_NAME].asString());
+}
+
+#endif
@@ -0,0 +1,479 @@
+/*
+ *  cube.h
+ *
+ *  Defines aggregate cubes over low cardinality attributes of an entity pair.  A cube is declared
+ *  over attributes of the two entities, e.g. x.a, y.b, y.c, and holds the instance count of the
+ *  relations between them for each combination of values.  Values are replaced by dictionary codes
+ *  per attribute, code 0 standing for a relation lacking the attribute, and cells are keyed by their
+ *  codes.  Cubes are kept current by a relation hook as the conditional tables are.
+ *
+ *  A cube loaded for a query is a dense count array when the product of its dimension sizes is
+ *  small and a list of its non-zero cells otherwise.  Counts filtered on the cube attributes are
+ *  sums over the slices matching the filter, a mask of matching codes per dimension.
+ *
+ *  Created by Ryan Faulkner on 2015-12-27
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _cube_h
+#define _cube_h
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <json/json.h>
+
+#include "redis.h"
+#include "hooks.h"
+#include "column_types.h"
+#include "models/models.h"
+
+#define KEY_CUBE_DEFINITIONS "cubes"
+#define KEY_CUBE_DEFINITIONS_VERSION "cubes_version"
+#define KEY_CUBE_PREFIX "cube"
+#define KEY_CUBE_DICT_PREFIX "cubedict"
+#define KEY_CUBE_DELIMETER "+"
+
+#define CUBE_DEFAULT_LIMIT 4096     // Non-zero cells before a cube overflows
+#define CUBE_MAX_DIMENSIONS 8
+#define CUBE_DENSE_CELLS 65536      // Largest dense count array
+
+#define CUBE_STATUS_READY "ready"
+#define CUBE_STATUS_OVERFLOW "overflow"
+
+#define JSON_ATTR_CUBE_NAME "cube"
+#define JSON_ATTR_CUBE_ENTITIES "entities"
+#define JSON_ATTR_CUBE_DIMS "dimensions"
+#define JSON_ATTR_CUBE_ENTITY "entity"
+#define JSON_ATTR_CUBE_ATTR "attribute"
+#define JSON_ATTR_CUBE_TYPE "type"
+#define JSON_ATTR_CUBE_LIMIT "limit"
+#define JSON_ATTR_CUBE_STATUS "status"
+#define JSON_ATTR_CUBE_CELLS "cells"
+#define JSON_ATTR_CUBE_VALUES "values"
+#define JSON_ATTR_CUBE_COUNT "count"
+
+
+/** An attribute of a cube with its values by dictionary code, code 0 is the missing value */
+struct CubeDimension {
+    std::string entity;
+    std::string attribute;
+    std::string type;
+    std::vector<std::string> values;
+};
+
+
+/**
+ *  Interface to the aggregate cubes and the in-memory form of a loaded cube.  Cubes are named by
+ *  their attributes in declaration order, e.g. "x.a,y.b,y.c".
+ */
+class AggregateCube {
+
+    static DefinitionCache& definitionCache();
+    std::vector<CubeDimension> dimensions;
+    bool dense;
+    std::vector<long> strides;
+    std::vector<long> counts;                       // dense count array
+    std::vector<std::vector<long>> cellCodes;       // sparse cells
+    std::vector<long> cellCounts;
+
+    static std::string cellField(RedisHandler&, Json::Value&, Json::Value&);
+    static bool parseCellField(std::string, std::vector<long>&);
+    static long encode(RedisHandler&, std::string, long, std::string);
+    static void updateCell(RedisHandler&, Json::Value&, Json::Value&, int);
+
+public:
+    AggregateCube() : dense(false) {}
+
+    static std::string cubeName(std::vector<std::string>&);
+    static std::string cubeKey(std::string);
+    static std::string dictionaryKey(std::string);
+    static void relationHook(RedisHandler&, std::string, Json::Value&, int, int);
+    static void relationBatchHook(RedisHandler&, std::vector<RelationDelta>&);
+
+    static void declare(RedisHandler&, Json::Value&, std::vector<Json::Value>&);
+    static bool fetchDefinition(RedisHandler&, std::string, Json::Value&);
+    static std::vector<Json::Value> fetchDefinitions(RedisHandler&);
+    static bool covers(Json::Value&, std::string, std::string);
+    static bool load(RedisHandler&, std::string, AggregateCube&);
+    static Json::Value fetchCube(RedisHandler&, std::string);
+    static bool drop(RedisHandler&, std::string);
+    static void dropEntity(RedisHandler&, std::string);
+
+    long dimension(std::string, std::string);
+    long size() { return this->dimensions.size(); }
+    bool isDense() { return this->dense; }
+    std::vector<std::vector<bool>> masks();
+    void restrict(std::vector<bool>&, long, AttributeTuple&, std::string);
+    long sum(std::vector<std::vector<bool>>&);
+};
+
+/** Name of the cube over a list of entity attributes */
+std::string AggregateCube::cubeName(std::vector<std::string>& attributes) {
+    std::string name;
+    for (std::vector<std::string>::iterator it = attributes.begin(); it != attributes.end(); ++it)
+        name += (it == attributes.begin() ? std::string("") : std::string(",")) + *it;
+    return name;
+}
+
+/** Redis key of the cells of a cube */
+std::string AggregateCube::cubeKey(std::string name) {
+    return std::string(KEY_CUBE_PREFIX) + KEY_CUBE_DELIMETER + name;
+}
+
+/**
+ *  Redis key of the dictionaries of a cube.  The hash maps "d=value" to the code of the value on
+ *  dimension d and "d#code" back to the value, "d#" holds the last code assigned.
+ */
+std::string AggregateCube::dictionaryKey(std::string name) {
+    return std::string(KEY_CUBE_DICT_PREFIX) + KEY_CUBE_DELIMETER + name;
+}
+
+/**
+ *  Code of a value on a dimension, assigning the next code to a value not seen yet.  Writers racing
+ *  on a new value each take a code but only the first claims the value, the others read its code
+ *  back and leave an unused reverse entry behind.
+ */
+long AggregateCube::encode(RedisHandler& rds, std::string name, long dim, std::string value) {
+    std::string key = AggregateCube::dictionaryKey(name);
+    std::string prefix = std::to_string(dim);
+    std::string code = rds.readHashMap(key, prefix + "=" + value);
+    if (code.length() > 0) return std::atol(code.c_str());
+
+    long assigned = rds.incrementHashMapAndRead(key, prefix + "#", 1);
+    rds.writeHashMap(key, prefix + "#" + std::to_string(assigned), value);
+    if (rds.writeHashMapIfAbsent(key, prefix + "=" + value, std::to_string(assigned)))
+        return assigned;
+    return std::atol(rds.readHashMap(key, prefix + "=" + value).c_str());
+}
+
+/** Cell fields are the codes of the relation on each dimension separated by ':' */
+std::string AggregateCube::cellField(RedisHandler& rds, Json::Value& definition, Json::Value& relation) {
+    std::string name = definition[JSON_ATTR_CUBE_NAME].asString();
+    std::string left = relation[JSON_ATTR_REL_ENTL].asString();
+    std::string field, side;
+    Json::Value& dims = definition[JSON_ATTR_CUBE_DIMS];
+
+    for (Json::ArrayIndex i = 0; i < dims.size(); i++) {
+        side = left.compare(dims[i][JSON_ATTR_CUBE_ENTITY].asString()) == 0 ?
+            JSON_ATTR_REL_FIELDSL : JSON_ATTR_REL_FIELDSR;
+        std::string attribute = dims[i][JSON_ATTR_CUBE_ATTR].asString();
+        long code = relation[side].isMember(attribute) ?
+            AggregateCube::encode(rds, name, i, relation[side][attribute].asString()) : 0;
+        field += (i > 0 ? std::string(":") : std::string("")) + std::to_string(code);
+    }
+    return field;
+}
+
+/** Read the codes of a cell from its field */
+bool AggregateCube::parseCellField(std::string field, std::vector<long>& codes) {
+    codes.clear();
+    std::string::size_type start = 0, end;
+    while (true) {
+        end = field.find(':', start);
+        codes.push_back(std::atol(field.substr(start, end - start).c_str()));
+        if (end == std::string::npos) break;
+        start = end + 1;
+    }
+    return codes.size() > 0;
+}
+
+/**
+ *  Apply a change in instance count for a relation to a cube.  Cells falling to zero are removed,
+ *  a new cell beyond the limit overflows the cube.
+ */
+void AggregateCube::updateCell(RedisHandler& rds, Json::Value& definition, Json::Value& relation, int delta) {
+    std::string name = definition[JSON_ATTR_CUBE_NAME].asString();
+    std::string key = AggregateCube::cubeKey(name);
+    std::string field = AggregateCube::cellField(rds, definition, relation);
+    long count = rds.incrementHashMapAndRead(key, field, delta);
+
+    if (count <= 0)
+        rds.deleteHashMapField(key, field);
+    else if (count == delta && rds.hashMapLength(key) > definition[JSON_ATTR_CUBE_LIMIT].asInt64()) {
+        definition[JSON_ATTR_CUBE_STATUS] = CUBE_STATUS_OVERFLOW;
+        Json::FastWriter writer;
+        rds.writeHashMap(KEY_CUBE_DEFINITIONS, name, writer.write(definition));
+        AggregateCube::definitionCache().bump(rds);
+        rds.deleteKey(key);
+        rds.deleteKey(AggregateCube::dictionaryKey(name));
+    }
+}
+
+/** Definitions of the cubes, read once per version by the hooks */
+DefinitionCache& AggregateCube::definitionCache() {
+    static DefinitionCache cache(KEY_CUBE_DEFINITIONS, KEY_CUBE_DEFINITIONS_VERSION);
+    return cache;
+}
+
+/** Relation hook - applies the change in instance count to every ready cube over the pair */
+void AggregateCube::relationHook(RedisHandler& rds, std::string key, Json::Value& relation, int oldCount, int newCount) {
+    std::vector<RelationDelta> deltas(1, RelationDelta(key, &relation, oldCount, newCount));
+    AggregateCube::relationBatchHook(rds, deltas);
+}
+
+/** Batch relation hook - the definitions are read once for the chunk */
+void AggregateCube::relationBatchHook(RedisHandler& rds, std::vector<RelationDelta>& deltas) {
+    std::vector<Json::Value> definitions = AggregateCube::fetchDefinitions(rds);
+    if (definitions.size() == 0) return;
+
+    std::string left, right, first, second;
+    for (std::vector<RelationDelta>::iterator itDelta = deltas.begin(); itDelta != deltas.end(); ++itDelta) {
+        Json::Value& relation = *(itDelta->relation);
+        left = relation[JSON_ATTR_REL_ENTL].asString();
+        right = relation[JSON_ATTR_REL_ENTR].asString();
+
+        for (std::vector<Json::Value>::iterator it = definitions.begin(); it != definitions.end(); ++it) {
+            if ((*it)[JSON_ATTR_CUBE_STATUS].asString().compare(CUBE_STATUS_READY) != 0) continue;
+            first = (*it)[JSON_ATTR_CUBE_ENTITIES][0].asString();
+            second = (*it)[JSON_ATTR_CUBE_ENTITIES][1].asString();
+            if ((left.compare(first) == 0 && right.compare(second) == 0) ||
+                    (left.compare(second) == 0 && right.compare(first) == 0))
+                AggregateCube::updateCell(rds, *it, relation, itDelta->newCount - itDelta->oldCount);
+        }
+    }
+}
+
+static bool cubeHookRegistered = registerRelationHook(AggregateCube::relationHook, AggregateCube::relationBatchHook);
+
+/**
+ *  Declare a cube and build it from the relations currently between its entities.  Declaring an
+ *  existing cube rebuilds it.
+ */
+void AggregateCube::declare(RedisHandler& rds, Json::Value& definition, std::vector<Json::Value>& relations) {
+    std::string name = definition[JSON_ATTR_CUBE_NAME].asString();
+    Json::FastWriter writer;
+
+    definition[JSON_ATTR_CUBE_STATUS] = CUBE_STATUS_READY;
+    rds.deleteKey(AggregateCube::cubeKey(name));
+    rds.deleteKey(AggregateCube::dictionaryKey(name));
+    for (std::vector<Json::Value>::iterator it = relations.begin(); it != relations.end(); ++it) {
+        AggregateCube::updateCell(rds, definition, *it, (*it)[JSON_ATTR_REL_COUNT].asInt());
+        if (definition[JSON_ATTR_CUBE_STATUS].asString().compare(CUBE_STATUS_READY) != 0) return;
+    }
+    rds.writeHashMap(KEY_CUBE_DEFINITIONS, name, writer.write(definition));
+    AggregateCube::definitionCache().bump(rds);
+}
+
+/** Fetch the definition of a cube */
+bool AggregateCube::fetchDefinition(RedisHandler& rds, std::string name, Json::Value& definition) {
+    Json::Reader reader;
+    std::string value = rds.readHashMap(KEY_CUBE_DEFINITIONS, name);
+    return value.length() > 0 && reader.parse(value, definition, false);
+}
+
+/** Fetch the definitions of all cubes */
+std::vector<Json::Value> AggregateCube::fetchDefinitions(RedisHandler& rds) {
+    return AggregateCube::definitionCache().fetch(rds);
+}
+
+/** Does the cube of a definition hold an entity attribute? */
+bool AggregateCube::covers(Json::Value& definition, std::string entity, std::string attribute) {
+    Json::Value& dims = definition[JSON_ATTR_CUBE_DIMS];
+    for (Json::ArrayIndex i = 0; i < dims.size(); i++)
+        if (dims[i][JSON_ATTR_CUBE_ENTITY].asString().compare(entity) == 0 &&
+                dims[i][JSON_ATTR_CUBE_ATTR].asString().compare(attribute) == 0)
+            return true;
+    return false;
+}
+
+/**
+ *  Load a ready cube into memory - its dictionaries and cells, laid out as a dense count array
+ *  when the product of the dimension sizes is at most CUBE_DENSE_CELLS
+ */
+bool AggregateCube::load(RedisHandler& rds, std::string name, AggregateCube& cube) {
+    Json::Value definition;
+    if (!AggregateCube::fetchDefinition(rds, name, definition) ||
+            definition[JSON_ATTR_CUBE_STATUS].asString().compare(CUBE_STATUS_READY) != 0)
+        return false;
+
+    cube = AggregateCube();
+    Json::Value& dims = definition[JSON_ATTR_CUBE_DIMS];
+    for (Json::ArrayIndex i = 0; i < dims.size(); i++) {
+        CubeDimension dimension;
+        dimension.entity = dims[i][JSON_ATTR_CUBE_ENTITY].asString();
+        dimension.attribute = dims[i][JSON_ATTR_CUBE_ATTR].asString();
+        dimension.type = dims[i][JSON_ATTR_CUBE_TYPE].asString();
+        dimension.values.push_back("");
+        cube.dimensions.push_back(dimension);
+    }
+
+    // Reverse dictionary entries are "d#code", the counter is "d#"
+    std::unordered_map<std::string, std::string> entries = rds.readHashMapAll(AggregateCube::dictionaryKey(name));
+    std::string::size_type split;
+    long dim, code;
+    for (std::unordered_map<std::string, std::string>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        split = it->first.find_first_not_of("0123456789");
+        if (split == std::string::npos || it->first[split] != '#' || split + 1 == it->first.length()) continue;
+        dim = std::atol(it->first.substr(0, split).c_str());
+        code = std::atol(it->first.substr(split + 1).c_str());
+        if (dim >= cube.dimensions.size() || code < 1) continue;
+        if (cube.dimensions[dim].values.size() <= code)
+            cube.dimensions[dim].values.resize(code + 1);
+        cube.dimensions[dim].values[code] = it->second;
+    }
+
+    long cells = 1;
+    for (std::vector<CubeDimension>::iterator it = cube.dimensions.begin(); it != cube.dimensions.end(); ++it)
+        if (cells <= CUBE_DENSE_CELLS) cells *= it->values.size();
+    cube.dense = cells <= CUBE_DENSE_CELLS;
+    cube.strides.assign(cube.dimensions.size(), 0);
+    if (cube.dense) {
+        cube.counts.assign(cells, 0);
+        cells = 1;
+        for (long i = cube.dimensions.size() - 1; i >= 0; i--) {
+            cube.strides[i] = cells;
+            cells *= cube.dimensions[i].values.size();
+        }
+    }
+
+    std::unordered_map<std::string, std::string> values = rds.readHashMapAll(AggregateCube::cubeKey(name));
+    std::vector<long> codes;
+    long index;
+    bool valid;
+    for (std::unordered_map<std::string, std::string>::iterator it = values.begin(); it != values.end(); ++it) {
+        if (!AggregateCube::parseCellField(it->first, codes) || codes.size() != cube.dimensions.size()) continue;
+        valid = true;
+        index = 0;
+        for (long i = 0; i < codes.size(); i++) {
+            valid = valid && codes[i] >= 0 && codes[i] < cube.dimensions[i].values.size();
+            index += codes[i] * cube.strides[i];
+        }
+        if (!valid) continue;
+        if (cube.dense)
+            cube.counts[index] += std::atol(it->second.c_str());
+        else {
+            cube.cellCodes.push_back(codes);
+            cube.cellCounts.push_back(std::atol(it->second.c_str()));
+        }
+    }
+    return true;
+}
+
+/** A cube as json - its definition along with the values and counts of its non-zero cells */
+Json::Value AggregateCube::fetchCube(RedisHandler& rds, std::string name) {
+    Json::Value json;
+    AggregateCube cube;
+    if (!AggregateCube::fetchDefinition(rds, name, json)) return json;
+    json[JSON_ATTR_CUBE_CELLS] = Json::Value(Json::arrayValue);
+    if (!AggregateCube::load(rds, name, cube)) return json;
+
+    std::unordered_map<std::string, std::string> values = rds.readHashMapAll(AggregateCube::cubeKey(name));
+    std::vector<long> codes;
+    Json::Value cell;
+    for (std::unordered_map<std::string, std::string>::iterator it = values.begin(); it != values.end(); ++it) {
+        if (!AggregateCube::parseCellField(it->first, codes) || codes.size() != cube.dimensions.size()) continue;
+        cell = Json::Value();
+        cell[JSON_ATTR_CUBE_VALUES] = Json::Value(Json::arrayValue);
+        for (long i = 0; i < codes.size(); i++)
+            cell[JSON_ATTR_CUBE_VALUES].append(codes[i] > 0 && codes[i] < cube.dimensions[i].values.size() ?
+                Json::Value(cube.dimensions[i].values[codes[i]]) : Json::Value());
+        cell[JSON_ATTR_CUBE_COUNT] = (Json::Int64)std::atol(it->second.c_str());
+        json[JSON_ATTR_CUBE_CELLS].append(cell);
+    }
+    return json;
+}
+
+/** Remove a cube */
+bool AggregateCube::drop(RedisHandler& rds, std::string name) {
+    Json::Value definition;
+    if (!AggregateCube::fetchDefinition(rds, name, definition)) return false;
+    rds.deleteHashMapField(KEY_CUBE_DEFINITIONS, name);
+    AggregateCube::definitionCache().bump(rds);
+    rds.deleteKey(AggregateCube::cubeKey(name));
+    rds.deleteKey(AggregateCube::dictionaryKey(name));
+    return true;
+}
+
+/** Remove all cubes on an entity, e.g. once it is removed */
+void AggregateCube::dropEntity(RedisHandler& rds, std::string entity) {
+    std::vector<Json::Value> definitions = AggregateCube::fetchDefinitions(rds);
+    for (std::vector<Json::Value>::iterator it = definitions.begin(); it != definitions.end(); ++it)
+        if ((*it)[JSON_ATTR_CUBE_ENTITIES][0].asString().compare(entity) == 0 ||
+                (*it)[JSON_ATTR_CUBE_ENTITIES][1].asString().compare(entity) == 0)
+            AggregateCube::drop(rds, (*it)[JSON_ATTR_CUBE_NAME].asString());
+}
+
+/** Index of the dimension over an entity attribute, -1 if the cube does not hold it */
+long AggregateCube::dimension(std::string entity, std::string attribute) {
+    for (long i = 0; i < this->dimensions.size(); i++)
+        if (this->dimensions[i].entity.compare(entity) == 0 &&
+                this->dimensions[i].attribute.compare(attribute) == 0)
+            return i;
+    return -1;
+}
+
+/** Masks selecting every code of every dimension */
+std::vector<std::vector<bool>> AggregateCube::masks() {
+    std::vector<std::vector<bool>> masks;
+    for (std::vector<CubeDimension>::iterator it = this->dimensions.begin(); it != this->dimensions.end(); ++it)
+        masks.push_back(std::vector<bool>(it->values.size(), true));
+    return masks;
+}
+
+/**
+ *  Narrow the mask of a dimension to the codes whose values pass a filter.  The missing value
+ *  passes, as relations lacking a filtered attribute pass the filter.
+ */
+void AggregateCube::restrict(std::vector<bool>& mask, long dim, AttributeTuple& filter, std::string compare) {
+    CubeDimension& dimension = this->dimensions[dim];
+    AttributeTuple value;
+    bool match;
+    for (long code = 1; code < dimension.values.size(); code++) {
+        if (!mask[code]) continue;
+        value = AttributeTuple(dimension.entity, dimension.attribute, dimension.values[code], dimension.type);
+        if (dimension.type.compare(COLTYPE_NAME_INT) == 0)
+            match = AttributeTuple::compare<IntegerColumn>(value, filter, compare);
+        else if (dimension.type.compare(COLTYPE_NAME_FLOAT) == 0)
+            match = AttributeTuple::compare<FloatColumn>(value, filter, compare);
+        else
+            match = AttributeTuple::compare<StringColumn>(value, filter, compare);
+        mask[code] = match;
+    }
+}
+
+/**
+ *  Sum the counts of the cells selected by the masks.  A dense cube walks the selected codes of
+ *  each dimension in turn, a sparse cube tests each of its cells.
+ */
+long AggregateCube::sum(std::vector<std::vector<bool>>& masks) {
+    long total = 0;
+    long n = this->dimensions.size();
+
+    if (!this->dense) {
+        bool selected;
+        for (long c = 0; c < this->cellCodes.size(); c++) {
+            selected = true;
+            for (long i = 0; i < n && selected; i++)
+                selected = masks[i][this->cellCodes[c][i]];
+            if (selected) total += this->cellCounts[c];
+        }
+        return total;
+    }
+
+    std::vector<std::vector<long>> offsets(n);
+    for (long i = 0; i < n; i++) {
+        for (long code = 0; code < masks[i].size(); code++)
+            if (masks[i][code]) offsets[i].push_back(code * this->strides[i]);
+        if (offsets[i].size() == 0) return 0;
+    }
+
+    // Odometer over the selected codes, the last dimension is contiguous
+    std::vector<long> position(n, 0);
+    long base;
+    while (true) {
+        base = 0;
+        for (long i = 0; i < n - 1; i++)
+            base += offsets[i][position[i]];
+        for (std::vector<long>::iterator it = offsets[n - 1].begin(); it != offsets[n - 1].end(); ++it)
+            total += this->counts[base + *it];
+
+        long i = n - 2;
+        while (i >= 0 && ++position[i] == offsets[i].size())
+            position[i--] = 0;
+        if (i < 0) break;
+    }
+    return total;
+}
+
+#endif
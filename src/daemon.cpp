@@ -14,6 +14,8 @@
 #include <thread>
 #include <sstream>
 #include <string>
+#include <cstring>
+#include <strings.h>
 #include <redis3m/connection.h>
 #include "parse.h"
 #include "redis.h"
@@ -22,6 +24,7 @@
 #define DBY_CMD_QUEUE_LOCK_SUFFIX "_lock"
 #define DBY_CMD_QUEUE_PREFIX "dby_command_queue_"
 #define DBY_RSP_QUEUE_PREFIX "dby_response_queue_"
+#define DBY_BATCH_MARKER "BATCH"
 
 #define REDIS_POLL_TIMEOUT 2000
 #define REDIS_RETRY_TIMEOUT 1000
@@ -60,8 +63,26 @@ std::string getKeyOrderValue(Parser& p, std::string key) {
         return "";  // error
 }
 
+/**
+ * Entries opening with the batch marker on a line of its own hold a script of statements, the
+ * script is returned without the marker.  Any other entry is a single statement.
+ */
+bool getBatchScript(const std::string& line, std::string& script) {
+    size_t length = std::strlen(DBY_BATCH_MARKER);
+    size_t start = line.find_first_not_of(LEXER_WHITESPACE);
+    if (start == std::string::npos || strncasecmp(line.c_str() + start, DBY_BATCH_MARKER, length) != 0)
+        return false;
+    start += length;
+    if (start < line.length() && std::strchr(BATCH_DELIMITERS, line[start]) == NULL &&
+            std::strchr(LEXER_WHITESPACE, line[start]) == NULL)
+        return false;
+    script = line.substr(start);
+    return true;
+}
+
 int main() {
     std::string line;
+    std::string script;
     std::string lock;
     std::string key;
 
@@ -70,6 +91,16 @@ int main() {
 
     cout << "Running databayes daemon..." << endl;
 
+    // Relations written before the pair catalog and the summaries existed need to be indexed
+    std::vector<std::string> built = IndexHandler().rebuildMissing();
+    for (std::vector<std::string>::iterator it = built.begin(); it != built.end(); ++it)
+        cout << "Built " << *it << endl;
+
+    // Cascades of entities removed before the last exit are carried on
+    long resumed = IndexHandler().resumeCascadeJobs();
+    if (resumed > 0)
+        cout << "Resuming " << resumed << " entity removal jobs..." << endl;
+
     // Read the input
     while (1) {
 
@@ -101,8 +132,14 @@ int main() {
 
         // 5. Parse the command and write response to redis
         if (std::strcmp(key_value.c_str(), "") != 0) {
-            redisHandler->write(std::string(DBY_RSP_QUEUE_PREFIX) + key_value, parser->parse(line));
-            parser->resetState();
+            // Entries marked as a batch run as one, the response lists each result
+            if (getBatchScript(line, script)) {
+                Json::FastWriter writer;
+                redisHandler->write(std::string(DBY_RSP_QUEUE_PREFIX) + key_value, writer.write(parser->parseBatch(script)));
+            } else {
+                redisHandler->write(std::string(DBY_RSP_QUEUE_PREFIX) + key_value, parser->parse(line));
+                parser->resetState();
+            }
         } else {
             // Badly formed key, drop the key and remove the lock
             cout << key + std::string(" is badly formed, can't determine value - not processed.") << endl;
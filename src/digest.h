@@ -0,0 +1,349 @@
+/*
+ *  digest.h
+ *
+ *  Defines the quantile sketches kept for numeric attributes.  Each entity pair holds a t-digest
+ *  per numeric attribute of its entities, weighted by instance count, and the digests of all pairs
+ *  on an entity are merged to answer percentile queries over the entity.
+ *
+ *  A digest can take new instances but cannot give any back, so a relation hook adds instances to
+ *  digests in place and drops the digests a decrement touches.  Each digest carries the catalog
+ *  version of its pair, a digest that missed a change to the pair is not used.  Dropped and stale
+ *  digests are rebuilt from the relations of their pair the next time they are queried.
+ *
+ *  Created by Ryan Faulkner on 2015-12-21
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _digest_h
+#define _digest_h
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <json/json.h>
+
+#include "redis.h"
+#include "hooks.h"
+#include "catalog.h"
+#include "column_types.h"
+#include "models/model_def.h"
+
+#define KEY_DIGEST_PREFIX "digest"
+#define KEY_DIGEST_DELIMETER "+"
+#define KEY_DIGEST_VERSION_DELIMETER "|"
+
+#define DIGEST_COMPRESSION 100      // Centroids kept are about this many, more is more accurate
+
+
+/**
+ *  Merging t-digest.  Centroids are merged under the k1 scale function so that they are small
+ *  near the tails, which keeps extreme percentiles accurate.
+ */
+class TDigest {
+
+    std::vector<std::pair<double, double>> centroids;   // mean, weight - sorted by mean after compress
+    double weight;
+    double min;
+    double max;
+    long unmerged;
+
+    double scale(double q) { return DIGEST_COMPRESSION / (2.0 * M_PI) * std::asin(2.0 * q - 1.0); }
+
+public:
+    TDigest() : weight(0.0), min(0.0), max(0.0), unmerged(0) {}
+
+    void add(double, double);
+    void merge(TDigest&);
+    void compress();
+    double quantile(double);
+    double total() { return this->weight; }
+
+    std::string serialize();
+    bool parse(std::string);
+};
+
+/** Add a value with a weight, centroids are merged once enough have been buffered */
+void TDigest::add(double value, double weight) {
+    if (weight <= 0.0) return;
+    if (this->weight == 0.0 || value < this->min) this->min = value;
+    if (this->weight == 0.0 || value > this->max) this->max = value;
+    this->centroids.push_back(std::make_pair(value, weight));
+    this->weight += weight;
+    if (++this->unmerged > 4 * DIGEST_COMPRESSION)
+        this->compress();
+}
+
+/** Add the centroids of another digest */
+void TDigest::merge(TDigest& other) {
+    other.compress();
+    for (std::vector<std::pair<double, double>>::iterator it = other.centroids.begin();
+            it != other.centroids.end(); ++it)
+        this->add(it->first, it->second);
+    if (other.weight > 0.0) {
+        this->min = std::min(this->min, other.min);
+        this->max = std::max(this->max, other.max);
+    }
+}
+
+/** Sort the centroids and merge neighbours while the merged centroid spans at most one unit of k */
+void TDigest::compress() {
+    if (this->unmerged == 0) return;
+    std::sort(this->centroids.begin(), this->centroids.end());
+
+    std::vector<std::pair<double, double>> merged;
+    double before = 0.0, kLeft = this->scale(0.0);
+    for (std::vector<std::pair<double, double>>::iterator it = this->centroids.begin();
+            it != this->centroids.end(); ++it) {
+        if (merged.size() > 0 &&
+                this->scale((before + merged.back().second + it->second) / this->weight) - kLeft <= 1.0) {
+            std::pair<double, double>& last = merged.back();
+            last.first += (it->first - last.first) * it->second / (last.second + it->second);
+            last.second += it->second;
+        } else {
+            if (merged.size() > 0) {
+                before += merged.back().second;
+                kLeft = this->scale(before / this->weight);
+            }
+            merged.push_back(*it);
+        }
+    }
+    this->centroids = merged;
+    this->unmerged = 0;
+}
+
+/** Estimate the value at quantile q in [0, 1] by interpolating between centroid centres */
+double TDigest::quantile(double q) {
+    this->compress();
+    if (this->centroids.size() == 0) return 0.0;
+    if (this->centroids.size() == 1) return this->centroids[0].first;
+
+    double target = q * this->weight;
+    double cumulative = 0.0, centre, previousCentre = 0.0, previousMean = this->min;
+    for (std::vector<std::pair<double, double>>::iterator it = this->centroids.begin();
+            it != this->centroids.end(); ++it) {
+        centre = cumulative + it->second / 2.0;
+        if (target < centre) {
+            if (centre == previousCentre) return it->first;
+            return previousMean + (it->first - previousMean) * (target - previousCentre) / (centre - previousCentre);
+        }
+        cumulative += it->second;
+        previousCentre = centre;
+        previousMean = it->first;
+    }
+    if (cumulative == previousCentre) return this->max;
+    return previousMean + (this->max - previousMean) * (target - previousCentre) / (cumulative - previousCentre);
+}
+
+/** Compact string form - "<weight>;<min>;<max>" followed by ";<mean>:<weight>" per centroid */
+std::string TDigest::serialize() {
+    this->compress();
+    std::ostringstream out;
+    out.precision(17);
+    out << this->weight << ";" << this->min << ";" << this->max;
+    for (std::vector<std::pair<double, double>>::iterator it = this->centroids.begin();
+            it != this->centroids.end(); ++it)
+        out << ";" << it->first << ":" << it->second;
+    return out.str();
+}
+
+/** Read the string form of a digest, false if it is empty or malformed */
+bool TDigest::parse(std::string serialized) {
+    std::stringstream ss(serialized);
+    std::string item;
+    std::vector<std::string> items;
+    while (std::getline(ss, item, ';'))
+        items.push_back(item);
+    if (items.size() < 3) return false;
+
+    *this = TDigest();
+    this->weight = std::atof(items[0].c_str());
+    this->min = std::atof(items[1].c_str());
+    this->max = std::atof(items[2].c_str());
+    for (long i = 3; i < items.size(); i++) {
+        size_t split = items[i].find(':');
+        if (split == std::string::npos) return false;
+        this->centroids.push_back(std::make_pair(std::atof(items[i].substr(0, split).c_str()),
+            std::atof(items[i].substr(split + 1).c_str())));
+    }
+    return true;
+}
+
+
+/**
+ *  Interface to the stored digests.  The digests of a pair are one redis hash with a field
+ *  "<entity>.<attr>" per attribute, each stored as "<pair version>|<digest>".
+ */
+class QuantileStore {
+
+    static std::string pairKey(std::string);
+    static std::string field(std::string, std::string);
+    static void numericFields(Json::Value&, std::vector<std::string>&);
+    static bool parse(std::string, long&, TDigest&);
+
+public:
+
+    static void relationHook(RedisHandler&, std::string, Json::Value&, int, int);
+    static void relationBatchHook(RedisHandler&, std::vector<RelationDelta>&);
+    static void add(TDigest&, Json::Value&, std::string, std::string, double);
+    static bool fetch(RedisHandler&, std::string, std::string, std::string, long, TDigest&);
+    static void store(RedisHandler&, std::string, std::string, std::string, long, TDigest&);
+    static void dropPair(RedisHandler&, std::string);
+};
+
+/** Redis key of the digests of a pair */
+std::string QuantileStore::pairKey(std::string pair) {
+    return std::string(KEY_DIGEST_PREFIX) + KEY_DIGEST_DELIMETER + pair;
+}
+
+/** Hash field of the digest of an entity attribute */
+std::string QuantileStore::field(std::string entity, std::string attribute) {
+    return entity + std::string(".") + attribute;
+}
+
+/** Add the values a relation carries for an entity attribute with a weight to a digest */
+void QuantileStore::add(TDigest& digest, Json::Value& relation, std::string entity, std::string attribute,
+        double weight) {
+    if (relation[JSON_ATTR_REL_ENTL].asString().compare(entity) == 0 &&
+            relation[JSON_ATTR_REL_FIELDSL].isMember(attribute))
+        digest.add(std::atof(relation[JSON_ATTR_REL_FIELDSL][attribute].asCString()), weight);
+    if (relation[JSON_ATTR_REL_ENTR].asString().compare(entity) == 0 &&
+            relation[JSON_ATTR_REL_FIELDSR].isMember(attribute))
+        digest.add(std::atof(relation[JSON_ATTR_REL_FIELDSR][attribute].asCString()), weight);
+}
+
+/** Numeric attribute fields a relation carries, appended to the fields if not already there */
+void QuantileStore::numericFields(Json::Value& relation, std::vector<std::string>& fields) {
+    const char* sides[2][2] = { { JSON_ATTR_REL_ENTL, JSON_ATTR_REL_FIELDSL },
+        { JSON_ATTR_REL_ENTR, JSON_ATTR_REL_FIELDSR } };
+    std::vector<std::string> members;
+    std::string entity, type;
+
+    for (int i = 0; i < 2; i++) {
+        Json::Value& values = relation[sides[i][1]];
+        entity = relation[sides[i][0]].asString();
+        members = values.getMemberNames();
+        for (std::vector<std::string>::iterator it = members.begin(); it != members.end(); ++it) {
+            type = values.get(std::string(JSON_ATTR_REL_TYPE_PREFIX) + *it, "").asString();
+            if (type.compare(COLTYPE_NAME_INT) != 0 && type.compare(COLTYPE_NAME_FLOAT) != 0) continue;
+            if (std::find(fields.begin(), fields.end(), QuantileStore::field(entity, *it)) == fields.end())
+                fields.push_back(QuantileStore::field(entity, *it));
+        }
+    }
+}
+
+/** Split a stored digest into its pair version and digest, false if it is empty or malformed */
+bool QuantileStore::parse(std::string value, long& version, TDigest& digest) {
+    size_t split = value.find(KEY_DIGEST_VERSION_DELIMETER);
+    if (split == std::string::npos) return false;
+    version = std::atol(value.substr(0, split).c_str());
+    return digest.parse(value.substr(split + 1));
+}
+
+/** Relation hook - runs the batch hook on a chunk of one */
+void QuantileStore::relationHook(RedisHandler& rds, std::string key, Json::Value& relation, int oldCount, int newCount) {
+    std::vector<RelationDelta> deltas(1, RelationDelta(key, &relation, oldCount, newCount));
+    QuantileStore::relationBatchHook(rds, deltas);
+}
+
+/**
+ *  Batch relation hook - the digests of every pair in the chunk are read in one pipeline and the
+ *  updates sent in another.  The catalog bumps a pair once per chunk, so a digest stored at the
+ *  version before takes the new instances of the chunk and is stamped with the version after.  A
+ *  digest at any other version missed a change and is dropped, as are the digests a decrement
+ *  touches, and both are rebuilt from the relations of their pair on query.
+ */
+void QuantileStore::relationBatchHook(RedisHandler& rds, std::vector<RelationDelta>& deltas) {
+    std::unordered_map<std::string, std::vector<RelationDelta*>> chunks;     // pair -> deltas
+    std::unordered_map<std::string, std::vector<std::string>> fields;        // pair -> fields
+    std::vector<std::pair<std::string, std::string>> reads;                  // pair, field
+    std::vector<std::string> args, replies, drops;
+    std::string pair;
+    bool pending = false;
+
+    for (std::vector<RelationDelta>::iterator it = deltas.begin(); it != deltas.end(); ++it) {
+        pair = PairCatalog::pairFromKey(it->key);
+        chunks[pair].push_back(&(*it));
+        QuantileStore::numericFields(*(it->relation), fields[pair]);
+    }
+
+    for (std::unordered_map<std::string, std::vector<RelationDelta*>>::iterator it = chunks.begin();
+            it != chunks.end(); ++it) {
+        std::vector<std::string>& pairFields = fields[it->first];
+        if (pairFields.size() == 0) continue;
+
+        bool decrement = false;
+        for (std::vector<RelationDelta*>::iterator itDelta = it->second.begin(); itDelta != it->second.end(); ++itDelta)
+            if ((*itDelta)->newCount < (*itDelta)->oldCount || (*itDelta)->version == 0)
+                decrement = true;
+        if (decrement) {
+            args.clear(); args.push_back("HDEL"); args.push_back(QuantileStore::pairKey(it->first));
+            args.insert(args.end(), pairFields.begin(), pairFields.end());
+            rds.appendCommand(args);
+            pending = true;
+            continue;
+        }
+        for (std::vector<std::string>::iterator itField = pairFields.begin(); itField != pairFields.end(); ++itField) {
+            args.clear(); args.push_back("HGET"); args.push_back(QuantileStore::pairKey(it->first));
+            args.push_back(*itField);
+            rds.appendCommand(args);
+            reads.push_back(std::make_pair(it->first, *itField));
+        }
+    }
+    if (!pending && reads.size() == 0) return;
+
+    // The drops go out with the reads, the replies of the reads follow theirs
+    replies = rds.flushPipeline();
+    if (reads.size() == 0 || replies.size() < reads.size()) return;
+    size_t offset = replies.size() - reads.size();
+
+    pending = false;
+    TDigest digest;
+    long version;
+    for (size_t i = 0; i < reads.size(); i++) {
+        if (!QuantileStore::parse(replies[offset + i], version, digest)) continue;
+        std::vector<RelationDelta*>& chunk = chunks[reads[i].first];
+        args.clear();
+        if (version == chunk.front()->version - 1) {
+            size_t split = reads[i].second.find('.');
+            for (std::vector<RelationDelta*>::iterator it = chunk.begin(); it != chunk.end(); ++it)
+                QuantileStore::add(digest, *((*it)->relation), reads[i].second.substr(0, split),
+                    reads[i].second.substr(split + 1), (*it)->newCount - (*it)->oldCount);
+            args.push_back("HSET"); args.push_back(QuantileStore::pairKey(reads[i].first));
+            args.push_back(reads[i].second);
+            args.push_back(std::to_string(chunk.front()->version) + KEY_DIGEST_VERSION_DELIMETER + digest.serialize());
+        } else {
+            args.push_back("HDEL"); args.push_back(QuantileStore::pairKey(reads[i].first));
+            args.push_back(reads[i].second);
+        }
+        rds.appendCommand(args);
+        pending = true;
+    }
+    if (pending) rds.flushPipeline();
+}
+
+static bool digestHookRegistered = registerRelationHook(QuantileStore::relationHook, QuantileStore::relationBatchHook);
+
+/** Fetch the digest of an entity attribute on a pair, false if it has not been built at this pair version */
+bool QuantileStore::fetch(RedisHandler& rds, std::string pair, std::string entity, std::string attribute,
+        long version, TDigest& digest) {
+    long stored;
+    return QuantileStore::parse(rds.readHashMap(QuantileStore::pairKey(pair), QuantileStore::field(entity, attribute)),
+        stored, digest) && stored == version;
+}
+
+/** Store the digest of an entity attribute on a pair built at a pair version */
+void QuantileStore::store(RedisHandler& rds, std::string pair, std::string entity, std::string attribute,
+        long version, TDigest& digest) {
+    rds.writeHashMap(QuantileStore::pairKey(pair), QuantileStore::field(entity, attribute),
+        std::to_string(version) + KEY_DIGEST_VERSION_DELIMETER + digest.serialize());
+}
+
+/** Remove the digests of a pair */
+void QuantileStore::dropPair(RedisHandler& rds, std::string pair) {
+    rds.deleteKey(QuantileStore::pairKey(pair));
+}
+
+#endif
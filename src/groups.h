@@ -0,0 +1,142 @@
+/*
+ *  groups.h
+ *
+ *  Defines the per group aggregates of GROUP BY queries.  The filtered relations on the given
+ *  entity are read once and each is added to the group of the value the given entity carries for
+ *  the grouping attribute, so a breakdown over N values is one scan rather than N queries.
+ *
+ *  Created by Ryan Faulkner on 2015-12-25
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _groups_h
+#define _groups_h
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+#include <json/json.h>
+
+#include "moments.h"
+#include "column_types.h"
+#include "models/model_def.h"
+
+#define JSON_ATTR_GROUP_VALUE "group"
+#define JSON_ATTR_GROUP_COUNT "count"
+#define JSON_ATTR_GROUP_PROB "probability"
+#define JSON_ATTR_GROUP_MEAN "mean"
+#define JSON_ATTR_GROUP_SAMPLES "samples"
+
+
+/**
+ *  Aggregates of one group.  "marginal" is the instance count on the given entity in the group and
+ *  "pairwise" that of its relations with the target entity, the moments are those of the target
+ *  attribute over the pairwise instances carrying it.
+ */
+struct GroupAggregate {
+    long marginal;
+    long pairwise;
+    Moments moments;
+    std::vector<Json::Value> relations;     // relations with the target, kept for sampling
+    std::vector<double> weights;
+
+    GroupAggregate() : marginal(0), pairwise(0) {}
+};
+
+
+/**
+ *  Hash aggregation of relations on the given entity by the value of one of its attributes.
+ *  Relations on which the given entity does not carry the attribute fall in no group.
+ */
+class GroupTable {
+
+    std::string target;
+    std::string targetAttribute;    // empty unless means are aggregated
+    std::string given;
+    std::string groupAttribute;
+    std::string groupType;
+    bool keepRelations;
+    std::map<std::string, GroupAggregate> groups;
+
+public:
+    GroupTable(std::string, std::string, std::string, std::string, bool);
+
+    void add(Json::Value&);
+    std::vector<std::string> values();
+    GroupAggregate& group(std::string value) { return this->groups[value]; }
+    long size() { return this->groups.size(); }
+    Json::Value toJson();
+};
+
+GroupTable::GroupTable(std::string target, std::string targetAttribute, std::string given,
+        std::string groupAttribute, bool keepRelations) : target(target),
+        targetAttribute(targetAttribute), given(given), groupAttribute(groupAttribute),
+        keepRelations(keepRelations) {}
+
+/** Add a relation to the group of the value the given entity carries on it */
+void GroupTable::add(Json::Value& relation) {
+    bool left = relation[JSON_ATTR_REL_ENTL].asString().compare(this->given) == 0;
+    if (!left && relation[JSON_ATTR_REL_ENTR].asString().compare(this->given) != 0) return;
+
+    Json::Value& side = relation[left ? JSON_ATTR_REL_FIELDSL : JSON_ATTR_REL_FIELDSR];
+    Json::Value& other = relation[left ? JSON_ATTR_REL_FIELDSR : JSON_ATTR_REL_FIELDSL];
+    std::string otherEntity = relation[left ? JSON_ATTR_REL_ENTR : JSON_ATTR_REL_ENTL].asString();
+    if (!side.isMember(this->groupAttribute)) return;
+
+    if (this->groupType.compare("") == 0)
+        this->groupType = side.get(std::string(JSON_ATTR_REL_TYPE_PREFIX) + this->groupAttribute,
+            "").asString();
+
+    long count = relation[JSON_ATTR_REL_COUNT].asInt();
+    GroupAggregate& group = this->groups[side[this->groupAttribute].asString()];
+    group.marginal += count;
+    if (otherEntity.compare(this->target) != 0) return;
+
+    group.pairwise += count;
+    if (this->targetAttribute.compare("") != 0 && other.isMember(this->targetAttribute))
+        group.moments.add(std::atof(other[this->targetAttribute].asCString()), count);
+    if (this->keepRelations) {
+        group.relations.push_back(relation);
+        group.weights.push_back(relation[JSON_ATTR_REL_COUNT].asDouble());
+    }
+}
+
+/** Group values, in numeric order for numeric attributes and in value order otherwise */
+std::vector<std::string> GroupTable::values() {
+    std::vector<std::string> values;
+    for (std::map<std::string, GroupAggregate>::iterator it = this->groups.begin();
+            it != this->groups.end(); ++it)
+        values.push_back(it->first);
+
+    if (this->groupType.compare(COLTYPE_NAME_INT) == 0 ||
+            this->groupType.compare(COLTYPE_NAME_FLOAT) == 0)
+        std::stable_sort(values.begin(), values.end(),
+            [](const std::string& a, const std::string& b) {
+                return std::atof(a.c_str()) < std::atof(b.c_str()); });
+    return values;
+}
+
+/**
+ *  Json form of the groups - the instance count on the given entity, the probability of the target
+ *  entity and, when means are aggregated, the mean of the target attribute in each group
+ */
+Json::Value GroupTable::toJson() {
+    Json::Value json(Json::arrayValue), item;
+    std::vector<std::string> values = this->values();
+    for (std::vector<std::string>::iterator it = values.begin(); it != values.end(); ++it) {
+        GroupAggregate& group = this->groups[*it];
+        item = Json::Value();
+        item[JSON_ATTR_GROUP_VALUE] = *it;
+        item[JSON_ATTR_GROUP_COUNT] = (Json::Int64)group.marginal;
+        item[JSON_ATTR_GROUP_PROB] = group.marginal > 0 ?
+            (double)group.pairwise / group.marginal : 0.0;
+        if (this->targetAttribute.compare("") != 0)
+            item[JSON_ATTR_GROUP_MEAN] = group.moments.count > 0 ? group.moments.mean() : -1.0;
+        json.append(item);
+    }
+    return json;
+}
+
+#endif
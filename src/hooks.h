@@ -0,0 +1,154 @@
+/*
+ *  hooks.h
+ *
+ *  Defines the maintenance hooks that run whenever the instance count of a relation changes.
+ *  Structures derived from the relation set (catalogs, counters, sketches) register a hook here
+ *  so that they are kept current by every write path, both the index and the relation ORM.
+ *
+ *  Created by Ryan Faulkner on 2015-12-14
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _hooks_h
+#define _hooks_h
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <mutex>
+#include <unordered_map>
+#include <json/json.h>
+
+#include "redis.h"
+
+/**
+ *  Hook signature - receives the relation key, the relation json and the instance count of the
+ *  relation before and after the change.  A count of zero means the relation does not exist.
+ */
+typedef void (*RelationHook)(RedisHandler&, std::string, Json::Value&, int, int);
+
+/**
+ *  A change in the instance count of one relation of a chunk written together.  The version is
+ *  that of the pair after the chunk, set by the pair catalog which runs ahead of the other hooks.
+ */
+struct RelationDelta {
+    std::string key;
+    Json::Value* relation;
+    int oldCount;
+    int newCount;
+    long version;
+
+    RelationDelta(std::string key, Json::Value* relation, int oldCount, int newCount) :
+        key(key), relation(relation), oldCount(oldCount), newCount(newCount), version(0) {}
+};
+
+/**
+ *  Batch hook signature - receives the changes of a chunk of relations at once so that the hook
+ *  reads what it needs once and sends its updates for the whole chunk in one pipeline.
+ */
+typedef void (*RelationBatchHook)(RedisHandler&, std::vector<RelationDelta>&);
+
+/** Registry of relation hooks in order of registration */
+std::vector<RelationHook>& relationHooks() {
+    static std::vector<RelationHook> hooks;
+    return hooks;
+}
+
+/** Batch entry points of the registered hooks by position, NULL for hooks run per relation */
+std::vector<RelationBatchHook>& relationBatchHooks() {
+    static std::vector<RelationBatchHook> hooks;
+    return hooks;
+}
+
+/** Register a hook, returns true so that registration may be done in a static initializer */
+bool registerRelationHook(RelationHook hook, RelationBatchHook batchHook = NULL) {
+    relationHooks().push_back(hook);
+    relationBatchHooks().push_back(batchHook);
+    return true;
+}
+
+void applyRelationDeltas(RedisHandler&, std::vector<RelationDelta>&);
+
+/**
+ *  Run all registered hooks for a change in the instance count of a relation, as a chunk of one so
+ *  that hooks reading the pair version see it
+ */
+void applyRelationDelta(RedisHandler& rds, std::string key, Json::Value& relation, int oldCount, int newCount) {
+    std::vector<RelationDelta> deltas(1, RelationDelta(key, &relation, oldCount, newCount));
+    applyRelationDeltas(rds, deltas);
+}
+
+/** Run all registered hooks for the changes of a chunk of relations, hooks without a batch entry point run per relation */
+void applyRelationDeltas(RedisHandler& rds, std::vector<RelationDelta>& deltas) {
+    std::vector<RelationDelta> changed;
+    for (std::vector<RelationDelta>::iterator it = deltas.begin(); it != deltas.end(); ++it)
+        if (it->oldCount != it->newCount)
+            changed.push_back(*it);
+    if (changed.size() == 0) return;
+
+    std::vector<RelationHook>& hooks = relationHooks();
+    std::vector<RelationBatchHook>& batchHooks = relationBatchHooks();
+    for (size_t i = 0; i < hooks.size(); i++) {
+        if (batchHooks[i] != NULL) {
+            batchHooks[i](rds, changed);
+            continue;
+        }
+        for (std::vector<RelationDelta>::iterator it = changed.begin(); it != changed.end(); ++it)
+            hooks[i](rds, it->key, *(it->relation), it->oldCount, it->newCount);
+    }
+}
+
+
+/**
+ *  Process wide cache of a redis hash of json definitions read by a hook on every write.  Writers
+ *  bump the version key after changing the hash and readers reload the hash only once the version
+ *  has moved, so a write costs one GET rather than a read of every definition.
+ */
+class DefinitionCache {
+
+    std::string definitionsKey;
+    std::string versionKey;
+    std::string version;
+    bool loaded;
+    std::vector<Json::Value> definitions;
+    std::mutex lock;
+
+public:
+    DefinitionCache(std::string definitionsKey, std::string versionKey) :
+        definitionsKey(definitionsKey), versionKey(versionKey), loaded(false) {}
+
+    std::vector<Json::Value> fetch(RedisHandler&);
+    void bump(RedisHandler& rds) { rds.incrementKey(this->versionKey, 1); }
+};
+
+/** Fetch the definitions, reading the hash only when the version moved since it was last read */
+std::vector<Json::Value> DefinitionCache::fetch(RedisHandler& rds) {
+    std::vector<std::string> keys(1, this->versionKey);
+    std::string version = rds.readMany(keys)[0];
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        if (this->loaded && this->version.compare(version) == 0)
+            return this->definitions;
+    }
+
+    std::vector<Json::Value> definitions;
+    std::unordered_map<std::string, std::string> values = rds.readHashMapAll(this->definitionsKey);
+    Json::Reader reader;
+    Json::Value json;
+    for (std::unordered_map<std::string, std::string>::iterator it = values.begin(); it != values.end(); ++it) {
+        json = Json::Value();
+        if (reader.parse(it->second, json, false))
+            definitions.push_back(json);
+    }
+
+    // A reader that raced a newer load leaves the newer definitions in place
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (!this->loaded || std::atol(version.c_str()) >= std::atol(this->version.c_str())) {
+        this->definitions = definitions;
+        this->version = version;
+        this->loaded = true;
+    }
+    return definitions;
+}
+
+#endif
@@ -18,11 +18,26 @@
 #include <fstream>
 #include <string>
 #include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
 #include <json/json.h>
 #include <boost/regex.hpp>
 
 #include "redis.h"
 #include "md5.h"
+#include "hooks.h"
+#include "catalog.h"
+#include "cpt.h"
+#include "classifier.h"
+#include "cube.h"
+#include "standing.h"
+#include "moments.h"
+#include "topk.h"
+#include "sketch.h"
+#include "digest.h"
 #include "models/models.h"
 
 #define IDX_SIZE 100000
@@ -35,26 +50,146 @@
 #define KEY_DELIMETER "+"
 #define KEY_TOTAL_RELATIONS "total_relations"
 
+// Cascade removal of entities - removed entities are tombstoned while their relations are cleared
+#define KEY_TOMBSTONES "tombstones"
+#define KEY_TOMBSTONE_JOBS "tombstone_jobs"     // Job clearing each tombstoned entity, to resume it
+#define KEY_JOB_COUNTER "job_counter"
+#define KEY_JOB_PREFIX "job"
+#define JOB_FIELD_ENTITY "entity"
+#define JOB_FIELD_STATUS "status"
+#define JOB_FIELD_TOTAL "total"
+#define JOB_FIELD_REMOVED "removed"
+#define JOB_STATUS_RUNNING "running"
+#define JOB_STATUS_DONE "done"
+#define KEY_CASCADE_LEASE "cascade_lease"           // Held by the process clearing an entity, per entity
+#define CASCADE_LEASE_SECONDS 60
+#define KEY_LEASE_OWNERS "lease_owners"               // Counter naming the holders of leases
+#define KEY_REBUILD_LEASE "rebuild_lease"             // Held by the process rebuilding hook structures
+#define REBUILD_LEASE_SECONDS 600
+#define REBUILD_WAIT_MS 100
+#define REMOVE_BATCH_SIZE 500
+#define RELATION_LOCK_STRIPES 64
+
+/** Cascade jobs running in this process, so that they may be waited on before it exits */
+struct CascadeJobs {
+    std::mutex lock;
+    std::condition_variable done;
+    long running;
+
+    CascadeJobs() : running(0) {}
+};
+
+CascadeJobs& cascadeJobs() {
+    static CascadeJobs jobs;
+    return jobs;
+}
+
+/**
+ *  Striped locks over relation keys.  The count of a relation is read, changed and written back
+ *  under the lock of its stripe so that threads of this process writing the same relation do not
+ *  lose increments.  Several stripes are always taken in increasing order.
+ */
+struct RelationLocks {
+    std::mutex stripes[RELATION_LOCK_STRIPES];
+
+    static size_t stripe(const std::string& key) { return std::hash<std::string>()(key) % RELATION_LOCK_STRIPES; }
+};
+
+RelationLocks& relationLocks() {
+    static RelationLocks locks;
+    return locks;
+}
+
+/**
+ *  State of an index handler kept for each thread using it - the redis connection, which may not be
+ *  shared, and the entity definitions read while caching is on, e.g. for the length of a batch of
+ *  statements
+ */
+struct IndexThreadState {
+    RedisHandler redis;
+    bool entityCaching;
+    std::unordered_map<std::string, Json::Value> entityCache;
+
+    IndexThreadState() : redis(REDISHOST, REDISPORT), entityCaching(false) {}
+};
+
+class IndexHandler;
+
+/** Index handlers alive in this process, a handler is only released from while it is listed */
+struct LiveIndexHandlers {
+    std::mutex lock;
+    std::set<IndexHandler*> handlers;
+};
+
+LiveIndexHandlers& liveIndexHandlers() {
+    static LiveIndexHandlers live;
+    return live;
+}
+
+/**
+ *  Handlers holding state for the current thread.  When the thread exits its state, with its redis
+ *  connection, is released from each of them that is still alive.
+ */
+struct IndexThreadRelease {
+    std::set<IndexHandler*> handlers;
+
+    ~IndexThreadRelease();
+};
+
 class IndexHandler {
 
-    RedisHandler* redisHandler;
+    friend struct IndexThreadRelease;
+
+    // The creating thread reads its state without locking, other threads find theirs under the lock
+    std::thread::id owner;
+    IndexThreadState* ownerState;
+    std::mutex lock;
+    std::unordered_map<std::thread::id, std::unique_ptr<IndexThreadState>> threads;
+
+    IndexThreadState& local();
+    void release(std::thread::id);
+    RedisHandler* redis() { return &(this->local().redis); }
 
 public:
     /**
      * Constructor and Destructor for index handler
      */
-    IndexHandler() { this->redisHandler = new RedisHandler(REDISHOST, REDISPORT); }
-    ~IndexHandler() { delete redisHandler; }
+    IndexHandler() : owner(std::this_thread::get_id()) {
+        this->ownerState = new IndexThreadState();
+        this->threads[this->owner] = std::unique_ptr<IndexThreadState>(this->ownerState);
+        std::lock_guard<std::mutex> guard(liveIndexHandlers().lock);
+        liveIndexHandlers().handlers.insert(this);
+    }
+    ~IndexHandler() {
+        std::lock_guard<std::mutex> guard(liveIndexHandlers().lock);
+        liveIndexHandlers().handlers.erase(this);
+    }
+
+    void cacheEntities(bool);
+    long countThreadStates();
 
     void writeEntity(Entity&);
     bool writeRelation(Relation&, int = 1);
     bool writeRelation(Json::Value&, int = 1);
+    std::vector<bool> writeRelations(std::vector<std::pair<Json::Value, int>>&);
     bool writeToDisk(int);
 
     bool removeEntity(std::string);
     bool removeEntity(Entity&);
+    std::string removeEntityAsync(std::string);
+    long removeEntityRelations(std::string, std::string = "");
     bool removeRelation(Relation&);
     bool removeRelation(Json::Value&);
+    bool decrementRelation(Relation&, int);
+
+    static void startCascadeJob(std::string, std::string);
+    static void runCascadeJob(std::string, std::string);
+    static void waitForJobs();
+    long resumeCascadeJobs();
+    bool fetchJobStatus(std::string, Json::Value&);
+    bool isTombstoned(std::string);
+    void invalidateEntityPairs(std::string);
+    std::set<std::string> fetchTombstones();
 
     bool composeJSON(std::string, Json::Value&);
 
@@ -68,6 +203,52 @@ public:
     bool fetchEntity(std::string, Json::Value&);
     std::string fetchEntityFieldType(std::string, std::string);
     std::vector<Json::Value> fetchRelationPrefix(std::string, std::string);
+    std::vector<Json::Value> fetchRelationPrefix(std::vector<std::string>&);
+    std::vector<Json::Value> fetchEntityRelations(std::string);
+    std::vector<std::string> fetchEntityRelationKeys(std::string);
+    std::vector<Json::Value> fetchPairSummaries(std::string, std::string);
+    std::string fetchPairVersions(std::string, std::string);
+    std::string fetchEntityPairVersions(std::string);
+    std::string fetchPairVersions(std::vector<std::string>&);
+    long fetchPairVersion(std::string);
+    long fetchPairDistinct(std::string);
+    void fetchPairRelations(std::string, std::vector<std::string>&, std::vector<Json::Value>&);
+    std::vector<std::string> rebuildMissing();
+    void rebuildCatalog();
+    void rebuildMoments();
+    void rebuildTopK();
+    void rebuildSketch();
+    bool estimateCount(std::string, AttributeTuple&, SketchEstimate&);
+    bool fetchMoments(std::string, std::string, Moments&);
+    std::vector<ValueCount> fetchTopValues(std::string, std::string, long);
+    std::vector<std::string> fetchEntityPairs(std::string);
+    bool fetchQuantileDigest(std::string, std::string, TDigest&);
+
+    // Conditional probability tables
+    bool writeConditionalTable(std::string, std::string, std::string, std::string, long);
+    bool fetchConditionalTable(std::string, Json::Value&);
+    std::vector<Json::Value> fetchConditionalTables();
+    bool fetchTableCells(std::string, std::vector<TableCell>&);
+    bool removeConditionalTable(std::string);
+
+    // Aggregate cubes
+    bool writeCube(std::vector<std::string>&, long);
+    bool fetchCube(std::string, Json::Value&);
+    std::vector<Json::Value> fetchCubes();
+    bool loadCube(std::string, AggregateCube&);
+    bool removeCube(std::string);
+
+    // Standing queries
+    std::string writeStandingQuery(std::string, std::string, std::string, AttributeBucket&, std::string);
+    bool fetchStandingQuery(std::string, Json::Value&);
+    std::vector<Json::Value> fetchStandingQueries();
+    bool removeStandingQuery(std::string);
+
+    // Naive Bayes classifiers
+    bool writeClassifier(std::string, std::string, std::string);
+    bool fetchClassifier(std::string, Json::Value&);
+    std::vector<Json::Value> fetchClassifiers();
+    bool removeClassifier(std::string);
     std::vector<Json::Value> fetchPatternJson(std::string);
     std::vector<std::string> fetchPatternKeys(std::string);
     bool fetchFromDisk(int);   // Loads disk
@@ -140,19 +321,19 @@ std::string IndexHandler::generateRelationHash(Json::Value val) {
  *
  *  e.g. {"entity": <string:entname>, "fields": <string_array:[<f1,f2,...>]>}
  */
-void IndexHandler::writeEntity(Entity& e) { e.write(*(this->redisHandler)); }
+void IndexHandler::writeEntity(Entity& e) { e.write(*(this->redis())); }
 
-/** Remove entity key from redis */
+/**
+ * Remove entity key from redis.  The entity is tombstoned so that queries ignore it immediately and
+ * then all relations containing it are removed in batches before the tombstone is cleared.
+ */
 bool IndexHandler::removeEntity(Entity& e) {
-    if (e.remove(*(this->redisHandler))) {
-        // Delete all relations containing this entity
-        // TODO - use ORM to remove relations
-        std::vector<Json::Value> relations_left = this->fetchRelationPrefix(e.name, "*");
-        std::vector<Json::Value> relations_right = this->fetchRelationPrefix("*", e.name);
-        for (std::vector<Json::Value>::iterator it = relations_left.begin() ; it != relations_left.end(); ++it)
-            this->removeRelation(*it);
-        for (std::vector<Json::Value>::iterator it = relations_right.begin() ; it != relations_right.end(); ++it)
-            this->removeRelation(*it);
+    this->redis()->connect();
+    this->local().entityCache.erase(e.name);
+    if (e.remove(*(this->redis()))) {
+        this->redis()->addSetMember(KEY_TOMBSTONES, e.name);
+        this->invalidateEntityPairs(e.name);
+        this->removeEntityRelations(e.name);
         return true;
     }
     return false;
@@ -161,7 +342,221 @@ bool IndexHandler::removeEntity(Entity& e) {
 /** Remove entity key from redis */
 bool IndexHandler::removeEntity(std::string entity) {
     Entity e(entity);
-    this->removeEntity(e);
+    return this->removeEntity(e);
+}
+
+/**
+ * Removes an entity without waiting on the cascade.  The entity is tombstoned right away and its
+ * relations are removed by a background job.
+ *
+ * @returns     the job id that can be used to poll progress, or "" if the entity does not exist
+ */
+std::string IndexHandler::removeEntityAsync(std::string entity) {
+    Entity e(entity);
+    this->redis()->connect();
+    this->local().entityCache.erase(e.name);
+    if (!e.remove(*(this->redis())))
+        return "";
+    this->redis()->addSetMember(KEY_TOMBSTONES, e.name);
+    this->invalidateEntityPairs(e.name);
+
+    std::string jobId = std::to_string(this->redis()->incrementAndRead(KEY_JOB_COUNTER, 1));
+    std::string jobKey = std::string(KEY_JOB_PREFIX) + KEY_DELIMETER + jobId;
+    this->redis()->writeHashMap(jobKey, JOB_FIELD_ENTITY, entity);
+    this->redis()->writeHashMap(jobKey, JOB_FIELD_STATUS, JOB_STATUS_RUNNING);
+    this->redis()->writeHashMap(jobKey, JOB_FIELD_TOTAL, "0");
+    this->redis()->writeHashMap(jobKey, JOB_FIELD_REMOVED, "0");
+    this->redis()->writeHashMap(KEY_TOMBSTONE_JOBS, entity, jobKey);
+
+    IndexHandler::startCascadeJob(entity, jobKey);
+    return jobId;
+}
+
+/** Run a cascade job in the background, counted as running until it returns */
+void IndexHandler::startCascadeJob(std::string entity, std::string jobKey) {
+    CascadeJobs& jobs = cascadeJobs();
+    {
+        std::lock_guard<std::mutex> guard(jobs.lock);
+        jobs.running++;
+    }
+    std::thread(&IndexHandler::runCascadeJob, entity, jobKey).detach();
+}
+
+/** Background job body - runs on its own index handler and redis connection */
+void IndexHandler::runCascadeJob(std::string entity, std::string jobKey) {
+    {
+        IndexHandler ih;
+        ih.removeEntityRelations(entity, jobKey);
+    }
+    CascadeJobs& jobs = cascadeJobs();
+    std::lock_guard<std::mutex> guard(jobs.lock);
+    jobs.running--;
+    jobs.done.notify_all();
+}
+
+/** Block until the cascade jobs started by this process are done, call before exiting */
+void IndexHandler::waitForJobs() {
+    CascadeJobs& jobs = cascadeJobs();
+    std::unique_lock<std::mutex> guard(jobs.lock);
+    jobs.done.wait(guard, [&jobs] { return jobs.running == 0; });
+}
+
+/**
+ * Restart the cascades of entities still tombstoned, e.g. after the process running them exited.
+ * A job recorded for the entity carries on reporting on its key.  A cascade whose lease is still
+ * held by another process returns at once.
+ *
+ * @returns     the number of jobs started
+ */
+long IndexHandler::resumeCascadeJobs() {
+    std::set<std::string> tombstones = this->fetchTombstones();
+    for (std::set<std::string>::iterator it = tombstones.begin(); it != tombstones.end(); ++it)
+        IndexHandler::startCascadeJob(*it, this->redis()->readHashMap(KEY_TOMBSTONE_JOBS, *it));
+    return tombstones.size();
+}
+
+/**
+ * Removes every relation containing the entity.  Keys are read and unlinked in pipelined batches
+ * and the global relation count is adjusted once per batch.  Every pair containing the entity is
+ * emptied so the pairs are dropped from the catalog as a whole.  Progress is recorded on the job
+ * key if one is given.  Clears the tombstone for the entity when complete.
+ *
+ * The cascade of an entity is run by one process at a time, the one holding its lease, which is
+ * renewed after every batch.  A cascade finding the lease held returns at once and leaves the
+ * entity to its holder.  Only relations whose UNLINK removed them are counted and taken out of
+ * the summaries, so a relation is never subtracted twice, e.g. by a job resumed after a crash.
+ *
+ * @returns     the number of relations removed
+ */
+long IndexHandler::removeEntityRelations(std::string entity, std::string jobKey) {
+    std::string leaseKey = std::string(KEY_CASCADE_LEASE) + KEY_DELIMETER + entity;
+    this->redis()->connect();
+    std::string owner = std::to_string(this->redis()->incrementAndRead(KEY_LEASE_OWNERS, 1));
+    if (!this->redis()->setIfAbsent(leaseKey, owner, CASCADE_LEASE_SECONDS))
+        return 0;
+
+    std::vector<std::string> keys = this->fetchEntityRelationKeys(entity);
+    std::vector<std::string> pairs = PairCatalog::fetchEntityPairs(*(this->redis()), entity);
+    std::vector<Json::Value> watches = StandingQuery::fetchDefinitions(*(this->redis()));
+    std::vector<bool> watchChanged(watches.size(), false);
+    long removed = 0, total = keys.size();
+
+    // A resumed job counts on from the relations removed before it was interrupted
+    if (jobKey.compare("") != 0) {
+        removed = std::atol(this->redis()->readHashMap(jobKey, JOB_FIELD_REMOVED).c_str());
+        total += removed;
+        this->redis()->writeHashMap(jobKey, JOB_FIELD_STATUS, JOB_STATUS_RUNNING);
+        this->redis()->writeHashMap(jobKey, JOB_FIELD_TOTAL, std::to_string(total));
+    }
+
+    for (std::vector<std::string>::iterator it = keys.begin(); it != keys.end(); ) {
+        std::vector<std::string>::iterator end = it + std::min((long)REMOVE_BATCH_SIZE, (long)std::distance(it, keys.end()));
+        std::vector<std::string> batch(it, end);
+        std::vector<std::string> values = this->redis()->readMany(batch);
+        std::vector<bool> unlinked = this->redis()->deleteKeys(batch);
+
+        // Unlinked keys leave the pair key sets so that a resumed job does not list them again
+        std::vector<std::string> args;
+        for (std::vector<std::string>::iterator itKey = batch.begin(); itKey != batch.end(); ++itKey) {
+            args.clear(); args.push_back("SREM");
+            args.push_back(std::string(KEY_CATALOG_PAIR_KEYS) + KEY_CATALOG_DELIMETER + PairCatalog::pairFromKey(*itKey));
+            args.push_back(*itKey);
+            this->redis()->appendCommand(args);
+        }
+        this->redis()->flushPipeline();
+
+        // Sum the instance counts so the total is adjusted once for the whole batch, the summaries
+        // kept per entity are corrected for the partner entities
+        long batchCount = 0, batchRemoved = 0;
+        std::vector<Json::Value> jsons(values.size());
+        std::vector<RelationDelta> deltas;
+        for (int i = 0; i < values.size(); i++)
+            if (i < unlinked.size() && unlinked[i] && this->composeJSON(values[i], jsons[i])) {
+                batchCount += jsons[i][JSON_ATTR_REL_COUNT].asInt();
+                batchRemoved++;
+                deltas.push_back(RelationDelta(batch[i], &jsons[i], jsons[i][JSON_ATTR_REL_COUNT].asInt(), 0));
+            }
+        MomentStore::relationBatchHook(*(this->redis()), deltas);
+        TopKStore::relationBatchHook(*(this->redis()), deltas);
+        CountSketch::relationBatchHook(*(this->redis()), deltas);
+        for (std::vector<RelationDelta>::iterator it = deltas.begin(); it != deltas.end(); ++it)
+            for (int j = 0; j < watches.size(); j++)
+                if (StandingQuery::apply(*(this->redis()), watches[j], *(it->relation), -it->oldCount, false))
+                    watchChanged[j] = true;
+        this->redis()->flushPipeline();
+
+        this->redis()->decrementKey(KEY_TOTAL_RELATIONS, batchCount);
+        removed += batchRemoved;
+        total -= batch.size() - batchRemoved;
+
+        if (jobKey.compare("") != 0) {
+            this->redis()->writeHashMap(jobKey, JOB_FIELD_REMOVED, std::to_string(removed));
+            this->redis()->writeHashMap(jobKey, JOB_FIELD_TOTAL, std::to_string(total));
+        }
+        it = end;
+
+        // Renew the lease, stopping if it was lost to another process
+        std::vector<std::string> leaseKeys(1, leaseKey);
+        if (this->redis()->readMany(leaseKeys)[0].compare(owner) != 0)
+            return removed;
+        this->redis()->expire(leaseKey, CASCADE_LEASE_SECONDS);
+    }
+
+    for (std::vector<std::string>::iterator it = pairs.begin(); it != pairs.end(); ++it) {
+        PairCatalog::dropPair(*(this->redis()), *it);
+        QuantileStore::dropPair(*(this->redis()), *it);
+    }
+    MomentStore::dropEntity(*(this->redis()), entity);
+
+    // Standing queries on the partner entities publish once for the whole cascade
+    for (int j = 0; j < watches.size(); j++)
+        if (watchChanged[j])
+            StandingQuery::publish(*(this->redis()), watches[j]);
+
+    this->redis()->removeSetMember(KEY_TOMBSTONES, entity);
+    this->redis()->deleteHashMapField(KEY_TOMBSTONE_JOBS, entity);
+    if (jobKey.compare("") != 0)
+        this->redis()->writeHashMap(jobKey, JOB_FIELD_STATUS, JOB_STATUS_DONE);
+    this->redis()->deleteKey(leaseKey);
+    return removed;
+}
+
+/** Fetch the progress of a cascade removal job */
+bool IndexHandler::fetchJobStatus(std::string jobId, Json::Value& json) {
+    std::string jobKey = std::string(KEY_JOB_PREFIX) + KEY_DELIMETER + jobId;
+    this->redis()->connect();
+    if (!this->redis()->exists(jobKey))
+        return false;
+    json["job"] = jobId;
+    json[JOB_FIELD_ENTITY] = this->redis()->readHashMap(jobKey, JOB_FIELD_ENTITY);
+    json[JOB_FIELD_STATUS] = this->redis()->readHashMap(jobKey, JOB_FIELD_STATUS);
+    json[JOB_FIELD_TOTAL] = std::atoi(this->redis()->readHashMap(jobKey, JOB_FIELD_TOTAL).c_str());
+    json[JOB_FIELD_REMOVED] = std::atoi(this->redis()->readHashMap(jobKey, JOB_FIELD_REMOVED).c_str());
+    return true;
+}
+
+/** Bump the versions of all pairs on the entity so cached state built from them is discarded, tables, cubes, classifiers and standing queries on the entity are dropped */
+void IndexHandler::invalidateEntityPairs(std::string entity) {
+    std::vector<std::string> pairs = PairCatalog::fetchEntityPairs(*(this->redis()), entity);
+    for (std::vector<std::string>::iterator it = pairs.begin(); it != pairs.end(); ++it)
+        PairCatalog::bumpVersion(*(this->redis()), *it);
+    ConditionalTable::dropEntity(*(this->redis()), entity);
+    AggregateCube::dropEntity(*(this->redis()), entity);
+    ClassifierRegistry::dropEntity(*(this->redis()), entity);
+    StandingQuery::dropEntity(*(this->redis()), entity);
+}
+
+/** Is the entity pending removal? */
+bool IndexHandler::isTombstoned(std::string entity) {
+    std::set<std::string> tombstones = this->fetchTombstones();
+    return tombstones.find(entity) != tombstones.end();
+}
+
+/** Fetch the set of entities pending removal */
+std::set<std::string> IndexHandler::fetchTombstones() {
+    this->redis()->connect();
+    std::vector<std::string> members = this->redis()->setMembers(KEY_TOMBSTONES);
+    return std::set<std::string>(members.begin(), members.end());
 }
 
 /** Wraps removeRelation(Json::Value&) */
@@ -173,19 +568,50 @@ bool IndexHandler::removeRelation(Relation& rel) {
 /** Removes a relation from redis that is defined as a json object */
 bool IndexHandler::removeRelation(Json::Value& jsonVal) {
 
-    this->redisHandler->connect();
+    this->redis()->connect();
     std::string key = this->generateRelationKey(jsonVal[JSON_ATTR_REL_ENTL].asCString(), jsonVal[JSON_ATTR_REL_ENTR].asCString(), generateRelationHash(jsonVal));
     Json::Value jsonValReal;
+    std::lock_guard<std::mutex> guard(relationLocks().stripes[RelationLocks::stripe(key)]);
     this->fetchRaw(key, jsonValReal);   // Fetch the actual entry being removed
 
-    if (this->redisHandler->exists(key)) {
-        this->redisHandler->decrementKey(KEY_TOTAL_RELATIONS, jsonValReal[JSON_ATTR_REL_COUNT].asInt());    // decrement the global relation count
-        this->redisHandler->deleteKey(key);
+    if (this->redis()->exists(key)) {
+        this->redis()->decrementKey(KEY_TOTAL_RELATIONS, jsonValReal[JSON_ATTR_REL_COUNT].asInt());    // decrement the global relation count
+        this->redis()->deleteKey(key);
+        applyRelationDelta(*(this->redis()), key, jsonValReal, jsonValReal[JSON_ATTR_REL_COUNT].asInt(), 0);
         return true;
     }
     return false;
 }
 
+/**
+ * Decrements the instance count of a stored relation, removing it once no instances are left.  As
+ * in writeRelation the count is read and written back under the lock of the relation.
+ *
+ * @returns     false if the relation is not stored
+ */
+bool IndexHandler::decrementRelation(Relation& rel, int count) {
+    Json::Value jsonVal = rel.toJson(), stored;
+    this->redis()->connect();
+    std::string key = this->generateRelationKey(jsonVal[JSON_ATTR_REL_ENTL].asString(),
+        jsonVal[JSON_ATTR_REL_ENTR].asString(), generateRelationHash(jsonVal));
+
+    std::lock_guard<std::mutex> guard(relationLocks().stripes[RelationLocks::stripe(key)]);
+    if (!this->redis()->exists(key) || !this->fetchRaw(key, stored))
+        return false;
+    int oldCount = stored[JSON_ATTR_REL_COUNT].asInt();
+    int newCount = count >= oldCount ? 0 : oldCount - count;
+
+    this->redis()->decrementKey(KEY_TOTAL_RELATIONS, oldCount - newCount);
+    if (newCount == 0)
+        this->redis()->deleteKey(key);
+    else {
+        stored[JSON_ATTR_REL_COUNT] = newCount;
+        this->redis()->write(key, stored.toStyledString());
+    }
+    applyRelationDelta(*(this->redis()), key, stored, oldCount, newCount);
+    return true;
+}
+
 /**
  * Writes relation to in memory index.
  *
@@ -203,26 +629,108 @@ bool IndexHandler::writeRelation(Relation& rel, int count) {
  */
 bool IndexHandler::writeRelation(Json::Value& jsonVal, int count) {
     std::string key;
-    this->redisHandler->connect();
+    this->redis()->connect();
     key = this->generateRelationKey(
         std::string(jsonVal[JSON_ATTR_REL_ENTL].asCString()),
         std::string(jsonVal[JSON_ATTR_REL_ENTR].asCString()),
         generateRelationHash(jsonVal));
 
-    if (this->redisHandler->exists(key)) {
+    std::lock_guard<std::mutex> guard(relationLocks().stripes[RelationLocks::stripe(key)]);
+    int oldCount = 0;
+    if (this->redis()->exists(key)) {
         if (this->fetchRaw(key, jsonVal)) {
-            jsonVal[JSON_ATTR_REL_COUNT] =
-                jsonVal[JSON_ATTR_REL_COUNT].asInt() + count;
+            oldCount = jsonVal[JSON_ATTR_REL_COUNT].asInt();
+            jsonVal[JSON_ATTR_REL_COUNT] = oldCount + count;
         } else
             return false;
     } else
         jsonVal[JSON_ATTR_REL_COUNT] = count;
 
-    this->redisHandler->incrementKey(KEY_TOTAL_RELATIONS, count);
-    this->redisHandler->write(key, jsonVal.toStyledString());
+    this->redis()->incrementKey(KEY_TOTAL_RELATIONS, count);
+    this->redis()->write(key, jsonVal.toStyledString());
+    applyRelationDelta(*(this->redis()), key, jsonVal, oldCount, oldCount + count);
     return true;
 }
 
+/**
+ * Writes a batch of relations.  A relation repeated in the batch is written once with the counts
+ * summed, the stored relations are read in one pipeline, written back in another and the total is
+ * adjusted once.  The hooks then see the relations written as one chunk, those with a batch entry
+ * point sending their updates for the chunk in one pipeline.
+ *
+ * @param relations     relation json and instance count
+ * @returns             for each relation in the batch whether it was written
+ */
+std::vector<bool> IndexHandler::writeRelations(std::vector<std::pair<Json::Value, int>>& relations) {
+    std::unordered_map<std::string, long> slots;
+    std::vector<long> relationSlots;
+    std::vector<std::string> keys, values;
+    std::vector<Json::Value> jsons;
+    std::vector<int> counts, oldCounts;
+    std::vector<bool> written;
+    std::string key;
+
+    // Coalesce repeated relations
+    for (std::vector<std::pair<Json::Value, int>>::iterator it = relations.begin(); it != relations.end(); ++it) {
+        key = this->generateRelationKey(it->first[JSON_ATTR_REL_ENTL].asString(),
+            it->first[JSON_ATTR_REL_ENTR].asString(), generateRelationHash(it->first));
+        std::unordered_map<std::string, long>::iterator itSlot = slots.find(key);
+        if (itSlot == slots.end()) {
+            itSlot = slots.insert(std::make_pair(key, (long)keys.size())).first;
+            keys.push_back(key);
+            jsons.push_back(it->first);
+            counts.push_back(0);
+        }
+        counts[itSlot->second] += it->second;
+        relationSlots.push_back(itSlot->second);
+    }
+
+    // The stripes of every relation in the batch are held until its hooks have run
+    std::set<size_t> stripes;
+    std::vector<std::unique_lock<std::mutex>> guards;
+    for (std::vector<std::string>::iterator it = keys.begin(); it != keys.end(); ++it)
+        stripes.insert(RelationLocks::stripe(*it));
+    for (std::set<size_t>::iterator it = stripes.begin(); it != stripes.end(); ++it)
+        guards.push_back(std::unique_lock<std::mutex>(relationLocks().stripes[*it]));
+
+    this->redis()->connect();
+    std::vector<std::string> stored = this->redis()->readMany(keys);
+    std::vector<std::string> writeKeys;
+    Json::Value existing;
+    long total = 0;
+    for (size_t i = 0; i < keys.size(); i++) {
+        oldCounts.push_back(0);
+        written.push_back(true);
+        if (i < stored.size() && stored[i].compare("") != 0) {
+            if (!this->composeJSON(stored[i], existing)) {
+                written[i] = false;
+                continue;
+            }
+            oldCounts[i] = existing[JSON_ATTR_REL_COUNT].asInt();
+            jsons[i] = existing;
+        }
+        jsons[i][JSON_ATTR_REL_COUNT] = oldCounts[i] + counts[i];
+        writeKeys.push_back(keys[i]);
+        values.push_back(jsons[i].toStyledString());
+        total += counts[i];
+    }
+
+    this->redis()->writeMany(writeKeys, values);
+    this->redis()->incrementKey(KEY_TOTAL_RELATIONS, total);
+
+    // The hooks see the whole chunk at once
+    std::vector<RelationDelta> deltas;
+    for (size_t i = 0; i < keys.size(); i++)
+        if (written[i])
+            deltas.push_back(RelationDelta(keys[i], &jsons[i], oldCounts[i], oldCounts[i] + counts[i]));
+    applyRelationDeltas(*(this->redis()), deltas);
+
+    std::vector<bool> result;
+    for (std::vector<long>::iterator it = relationSlots.begin(); it != relationSlots.end(); ++it)
+        result.push_back(written[*it]);
+    return result;
+}
+
 /**
  * Handles writes to disk with strategy
  *
@@ -247,22 +755,77 @@ bool IndexHandler::composeJSON(std::string key, Json::Value& json) {
 
 /** Attempts to fetch an entity from index */
 bool IndexHandler::fetchEntity(std::string entity, Json::Value& json) {
-    this->redisHandler->connect();
+    IndexThreadState& state = this->local();
+    if (state.entityCaching) {
+        std::unordered_map<std::string, Json::Value>::iterator it = state.entityCache.find(entity);
+        if (it != state.entityCache.end()) {
+            json = it->second;
+            return true;
+        }
+    }
+    this->redis()->connect();
     if (this->existsEntity(entity)) {
         if (this->composeJSON(
-            this->redisHandler->read(this->generateEntityKey(entity)), json))
+            this->redis()->read(this->generateEntityKey(entity)), json)) {
+            if (state.entityCaching) state.entityCache[entity] = json;
             return true;
-        else
+        } else
             return false;
     } else
         return false;
 }
 
+/**
+ * Turn caching of entity definitions on or off for the calling thread, either way the cache starts
+ * empty.  Only entities found are cached and entities removed by the thread are dropped, definitions
+ * changed by other threads or processes are not seen while caching.
+ */
+void IndexHandler::cacheEntities(bool on) {
+    IndexThreadState& state = this->local();
+    state.entityCaching = on;
+    state.entityCache.clear();
+}
+
+/** State of the calling thread, made on its first use of the handler */
+IndexThreadState& IndexHandler::local() {
+    std::thread::id id = std::this_thread::get_id();
+    if (id == this->owner) return *(this->ownerState);
+    std::lock_guard<std::mutex> guard(this->lock);
+    std::unique_ptr<IndexThreadState>& state = this->threads[id];
+    if (!state) {
+        state.reset(new IndexThreadState());
+        static thread_local IndexThreadRelease release;
+        release.handlers.insert(this);
+    }
+    return *state;
+}
+
+/** Number of threads holding state in the handler, its owner included */
+long IndexHandler::countThreadStates() {
+    std::lock_guard<std::mutex> guard(this->lock);
+    return this->threads.size();
+}
+
+/** Drop the state of a thread other than the owner as it exits */
+void IndexHandler::release(std::thread::id id) {
+    if (id == this->owner) return;
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->threads.erase(id);
+}
+
+/** Release the state of the exiting thread from the handlers it used, as long as they are alive */
+IndexThreadRelease::~IndexThreadRelease() {
+    std::lock_guard<std::mutex> guard(liveIndexHandlers().lock);
+    for (std::set<IndexHandler*>::iterator it = this->handlers.begin(); it != this->handlers.end(); ++it)
+        if (liveIndexHandlers().handlers.count(*it) > 0)
+            (*it)->release(std::this_thread::get_id());
+}
+
 /** Attempts to fetch a key from index */
 bool IndexHandler::fetchRaw(std::string key, Json::Value& json) {
-    this->redisHandler->connect();
-    if (this->redisHandler->exists(key)) {
-        if (this->composeJSON(this->redisHandler->read(key), json))
+    this->redis()->connect();
+    if (this->redis()->exists(key)) {
+        if (this->composeJSON(this->redis()->read(key), json))
             return true;
         else
             return false;
@@ -270,46 +833,533 @@ bool IndexHandler::fetchRaw(std::string key, Json::Value& json) {
         return false;
 }
 
-/** Fetch a set of relations matching the entities */
+/**
+ * Fetch a set of relations matching the entities.  Matching pairs are read from the catalog and the
+ * relations of each pair are read in one pipelined batch.  Relations on entities pending removal
+ * are skipped.
+ */
 std::vector<Json::Value> IndexHandler::fetchRelationPrefix(std::string entityL, std::string entityR) {
-    this->redisHandler->connect();
-    std::vector<std::string> keys = this->redisHandler->keys(this->generateRelationKey(entityL, entityR, "*"));
+    std::vector<std::string> patterns;
+    patterns.push_back(this->orderPairAlphaNumeric(entityL, entityR));
+    return this->fetchRelationPrefix(patterns);
+}
+
+/**
+ * Fetch the relations containing the entity on either side, relations on the pair (e, e) are returned once.  The
+ * patterns are not put in pair order, which would place the wildcard first for either side.
+ */
+std::vector<Json::Value> IndexHandler::fetchEntityRelations(std::string entity) {
+    std::vector<std::string> patterns;
+    patterns.push_back(entity + KEY_DELIMETER + "*");
+    patterns.push_back(std::string("*") + KEY_DELIMETER + entity);
+    return this->fetchRelationPrefix(patterns);
+}
+
+/** Fetch the relations of all pairs matching any of the pair patterns in one batch */
+std::vector<Json::Value> IndexHandler::fetchRelationPrefix(std::vector<std::string>& patterns) {
+    std::set<std::string> tombstones = this->fetchTombstones();
+    std::vector<std::string> pairs = PairCatalog::matchPairs(*(this->redis()), patterns);
+    std::vector<std::string> keys, pairKeys, values;
     std::vector<Json::Value> relations;
     Json::Value json;
-    for (std::vector<string>::iterator it = keys.begin(); it != keys.end(); ++it) {
+
+    for (std::vector<std::string>::iterator it = pairs.begin(); it != pairs.end(); ++it) {
+        pairKeys = PairCatalog::fetchPairKeys(*(this->redis()), *it);
+        keys.insert(keys.end(), pairKeys.begin(), pairKeys.end());
+    }
+    values = this->redis()->readMany(keys);
+
+    for (std::vector<string>::iterator it = values.begin(); it != values.end(); ++it) {
         json = Json::Value();
-        this->composeJSON(this->redisHandler->read(*it), json);
+        if (!this->composeJSON(*it, json)) continue;
+        if (tombstones.size() > 0 &&
+                (tombstones.count(json[JSON_ATTR_REL_ENTL].asString()) > 0 ||
+                tombstones.count(json[JSON_ATTR_REL_ENTR].asString()) > 0))
+            continue;
         relations.push_back(json);
     }
     return relations;
 }
 
-/** Fetch a set of relations matching the entities */
-std::vector<Json::Value> IndexHandler::fetchAttribute(AttributeTuple& attr) {
-    this->redisHandler->connect();
-    std::vector<std::string> keysl = this->redisHandler->keys(this->generateRelationKey(attr.entity, "*", "*"));
-    std::vector<std::string> keysr = this->redisHandler->keys(this->generateRelationKey("*", attr.entity, "*"));
-    std::vector<Json::Value> relations;
+/** Fetch the keys of all relations containing the entity on either side */
+std::vector<std::string> IndexHandler::fetchEntityRelationKeys(std::string entity) {
+    std::vector<std::string> pairs, pairKeys, keys;
+    this->redis()->connect();
+    pairs = PairCatalog::fetchEntityPairs(*(this->redis()), entity);
+    for (std::vector<std::string>::iterator it = pairs.begin(); it != pairs.end(); ++it) {
+        pairKeys = PairCatalog::fetchPairKeys(*(this->redis()), *it);
+        keys.insert(keys.end(), pairKeys.begin(), pairKeys.end());
+    }
+    return keys;
+}
 
-    for (std::vector<string>::iterator it = keysl.begin(); it != keysl.end(); ++it) {
-        Json::Value json;
-        this->composeJSON(this->redisHandler->read(*it), json);
-        relations.push_back(json);
+/** Fetch the catalog summaries for all pairs matching the entities - O(pairs) */
+std::vector<Json::Value> IndexHandler::fetchPairSummaries(std::string entityL, std::string entityR) {
+    std::vector<Json::Value> summaries;
+    std::set<std::string> tombstones = this->fetchTombstones();
+    std::vector<std::string> pairs = PairCatalog::matchPairs(*(this->redis()), this->orderPairAlphaNumeric(entityL, entityR));
+    std::vector<std::string> entities;
+
+    for (std::vector<std::string>::iterator it = pairs.begin(); it != pairs.end(); ++it) {
+        entities = PairCatalog::splitPair(*it);
+        if (entities.size() == 2 && (tombstones.count(entities[0]) > 0 || tombstones.count(entities[1]) > 0))
+            continue;
+        summaries.push_back(PairCatalog::fetchSummary(*(this->redis()), *it));
     }
-    for (std::vector<string>::iterator it = keysr.begin(); it != keysr.end(); ++it) {
-        Json::Value json;
-        this->composeJSON(this->redisHandler->read(*it), json);
+    return summaries;
+}
+
+/**
+ * Fetch the versions of all pairs matching the entities as a canonical string.  The string changes
+ * whenever any relation in the matching set changes, or a matching pair is added or removed.
+ */
+std::string IndexHandler::fetchPairVersions(std::string entityL, std::string entityR) {
+    std::vector<std::string> patterns;
+    patterns.push_back(this->orderPairAlphaNumeric(entityL, entityR));
+    return this->fetchPairVersions(patterns);
+}
+
+/** Fetch the versions of all pairs containing the entity on either side, as for fetchPairVersions */
+std::string IndexHandler::fetchEntityPairVersions(std::string entity) {
+    std::vector<std::string> patterns;
+    patterns.push_back(entity + KEY_DELIMETER + "*");
+    patterns.push_back(std::string("*") + KEY_DELIMETER + entity);
+    return this->fetchPairVersions(patterns);
+}
+
+/** Fetch the versions of all pairs matching any of the patterns from one read of the version map */
+std::string IndexHandler::fetchPairVersions(std::vector<std::string>& patterns) {
+    std::unordered_map<std::string, std::string> versions = PairCatalog::fetchVersions(*(this->redis()));
+    std::set<std::string> matches;
+
+    for (std::unordered_map<std::string, std::string>::iterator it = versions.begin(); it != versions.end(); ++it)
+        for (std::vector<std::string>::iterator itPat = patterns.begin(); itPat != patterns.end(); ++itPat)
+            if (fnmatch(itPat->c_str(), it->first.c_str(), 0) == 0) {
+                matches.insert(it->first + std::string(":") + it->second);
+                break;
+            }
+
+    std::string out;
+    for (std::set<std::string>::iterator it = matches.begin(); it != matches.end(); ++it)
+        out += *it + std::string(",");
+    return out;
+}
+
+/** Fetch the version of a single pair */
+long IndexHandler::fetchPairVersion(std::string pair) {
+    return PairCatalog::fetchVersion(*(this->redis()), pair);
+}
+
+/** Fetch the number of distinct relations on a single pair */
+long IndexHandler::fetchPairDistinct(std::string pair) {
+    return PairCatalog::fetchPairDistinct(*(this->redis()), pair);
+}
+
+/** Fetch the relations of a single pair along with their keys, skipping entities pending removal */
+void IndexHandler::fetchPairRelations(std::string pair, std::vector<std::string>& keys, std::vector<Json::Value>& relations) {
+    std::set<std::string> tombstones = this->fetchTombstones();
+    std::vector<std::string> pairKeys = PairCatalog::fetchPairKeys(*(this->redis()), pair);
+    std::vector<std::string> values = this->redis()->readMany(pairKeys);
+    Json::Value json;
+
+    for (long i = 0; i < values.size(); i++) {
+        json = Json::Value();
+        if (!this->composeJSON(values[i], json)) continue;
+        if (tombstones.count(json[JSON_ATTR_REL_ENTL].asString()) > 0 ||
+                tombstones.count(json[JSON_ATTR_REL_ENTR].asString()) > 0)
+            continue;
+        keys.push_back(pairKeys[i]);
         relations.push_back(json);
     }
-    return relations;
+}
+
+/**
+ * Builds the structures kept by the relation hooks that have not been built over this database, e.g.
+ * when relations were written before the structure existed or loaded from a snapshot.  Only the
+ * rebuilds set the markers, so writes made before a build never hide the relations before them.
+ * Every process should call this when it starts, before it writes.
+ *
+ * Rebuilds are run by one process at a time, the one holding the rebuild lease.  Processes starting
+ * meanwhile wait until every marker is set rather than replaying the relations a second time.
+ *
+ * @returns     the names of the structures built
+ */
+std::vector<std::string> IndexHandler::rebuildMissing() {
+    std::vector<std::string> built, leaseKeys(1, KEY_REBUILD_LEASE);
+    this->redis()->connect();
+    std::string owner = std::to_string(this->redis()->incrementAndRead(KEY_LEASE_OWNERS, 1));
+    while (!this->redis()->exists(KEY_CATALOG_BUILT) || !this->redis()->exists(KEY_MOMENTS_BUILT) ||
+            !this->redis()->exists(KEY_TOPK_BUILT) || !this->redis()->exists(KEY_SKETCH_BUILT)) {
+        if (!this->redis()->setIfAbsent(KEY_REBUILD_LEASE, owner, REBUILD_LEASE_SECONDS)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(REBUILD_WAIT_MS));
+            continue;
+        }
+
+        // The markers are read again under the lease, a build may have finished since
+        if (!this->redis()->exists(KEY_CATALOG_BUILT)) {
+            this->rebuildCatalog();
+            built.push_back("entity pair catalog");
+        }
+        this->redis()->expire(KEY_REBUILD_LEASE, REBUILD_LEASE_SECONDS);
+        if (!this->redis()->exists(KEY_MOMENTS_BUILT)) {
+            this->rebuildMoments();
+            built.push_back("attribute moment accumulators");
+        }
+        this->redis()->expire(KEY_REBUILD_LEASE, REBUILD_LEASE_SECONDS);
+        if (!this->redis()->exists(KEY_TOPK_BUILT)) {
+            this->rebuildTopK();
+            built.push_back("attribute value counts");
+        }
+        this->redis()->expire(KEY_REBUILD_LEASE, REBUILD_LEASE_SECONDS);
+        if (!this->redis()->exists(KEY_SKETCH_BUILT)) {
+            this->rebuildSketch();
+            built.push_back("count-min sketch");
+        }
+        if (this->redis()->readMany(leaseKeys)[0].compare(owner) == 0)
+            this->redis()->deleteKey(KEY_REBUILD_LEASE);
+    }
+    return built;
+}
+
+/** Rebuilds the pair catalog from a scan over all relation keys, e.g. for data written before the catalog existed */
+void IndexHandler::rebuildCatalog() {
+    std::vector<std::string> pairs, keys, values;
+    Json::Value json;
+
+    this->redis()->connect();
+    pairs = PairCatalog::fetchPairs(*(this->redis()));
+    for (std::vector<std::string>::iterator it = pairs.begin(); it != pairs.end(); ++it)
+        PairCatalog::dropPair(*(this->redis()), *it);
+
+    keys = this->redis()->keys(std::string("rel") + KEY_DELIMETER + "*");
+    values = this->redis()->readMany(keys);
+    for (int i = 0; i < keys.size(); i++) {
+        json = Json::Value();
+        if (this->composeJSON(values[i], json))
+            PairCatalog::relationHook(*(this->redis()), keys[i], json, 0, json[JSON_ATTR_REL_COUNT].asInt());
+    }
+    this->redis()->write(KEY_CATALOG_BUILT, "1");
+}
+
+/** Rebuilds the moment accumulators from a scan over all relation keys */
+void IndexHandler::rebuildMoments() {
+    std::vector<std::string> keys, values;
+    Json::Value json;
+
+    this->redis()->connect();
+    keys = this->redis()->keys(std::string(KEY_MOMENTS_PREFIX) + KEY_MOMENTS_DELIMETER + "*");
+    this->redis()->deleteKeys(keys);
+
+    keys = this->redis()->keys(std::string("rel") + KEY_DELIMETER + "*");
+    values = this->redis()->readMany(keys);
+    for (int i = 0; i < keys.size(); i++) {
+        json = Json::Value();
+        if (this->composeJSON(values[i], json))
+            MomentStore::apply(*(this->redis()), json, json[JSON_ATTR_REL_COUNT].asInt());
+    }
+    this->redis()->write(KEY_MOMENTS_BUILT, "1");
+}
+
+/** Rebuilds the attribute value counts from a scan over all relation keys */
+void IndexHandler::rebuildTopK() {
+    std::vector<std::string> keys, values;
+    Json::Value json;
+
+    this->redis()->connect();
+    keys = this->redis()->keys(std::string(KEY_TOPK_PREFIX) + KEY_TOPK_DELIMETER + "*");
+    this->redis()->deleteKeys(keys);
+
+    keys = this->redis()->keys(std::string("rel") + KEY_DELIMETER + "*");
+    values = this->redis()->readMany(keys);
+    for (int i = 0; i < keys.size(); i++) {
+        json = Json::Value();
+        if (this->composeJSON(values[i], json))
+            TopKStore::apply(*(this->redis()), json, json[JSON_ATTR_REL_COUNT].asInt());
+    }
+    this->redis()->write(KEY_TOPK_BUILT, "1");
+}
+
+/** Rebuilds the count-min sketch from a scan over all relation keys */
+void IndexHandler::rebuildSketch() {
+    std::vector<std::string> keys, values;
+    Json::Value json;
+
+    this->redis()->connect();
+    CountSketch::clear(*(this->redis()));
+
+    keys = this->redis()->keys(std::string("rel") + KEY_DELIMETER + "*");
+    values = this->redis()->readMany(keys);
+    for (int i = 0; i < keys.size(); i++) {
+        json = Json::Value();
+        if (this->composeJSON(values[i], json))
+            CountSketch::apply(*(this->redis()), keys[i], json, json[JSON_ATTR_REL_COUNT].asInt());
+    }
+    this->redis()->write(KEY_SKETCH_BUILT, "1");
+}
+
+/**
+ *  Estimate the relation instances in a sketch scope passing an equality filter, an empty
+ *  attribute gives the exact total of the scope
+ */
+bool IndexHandler::estimateCount(std::string scope, AttributeTuple& filter, SketchEstimate& estimate) {
+    this->redis()->connect();
+    return CountSketch::estimate(*(this->redis()), scope, filter.entity, filter.attribute,
+        filter.value, filter.type, estimate);
+}
+
+/** Fetch the moment accumulators of an entity attribute, false if no relation carries it */
+bool IndexHandler::fetchMoments(std::string entity, std::string attribute, Moments& moments) {
+    return MomentStore::fetch(*(this->redis()), entity, attribute, moments);
+}
+
+/** Fetch the k most frequent values of an entity attribute with their instance counts */
+std::vector<ValueCount> IndexHandler::fetchTopValues(std::string entity, std::string attribute, long k) {
+    return TopKStore::fetch(*(this->redis()), entity, attribute, k);
+}
+
+/** Fetch the catalog pairs containing the entity on either side */
+std::vector<std::string> IndexHandler::fetchEntityPairs(std::string entity) {
+    return PairCatalog::fetchEntityPairs(*(this->redis()), entity);
+}
+
+/**
+ * Merge the digests of an entity attribute over all pairs on the entity.  Digests dropped by a
+ * decrement, or never queried, are built from the relations of their pair and stored.
+ *
+ * @returns     false if no instance carries the attribute
+ */
+bool IndexHandler::fetchQuantileDigest(std::string entity, std::string attribute, TDigest& digest) {
+    std::vector<std::string> pairs = this->fetchEntityPairs(entity);
+    std::vector<std::string> keys;
+    std::vector<Json::Value> relations;
+    TDigest pairDigest;
+    long version;
+
+    for (std::vector<std::string>::iterator it = pairs.begin(); it != pairs.end(); ++it) {
+        version = PairCatalog::fetchVersion(*(this->redis()), *it);
+        if (!QuantileStore::fetch(*(this->redis()), *it, entity, attribute, version, pairDigest)) {
+            keys.clear();
+            relations.clear();
+            pairDigest = TDigest();
+            this->fetchPairRelations(*it, keys, relations);
+            for (std::vector<Json::Value>::iterator itRel = relations.begin(); itRel != relations.end(); ++itRel)
+                QuantileStore::add(pairDigest, *itRel, entity, attribute, (*itRel)[JSON_ATTR_REL_COUNT].asInt());
+
+            // A digest built while the pair changed is used but not stored
+            if (PairCatalog::fetchVersion(*(this->redis()), *it) == version)
+                QuantileStore::store(*(this->redis()), *it, entity, attribute, version, pairDigest);
+        }
+        digest.merge(pairDigest);
+    }
+    return digest.total() > 0;
+}
+
+/**
+ * Declare the conditional table P(targetEntity.targetAttr | givenEntity.givenAttr) and build it from
+ * the existing relations.  The entities must differ and both attributes must exist.
+ */
+bool IndexHandler::writeConditionalTable(std::string targetEntity, std::string targetAttr,
+        std::string givenEntity, std::string givenAttr, long limit) {
+    if (targetEntity.compare(givenEntity) == 0 || limit < 1) return false;
+    if (!this->existsEntityField(targetEntity, targetAttr) || !this->existsEntityField(givenEntity, givenAttr))
+        return false;
+
+    Json::Value definition;
+    definition[JSON_ATTR_CPT_NAME] = ConditionalTable::tableName(targetEntity, targetAttr, givenEntity, givenAttr);
+    definition[JSON_ATTR_CPT_TARGET_ENT] = targetEntity;
+    definition[JSON_ATTR_CPT_TARGET_ATTR] = targetAttr;
+    definition[JSON_ATTR_CPT_GIVEN_ENT] = givenEntity;
+    definition[JSON_ATTR_CPT_GIVEN_ATTR] = givenAttr;
+    definition[JSON_ATTR_CPT_LIMIT] = (Json::Int64)limit;
+
+    std::vector<Json::Value> relations = this->fetchRelationPrefix(targetEntity, givenEntity);
+    ConditionalTable::declare(*(this->redis()), definition, relations);
+    return true;
+}
+
+/** Fetch a conditional table with its cells */
+bool IndexHandler::fetchConditionalTable(std::string name, Json::Value& table) {
+    table = ConditionalTable::fetchTable(*(this->redis()), name);
+    return !table.isNull();
+}
+
+/** Fetch the definitions of all conditional tables */
+std::vector<Json::Value> IndexHandler::fetchConditionalTables() {
+    return ConditionalTable::fetchDefinitions(*(this->redis()));
+}
+
+/** Fetch the cells of a conditional table, false unless the table exists and is within its limit */
+bool IndexHandler::fetchTableCells(std::string name, std::vector<TableCell>& cells) {
+    Json::Value definition;
+    if (!ConditionalTable::fetchDefinition(*(this->redis()), name, definition) ||
+            definition[JSON_ATTR_CPT_STATUS].asString().compare(CPT_STATUS_READY) != 0)
+        return false;
+    cells = ConditionalTable::fetchCells(*(this->redis()), name);
+    return true;
+}
+
+/** Remove a conditional table */
+bool IndexHandler::removeConditionalTable(std::string name) {
+    return ConditionalTable::drop(*(this->redis()), name);
+}
+
+/**
+ * Declare the aggregate cube over a list of entity attributes, e.g. "x.a", and build it from the
+ * existing relations.  The attributes must exist, be distinct and span exactly two entities.
+ */
+bool IndexHandler::writeCube(std::vector<std::string>& attributes, long limit) {
+    if (attributes.size() == 0 || attributes.size() > CUBE_MAX_DIMENSIONS || limit < 1) return false;
+
+    Json::Value definition, dimension;
+    std::vector<std::string> entities;
+    std::set<std::string> seen;
+    std::string::size_type split;
+    std::string entity, attribute;
+
+    definition[JSON_ATTR_CUBE_NAME] = AggregateCube::cubeName(attributes);
+    definition[JSON_ATTR_CUBE_DIMS] = Json::Value(Json::arrayValue);
+    for (std::vector<std::string>::iterator it = attributes.begin(); it != attributes.end(); ++it) {
+        split = it->find('.');
+        if (split == std::string::npos || !seen.insert(*it).second) return false;
+        entity = it->substr(0, split);
+        attribute = it->substr(split + 1);
+        if (!this->existsEntityField(entity, attribute)) return false;
+        if (std::find(entities.begin(), entities.end(), entity) == entities.end())
+            entities.push_back(entity);
+
+        dimension = Json::Value();
+        dimension[JSON_ATTR_CUBE_ENTITY] = entity;
+        dimension[JSON_ATTR_CUBE_ATTR] = attribute;
+        dimension[JSON_ATTR_CUBE_TYPE] = this->fetchEntityFieldType(entity, attribute);
+        definition[JSON_ATTR_CUBE_DIMS].append(dimension);
+    }
+    if (entities.size() != 2) return false;
+
+    definition[JSON_ATTR_CUBE_ENTITIES] = Json::Value(Json::arrayValue);
+    definition[JSON_ATTR_CUBE_ENTITIES].append(entities[0]);
+    definition[JSON_ATTR_CUBE_ENTITIES].append(entities[1]);
+    definition[JSON_ATTR_CUBE_LIMIT] = (Json::Int64)limit;
+
+    std::vector<Json::Value> relations = this->fetchRelationPrefix(entities[0], entities[1]);
+    AggregateCube::declare(*(this->redis()), definition, relations);
+    return true;
+}
+
+/** Fetch an aggregate cube with its cells */
+bool IndexHandler::fetchCube(std::string name, Json::Value& cube) {
+    cube = AggregateCube::fetchCube(*(this->redis()), name);
+    return !cube.isNull();
+}
+
+/** Fetch the definitions of all aggregate cubes */
+std::vector<Json::Value> IndexHandler::fetchCubes() {
+    return AggregateCube::fetchDefinitions(*(this->redis()));
+}
+
+/** Load an aggregate cube for queries, false unless the cube exists and is within its limit */
+bool IndexHandler::loadCube(std::string name, AggregateCube& cube) {
+    return AggregateCube::load(*(this->redis()), name, cube);
+}
+
+/** Remove an aggregate cube */
+bool IndexHandler::removeCube(std::string name) {
+    return AggregateCube::drop(*(this->redis()), name);
+}
+
+/**
+ * Register a standing query for the probability of targetEntity given givenEntity or, with an
+ * attribute, the expected value of targetEntity.targetAttr, subject to a filter.  Returns the id of
+ * the query, empty if the entities or the attribute do not exist.
+ */
+std::string IndexHandler::writeStandingQuery(std::string targetEntity, std::string targetAttr,
+        std::string givenEntity, AttributeBucket& filter, std::string comparator) {
+    if (!this->existsEntity(targetEntity) || !this->existsEntity(givenEntity)) return "";
+    if (targetAttr.compare("") != 0 && !this->existsEntityField(targetEntity, targetAttr)) return "";
+
+    Json::Value definition;
+    definition[JSON_ATTR_WATCH_TARGET_ENT] = targetEntity;
+    definition[JSON_ATTR_WATCH_TARGET_ATTR] = targetAttr;
+    definition[JSON_ATTR_WATCH_GIVEN_ENT] = givenEntity;
+    definition[JSON_ATTR_WATCH_COMPARE] = comparator;
+    definition[JSON_ATTR_WATCH_FILTER] = Json::Value(Json::arrayValue);
+
+    Json::Reader reader;
+    Json::Value tuple;
+    std::unordered_map<std::string, std::vector<std::string>> hash = filter.getAttributeHash();
+    for (std::unordered_map<std::string, std::vector<std::string>>::iterator it = hash.begin(); it != hash.end(); ++it)
+        for (std::vector<std::string>::iterator itTuple = it->second.begin(); itTuple != it->second.end(); ++itTuple)
+            if (reader.parse(*itTuple, tuple, false))
+                definition[JSON_ATTR_WATCH_FILTER].append(tuple);
+
+    std::vector<Json::Value> relations = this->fetchEntityRelations(
+        targetAttr.compare("") == 0 ? givenEntity : targetEntity);
+    return StandingQuery::declare(*(this->redis()), definition, relations);
+}
+
+/** Fetch a standing query with its current answer */
+bool IndexHandler::fetchStandingQuery(std::string id, Json::Value& query) {
+    query = StandingQuery::fetchQuery(*(this->redis()), id);
+    return !query.isNull();
+}
+
+/** Fetch the definitions of all standing queries */
+std::vector<Json::Value> IndexHandler::fetchStandingQueries() {
+    return StandingQuery::fetchDefinitions(*(this->redis()));
+}
+
+/** Remove a standing query */
+bool IndexHandler::removeStandingQuery(std::string id) {
+    return StandingQuery::drop(*(this->redis()), id);
+}
+
+/**
+ * Declare the naive Bayes classifier of targetEntity.targetAttr given the attributes of givenEntity.
+ * The entities must differ and the target attribute must exist, the model is built on first use.
+ */
+bool IndexHandler::writeClassifier(std::string targetEntity, std::string targetAttr, std::string givenEntity) {
+    if (targetEntity.compare(givenEntity) == 0 || !this->existsEntity(givenEntity) ||
+            !this->existsEntityField(targetEntity, targetAttr))
+        return false;
+
+    Json::Value definition;
+    definition[JSON_ATTR_NB_NAME] = ClassifierRegistry::classifierName(targetEntity, targetAttr, givenEntity);
+    definition[JSON_ATTR_NB_TARGET_ENT] = targetEntity;
+    definition[JSON_ATTR_NB_TARGET_ATTR] = targetAttr;
+    definition[JSON_ATTR_NB_GIVEN_ENT] = givenEntity;
+    ClassifierRegistry::declare(*(this->redis()), definition);
+    ClassifierRegistry::instance().forget(definition[JSON_ATTR_NB_NAME].asString());
+    return true;
+}
+
+/** Fetch the definition of a classifier */
+bool IndexHandler::fetchClassifier(std::string name, Json::Value& definition) {
+    return ClassifierRegistry::fetchDefinition(*(this->redis()), name, definition);
+}
+
+/** Fetch the definitions of all classifiers */
+std::vector<Json::Value> IndexHandler::fetchClassifiers() {
+    return ClassifierRegistry::fetchDefinitions(*(this->redis()));
+}
+
+/** Remove a classifier */
+bool IndexHandler::removeClassifier(std::string name) {
+    return ClassifierRegistry::drop(*(this->redis()), name);
+}
+
+/** Fetch a set of relations matching the entities */
+std::vector<Json::Value> IndexHandler::fetchAttribute(AttributeTuple& attr) {
+    return this->fetchEntityRelations(attr.entity);
 }
 
 bool IndexHandler::existsEntity(Entity& e) { this->existsEntity(e.name); }
 
 /** Check to ensure entity exists */
 bool IndexHandler::existsEntity(std::string entity) {
-    this->redisHandler->connect();
-    return this->redisHandler->exists(this->generateEntityKey(entity));
+    IndexThreadState& state = this->local();
+    if (state.entityCaching && state.entityCache.find(entity) != state.entityCache.end())
+        return true;
+    this->redis()->connect();
+    return this->redis()->exists(this->generateEntityKey(entity));
 }
 
 /** Check to ensure entity exists */
@@ -321,12 +1371,12 @@ bool IndexHandler::existsEntityField(std::string entity, std::string field) {
 
 
 /** Check to ensure relation exists */
-bool IndexHandler::existsRelation(Relation& r) { this->existsRelation(r.name_left, r.name_right); }
+bool IndexHandler::existsRelation(Relation& r) { return this->existsRelation(r.name_left, r.name_right); }
 
-/** Check to ensure relation exists */
+/** Check to ensure relations exist between the entities */
 bool IndexHandler::existsRelation(std::string entityL, std::string entityR) {
-    this->redisHandler->connect();
-    return this->redisHandler->exists(this->generateRelationKey(entityL, entityR, "*"));
+    this->redis()->connect();
+    return PairCatalog::matchPairs(*(this->redis()), this->orderPairAlphaNumeric(entityL, entityR)).size() > 0;
 }
 
 /**
@@ -341,12 +1391,12 @@ std::vector<Json::Value> IndexHandler::fetchPatternJson(std::string pattern) {
     bool parsedSuccess;
     std::vector<string> vec;
 
-    this->redisHandler->connect();
-    vec = this->redisHandler->keys(pattern);
+    this->redis()->connect();
+    vec = this->redis()->keys(pattern);
 
     // Iterate over all entries returned from redis
     for (std::vector<std::string>::iterator it = vec.begin() ; it != vec.end(); ++it) {
-        parsedSuccess = reader.parse(this->redisHandler->read(*it), inMem, false);
+        parsedSuccess = reader.parse(this->redis()->read(*it), inMem, false);
         if (parsedSuccess)
             elems.push_back(inMem);
     }
@@ -361,8 +1411,8 @@ std::vector<Json::Value> IndexHandler::fetchPatternJson(std::string pattern) {
 std::vector<string> IndexHandler::fetchPatternKeys(std::string pattern) {
     std::vector<std::string> elems = std::vector<std::string>();
     std::vector<string> vec;
-    this->redisHandler->connect();
-    vec = this->redisHandler->keys(pattern);
+    this->redis()->connect();
+    vec = this->redis()->keys(pattern);
     for (std::vector<std::string>::iterator it = vec.begin() ; it != vec.end(); ++it)
         elems.push_back((*it).substr(4, (*it).length()));
     return elems;
@@ -479,8 +1529,8 @@ void IndexHandler::filterRelations(std::vector<Relation>& relations, AttributeBu
 
     }
 
-    // Wipe the unmatched elements
-    for (std::vector<int>::iterator it = killIndices.begin(); it != killIndices.end(); ++it)
+    // Wipe the unmatched elements - last first so that the remaining indices stay valid
+    for (std::vector<int>::reverse_iterator it = killIndices.rbegin(); it != killIndices.rend(); ++it)
         relations.erase(relations.begin() + *it);
 }
 
@@ -499,14 +1549,14 @@ void IndexHandler::filterRelations(std::vector<Json::Value>& relations, Attribut
 
 /** Fetch the number of relations existing */
 long IndexHandler::getRelationCountTotal() {
-    this->redisHandler->connect();
-    return atol(this->redisHandler->read(KEY_TOTAL_RELATIONS).c_str());
+    this->redis()->connect();
+    return atol(this->redis()->read(KEY_TOTAL_RELATIONS).c_str());
 }
 
 /** Fetch the number of relations existing */
 void IndexHandler::setRelationCountTotal(long value) {
-    this->redisHandler->connect();
-    this->redisHandler->write(KEY_TOTAL_RELATIONS, std::to_string(value).c_str());
+    this->redis()->connect();
+    this->redis()->write(KEY_TOTAL_RELATIONS, std::to_string(value).c_str());
 }
 
 /** Takes a list of relations represented as a json vector and returns a relation vector */
@@ -527,11 +1577,12 @@ std::vector<Json::Value> IndexHandler::Relation2JsonVector(std::vector<Relation>
     return jsonRelations;
 }
 
+/** Sum the instance counts of the relations among matching entities from the catalog */
 long IndexHandler::computeRelationsCount(std::string left_entity, std::string right_entity) {
-    std::vector<Json::Value> relations = this->fetchRelationPrefix(left_entity, right_entity);
+    std::vector<Json::Value> summaries = this->fetchPairSummaries(left_entity, right_entity);
     long totalCount = 0;
-    for (std::vector<Json::Value>::iterator it = relations.begin() ; it != relations.end(); ++it)
-        totalCount += (*it)[JSON_ATTR_REL_COUNT].asInt();
+    for (std::vector<Json::Value>::iterator it = summaries.begin() ; it != summaries.end(); ++it)
+        totalCount += (*it)[JSON_ATTR_CAT_COUNT].asInt64();
     return totalCount;
 }
 
@@ -0,0 +1,198 @@
+/*
+ *  lexer.h
+ *
+ *  Splits a statement into tokens that point into the statement rather than copying it, and tags
+ *  each token with its keyword.  Keywords are found with a perfect hash - the hash of every keyword
+ *  lands in its own slot of the keyword table, which is checked when compiling, so recognizing a
+ *  token costs one hash over at most KEYWORD_MAX_LENGTH characters and one comparison.
+ *
+ *  Created by Ryan Faulkner on 2015-12-28
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _lexer_h
+#define _lexer_h
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#define STR_CMD_ADD "add"
+#define STR_CMD_DEC "dec"
+#define STR_CMD_GEN "gen"
+#define STR_CMD_INF "inf"
+#define STR_CMD_SET "set"
+#define STR_CMD_GIV "given"
+#define STR_CMD_ATR "attr"
+#define STR_CMD_DEF "def"
+#define STR_CMD_LST "lst"
+#define STR_CMD_ENT "ent"
+#define STR_CMD_RM "rm"
+#define STR_CMD_EXIT "exit"
+#define STR_CMD_AS "as"
+#define STR_CMD_REL "rel"
+#define STR_CMD_FOR "for"
+#define STR_CMD_JOB "job"
+#define STR_CMD_PAIR "pair"
+#define STR_CMD_SAMPLES "samples"
+#define STR_CMD_NOREPLACE "noreplace"
+#define STR_CMD_SEED "seed"
+#define STR_CMD_CPT "cpt"
+#define STR_CMD_LIMIT "limit"
+#define STR_CMD_VAR "var"
+#define STR_CMD_STDDEV "stddev"
+#define STR_CMD_APPROX "approx"
+#define STR_CMD_PCT "pct"
+#define STR_CMD_TOP "top"
+#define STR_CMD_CACHE "cache"
+#define STR_CMD_GROUP "group"
+#define STR_CMD_BY "by"
+#define STR_CMD_MC "mc"
+#define STR_CMD_PRECISION "precision"
+#define STR_CMD_BUDGET "budget"
+#define STR_CMD_NB "nb"
+#define STR_CMD_CLASSIFY "classify"
+#define STR_CMD_CUBE "cube"
+#define STR_CMD_WATCH "watch"
+#define STR_CMD_PREPARE "prepare"
+#define STR_CMD_EXECUTE "execute"
+
+// Adding a keyword may need a new multiplier, the static_assert below reports collisions
+#define KEYWORD_TABLE_SIZE 256
+#define KEYWORD_HASH_MULT 99u
+#define KEYWORD_MAX_LENGTH 9
+
+#define LEXER_WHITESPACE " \t\r\n"
+
+
+/** Keywords of the query language, KW_NONE for any other token */
+enum Keyword {
+    KW_NONE = 0,
+    KW_ADD, KW_DEC, KW_GEN, KW_INF, KW_SET, KW_GIVEN, KW_ATTR, KW_DEF, KW_LST, KW_ENT, KW_RM,
+    KW_EXIT, KW_AS, KW_REL, KW_FOR, KW_JOB, KW_PAIR, KW_SAMPLES, KW_NOREPLACE, KW_SEED, KW_CPT,
+    KW_LIMIT, KW_VAR, KW_STDDEV, KW_APPROX, KW_PCT, KW_TOP, KW_CACHE, KW_GROUP, KW_BY, KW_MC,
+    KW_PRECISION, KW_BUDGET, KW_NB, KW_CLASSIFY, KW_CUBE, KW_WATCH, KW_PREPARE, KW_EXECUTE
+};
+
+struct KeywordEntry {
+    const char* text;
+    size_t length;
+    Keyword keyword;
+};
+
+#define KEYWORD_ENTRY(text, keyword) { text, sizeof(text) - 1, keyword }
+
+constexpr KeywordEntry KEYWORDS[] = {
+    KEYWORD_ENTRY(STR_CMD_ADD, KW_ADD), KEYWORD_ENTRY(STR_CMD_DEC, KW_DEC),
+    KEYWORD_ENTRY(STR_CMD_GEN, KW_GEN), KEYWORD_ENTRY(STR_CMD_INF, KW_INF),
+    KEYWORD_ENTRY(STR_CMD_SET, KW_SET), KEYWORD_ENTRY(STR_CMD_GIV, KW_GIVEN),
+    KEYWORD_ENTRY(STR_CMD_ATR, KW_ATTR), KEYWORD_ENTRY(STR_CMD_DEF, KW_DEF),
+    KEYWORD_ENTRY(STR_CMD_LST, KW_LST), KEYWORD_ENTRY(STR_CMD_ENT, KW_ENT),
+    KEYWORD_ENTRY(STR_CMD_RM, KW_RM), KEYWORD_ENTRY(STR_CMD_EXIT, KW_EXIT),
+    KEYWORD_ENTRY(STR_CMD_AS, KW_AS), KEYWORD_ENTRY(STR_CMD_REL, KW_REL),
+    KEYWORD_ENTRY(STR_CMD_FOR, KW_FOR), KEYWORD_ENTRY(STR_CMD_JOB, KW_JOB),
+    KEYWORD_ENTRY(STR_CMD_PAIR, KW_PAIR), KEYWORD_ENTRY(STR_CMD_SAMPLES, KW_SAMPLES),
+    KEYWORD_ENTRY(STR_CMD_NOREPLACE, KW_NOREPLACE), KEYWORD_ENTRY(STR_CMD_SEED, KW_SEED),
+    KEYWORD_ENTRY(STR_CMD_CPT, KW_CPT), KEYWORD_ENTRY(STR_CMD_LIMIT, KW_LIMIT),
+    KEYWORD_ENTRY(STR_CMD_VAR, KW_VAR), KEYWORD_ENTRY(STR_CMD_STDDEV, KW_STDDEV),
+    KEYWORD_ENTRY(STR_CMD_APPROX, KW_APPROX), KEYWORD_ENTRY(STR_CMD_PCT, KW_PCT),
+    KEYWORD_ENTRY(STR_CMD_TOP, KW_TOP), KEYWORD_ENTRY(STR_CMD_CACHE, KW_CACHE),
+    KEYWORD_ENTRY(STR_CMD_GROUP, KW_GROUP), KEYWORD_ENTRY(STR_CMD_BY, KW_BY),
+    KEYWORD_ENTRY(STR_CMD_MC, KW_MC), KEYWORD_ENTRY(STR_CMD_PRECISION, KW_PRECISION),
+    KEYWORD_ENTRY(STR_CMD_BUDGET, KW_BUDGET), KEYWORD_ENTRY(STR_CMD_NB, KW_NB),
+    KEYWORD_ENTRY(STR_CMD_CLASSIFY, KW_CLASSIFY), KEYWORD_ENTRY(STR_CMD_CUBE, KW_CUBE),
+    KEYWORD_ENTRY(STR_CMD_WATCH, KW_WATCH), KEYWORD_ENTRY(STR_CMD_PREPARE, KW_PREPARE),
+    KEYWORD_ENTRY(STR_CMD_EXECUTE, KW_EXECUTE)
+};
+
+#define KEYWORD_COUNT (sizeof(KEYWORDS) / sizeof(KeywordEntry))
+
+/** Case insensitive hash of a keyword, folding letters to lower case by setting bit 5 */
+constexpr uint32_t keywordHash(const char* s, size_t n, uint32_t h) {
+    return n == 0 ? (h ^ (h >> 16)) :
+        keywordHash(s + 1, n - 1, h * KEYWORD_HASH_MULT + ((uint32_t)(unsigned char)*s | 0x20u));
+}
+
+constexpr uint32_t keywordSlot(const char* s, size_t n) {
+    return keywordHash(s, n, (uint32_t)n) % KEYWORD_TABLE_SIZE;
+}
+
+/** Keyword i takes a slot of its own among the keywords before it and fits KEYWORD_MAX_LENGTH */
+constexpr bool keywordSlotFree(size_t i, size_t j) {
+    return j >= i ? KEYWORDS[i].length <= KEYWORD_MAX_LENGTH :
+        keywordSlot(KEYWORDS[i].text, KEYWORDS[i].length) != keywordSlot(KEYWORDS[j].text, KEYWORDS[j].length) &&
+        keywordSlotFree(i, j + 1);
+}
+
+constexpr bool keywordsPerfect(size_t i) {
+    return i >= KEYWORD_COUNT || (keywordSlotFree(i, 0) && keywordsPerfect(i + 1));
+}
+
+static_assert(keywordsPerfect(0), "Keyword hash collides, choose another KEYWORD_HASH_MULT");
+
+
+/** A token of a statement, it refers into the statement and is only valid as long as it */
+struct Token {
+    const char* start;
+    size_t length;
+    Keyword keyword;
+
+    Token() : start(NULL), length(0), keyword(KW_NONE) {}
+    Token(const char* start, size_t length, Keyword keyword) : start(start), length(length), keyword(keyword) {}
+
+    std::string str() const { return std::string(this->start, this->length); }
+};
+
+
+class Lexer {
+
+    static const KeywordEntry** table();
+
+public:
+
+    static Keyword keyword(const char*, size_t);
+    static size_t scan(const std::string&, std::vector<Token>&);
+};
+
+/** Keyword table indexed by slot, empty slots are NULL */
+const KeywordEntry** Lexer::table() {
+    static const KeywordEntry* slots[KEYWORD_TABLE_SIZE] = {};
+    static bool built = [] {
+        for (size_t i = 0; i < KEYWORD_COUNT; i++)
+            slots[keywordSlot(KEYWORDS[i].text, KEYWORDS[i].length)] = &KEYWORDS[i];
+        return true;
+    }();
+    (void)built;
+    return slots;
+}
+
+/** Keyword of a token, KW_NONE if it is not one */
+Keyword Lexer::keyword(const char* s, size_t n) {
+    if (n == 0 || n > KEYWORD_MAX_LENGTH) return KW_NONE;
+    const KeywordEntry* entry = Lexer::table()[keywordSlot(s, n)];
+    if (entry == NULL || entry->length != n) return KW_NONE;
+    for (size_t i = 0; i < n; i++)
+        if ((s[i] | 0x20) != entry->text[i]) return KW_NONE;
+    return entry->keyword;
+}
+
+/**
+ *  Split a statement on whitespace, appending its tokens
+ *
+ *  @param statement    statement, must outlive the tokens
+ *  @param tokens       tokens found
+ *  @return             number of tokens found
+ */
+size_t Lexer::scan(const std::string& statement, std::vector<Token>& tokens) {
+    size_t count = 0, start, end = 0;
+    while ((start = statement.find_first_not_of(LEXER_WHITESPACE, end)) != std::string::npos) {
+        end = statement.find_first_of(LEXER_WHITESPACE, start);
+        if (end == std::string::npos) end = statement.length();
+        tokens.push_back(Token(statement.data() + start, end - start,
+            Lexer::keyword(statement.data() + start, end - start)));
+        count++;
+    }
+    return count;
+}
+
+#endif
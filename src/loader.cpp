@@ -0,0 +1,74 @@
+/*
+ *  loader.cpp
+ *
+ *  Bulk loads relations between two entities from a CSV or JSON lines file.
+ *
+ *      loader [-j] [-w workers] [-s snapshot] <left entity> <right entity> <file | ->
+ *
+ *  Created by Ryan Faulkner on 2015-12-28
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "loader.h"
+#include "emit.h"
+
+using namespace std;
+
+int usage(char* name) {
+    cout << "usage: " << name << " [-j] [-w workers] [-s snapshot] <left entity> <right entity> <file | ->" << endl;
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    int format = LOADER_FORMAT_CSV;
+    long workers = 0;
+    string snapshot;
+    vector<string> args;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0)
+            format = LOADER_FORMAT_JSONL;
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+            workers = atol(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            snapshot = argv[++i];
+        else
+            args.push_back(argv[i]);
+    }
+    if (args.size() != 3) return usage(argv[0]);
+
+    ifstream file;
+    if (args[2].compare("-") != 0) {
+        file.open(args[2].c_str());
+        if (!file.is_open()) {
+            emitCLIError(string("Could not open ") + args[2]);
+            return 1;
+        }
+    }
+
+    // Relations written before the pair catalog and the summaries existed need to be indexed, a
+    // snapshot is loaded into an empty database and built when it is next opened
+    IndexHandler ih;
+    if (snapshot.compare("") == 0) {
+        vector<string> built = ih.rebuildMissing();
+        for (vector<string>::iterator it = built.begin(); it != built.end(); ++it)
+            emitCLINote(string("Built ") + *it);
+    }
+    BulkLoader loader(ih, args[0], args[1], format, workers);
+    LoaderStats stats;
+    if (!loader.load(file.is_open() ? (istream&)file : cin, stats, snapshot)) {
+        emitCLIError(loader.error);
+        return 1;
+    }
+
+    for (vector<string>::iterator it = stats.errors.begin(); it != stats.errors.end(); ++it)
+        emitCLIWarning(*it);
+    emitCLINote(to_string(stats.rows) + string(" rows, ") + to_string(stats.loaded) + string(" loaded, ") +
+        to_string(stats.rejected) + string(" rejected, ") + to_string(stats.relations) + string(" relations written"));
+    emitCLINote(to_string((long)stats.rowsPerSecond()) + string(" rows/s over ") + to_string(stats.elapsed) + string(" ms"));
+    return stats.failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,437 @@
+/*
+ *  loader.h
+ *
+ *  Defines the bulk loader.  Rows of a CSV or JSON lines file name attributes of a pair of entities
+ *  and optionally a count, each row adding one relation.  The file is read in chunks, the rows of a
+ *  chunk are parsed and validated against the entity definitions on a work-stealing pool, each
+ *  worker summing the counts of repeated relations in its own partial, and the merged chunk is
+ *  written with pipelined reads and writes.  A loader may instead write a snapshot - a file of redis
+ *  commands for "redis-cli --pipe" - to build a database offline.
+ *
+ *  Created by Ryan Faulkner on 2015-12-28
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _loader_h
+#define _loader_h
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <fstream>
+#include <istream>
+#include <unordered_map>
+#include <json/json.h>
+
+#include "pool.h"
+#include "column_types.h"
+#include "index.h"
+
+#define LOADER_FORMAT_CSV 0
+#define LOADER_FORMAT_JSONL 1
+
+#define LOADER_CHUNK_ROWS 65536     // Rows parsed before the chunk is written
+#define LOADER_SLICE_ROWS 1024      // Rows per pool task
+#define LOADER_MAX_ERRORS 10        // Rejected rows reported
+#define LOADER_DELIMITER ','
+#define LOADER_QUOTE '"'
+#define LOADER_COL_COUNT "count"
+#define LOADER_COL_SEPARATOR "."
+
+#define LOADER_TARGET_LEFT 0
+#define LOADER_TARGET_RIGHT 1
+#define LOADER_TARGET_COUNT 2
+
+#define ERR_LOADER_SAME_ENTITY "Bulk loads need two different entities."
+#define ERR_LOADER_NO_ENTITY "Entity does not exist: "
+#define ERR_LOADER_COLUMN "Column is not an attribute of either entity: "
+#define ERR_LOADER_SNAPSHOT "Could not open snapshot: "
+#define ERR_LOADER_COUNT "Summed count of the relation is too large: "
+
+
+/** Attribute a column or key holds */
+struct LoaderColumn {
+    int target;
+    std::string attribute;
+    std::string type;
+
+    LoaderColumn() : target(LOADER_TARGET_COUNT) {}
+    LoaderColumn(int target, std::string attribute, std::string type) :
+        target(target), attribute(attribute), type(type) {}
+};
+
+/** Counts of a load */
+struct LoaderStats {
+    long rows;
+    long loaded;
+    long rejected;
+    long relations;         // relations written, once per chunk they appear in
+    long failed;            // distinct relations whose write failed
+    long elapsed;           // milliseconds
+    std::vector<std::string> errors;
+
+    LoaderStats() : rows(0), loaded(0), rejected(0), relations(0), failed(0), elapsed(0) {}
+
+    double rowsPerSecond() { return this->elapsed > 0 ? this->rows * 1000.0 / this->elapsed : (double)this->rows; }
+};
+
+/** Relations of a chunk by key with their summed counts, which may pass INT_MAX before they are written */
+typedef std::unordered_map<std::string, std::pair<Json::Value, long>> LoaderPartial;
+
+
+class BulkLoader {
+
+    IndexHandler* indexHandler;
+    std::string left;
+    std::string right;
+    int format;
+    long workers;
+
+    std::unordered_map<std::string, LoaderColumn> targets;     // "entity.attribute" and "count"
+    std::vector<LoaderColumn> columns;                          // CSV header in order
+
+    bool resolve();
+    bool readHeader(std::string&);
+    bool parseRow(const std::string&, Json::Reader&, Json::Value&, std::string&, int&, std::string&);
+    void parseSlice(std::vector<std::string>&, long, long, long, LoaderPartial&, LoaderStats&);
+    static bool overflows(LoaderPartial::iterator, LoaderStats&);
+    void writeChunk(LoaderPartial&, LoaderStats&);
+    void writeSnapshot(LoaderPartial&, std::ofstream&, LoaderStats&);
+
+public:
+
+    std::string error;
+
+    BulkLoader(IndexHandler&, std::string, std::string, int = LOADER_FORMAT_CSV, long = 0);
+
+    bool load(std::istream&, LoaderStats&, std::string = "");
+
+    static std::vector<std::string> splitCSV(const std::string&);
+    static void writeCommand(std::ostream&, std::vector<std::string>&);
+};
+
+/**
+ *  @param ih       index the entities are read from and the relations written to
+ *  @param left     first entity of every relation
+ *  @param right    second entity of every relation
+ *  @param format   LOADER_FORMAT_CSV, the first line naming the columns, or LOADER_FORMAT_JSONL
+ *  @param workers  pool size, 0 to size it to the machine
+ */
+BulkLoader::BulkLoader(IndexHandler& ih, std::string left, std::string right, int format, long workers) :
+    indexHandler(&ih), left(left), right(right), format(format), workers(workers) {}
+
+/** Map "entity.attribute" of both entities and the count to where their values go */
+bool BulkLoader::resolve() {
+    Json::Value json;
+    std::vector<std::string> entities, members;
+    entities.push_back(this->left);
+    entities.push_back(this->right);
+
+    if (this->left.compare(this->right) == 0) {
+        this->error = ERR_LOADER_SAME_ENTITY;
+        return false;
+    }
+    this->targets.clear();
+    this->targets[LOADER_COL_COUNT] = LoaderColumn(LOADER_TARGET_COUNT, "", COLTYPE_NAME_INT);
+    for (long i = 0; i < (long)entities.size(); i++) {
+        json = Json::Value();
+        if (!this->indexHandler->fetchEntity(entities[i], json)) {
+            this->error = std::string(ERR_LOADER_NO_ENTITY) + entities[i];
+            return false;
+        }
+        members = json[JSON_ATTR_ENT_FIELDS].getMemberNames();
+        for (std::vector<std::string>::iterator it = members.begin(); it != members.end(); ++it)
+            if (it->compare(JSON_ATTR_FIELDS_COUNT) != 0 && json[JSON_ATTR_ENT_FIELDS][*it].isString())
+                this->targets[entities[i] + LOADER_COL_SEPARATOR + *it] = LoaderColumn(
+                    i == 0 ? LOADER_TARGET_LEFT : LOADER_TARGET_RIGHT, *it, json[JSON_ATTR_ENT_FIELDS][*it].asString());
+    }
+    return true;
+}
+
+/** Columns of a CSV file from its first line, every column must be known */
+bool BulkLoader::readHeader(std::string& line) {
+    std::vector<std::string> names = BulkLoader::splitCSV(line);
+    this->columns.clear();
+    for (std::vector<std::string>::iterator it = names.begin(); it != names.end(); ++it) {
+        std::unordered_map<std::string, LoaderColumn>::iterator target = this->targets.find(*it);
+        if (target == this->targets.end()) {
+            this->error = std::string(ERR_LOADER_COLUMN) + *it;
+            return false;
+        }
+        this->columns.push_back(target->second);
+    }
+    return true;
+}
+
+/**
+ *  Parse one row into the json of its relation.  Empty CSV fields and null JSON values leave the
+ *  attribute out of the relation.
+ *
+ *  @param line         row
+ *  @param reader       reader owned by the calling worker
+ *  @param relation     relation of the row
+ *  @param key          index key of the relation
+ *  @param count        count of the row, 1 unless given
+ *  @param err          why the row was rejected
+ *  @return             false if the row is rejected
+ */
+bool BulkLoader::parseRow(const std::string& line, Json::Reader& reader, Json::Value& relation,
+        std::string& key, int& count, std::string& err) {
+    std::vector<std::pair<LoaderColumn*, std::string>> cells;
+    valpair leftValues, rightValues;
+    std::unordered_map<std::string, std::string> leftTypes, rightTypes;
+    std::string countValue("1");
+
+    if (this->format == LOADER_FORMAT_CSV) {
+        std::vector<std::string> fields = BulkLoader::splitCSV(line);
+        if (fields.size() != this->columns.size()) {
+            err = "wrong number of fields";
+            return false;
+        }
+        for (long i = 0; i < (long)fields.size(); i++)
+            if (fields[i].compare("") != 0)
+                cells.push_back(std::make_pair(&this->columns[i], fields[i]));
+    } else {
+        Json::Value row;
+        if (!reader.parse(line, row, false) || !row.isObject()) {
+            err = "not a JSON object";
+            return false;
+        }
+        std::vector<std::string> members = row.getMemberNames();
+        for (std::vector<std::string>::iterator it = members.begin(); it != members.end(); ++it) {
+            std::unordered_map<std::string, LoaderColumn>::iterator target = this->targets.find(*it);
+            if (target == this->targets.end()) {
+                err = std::string("unknown key ") + *it;
+                return false;
+            }
+            if (row[*it].isNull()) continue;
+            std::string value = row[*it].isString() ? row[*it].asString() : Json::FastWriter().write(row[*it]);
+            if (!row[*it].isString()) value.erase(value.length() - 1);     // newline of the writer
+            cells.push_back(std::make_pair(&target->second, value));
+        }
+    }
+
+    for (std::vector<std::pair<LoaderColumn*, std::string>>::iterator it = cells.begin(); it != cells.end(); ++it) {
+        LoaderColumn& column = *(it->first);
+        if (!validateType(column.type, it->second)) {
+            err = std::string("bad value for ") + (column.target == LOADER_TARGET_COUNT ?
+                std::string(LOADER_COL_COUNT) : column.attribute);
+            return false;
+        }
+        if (column.target == LOADER_TARGET_LEFT) {
+            leftValues.push_back(std::make_pair(column.attribute, it->second));
+            leftTypes[column.attribute] = column.type;
+        } else if (column.target == LOADER_TARGET_RIGHT) {
+            rightValues.push_back(std::make_pair(column.attribute, it->second));
+            rightTypes[column.attribute] = column.type;
+        } else
+            countValue = it->second;
+    }
+    long n = std::strtol(countValue.c_str(), NULL, 10);
+    if (n <= 0 || n > INT_MAX) {
+        err = "count out of range";
+        return false;
+    }
+    count = (int)n;
+
+    relation = Relation(this->left, this->right, leftValues, rightValues, leftTypes, rightTypes).toJson();
+    key = this->indexHandler->generateRelationKey(this->left, this->right,
+        this->indexHandler->generateRelationHash(relation));
+    return true;
+}
+
+/** Pool task - parse rows [begin, end) of a chunk into the partial of the worker */
+void BulkLoader::parseSlice(std::vector<std::string>& rows, long begin, long end, long firstLine,
+        LoaderPartial& partial, LoaderStats& stats) {
+    Json::Reader reader;
+    Json::Value relation;
+    std::string key, err;
+    int count;
+
+    for (long i = begin; i < end; i++) {
+        if (rows[i].find_first_not_of(" \t\r") == std::string::npos) continue;
+        stats.rows++;
+        if (!this->parseRow(rows[i], reader, relation, key, count, err)) {
+            stats.rejected++;
+            if ((long)stats.errors.size() < LOADER_MAX_ERRORS)
+                stats.errors.push_back(std::string("line ") + std::to_string(firstLine + i) + std::string(": ") + err);
+            continue;
+        }
+        stats.loaded++;
+        LoaderPartial::iterator it = partial.find(key);
+        if (it == partial.end())
+            partial.insert(std::make_pair(key, std::make_pair(relation, count)));
+        else
+            it->second.second += count;
+    }
+}
+
+/** Is the summed count of a relation past INT_MAX?  Such a relation is counted as failed. */
+bool BulkLoader::overflows(LoaderPartial::iterator it, LoaderStats& stats) {
+    if (it->second.second <= INT_MAX) return false;
+    stats.failed++;
+    if ((long)stats.errors.size() < LOADER_MAX_ERRORS)
+        stats.errors.push_back(std::string(ERR_LOADER_COUNT) + it->first);
+    return true;
+}
+
+/** Write the relations of a chunk, stored counts are added to.  Relations summed past INT_MAX fail. */
+void BulkLoader::writeChunk(LoaderPartial& chunk, LoaderStats& stats) {
+    std::vector<std::pair<Json::Value, int>> relations;
+    for (LoaderPartial::iterator it = chunk.begin(); it != chunk.end(); ++it) {
+        if (BulkLoader::overflows(it, stats)) continue;
+        relations.push_back(std::make_pair(it->second.first, (int)it->second.second));
+    }
+    std::vector<bool> written = this->indexHandler->writeRelations(relations);
+    for (std::vector<bool>::iterator it = written.begin(); it != written.end(); ++it)
+        if (*it) stats.relations++; else stats.failed++;
+}
+
+/**
+ *  Write the relations of a whole load as redis commands along with the relation total.  The
+ *  snapshot is meant for an empty database, the summaries kept by relation hooks are rebuilt by the
+ *  daemon when it starts on the loaded database.
+ */
+void BulkLoader::writeSnapshot(LoaderPartial& all, std::ofstream& out, LoaderStats& stats) {
+    std::vector<std::string> command;
+    long total = 0;
+    for (LoaderPartial::iterator it = all.begin(); it != all.end(); ++it) {
+        if (BulkLoader::overflows(it, stats)) continue;
+        it->second.first[JSON_ATTR_REL_COUNT] = (int)it->second.second;
+        command.clear();
+        command.push_back("SET");
+        command.push_back(it->first);
+        command.push_back(it->second.first.toStyledString());
+        BulkLoader::writeCommand(out, command);
+        total += it->second.second;
+        stats.relations++;
+    }
+    command.clear();
+    command.push_back("INCRBY");
+    command.push_back(KEY_TOTAL_RELATIONS);
+    command.push_back(std::to_string(total));
+    BulkLoader::writeCommand(out, command);
+}
+
+/**
+ *  Load every row of a stream
+ *
+ *  @param in           CSV or JSON lines rows
+ *  @param stats        counts of the load and the first rejected rows
+ *  @param snapshot     path of a snapshot to write instead of writing to the index, the relations
+ *                      of the whole load are then held in memory until the end
+ *  @return             false if the entities, the header or the snapshot are unusable
+ */
+bool BulkLoader::load(std::istream& in, LoaderStats& stats, std::string snapshot) {
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    std::vector<std::string> rows;
+    std::string line;
+    std::ofstream out;
+    LoaderPartial all;
+    long firstLine = 1;
+
+    if (!this->resolve()) return false;
+    if (this->format == LOADER_FORMAT_CSV) {
+        if (!std::getline(in, line) || !this->readHeader(line)) return false;
+        firstLine++;
+    }
+    if (snapshot.compare("") != 0) {
+        out.open(snapshot.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) {
+            this->error = std::string(ERR_LOADER_SNAPSHOT) + snapshot;
+            return false;
+        }
+    }
+
+    WorkStealingPool pool(this->workers);
+    std::vector<LoaderPartial> partials(pool.size());
+    std::vector<LoaderStats> workerStats(pool.size());
+
+    while (in.good()) {
+        rows.clear();
+        while ((long)rows.size() < LOADER_CHUNK_ROWS && std::getline(in, line))
+            rows.push_back(line);
+        if (rows.empty()) break;
+
+        for (long begin = 0; begin < (long)rows.size(); begin += LOADER_SLICE_ROWS) {
+            long end = std::min(begin + LOADER_SLICE_ROWS, (long)rows.size());
+            pool.submit([this, &rows, &partials, &workerStats, begin, end, firstLine](long worker) {
+                this->parseSlice(rows, begin, end, firstLine, partials[worker], workerStats[worker]);
+            });
+        }
+        pool.wait();
+        firstLine += rows.size();
+
+        // Merge the partials of the workers, into the whole load for a snapshot
+        LoaderPartial chunk;
+        LoaderPartial& merged = out.is_open() ? all : chunk;
+        for (std::vector<LoaderPartial>::iterator it = partials.begin(); it != partials.end(); ++it) {
+            for (LoaderPartial::iterator rel = it->begin(); rel != it->end(); ++rel) {
+                LoaderPartial::iterator found = merged.find(rel->first);
+                if (found == merged.end())
+                    merged.insert(*rel);
+                else
+                    found->second.second += rel->second.second;
+            }
+            it->clear();
+        }
+        if (!out.is_open())
+            this->writeChunk(chunk, stats);
+    }
+    if (out.is_open()) {
+        this->writeSnapshot(all, out, stats);
+        out.close();
+    }
+
+    for (std::vector<LoaderStats>::iterator it = workerStats.begin(); it != workerStats.end(); ++it) {
+        stats.rows += it->rows;
+        stats.loaded += it->loaded;
+        stats.rejected += it->rejected;
+        for (std::vector<std::string>::iterator err = it->errors.begin(); err != it->errors.end(); ++err)
+            if ((long)stats.errors.size() < LOADER_MAX_ERRORS) stats.errors.push_back(*err);
+    }
+    stats.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count();
+    return true;
+}
+
+/** Fields of a CSV line, fields may be quoted with quotes inside doubled */
+std::vector<std::string> BulkLoader::splitCSV(const std::string& line) {
+    std::vector<std::string> fields;
+    std::string field;
+    bool quoted = false;
+    size_t end = line.length();
+    if (end > 0 && line[end - 1] == '\r') end--;
+
+    for (size_t i = 0; i < end; i++) {
+        char c = line[i];
+        if (quoted) {
+            if (c == LOADER_QUOTE && i + 1 < end && line[i + 1] == LOADER_QUOTE) {
+                field += c;
+                i++;
+            } else if (c == LOADER_QUOTE)
+                quoted = false;
+            else
+                field += c;
+        } else if (c == LOADER_QUOTE)
+            quoted = true;
+        else if (c == LOADER_DELIMITER) {
+            fields.push_back(field);
+            field.clear();
+        } else
+            field += c;
+    }
+    fields.push_back(field);
+    return fields;
+}
+
+/** Write a command in the redis protocol */
+void BulkLoader::writeCommand(std::ostream& out, std::vector<std::string>& args) {
+    out << "*" << args.size() << "\r\n";
+    for (std::vector<std::string>::iterator it = args.begin(); it != args.end(); ++it)
+        out << "$" << it->length() << "\r\n" << *it << "\r\n";
+}
+
+#endif
@@ -209,6 +209,22 @@ public:
         return bucketStr;
     }
 
+    // Canonical string for the contents of the bucket - equal for buckets holding the same attributes
+    std::string signature() {
+        std::vector<std::string> items;
+        AttributeTuple at;
+        for (std::unordered_map<std::string, std::vector<std::string>>::iterator it = this->attrs.begin(); it != this->attrs.end(); ++it)
+            for (std::vector<std::string>::iterator it_in = it->second.begin(); it_in != it->second.end(); ++it_in) {
+                at.fromString(*it_in);
+                items.push_back(at.entity + std::string(".") + at.attribute + std::string("=") + at.value);
+            }
+        std::sort(items.begin(), items.end());
+        std::string sig;
+        for (std::vector<std::string>::iterator it = items.begin(); it != items.end(); ++it)
+            sig += *it + std::string(";");
+        return sig;
+    }
+
     void clearBucket() { attrs.clear(); }
 };
 
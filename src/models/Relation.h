@@ -13,6 +13,7 @@
 
 #include "model_def.h"
 #include "Entity.h"
+#include "../hooks.h"
 
 /**
  *  Models relations which consist of two entity and a variable number of
@@ -356,15 +357,18 @@ public:
     void write(RedisHandler& rds, bool overwriteCount=false) {
         std::string key = this->generateKey();
         int instance_count = 0;
+        int new_count;
         if (rds.exists(key))
             instance_count = this->getInstanceCount(rds);
         Json::Value jsonVal = this->toJson();
         if (overwriteCount)
-            jsonVal[JSON_ATTR_REL_COUNT] = this->instance_count;
+            new_count = this->instance_count;
         else    // Otherwise increment
-            jsonVal[JSON_ATTR_REL_COUNT] = instance_count + 1;
-        rds.incrementKey(KEY_TOTAL_RELATIONS, 1);
+            new_count = instance_count + 1;
+        jsonVal[JSON_ATTR_REL_COUNT] = new_count;
+        rds.incrementKey(KEY_TOTAL_RELATIONS, new_count - instance_count);
         rds.write(key, jsonVal.toStyledString());
+        applyRelationDelta(rds, key, jsonVal, instance_count, new_count);
     }
 
     bool decrementCount(RedisHandler& rds, int decVal) {
@@ -375,15 +379,13 @@ public:
             this->composeJSON(rds, json);
             this->fromJSON(json);
             // TODO - issue a warning if the decValue exceeds
+            // The global relation count is adjusted by remove/write
             if (decVal >= json[JSON_ATTR_REL_COUNT].asInt()) {
                 this->remove(rds);
-                rds.decrementKey(KEY_TOTAL_RELATIONS,
-                    json[JSON_ATTR_REL_COUNT].asInt());
             } else {
                 this->instance_count =
                     json[JSON_ATTR_REL_COUNT].asInt() - decVal;
                 this->write(rds, true);
-                rds.decrementKey(KEY_TOTAL_RELATIONS, decVal);
             }
             return true;
         }
@@ -393,8 +395,11 @@ public:
     bool remove(RedisHandler& rds) {
         std::string key = this->generateKey();
         if (rds.exists(key)) {
-            rds.decrementKey(KEY_TOTAL_RELATIONS, this->instance_count);
+            int instance_count = this->getInstanceCount(rds);
+            Json::Value jsonVal = this->toJson();
+            rds.decrementKey(KEY_TOTAL_RELATIONS, instance_count);
             rds.deleteKey(key);
+            applyRelationDelta(rds, key, jsonVal, instance_count, 0);
             return true;
         }
         return false;
@@ -17,6 +17,7 @@
 #include "../redis.h"
 
 #include <string>
+#include <algorithm>
 #include <unordered_map>
 #include <json/json.h>
 #include <boost/regex.hpp>
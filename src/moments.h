@@ -0,0 +1,188 @@
+/*
+ *  moments.h
+ *
+ *  Defines the moment accumulators kept for numeric entity attributes.  For each entity and
+ *  attribute the store keeps the instance count, sum and sum of squares of the attribute values
+ *  over all relations on the entity, so the mean and variance of an attribute are read in O(1).
+ *  A relation hook keeps the accumulators current for every write path.
+ *
+ *  Created by Ryan Faulkner on 2015-12-18
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _moments_h
+#define _moments_h
+
+#include <string>
+#include <vector>
+#include <cmath>
+#include <sstream>
+#include <json/json.h>
+
+#include "redis.h"
+#include "hooks.h"
+#include "column_types.h"
+#include "models/model_def.h"
+
+#define KEY_MOMENTS_PREFIX "moments"
+#define KEY_MOMENTS_DELIMETER "+"
+#define KEY_MOMENTS_BUILT "moments_built"
+
+#define MOMENT_FIELD_COUNT "count"
+#define MOMENT_FIELD_SUM "sum"
+#define MOMENT_FIELD_SUMSQ "sumsq"
+
+
+/**
+ *  Count, sum and sum of squares of a set of weighted values
+ */
+struct Moments {
+    long count;
+    double sum;
+    double sumsq;
+
+    Moments() : count(0), sum(0.0), sumsq(0.0) {}
+
+    void add(double value, long n) {
+        this->count += n;
+        this->sum += value * n;
+        this->sumsq += value * value * n;
+    }
+
+    /** Combine with the moments of another set of values */
+    void merge(const Moments& other) {
+        this->count += other.count;
+        this->sum += other.sum;
+        this->sumsq += other.sumsq;
+    }
+
+    /** Mean of the values, zero when no values were accumulated */
+    double mean() { return this->count > 0 ? this->sum / this->count : 0.0; }
+
+    /** Population variance, clamped at zero against rounding in the accumulated sums */
+    double variance() {
+        if (this->count <= 0) return 0.0;
+        double mean = this->mean();
+        double variance = this->sumsq / this->count - mean * mean;
+        return variance > 0.0 ? variance : 0.0;
+    }
+
+    double stddev() { return std::sqrt(this->variance()); }
+};
+
+
+/**
+ *  Interface to the moment accumulators.  The accumulators of an entity are one redis hash with the
+ *  fields "<attr>:count", "<attr>:sum" and "<attr>:sumsq".
+ */
+class MomentStore {
+
+    static std::string entityKey(std::string);
+    static std::string field(std::string, std::string);
+
+public:
+
+    static std::string formatValue(double);
+    static void apply(RedisHandler&, Json::Value&, long, bool = true);
+    static void relationHook(RedisHandler&, std::string, Json::Value&, int, int);
+    static void relationBatchHook(RedisHandler&, std::vector<RelationDelta>&);
+    static bool fetch(RedisHandler&, std::string, std::string, Moments&);
+    static void dropEntity(RedisHandler&, std::string);
+};
+
+/** Redis key of the accumulators of an entity */
+std::string MomentStore::entityKey(std::string entity) {
+    return std::string(KEY_MOMENTS_PREFIX) + KEY_MOMENTS_DELIMETER + entity;
+}
+
+/** Hash field of one accumulator of an attribute */
+std::string MomentStore::field(std::string attribute, std::string moment) {
+    return attribute + std::string(":") + moment;
+}
+
+/** Full precision decimal for HINCRBYFLOAT, std::to_string keeps only six places */
+std::string MomentStore::formatValue(double value) {
+    std::ostringstream out;
+    out.precision(17);
+    out << value;
+    return out.str();
+}
+
+/**
+ *  Add the numeric attribute values of a relation to the accumulators of its entities, weighted by
+ *  a change in instance count.  All updates for the relation are sent in one pipeline unless the
+ *  caller flushes it.
+ */
+void MomentStore::apply(RedisHandler& rds, Json::Value& relation, long delta, bool flush) {
+    const char* sides[2][2] = { { JSON_ATTR_REL_ENTL, JSON_ATTR_REL_FIELDSL },
+        { JSON_ATTR_REL_ENTR, JSON_ATTR_REL_FIELDSR } };
+    std::vector<std::string> members, args;
+    std::string key, type;
+    double value;
+    bool pending = false;
+
+    if (delta == 0) return;
+
+    for (int i = 0; i < 2; i++) {
+        Json::Value& fields = relation[sides[i][1]];
+        key = MomentStore::entityKey(relation[sides[i][0]].asString());
+        members = fields.getMemberNames();
+
+        for (std::vector<std::string>::iterator it = members.begin(); it != members.end(); ++it) {
+            type = fields.get(std::string("#") + *it, "").asString();
+            if (type.compare(COLTYPE_NAME_INT) != 0 && type.compare(COLTYPE_NAME_FLOAT) != 0) continue;
+            value = std::atof(fields[*it].asCString());
+
+            args.clear(); args.push_back("HINCRBY"); args.push_back(key);
+            args.push_back(MomentStore::field(*it, MOMENT_FIELD_COUNT)); args.push_back(std::to_string(delta));
+            rds.appendCommand(args);
+            args.clear(); args.push_back("HINCRBYFLOAT"); args.push_back(key);
+            args.push_back(MomentStore::field(*it, MOMENT_FIELD_SUM)); args.push_back(MomentStore::formatValue(value * delta));
+            rds.appendCommand(args);
+            args.clear(); args.push_back("HINCRBYFLOAT"); args.push_back(key);
+            args.push_back(MomentStore::field(*it, MOMENT_FIELD_SUMSQ)); args.push_back(MomentStore::formatValue(value * value * delta));
+            rds.appendCommand(args);
+            pending = true;
+        }
+    }
+
+    if (pending && flush) rds.flushPipeline();
+}
+
+/** Relation hook - applies the change in instance count to the accumulators */
+void MomentStore::relationHook(RedisHandler& rds, std::string key, Json::Value& relation, int oldCount, int newCount) {
+    MomentStore::apply(rds, relation, newCount - oldCount);
+}
+
+/** Batch relation hook - the updates of the chunk are sent in one pipeline */
+void MomentStore::relationBatchHook(RedisHandler& rds, std::vector<RelationDelta>& deltas) {
+    for (std::vector<RelationDelta>::iterator it = deltas.begin(); it != deltas.end(); ++it)
+        MomentStore::apply(rds, *(it->relation), it->newCount - it->oldCount, false);
+    rds.flushPipeline();
+}
+
+static bool momentHookRegistered = registerRelationHook(MomentStore::relationHook, MomentStore::relationBatchHook);
+
+/** Fetch the accumulators of an entity attribute, false if no relation carries the attribute */
+bool MomentStore::fetch(RedisHandler& rds, std::string entity, std::string attribute, Moments& moments) {
+    const char* fields[3] = { MOMENT_FIELD_COUNT, MOMENT_FIELD_SUM, MOMENT_FIELD_SUMSQ };
+    std::vector<std::string> args;
+    for (int i = 0; i < 3; i++) {
+        args.clear(); args.push_back("HGET"); args.push_back(MomentStore::entityKey(entity));
+        args.push_back(MomentStore::field(attribute, fields[i]));
+        rds.appendCommand(args);
+    }
+    std::vector<std::string> values = rds.flushPipeline();
+    if (values.size() != 3) return false;
+    moments.count = atol(values[0].c_str());
+    moments.sum = std::atof(values[1].c_str());
+    moments.sumsq = std::atof(values[2].c_str());
+    return moments.count > 0;
+}
+
+/** Remove the accumulators of an entity */
+void MomentStore::dropEntity(RedisHandler& rds, std::string entity) {
+    rds.deleteKey(MomentStore::entityKey(entity));
+}
+
+#endif
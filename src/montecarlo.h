@@ -0,0 +1,188 @@
+/*
+ *  montecarlo.h
+ *
+ *  Defines Monte Carlo estimation over draws along a chain of entities.  The alias tables of every
+ *  state reached are built once, then batches of draws run on a work-stealing pool.  Each worker
+ *  draws from its own random stream and accumulates into its own moments, which are only merged
+ *  between rounds.  Rounds continue until the standard error reaches the requested precision or
+ *  the time budget runs out.
+ *
+ *  Created by Ryan Faulkner on 2015-12-26
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _montecarlo_h
+#define _montecarlo_h
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <json/json.h>
+
+#include "pool.h"
+#include "random.h"
+#include "moments.h"
+#include "sampler.h"
+
+#define MC_BATCH_SIZE 4096          // Draws per task
+#define MC_ROUND_TASKS 4            // Tasks per worker between checks on the precision
+#define MC_MIN_DRAWS 16384          // Draws before the standard error is trusted
+#define MC_MAX_DRAWS 1000000000L
+#define MC_DEFAULT_BUDGET 1000      // Milliseconds
+#define MC_Z95 1.959964
+
+
+/**
+ *  A state reached along the chain.  Draws from a state pick one of its outcomes from the alias
+ *  table, "proceed" is the probability of drawing any outcome at all.  States on the first entity
+ *  have no outcomes and hold the value of the estimated attribute, if they carry it.
+ */
+struct MonteCarloNode {
+    AliasTable table;
+    std::vector<long> next;     // node reached by each outcome
+    double proceed;
+    bool terminal;              // state on the first entity
+    bool hasValue;
+    double value;
+
+    MonteCarloNode() : proceed(1.0), terminal(false), hasValue(false), value(0.0) {}
+};
+
+/** Estimate with its standard error and how it was reached */
+struct MonteCarloEstimate {
+    double value;
+    double error;
+    long draws;
+    long workers;
+    long elapsed;       // milliseconds
+    bool converged;     // reached the requested precision within the budget
+
+    MonteCarloEstimate() : value(0.0), error(0.0), draws(0), workers(0), elapsed(0),
+        converged(false) {}
+    Json::Value toJson(std::string);
+};
+
+/** Json form of the estimate with a 95% interval, "field" names the estimated quantity */
+Json::Value MonteCarloEstimate::toJson(std::string field) {
+    Json::Value json;
+    json[field] = this->value;
+    json["stderr"] = this->error;
+    json["lower"] = this->value - MC_Z95 * this->error;
+    json["upper"] = this->value + MC_Z95 * this->error;
+    json["confidence"] = 0.95;
+    json["draws"] = (Json::Int64)this->draws;
+    json["workers"] = (Json::Int64)this->workers;
+    json["elapsed_ms"] = (Json::Int64)this->elapsed;
+    json["converged"] = this->converged;
+    return json;
+}
+
+
+/**
+ *  Draws from the states of a chain, root first.  Value draws walk to the first entity and report
+ *  the attribute value there, indicator draws report whether the walk reached the first entity.
+ */
+class MonteCarlo {
+
+    std::vector<MonteCarloNode> nodes;
+    bool values;
+
+    bool draw(RandomStream&, double&);
+    void drawBatch(RandomStream&, Moments&, long);
+
+public:
+    MonteCarlo(std::vector<MonteCarloNode>& nodes, bool values) : nodes(nodes), values(values) {}
+
+    MonteCarloEstimate run(RandomStream&, double, long, long = 0);
+};
+
+/** Walk from the root, false if the draw yields no value */
+bool MonteCarlo::draw(RandomStream& rng, double& value) {
+    MonteCarloNode* node = &(this->nodes[0]);
+    long index;
+    double u1, u2;
+
+    while (!node->terminal) {
+        if (!this->values && rng.uniform() >= node->proceed) {
+            value = 0.0;
+            return true;
+        }
+        u1 = rng.uniform();
+        u2 = rng.uniform();
+        index = node->table.sample(u1, u2);
+        if (index < 0) return false;
+        node = &(this->nodes[node->next[index]]);
+    }
+
+    if (!this->values) {
+        value = 1.0;
+        return true;
+    }
+    value = node->value;
+    return node->hasValue;
+}
+
+/** Draw a batch, accumulating locally before adding to the moments of the worker */
+void MonteCarlo::drawBatch(RandomStream& rng, Moments& partial, long n) {
+    Moments local;
+    double value;
+    for (long i = 0; i < n; i++)
+        if (this->draw(rng, value))
+            local.add(value, 1);
+    partial.merge(local);
+}
+
+/**
+ *  Estimate the mean of the draws.  Each round queues MC_ROUND_TASKS batches per worker, batches
+ *  starting after the deadline are skipped.
+ *
+ *  @param rng          stream the worker streams are split from
+ *  @param precision    target standard error, 0 to run for the whole budget
+ *  @param budget       milliseconds
+ *  @param workers      pool size, 0 to size it to the machine
+ */
+MonteCarloEstimate MonteCarlo::run(RandomStream& rng, double precision, long budget, long workers) {
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    Clock::time_point deadline = start + std::chrono::milliseconds(budget);
+
+    WorkStealingPool pool(workers);
+    std::vector<RandomStream> streams;
+    std::vector<Moments> partials(pool.size());
+    for (long i = 0; i < pool.size(); i++)
+        streams.push_back(rng.split());
+
+    MonteCarloEstimate estimate;
+    estimate.workers = pool.size();
+    Moments total;
+
+    while (true) {
+        for (long i = 0; i < pool.size() * MC_ROUND_TASKS; i++)
+            pool.submit([this, &streams, &partials, deadline](long worker) {
+                if (Clock::now() >= deadline) return;
+                this->drawBatch(streams[worker], partials[worker], MC_BATCH_SIZE);
+            });
+        pool.wait();
+
+        total = Moments();
+        for (std::vector<Moments>::iterator it = partials.begin(); it != partials.end(); ++it)
+            total.merge(*it);
+        if (total.count == 0) break;
+
+        estimate.draws = total.count;
+        estimate.value = total.mean();
+        estimate.error = std::sqrt(total.variance() / total.count);
+        if (precision > 0.0 && total.count >= MC_MIN_DRAWS && estimate.error <= precision) {
+            estimate.converged = true;
+            break;
+        }
+        if (Clock::now() >= deadline || total.count >= MC_MAX_DRAWS) break;
+    }
+
+    estimate.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        Clock::now() - start).count();
+    return estimate;
+}
+
+#endif
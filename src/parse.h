@@ -16,27 +16,16 @@
 #include <sstream>
 #include <unordered_map>
 #include <algorithm>
+#include <mutex>
 #include <json/json.h>
 
 #include "column_types.h"
+#include "lexer.h"
+#include "context.h"
 #include "index.h"
 #include "bayes.h"
+#include "prepared.h"
 
-#define STR_CMD_ADD "add"
-#define STR_CMD_DEC "dec"
-#define STR_CMD_GEN "gen"
-#define STR_CMD_INF "inf"
-#define STR_CMD_SET "set"
-#define STR_CMD_GIV "given"
-#define STR_CMD_ATR "attr"
-#define STR_CMD_DEF "def"
-#define STR_CMD_LST "lst"
-#define STR_CMD_ENT "ent"
-#define STR_CMD_RM "rm"
-#define STR_CMD_EXIT "exit"
-#define STR_CMD_AS "as"
-#define STR_CMD_REL "rel"
-#define STR_CMD_FOR "for"
 
 #define BAD_INPUT "ERR: Bad input symbol"
 #define BAD_EOL "ERR: Bad end of line"
@@ -55,31 +44,78 @@
 #define ERR_MALFORMED_CMD "ERR: Malformed Command"
 #define ERR_RM_REL_CMD "ERR: Either relation not found or not successfully removed"
 #define ERR_RM_ENT_CMD "ERR: Either entity not found or not successfully removed"
+#define ERR_ENT_PENDING_RM "ERR: Entity removal is still in progress."
+#define ERR_JOB_NOT_EXISTS "ERR: Job not found."
 #define ERR_PARSE_ATTR "ERR: Could not parse entity-attribute"
 #define ERR_MAL_GEN "ERR: Malformed GEN command"
 #define ERR_MAL_INF "ERR: Malformed INF command"
+#define ERR_BAD_SAMPLES "ERR: Sample count must be a positive integer"
+#define ERR_BAD_SEED "ERR: Seed must be a non-negative integer"
+#define ERR_MAL_CPT "ERR: Malformed CPT command"
+#define ERR_BAD_CPT "ERR: Conditional tables need attributes on two distinct entities."
+#define ERR_BAD_LIMIT "ERR: Table limit must be a positive integer"
+#define ERR_CPT_NOT_EXISTS "ERR: Conditional table not found."
+#define ERR_BAD_PCT "ERR: Percentile must be a number from 0 to 100"
+#define ERR_BAD_TOP "ERR: Top value count must be a positive integer"
+#define ERR_BAD_GROUP "ERR: GROUP BY takes an attribute of the given entity"
+#define ERR_BAD_PRECISION "ERR: Precision must be a positive number"
+#define ERR_BAD_BUDGET "ERR: Budget must be a positive number of milliseconds"
+#define ERR_MAL_NB "ERR: Malformed NB command"
+#define ERR_BAD_NB "ERR: Classifiers need an attribute of one entity given another, distinct entity."
+#define ERR_NB_NOT_EXISTS "ERR: Classifier not found."
+#define ERR_MAL_CUBE "ERR: Malformed CUBE command"
+#define ERR_BAD_CUBE "ERR: Cubes need distinct attributes spanning two entities."
+#define ERR_CUBE_NOT_EXISTS "ERR: Cube not found."
+#define ERR_BAD_WATCH "ERR: Standing queries take a probability or expected value given one existing entity."
+#define ERR_WATCH_NOT_EXISTS "ERR: Standing query not found."
+#define ERR_MAL_PREPARE "ERR: Malformed PREPARE command"
+#define ERR_BAD_PREPARE "ERR: Only ADD REL, GEN and INF statements may be prepared."
+#define ERR_PREPARED_NOT_EXISTS "ERR: Prepared statement not found."
+#define ERR_PREPARED_STALE "ERR: Entities were redefined since the statement was prepared, prepare it again."
+#define ERR_BAD_BIND "ERR: Values do not match the placeholders of the prepared statement."
+#define ERR_BATCH_WRITE "ERR: Relation could not be written."
+
+// Batch mode
+#define BATCH_DELIMITERS ";\n"
+#define BATCH_MAX_PENDING 1000      // Queued relations written together at most
+#define JSON_ATTR_BATCH_STMT "statement"
+#define JSON_ATTR_BATCH_RESULT "result"
+#define JSON_ATTR_BATCH_ERROR "error"
 #define ERR_BAD_SET "ERR: Some or all relations could not be updated."
 
 #define WILDCARD_CHAR '*'
 #define CONVERT_TO_LOWER false
 
-// STATE REPRESENTATIONS
-
-#define STATE_START 0       // Start state
+// STATE REPRESENTATIONS - STATE_START is defined with the context
 
 #define STATE_ADD 10        // Add a new relation
 #define STATE_P0 11
 #define STATE_P1 12
 #define STATE_P2 13
 #define STATE_P3 14
+#define STATE_ADD_CPT 15    // Declare a conditional probability table
+#define STATE_ADD_NB 16     // Declare a naive Bayes classifier
+#define STATE_ADD_CUBE 17   // Declare an aggregate cube
+
+#define STATE_CPT_TARGET 20     // Process the target attribute of a table
+#define STATE_CPT_GIVEN 21      // Process the given attribute of a table
+#define STATE_CPT_MOD 22        // Process trailing modifiers, e.g. LIMIT n
+#define STATE_NB_TARGET 23      // Process the class attribute of a classifier
+#define STATE_NB_GIVEN 24       // Process the feature entity of a classifier
+#define STATE_NB_INSTANCE 25    // Process the instances to classify
+#define STATE_CUBE_ATTRS 26     // Process the attributes of a cube
+#define STATE_CUBE_MOD 27       // Process trailing modifiers, e.g. LIMIT n
+#define STATE_WATCH_ID 28       // Process the id of a standing query
 
 #define STATE_GEN 30        // Generate a sample entity or attribute
 #define STATE_INF 70        // Infer the expected value of an attribute
 #define STATE_GENINF_E1 31  // Process first entity
 #define STATE_GENINF_E2 32  // Process second entity
 #define STATE_GENINF_ATTR 33  // Process second entity
+#define STATE_GENINF_MOD 34  // Process trailing modifiers, e.g. SAMPLES n
 
 #define STATE_SET 80        // Generate an entity given others
+#define STATE_CLASSIFY 85   // Classify instances with a naive Bayes classifier
 
 #define STATE_DEF 40        // Describes entity definitions
 #define STATE_DEF_PROC 41
@@ -87,13 +123,31 @@
 #define STATE_LST 50        // Lists entities or relations
 #define STATE_LST_ENT 51        // Lists entities
 #define STATE_LST_REL 52        // Lists relations
+#define STATE_LST_JOB 53        // Lists progress of a background job
+#define STATE_LST_PAIR 54        // Lists entity pairs from the catalog
+#define STATE_LST_CPT 55        // Lists conditional tables
+#define STATE_LST_CACHE 56        // Reports the result cache
+#define STATE_LST_NB 57        // Lists naive Bayes classifiers
+#define STATE_LST_CUBE 58        // Lists aggregate cubes
+#define STATE_LST_WATCH 59        // Lists standing queries
 
 #define STATE_RM 60        // Remove elements
 #define STATE_RM_ENT 61        // Remove entities
 #define STATE_RM_REL 62        // Remove relations
+#define STATE_RM_CPT 63        // Remove conditional tables
+#define STATE_RM_NB 64        // Remove naive Bayes classifiers
+#define STATE_RM_CUBE 65        // Remove aggregate cubes
+#define STATE_RM_WATCH 66        // Remove standing queries
+#define STATE_RM_PREPARED 67        // Remove prepared statements
 
 #define STATE_DEC 90        // decrement relations elements
 
+#define STATE_PREPARE 91        // Prepare a statement
+#define STATE_PREPARE_NAME 92   // Process the name of a prepared statement
+#define STATE_PREPARE_AS 93     // Process AS, the statement follows
+#define STATE_EXECUTE 95        // Execute a prepared statement
+#define STATE_EXECUTE_VALUES 96     // Process the values bound to the placeholders
+
 #define STATE_FINISH 99     // Successful end state
 
 #define STATE_EXIT 100       // Terminate program
@@ -105,8 +159,8 @@ using namespace std;
  *  Implements an SLR parser. Valid Statements:
  *
  *      (1) ADD REL E1(x1=vx1[, x2=vx2, ..]) E2(y1=vy1[, y2=vy2, ..])
- *      (2) GEN E1[.A_E1] GIVEN E2 [ATTR Ai=Vi[, ...]]
- *      (3) INF E1.A_E1 GIVEN E2 [ATTR Ai=Vi[, ...]]
+ *      (2) GEN E1[.A_E1] GIVEN E2 [GIVEN E3 ...] [ATTR Ai=Vi[, ...]] [GROUP BY A_E2] [SAMPLES n [NOREPLACE]] [SEED s]
+ *      (3) INF E1[.A_E1] GIVEN E2 [GIVEN E3 ...] [ATTR Ai=Vi[, ...]] [GROUP BY A_E2|VAR|STDDEV|PCT p|TOP k|APPROX|MC [PRECISION e] [BUDGET ms]]
  *      (4) DEF E1[(x1_type-x1, x2_type-x2, ...)]
  *      (5) LST REL [E1 [E2]]
  *      (6) LST ENT [E1]*
@@ -114,77 +168,107 @@ using namespace std;
  *      (8) RM ENT [E1]*
  *      (9) SET E.A FOR E1(x1=vx1[, x2=vx2, ..]) E2(y1=vy1[, y2=vy2, ..]) AS V
  *      (10) DEC E1(x1=vx1[, x2=vx2, ..]) E2(y1=vy1[, y2=vy2, ..])
+ *      (11) LST JOB J
+ *      (12) LST PAIR E1 E2
+ *      (13) ADD CPT E1.A_E1 GIVEN E2.A_E2 [LIMIT n]
+ *      (14) LST CPT [E1.A_E1 GIVEN E2.A_E2]
+ *      (15) RM CPT E1.A_E1 GIVEN E2.A_E2
+ *      (16) LST CACHE
+ *      (17) ADD NB E1.A_E1 GIVEN E2
+ *      (18) LST NB [E1.A_E1 GIVEN E2]
+ *      (19) RM NB E1.A_E1 GIVEN E2
+ *      (20) CLASSIFY E1.A_E1 GIVEN E2 x1=vx1[,x2=vx2,..] [y1=vy1[,y2=vy2,..] ...]
+ *      (21) ADD CUBE E1.A1,E2.A2[,...] [LIMIT n]
+ *      (22) LST CUBE [E1.A1,E2.A2[,...]]
+ *      (23) RM CUBE E1.A1,E2.A2[,...]
+ *      (24) WATCH E1[.A_E1] GIVEN E2 [ATTR Ai=Vi[, ...]]
+ *      (25) LST WATCH [W]
+ *      (26) RM WATCH W
+ *      (27) PREPARE P AS [ADD REL ...|GEN ...|INF ...]
+ *      (28) EXECUTE P [v1 v2 ...]
+ *      (29) RM PREPARE P
  *
  *  (1) provides a facility for insertion into the system
  *  (2) generate a sample conditional on a set of constraints
- *  (3) infer an expected value for an attribute
+ *  (3) infer an expected value for an attribute, or without one the probability of E1 given E2
+ *  (2), (3) with further GIVEN entities query the chain E1 <- E2 <- E3 ..., ATTR filters the last
+ *  (2), (3) with GROUP BY answer once per value of an attribute of E2 from one scan
+ *  (3) with MC estimates from parallel draws until the standard error reaches PRECISION or BUDGET ms pass
  *  (4) define a new entity
  *  (5) list relations optionally dependent relational entities
  *  (6) list entities.  Either specify them or simply list all.
  *  (7) remove a relation
  *  (8) remove an entity
  *  (9) set an attribute value
+ *  (10) decrement the count for this relation
+ *  (11) report the progress of a background job, e.g. RM ENT cascades
+ *  (12) list entity pairs having relations with their relation counts
+ *  (13) declare a conditional probability table, kept current as relations are written
+ *  (14) list conditional tables or show the cells of one
+ *  (15) remove a conditional table
+ *  (16) report occupancy and hit rate of the query result cache
+ *  (17) declare a naive Bayes classifier predicting A_E1 from the attributes of E2
+ *  (18) list classifiers or show the classes and features of one
+ *  (19) remove a classifier
+ *  (20) classify a batch of E2 instances, one comma separated list of attribute values each
+ *  (21) declare an aggregate cube of instance counts over attributes of an entity pair
+ *  (22) list aggregate cubes or show the cells of one
+ *  (23) remove an aggregate cube
+ *  (24) register a standing INF query, its answer is kept current and published as it changes
+ *  (25) list standing queries or show the current answer of one
+ *  (26) remove a standing query
+ *  (27) parse and type check a statement once, "?" stands for an attribute value or the count of ADD REL
+ *  (28) execute a prepared statement binding one value to each "?" in order
+ *  (29) remove a prepared statement
+ *
+ *  Everything read from a statement is kept in a ParseContext, so one parser serves any number of
+ *  threads as long as each parses with a context of its own.
  */
 class Parser {
 
-    // Stores the number of symbols and the symbol index in the statement
-    int nSymbols;
-    int nSymbolIdx;
-
-    int state;
-    int macroState;
-
-    bool entityProcessed;
-    bool fieldsProcessed;
-    bool parsedIDWord;      // Flag indicating whether pending ID Syntax token has been seen
     bool debug;
 
-    bool error;
-    std::string errStr;
-    std::string rspStr;
-
-    // Define lists that store state of newly defined fields and values
-    defpair* currFields;
-    valpair* currValues;
-    valpair* bufferValues;
-    std::unordered_map<std::string, std::string>* currTypes;
-    std::unordered_map<std::string, std::string>* bufferTypes;
-
-    // Define internal state that stores entity handles
-    std::string currEntity;
-    std::string currValue;
-    std::string bufferEntity;
-
-    // Attribute values for internal state
-    std::string currAttrEntity;
-    std::string bufferAttrEntity;
-    std::string currAttribute;
-    std::string bufferAttribute;
-
     // Index interface pointer
     IndexHandler* indexHandler;
 
-    // Index interface pointer
+    // Bayes interface pointer - it guards its own caches and draws from a stream per thread
     Bayes* bayes;
 
+    // Prepared statements by name, kept across statements and shared by every thread
+    std::unordered_map<std::string, PreparedStatement> prepared;
+    std::mutex preparedLock;
+
+    // Context of the statement parsed by parse(string), for callers keeping the parser to one thread
+    ParseContext context;
+
     // Parse methods
-    void parseRelationPair(const std::string);
-    void parseEntitySymbol(const std::string);
-    void parseAttributeSymbol(const std::string, bool = false);
-    void parseFieldStatement(const string &source);
-    void parseEntityDefinitionField(const std::string);
-    void parseEntityAssignField(const std::string);
-    void parseCommaSeparatedList(const string&, const char = '=');
-    void parseGenForm(const std::string, const std::string);
-    void parseSet(const std::string);
-    void parseValue(const std::string);
-
-    void processGEN();
-    void processINF();
-    void processSET();
-    void processDEC(RedisHandler&);
-
-    void cleanup();
+    void parseRelationPair(ParseContext&, const Token&);
+    void parseEntitySymbol(ParseContext&, const Token&);
+    void parseAttributeSymbol(ParseContext&, const Token&, bool = false);
+    void parseFieldStatement(ParseContext&, const Token&);
+    void parseEntityDefinitionField(ParseContext&, const std::string&);
+    void parseEntityAssignField(ParseContext&, const std::string&);
+    void parseCommaSeparatedList(ParseContext&, const Token&, const char = '=');
+    void parseGenForm(ParseContext&, const Token&, const std::string&);
+    void parseGenModifier(ParseContext&, const Token&, const std::string&);
+    void parseCptForm(ParseContext&, const Token&);
+    void parseClassifierForm(ParseContext&, const Token&);
+    void parseCubeForm(ParseContext&, const Token&);
+    void parseSet(ParseContext&, const Token&);
+    void parseValue(ParseContext&, const Token&);
+
+    void processGEN(ParseContext&);
+    void processINF(ParseContext&);
+    void processCPT(ParseContext&);
+    void processNB(ParseContext&);
+    void processCUBE(ParseContext&);
+    void processWATCH(ParseContext&);
+    void processPREPARE(ParseContext&);
+    void processEXECUTE(ParseContext&, RedisHandler&);
+    void processStatement(ParseContext&, RedisHandler&);
+    void flushRelations(ParseContext&);
+    void processSET(ParseContext&);
+    void processDEC(ParseContext&);
 
 public:
     Parser();
@@ -194,10 +278,13 @@ public:
     void resetState();
 
     std::string parse(const string&);
-    std::string analyze(const string&);
+    std::string parse(const string&, ParseContext&);
+    std::string analyze(ParseContext&, const Token&);
+    Json::Value parseBatch(const string&);
 
     std::vector<std::string> tokenize(const std::string &source, const char delimiter = ' ');
     std::vector<std::string> &tokenize(const std::string &source, const char delimiter, std::vector<std::string> &elems);
+    std::vector<std::string> tokenize(const Token &source, const char delimiter);
 };
 
 
@@ -208,7 +295,6 @@ Parser::Parser() {
     this->debug = false;
     this->indexHandler = new IndexHandler();
     this->bayes = new Bayes();
-    this->resetState();
 }
 
 /**
@@ -230,71 +316,67 @@ void Parser::setDebug(bool debugVal) {
  * Resets the parser state
  */
 void Parser::resetState() {
-    this->state = STATE_START;
-    this->error = false;
-    this->errStr = "";
-    this->rspStr = "";
-    this->currFields = NULL;
-    this->currValues = NULL;
-    this->bufferValues = NULL;
-    this->currTypes = NULL;
-    this->bufferTypes = NULL;
-    this->fieldsProcessed = false;
-    this->entityProcessed = false;
-    this->parsedIDWord = false;
-    this->currEntity = "";
-    this->currAttribute = "";
-    this->currValue = "";
-    this->bufferEntity = "";
-    this->bufferAttribute = "";
+    this->context.reset();
 }
 
 /**
- *  Parse loop, calls analyzer
+ *  Parse a statement in the context kept by the parser, see parse(string, ParseContext)
  */
 std::string Parser::parse(const string& s) {
+    return this->parse(s, this->context);
+}
+
+/**
+ *  Parse loop, calls analyzer on each token of the statement.  Any number of threads may parse at
+ *  once as long as each passes its own context.
+ *
+ *  @param s        statement
+ *  @param ctx      context of the statement, reset() it between statements
+ *  @return         response of the statement or the error
+ */
+std::string Parser::parse(const string& s, ParseContext& ctx) {
 
-    vector<string> tokensPre = this->tokenize(s);
-    vector<string> tokens;
+    std::vector<Token> tokens;
     std::string result;
 
-    this->state = STATE_START;      // Initialize state
-    this->error = false;            // Initialize error condition
-    this->errStr = "";              // Initialize error message
+    ctx.state = STATE_START;      // Initialize state
+    ctx.error = false;            // Initialize error condition
+    ctx.errStr = "";              // Initialize error message
 
-    // strip out whitespace tokens
-    for (std::vector<string>::iterator it = tokensPre.begin();
-            it != tokensPre.end(); ++it)
-        if (it->compare("") != 0)
-            tokens.push_back(*it);
+    // Tokens refer into the statement, whitespace is skipped
+    Lexer::scan(s, tokens);
 
-    this->nSymbols = tokens.size();
-    this->nSymbolIdx = 0;
+    ctx.nSymbols = tokens.size();
+    ctx.nSymbolIdx = 0;
 
     // Process command tokens
-    for (std::vector<string>::iterator it = tokens.begin();
+    for (std::vector<Token>::iterator it = tokens.begin();
             it != tokens.end(); ++it) {
-        this->nSymbolIdx++;
+        ctx.nSymbolIdx++;
         if (this->debug)
-            emitCLINote(std::string("Processing input token: ") + *it);
-        result = this->analyze(*it);
+            emitCLINote(std::string("Processing input token: ") + it->str());
+        result = this->analyze(ctx, *it);
 
         // Handle Errors detected during statement parse
-        if (this->error) {
-            emitCLIError(this->errStr);
-            return this->errStr;
+        if (ctx.error) {
+            ctx.cleanup();
+            emitCLIError(ctx.errStr);
+            return ctx.errStr;
         }
     }
 
-    if (this->state == STATE_EXIT)
+    if (ctx.state == STATE_EXIT) {
+        this->flushRelations(ctx);
+        IndexHandler::waitForJobs();    // Cascades of removed entities would be cut short
         exit(0);
+    }
 
     // If the input was not interpreted to any meaningful command
-    if (this->state == STATE_START && tokens.size() > 0) {
+    if (ctx.state == STATE_START && tokens.size() > 0) {
         emitCLIError(std::string(ERR_UNKNOWN_CMD));
         return ERR_UNKNOWN_CMD;
-    } else if (this->state != STATE_FINISH &&
-        tokens.size() > this->nSymbolIdx) {
+    } else if (ctx.state != STATE_FINISH &&
+        tokens.size() > ctx.nSymbolIdx) {
         emitCLIError(std::string(ERR_MALFORMED_CMD));
         return ERR_MALFORMED_CMD;
     }
@@ -304,289 +386,556 @@ std::string Parser::parse(const string& s) {
 
 
 /**
- * Lexical analyzer and state interpreter (FSM mealy model)
+ *  Run a batch of statements separated by ';' or new lines.  Adjacent ADD REL statements are
+ *  queued and written together, repeats of a relation coalesced, and the queue is written before
+ *  any other statement runs.  Entity definitions are read once for the whole batch.  The batch
+ *  runs in a context of its own so batches may run on several threads at once.
+ *
+ *  @param script   statements
+ *  @return         one result per statement with its response and whether it failed
  */
-std::string Parser::analyze(const std::string& s) {
+Json::Value Parser::parseBatch(const string& script) {
+    std::string statement;
+    size_t start = 0, end;
+    Json::Value result;
+    ParseContext ctx;
+    BatchState batch;
+
+    ctx.batch = &batch;
+    this->indexHandler->cacheEntities(true);
+
+    while (start < script.length()) {
+        end = script.find_first_of(BATCH_DELIMITERS, start);
+        if (end == std::string::npos) end = script.length();
+        statement = script.substr(start, end - start);
+        start = end + 1;
+        if (statement.find_first_not_of(LEXER_WHITESPACE) == std::string::npos) continue;
+
+        ctx.reset();
+        result = Json::Value();
+        result[JSON_ATTR_BATCH_RESULT] = this->parse(statement, ctx);
+        result[JSON_ATTR_BATCH_STMT] = statement;
+        result[JSON_ATTR_BATCH_ERROR] = ctx.error;
+        batch.results.append(result);
+        if (batch.pendingRelations.size() >= BATCH_MAX_PENDING)
+            this->flushRelations(ctx);
+    }
+    this->flushRelations(ctx);
 
-    // lowercase copy of token
-    std::string sLower = s;
-    std::transform(sLower.begin(), sLower.end(), sLower.begin(), ::tolower);
+    this->indexHandler->cacheEntities(false);
+    return batch.results;
+}
+
+/**
+ *  Write the relations queued by the batch of a statement, marking the statements whose relation failed
+ */
+void Parser::flushRelations(ParseContext& ctx) {
+    if (ctx.batch == NULL || ctx.batch->pendingRelations.empty()) return;
+    BatchState& batch = *(ctx.batch);
+    std::vector<bool> written = this->indexHandler->writeRelations(batch.pendingRelations);
+    for (size_t i = 0; i < written.size(); i++)
+        if (!written[i]) {
+            Json::Value& result = batch.results[batch.pendingResults[i]];
+            result[JSON_ATTR_BATCH_RESULT] = ERR_BATCH_WRITE;
+            result[JSON_ATTR_BATCH_ERROR] = true;
+            emitCLIError(std::string(ERR_BATCH_WRITE) + std::string(" -> ") + result[JSON_ATTR_BATCH_STMT].asString());
+        }
+    batch.pendingRelations.clear();
+    batch.pendingResults.clear();
+}
+
+
+/**
+ * State interpreter (FSM mealy model), keywords are dispatched on the keyword of the token
+ */
+std::string Parser::analyze(ParseContext& ctx, const Token& token) {
+
+    ctx.keyword = token.keyword;
 
     if (this->debug)
-        emitCLINote(std::string("Current state: ") + std::to_string(this->state));
-
-    if (this->state == STATE_START) {
-
-        if (sLower.compare(STR_CMD_ADD) == 0) {
-            this->state = STATE_ADD;
-            this->macroState = STATE_ADD;
-        } else if (sLower.compare(STR_CMD_GEN) == 0) {
-            this->state = STATE_GENINF_E1;
-            this->macroState = STATE_GEN;
-        } else if (sLower.compare(STR_CMD_INF) == 0) {
-            this->state = STATE_GENINF_E1;
-            this->macroState = STATE_INF;
-        } else if (sLower.compare(STR_CMD_DEF) == 0) {
-            this->state = STATE_DEF;
-            this->macroState = STATE_DEF;
-        } else if (sLower.compare(STR_CMD_LST) == 0) {
-            this->state = STATE_LST;
-            this->macroState = STATE_LST;
-        } else if (sLower.compare(STR_CMD_EXIT) == 0) {
-            this->state = STATE_EXIT;
-        } else if (sLower.compare(STR_CMD_RM) == 0) {
-            this->state = STATE_RM;
-            this->macroState = STATE_RM;
-        } else if (sLower.compare(STR_CMD_SET) == 0) {
-            this->state = STATE_SET;
-            this->macroState = STATE_SET;
-        } else if (sLower.compare(STR_CMD_DEC) == 0) {
-            this->state = STATE_P1;
-            this->macroState = STATE_DEC;
+        emitCLINote(std::string("Current state: ") + std::to_string(ctx.state));
+
+    if (ctx.state == STATE_START) {
+
+        // Only the statements a plan can hold follow PREPARE P AS
+        if (ctx.preparing && ctx.keyword != KW_ADD && ctx.keyword != KW_GEN && ctx.keyword != KW_INF) {
+            ctx.error = true;
+            ctx.errStr = ERR_BAD_PREPARE;
+            return ctx.rspStr;
+        }
+
+        switch (ctx.keyword) {
+            case KW_ADD:
+                ctx.state = STATE_ADD;
+                ctx.macroState = STATE_ADD;
+                break;
+            case KW_GEN:
+                ctx.state = STATE_GENINF_E1;
+                ctx.macroState = STATE_GEN;
+                break;
+            case KW_INF:
+                ctx.state = STATE_GENINF_E1;
+                ctx.macroState = STATE_INF;
+                break;
+            case KW_DEF:
+                ctx.state = STATE_DEF;
+                ctx.macroState = STATE_DEF;
+                break;
+            case KW_LST:
+                ctx.state = STATE_LST;
+                ctx.macroState = STATE_LST;
+                break;
+            case KW_EXIT:
+                ctx.state = STATE_EXIT;
+                break;
+            case KW_RM:
+                ctx.state = STATE_RM;
+                ctx.macroState = STATE_RM;
+                break;
+            case KW_SET:
+                ctx.state = STATE_SET;
+                ctx.macroState = STATE_SET;
+                break;
+            case KW_DEC:
+                ctx.state = STATE_P1;
+                ctx.macroState = STATE_DEC;
+                break;
+            case KW_WATCH:
+                ctx.state = STATE_GENINF_E1;
+                ctx.macroState = STATE_INF;
+                ctx.watching = true;
+                break;
+            case KW_CLASSIFY:
+                ctx.state = STATE_NB_TARGET;
+                ctx.macroState = STATE_CLASSIFY;
+                break;
+            case KW_PREPARE:
+                ctx.state = STATE_PREPARE_NAME;
+                ctx.macroState = STATE_PREPARE;
+                break;
+            case KW_EXECUTE:
+                ctx.state = STATE_PREPARE_NAME;
+                ctx.macroState = STATE_EXECUTE;
+                break;
+            default:
+                break;
         }
 
         if (this->debug)
-            emitCLINote(std::string("Setting Macro state: ") + std::to_string(this->macroState));
+            emitCLINote(std::string("Setting Macro state: ") + std::to_string(ctx.macroState));
 
-    } else if (this->state == STATE_ADD) {
-        if (sLower.compare(STR_CMD_REL) == 0)
-            this->state = STATE_P1;
-        else {
-            this->error = true;
-            this->errStr = BAD_INPUT;
-            return this->rspStr;
+    } else if (ctx.state == STATE_ADD) {
+        switch (ctx.keyword) {
+            case KW_REL:
+                ctx.state = STATE_P1;
+                break;
+            case KW_CPT:
+                ctx.macroState = STATE_ADD_CPT;
+                ctx.state = STATE_CPT_TARGET;
+                break;
+            case KW_NB:
+                ctx.macroState = STATE_ADD_NB;
+                ctx.state = STATE_NB_TARGET;
+                break;
+            case KW_CUBE:
+                ctx.macroState = STATE_ADD_CUBE;
+                ctx.state = STATE_CUBE_ATTRS;
+                break;
+            default:
+                ctx.error = true;
+                ctx.errStr = BAD_INPUT;
+                return ctx.rspStr;
         }
 
-    } else if (this->state == STATE_RM) {   // Branch to parse "RM" commands
-        if (sLower.compare(STR_CMD_REL) == 0) {
-            this->macroState = STATE_RM_REL;
-            this->state = STATE_P1;
-        } else {
-            this->state = STATE_RM_ENT;
+    } else if (ctx.state == STATE_RM) {   // Branch to parse "RM" commands
+        switch (ctx.keyword) {
+            case KW_REL:
+                ctx.macroState = STATE_RM_REL;
+                ctx.state = STATE_P1;
+                break;
+            case KW_CPT:
+                ctx.macroState = STATE_RM_CPT;
+                ctx.state = STATE_CPT_TARGET;
+                break;
+            case KW_NB:
+                ctx.macroState = STATE_RM_NB;
+                ctx.state = STATE_NB_TARGET;
+                break;
+            case KW_CUBE:
+                ctx.macroState = STATE_RM_CUBE;
+                ctx.state = STATE_CUBE_ATTRS;
+                break;
+            case KW_WATCH:
+                ctx.macroState = STATE_RM_WATCH;
+                ctx.state = STATE_WATCH_ID;
+                break;
+            case KW_PREPARE:
+                ctx.macroState = STATE_RM_PREPARED;
+                ctx.state = STATE_PREPARE_NAME;
+                break;
+            default:
+                ctx.state = STATE_RM_ENT;
         }
 
-    } else if (this->state == STATE_RM_ENT) {   // Branch to parse "RM ENT" commands
-        this->parseEntitySymbol(s);
-        this->state = STATE_FINISH;
+    } else if (ctx.state == STATE_CPT_TARGET || ctx.state == STATE_CPT_GIVEN ||
+            ctx.state == STATE_CPT_MOD) {     // Branch to parse "ADD/LST/RM CPT" commands
+        this->parseCptForm(ctx, token);
+
+    } else if (ctx.state == STATE_NB_TARGET || ctx.state == STATE_NB_GIVEN ||
+            ctx.state == STATE_NB_INSTANCE) {     // Branch to parse "ADD/LST/RM NB" and "CLASSIFY" commands
+        this->parseClassifierForm(ctx, token);
 
-    } else if (this->macroState == STATE_RM_REL &&
-            (this->state == STATE_P1 || this->state == STATE_P2)) {
-        this->parseRelationPair(s);
+    } else if (ctx.state == STATE_CUBE_ATTRS || ctx.state == STATE_CUBE_MOD) {
+        this->parseCubeForm(ctx, token);     // Branch to parse "ADD/LST/RM CUBE" commands
 
-    } else if (this->macroState == STATE_ADD &&
-            (this->state == STATE_P1 || this->state == STATE_P2 ||
-            this->state == STATE_P3)) {
-        this->parseRelationPair(s);
+    } else if (ctx.state == STATE_RM_ENT) {   // Branch to parse "RM ENT" commands
+        this->parseEntitySymbol(ctx, token);
+        ctx.state = STATE_FINISH;
 
-    } else if (this->macroState == STATE_DEC &&
-            (this->state == STATE_P1 || this->state == STATE_P2 ||
-            this->state == STATE_P3)) {
-        this->parseRelationPair(s);
+    } else if (ctx.macroState == STATE_RM_REL &&
+            (ctx.state == STATE_P1 || ctx.state == STATE_P2)) {
+        this->parseRelationPair(ctx, token);
 
-    } else if (this->macroState == STATE_GEN) {
-        this->parseGenForm(s, ERR_MAL_GEN);
+    } else if (ctx.macroState == STATE_ADD &&
+            (ctx.state == STATE_P1 || ctx.state == STATE_P2 ||
+            ctx.state == STATE_P3)) {
+        this->parseRelationPair(ctx, token);
 
-    } else if (this->macroState == STATE_INF) {
-        this->parseGenForm(s, ERR_MAL_INF);
+    } else if (ctx.macroState == STATE_DEC &&
+            (ctx.state == STATE_P1 || ctx.state == STATE_P2 ||
+            ctx.state == STATE_P3)) {
+        this->parseRelationPair(ctx, token);
 
-    } else if (this->state == STATE_DEF) {  // DEFINING new entities
+    } else if (ctx.macroState == STATE_GEN) {
+        this->parseGenForm(ctx, token, ERR_MAL_GEN);
 
-        this->currFields = new vector<std::pair<ColumnBase*, std::string>>;
-        this->state == STATE_DEF_PROC;
-        this->parseEntitySymbol(s);
+    } else if (ctx.macroState == STATE_INF) {
+        this->parseGenForm(ctx, token, ERR_MAL_INF);
+
+    } else if (ctx.state == STATE_DEF) {  // DEFINING new entities
+
+        ctx.state == STATE_DEF_PROC;
+        this->parseEntitySymbol(ctx, token);
 
         // Validate that entity is alpha-numeric
         boost::regex e("^[a-zA-Z0-9]*$");
-        if (!boost::regex_match(this->currEntity.c_str(), e)) {
-            this->error = true;
-            this->errStr = ERR_ENT_EXISTS;
-            return this->rspStr;
+        if (!boost::regex_match(ctx.currEntity.c_str(), e)) {
+            ctx.error = true;
+            ctx.errStr = ERR_ENT_EXISTS;
+            return ctx.rspStr;
         }
 
         // Ensure this entity has not already been defined
-        if (this->indexHandler->existsEntity(this->currEntity)) {
-            this->error = true;
-            this->errStr = ERR_ENT_EXISTS;
-            return this->rspStr;
+        if (this->indexHandler->existsEntity(ctx.currEntity)) {
+            ctx.error = true;
+            ctx.errStr = ERR_ENT_EXISTS;
+            return ctx.rspStr;
         }
 
-        if (this->fieldsProcessed)
-            this->state = STATE_FINISH;
-
-    } else if (this->state == STATE_DEF_PROC) {
-        this->parseFieldStatement(s);
-        if (this->fieldsProcessed)
-            this->state = STATE_FINISH;
-
-    } else if (this->state == STATE_LST) {
-        if (sLower.compare(STR_CMD_REL) == 0) {
-            this->macroState = STATE_LST_REL;
-            this->state = STATE_P1;
-        } else if (sLower.compare(STR_CMD_ENT) == 0)
-            this->state = STATE_LST_ENT;
+        // Relations of a removed entity with this name may still be in the process of being cleared
+        if (this->indexHandler->isTombstoned(ctx.currEntity)) {
+            ctx.error = true;
+            ctx.errStr = ERR_ENT_PENDING_RM;
+            return ctx.rspStr;
+        }
 
-    } else if (this->state == STATE_LST_ENT) {
+        if (ctx.fieldsProcessed)
+            ctx.state = STATE_FINISH;
 
-        this->macroState = STATE_LST_ENT;
-        this->parseEntitySymbol(s);
-        this->state = STATE_FINISH;
+    } else if (ctx.state == STATE_DEF_PROC) {
+        this->parseFieldStatement(ctx, token);
+        if (ctx.fieldsProcessed)
+            ctx.state = STATE_FINISH;
 
-    } else if (this->macroState == STATE_LST_REL && (this->state == STATE_P1 || this->state == STATE_P2)) {
-        this->parseRelationPair(s);
+    } else if (ctx.state == STATE_LST) {
+        switch (ctx.keyword) {
+            case KW_REL:
+                ctx.macroState = STATE_LST_REL;
+                ctx.state = STATE_P1;
+                break;
+            case KW_ENT:
+                ctx.state = STATE_LST_ENT;
+                break;
+            case KW_JOB:
+                ctx.state = STATE_LST_JOB;
+                break;
+            case KW_PAIR:
+                ctx.macroState = STATE_LST_PAIR;
+                ctx.state = STATE_P1;
+                break;
+            case KW_CPT:
+                // Without a table all tables are listed
+                ctx.macroState = STATE_LST_CPT;
+                ctx.state = ctx.nSymbolIdx == ctx.nSymbols ? STATE_FINISH : STATE_CPT_TARGET;
+                break;
+            case KW_CACHE:
+                ctx.macroState = STATE_LST_CACHE;
+                ctx.state = STATE_FINISH;
+                break;
+            case KW_NB:
+                // Without a classifier all classifiers are listed
+                ctx.macroState = STATE_LST_NB;
+                ctx.state = ctx.nSymbolIdx == ctx.nSymbols ? STATE_FINISH : STATE_NB_TARGET;
+                break;
+            case KW_CUBE:
+                // Without a cube all cubes are listed
+                ctx.macroState = STATE_LST_CUBE;
+                ctx.state = ctx.nSymbolIdx == ctx.nSymbols ? STATE_FINISH : STATE_CUBE_ATTRS;
+                break;
+            case KW_WATCH:
+                // Without an id all standing queries are listed
+                ctx.macroState = STATE_LST_WATCH;
+                ctx.state = ctx.nSymbolIdx == ctx.nSymbols ? STATE_FINISH : STATE_WATCH_ID;
+                break;
+            default:
+                break;
+        }
 
-    } else if (this->macroState == STATE_SET) {
-        if (this->state == STATE_SET)
-            this->state = STATE_P0;
-        this->parseSet(s);
+    } else if (ctx.state == STATE_PREPARE_NAME) {
+        ctx.preparedName = token.str();
+        if (ctx.macroState == STATE_PREPARE)
+            ctx.state = STATE_PREPARE_AS;
+        else if (ctx.macroState == STATE_EXECUTE)
+            ctx.state = ctx.nSymbolIdx == ctx.nSymbols ? STATE_FINISH : STATE_EXECUTE_VALUES;
+        else
+            ctx.state = STATE_FINISH;
 
-    } else if (this->state == STATE_FINISH) {  // Ensure processing is complete - no symbols should be left at this point
-        this->error = true;
-        this->errStr = BAD_EOL;
-        return this->rspStr;
+    } else if (ctx.state == STATE_PREPARE_AS) {
+        if (ctx.keyword != KW_AS || ctx.nSymbolIdx == ctx.nSymbols) {
+            ctx.error = true;
+            ctx.errStr = ERR_MAL_PREPARE;
+            return ctx.rspStr;
+        }
+        // The statement is parsed as usual from here, the tokens refer into its text
+        ctx.preparedText = std::string(token.start + token.length);
+        ctx.preparedText.erase(0, ctx.preparedText.find_first_not_of(LEXER_WHITESPACE));
+        ctx.preparing = true;
+        ctx.state = STATE_START;
+
+    } else if (ctx.state == STATE_EXECUTE_VALUES) {
+        ctx.executeValues.push_back(token.str());
+        if (ctx.nSymbolIdx == ctx.nSymbols)
+            ctx.state = STATE_FINISH;
+
+    } else if (ctx.state == STATE_WATCH_ID) {
+        ctx.currValue = token.str();
+        ctx.state = STATE_FINISH;
+
+    } else if (ctx.state == STATE_LST_JOB) {
+        ctx.macroState = STATE_LST_JOB;
+        ctx.currValue = token.str();
+        ctx.state = STATE_FINISH;
+
+    } else if (ctx.state == STATE_LST_ENT) {
+
+        ctx.macroState = STATE_LST_ENT;
+        this->parseEntitySymbol(ctx, token);
+        ctx.state = STATE_FINISH;
+
+    } else if ((ctx.macroState == STATE_LST_REL || ctx.macroState == STATE_LST_PAIR) &&
+            (ctx.state == STATE_P1 || ctx.state == STATE_P2)) {
+        this->parseRelationPair(ctx, token);
+
+    } else if (ctx.macroState == STATE_SET) {
+        if (ctx.state == STATE_SET)
+            ctx.state = STATE_P0;
+        this->parseSet(ctx, token);
+
+    } else if (ctx.state == STATE_FINISH) {  // Ensure processing is complete - no symbols should be left at this point
+        ctx.error = true;
+        ctx.errStr = BAD_EOL;
+        return ctx.rspStr;
     }
 
     // Post processing if command complete
-    if (this->state == STATE_FINISH) {
+    if (ctx.state == STATE_FINISH) {
 
-        RedisHandler redis = RedisHandler(REDISHOST, REDISPORT);
+        RedisHandler redis(REDISHOST, REDISPORT);
 
         if (this->debug) {
             emitCLINote(std::string("Finishing statement processing."));
-            emitCLINote(std::string("Macro state: ") + std::to_string(this->macroState));
-            emitCLINote(std::string("Error state: ") + std::to_string(this->error));
+            emitCLINote(std::string("Macro state: ") + std::to_string(ctx.macroState));
+            emitCLINote(std::string("Error state: ") + std::to_string(ctx.error));
         }
 
         // If there's an error cleanup and bail
-        if (this->error) { this->cleanup(); return this->rspStr; }
-
-        if (this->macroState == STATE_DEF && !this->error) { // Add this entity to the index
-            Entity e(this->currEntity, *(this->currFields));
-            e.write(redis);
-            // this->indexHandler->writeEntity(e);
-            this->rspStr = "Entity successfully added";
-
-            if (this->debug)
-                emitCLINote(std::string("Writing definition of entity."));
-
-        } else if (this->macroState == STATE_ADD) {
-            Relation r(this->bufferEntity,
-                       this->currEntity,
-                       *(this->bufferValues),
-                       *(this->currValues),
-                       *(this->bufferTypes),
-                       *(this->currTypes));
-            this->indexHandler->writeRelation(r, std::stoi(this->currValue));
-            this->rspStr = "Relation successfully added";
-
-            if (this->debug)
-                emitCLINote(std::string("Adding relation."));
-
-        } else if (this->macroState == STATE_GEN) {
-            this->processGEN();
-
-        } else if (this->macroState == STATE_INF) {
-            this->processINF();
-
-        } else if (this->macroState == STATE_LST_ENT) {
-
-            std::vector<Json::Value> entities;
-            emitCLINote(std::string("Current Matched Entities for \"") + this->currEntity + std::string("\""));
-            entities = this->indexHandler->fetchPatternJson(this->indexHandler->generateEntityKey(this->currEntity));
-            if (entities.size() != 0)
-                for (std::vector<Json::Value>::iterator it = entities.begin() ; it != entities.end(); ++it)
-                    this->rspStr += std::string((*it).toStyledString());
-            else
-                this->rspStr = "Not found";
-            emitCLINote(std::string(this->rspStr));
-
-        } else if (this->macroState == STATE_LST_REL) {
-            // Get all relations on given entities
-            emitCLINote(std::string("Current Matched Relations for \"") + this->bufferEntity + std::string("\" and \"") + this->currEntity + std::string("\""));
-
-            // Combine buffer and current values
-            for (std::vector<std::pair<std::string, std::string>>::iterator it = this->bufferValues->begin() ; it != bufferValues->end(); ++it)
-                this->currValues->push_back(*it);
-
-            // Fetch relations and filter on attribute criteria
-            std::vector<Json::Value> relationsJson = this->indexHandler->fetchRelationPrefix(this->bufferEntity, this->currEntity);
+        if (ctx.error) { ctx.cleanup(); return ctx.rspStr; }
+
+        if (ctx.preparing || ctx.macroState == STATE_RM_PREPARED)
+            this->processPREPARE(ctx);
+        else if (ctx.macroState == STATE_EXECUTE)
+            this->processEXECUTE(ctx, redis);
+        else
+            this->processStatement(ctx, redis);
+
+        // Cleanup
+        ctx.cleanup();
+    }
+
+    return ctx.rspStr;
+}
+
+/**
+ *  Run a parsed statement
+ */
+void Parser::processStatement(ParseContext& ctx, RedisHandler& redis) {
+
+    // Statements following queued relations must see them
+    if (ctx.macroState != STATE_ADD)
+        this->flushRelations(ctx);
+
+    if (ctx.macroState == STATE_DEF && !ctx.error) { // Add this entity to the index
+        Entity e(ctx.currEntity, ctx.currFields);
+        e.write(redis);
+        // this->indexHandler->writeEntity(e);
+        ctx.rspStr = "Entity successfully added";
+
+        if (this->debug)
+            emitCLINote(std::string("Writing definition of entity."));
+
+    } else if (ctx.macroState == STATE_ADD) {
+        Relation r(ctx.bufferEntity,
+                   ctx.currEntity,
+                   ctx.bufferValues,
+                   ctx.currValues,
+                   ctx.bufferTypes,
+                   ctx.currTypes);
+        if (ctx.batch != NULL) {
+            ctx.batch->pendingRelations.push_back(std::make_pair(r.toJson(), std::stoi(ctx.currValue)));
+            ctx.batch->pendingResults.push_back(ctx.batch->results.size());
+        } else
+            this->indexHandler->writeRelation(r, std::stoi(ctx.currValue));
+        ctx.rspStr = "Relation successfully added";
+
+        if (this->debug)
+            emitCLINote(std::string("Adding relation."));
+
+    } else if (ctx.macroState == STATE_GEN) {
+        this->processGEN(ctx);
+
+    } else if (ctx.macroState == STATE_INF && ctx.watching) {
+        this->processWATCH(ctx);
+
+    } else if (ctx.macroState == STATE_INF) {
+        this->processINF(ctx);
+
+    } else if (ctx.macroState == STATE_LST_WATCH || ctx.macroState == STATE_RM_WATCH) {
+        this->processWATCH(ctx);
+
+    } else if (ctx.macroState == STATE_LST_ENT) {
+
+        std::vector<Json::Value> entities;
+        emitCLINote(std::string("Current Matched Entities for \"") + ctx.currEntity + std::string("\""));
+        entities = this->indexHandler->fetchPatternJson(this->indexHandler->generateEntityKey(ctx.currEntity));
+        if (entities.size() != 0)
+            for (std::vector<Json::Value>::iterator it = entities.begin() ; it != entities.end(); ++it)
+                ctx.rspStr += std::string((*it).toStyledString());
+        else
+            ctx.rspStr = "Not found";
+        emitCLINote(std::string(ctx.rspStr));
+
+    } else if (ctx.macroState == STATE_LST_REL) {
+        // Get all relations on given entities
+        emitCLINote(std::string("Current Matched Relations for \"") + ctx.bufferEntity + std::string("\" and \"") + ctx.currEntity + std::string("\""));
+
+        // Combine buffer and current values
+        for (std::vector<std::pair<std::string, std::string>>::iterator it = ctx.bufferValues.begin() ; it != ctx.bufferValues.end(); ++it)
+            ctx.currValues.push_back(*it);
+
+        // Fetch relations and filter on attribute criteria
+        std::vector<Json::Value> relationsJson = this->indexHandler->fetchRelationPrefix(ctx.bufferEntity, ctx.currEntity);
+
+        if (ctx.currValues.size() == 0) {
+            // No attribute criteria - the relations read from the catalog are listed as is
+            for (std::vector<Json::Value>::iterator it = relationsJson.begin() ; it != relationsJson.end(); ++it)
+                ctx.rspStr += std::string(it->toStyledString());
+        } else {
             std::vector<Relation> relations = this->indexHandler->Json2RelationVector(relationsJson);
-            AttributeBucket ab = AttributeBucket(this->currEntity, *(this->currValues), *(this->currTypes));
+            AttributeBucket ab = AttributeBucket(ctx.currEntity, ctx.currValues, ctx.currTypes);
             this->indexHandler->filterRelations(relations, ab, ATTR_TUPLE_COMPARE_EQ);
 
             // for each relation determine if they match the condition criteria
             for (std::vector<Relation>::iterator it = relations.begin() ; it != relations.end(); ++it)
-                this->rspStr += std::string(it->toJson().toStyledString());
-            emitCLIGeneric(this->rspStr);
-
-        } else if (this->macroState == STATE_RM_REL) {
-            // Handle the logic for the removal of matching relations
-            Relation r(this->bufferEntity, this->currEntity, *(this->bufferValues), *(this->currValues), *(this->bufferTypes), *(this->currTypes));
-            if (this->indexHandler->removeRelation(r)) {
-                emitCLINote("Relation removed");
-            } else {
-                this->error = true;
-                this->errStr = ERR_RM_REL_CMD;
-            }
-
-        } else if (this->macroState == STATE_RM) {
-            // Handle the logic for the removal of matching entities
-            if (this->indexHandler->removeEntity(this->currEntity)) {
-                emitCLINote("Entity removed");
-            } else {
-                this->error = true;
-                this->errStr = ERR_RM_ENT_CMD;
-            }
+                ctx.rspStr += std::string(it->toJson().toStyledString());
+        }
+        emitCLIGeneric(ctx.rspStr);
+
+    } else if (ctx.macroState == STATE_LST_PAIR) {
+        // Overview of the entity pairs - read from the catalog without touching relations
+        Json::Value pairs(Json::arrayValue);
+        std::vector<Json::Value> summaries = this->indexHandler->fetchPairSummaries(ctx.bufferEntity, ctx.currEntity);
+        for (std::vector<Json::Value>::iterator it = summaries.begin() ; it != summaries.end(); ++it)
+            pairs.append(*it);
+        ctx.rspStr = pairs.toStyledString();
+        emitCLIGeneric(ctx.rspStr);
+
+    } else if (ctx.macroState == STATE_LST_CACHE) {
+        ctx.rspStr = this->bayes->resultCacheStats().toStyledString();
+        emitCLIGeneric(ctx.rspStr);
+
+    } else if (ctx.macroState == STATE_RM_REL) {
+        // Handle the logic for the removal of matching relations
+        Relation r(ctx.bufferEntity, ctx.currEntity, ctx.bufferValues, ctx.currValues, ctx.bufferTypes, ctx.currTypes);
+        if (this->indexHandler->removeRelation(r)) {
+            emitCLINote("Relation removed");
+        } else {
+            ctx.error = true;
+            ctx.errStr = ERR_RM_REL_CMD;
+        }
 
-        } else if (this->macroState == STATE_SET) {
-            this->processSET();
+    } else if (ctx.macroState == STATE_LST_JOB) {
+        Json::Value job;
+        if (this->indexHandler->fetchJobStatus(ctx.currValue, job)) {
+            ctx.rspStr = job.toStyledString();
+            emitCLIGeneric(ctx.rspStr);
+        } else {
+            ctx.error = true;
+            ctx.errStr = ERR_JOB_NOT_EXISTS;
+        }
 
-        } else if (this->macroState == STATE_DEC) {
-            this->processDEC(redis);
+    } else if (ctx.macroState == STATE_RM) {
+        // Handle the logic for the removal of matching entities - relations are removed by a background job
+        std::string jobId = this->indexHandler->removeEntityAsync(ctx.currEntity);
+        if (jobId.compare("") != 0) {
+            ctx.rspStr = std::string("Entity removed, clearing relations in job ") + jobId;
+            emitCLINote(ctx.rspStr);
+        } else {
+            ctx.error = true;
+            ctx.errStr = ERR_RM_ENT_CMD;
         }
 
-        // Cleanup
-        this->cleanup();
-    }
+    } else if (ctx.macroState == STATE_ADD_CPT || ctx.macroState == STATE_LST_CPT ||
+            ctx.macroState == STATE_RM_CPT) {
+        this->processCPT(ctx);
 
-    return this->rspStr;
-}
+    } else if (ctx.macroState == STATE_ADD_NB || ctx.macroState == STATE_LST_NB ||
+            ctx.macroState == STATE_RM_NB || ctx.macroState == STATE_CLASSIFY) {
+        this->processNB(ctx);
 
+    } else if (ctx.macroState == STATE_ADD_CUBE || ctx.macroState == STATE_LST_CUBE ||
+            ctx.macroState == STATE_RM_CUBE) {
+        this->processCUBE(ctx);
 
-/**
- * Performs cleanup of state containers after statement processing
- */
-void Parser::cleanup() {
-    if (this->debug)
-        emitCLINote("DEBUG -- cleanup. freeing out statement allocation.");
-    if (this->currFields != NULL) {
-        for (defpair::iterator it = this->currFields->begin();
-                it != this->currFields->end(); ++it)
-            delete it->first;
-        delete this->currFields;
-        this->currFields = NULL;
-    }
-    if (this->currValues != NULL) {
-        delete this->currValues; this->currValues = NULL;
-    }
-    if (this->bufferValues != NULL) {
-        delete this->bufferValues; this->bufferValues = NULL;
-    }
-    if (this->currTypes != NULL) {
-        delete this->currTypes; this->currTypes = NULL;
-    }
-    if (this->bufferTypes != NULL) {
-        delete this->bufferTypes; this->bufferTypes = NULL;
+    } else if (ctx.macroState == STATE_SET) {
+        this->processSET(ctx);
+
+    } else if (ctx.macroState == STATE_DEC) {
+        this->processDEC(ctx);
     }
 }
 
+
 /**
- *  Write a function to handle splitting strings on a delimeter
+ *  Write a function to handle splitting strings on a delimeter.  As with getline a trailing
+ *  delimeter does not end an empty element.
  */
 std::vector<std::string> &Parser::tokenize(const std::string &s, const char delim, std::vector<std::string> &elems) {
-    std::stringstream ss(s);
-    std::string item;
-    while (std::getline(ss, item, delim)) {
-        elems.push_back(item);
+    size_t start = 0, end;
+    while (start < s.length()) {
+        end = s.find(delim, start);
+        if (end == std::string::npos) end = s.length();
+        elems.push_back(s.substr(start, end - start));
+        start = end + 1;
     }
     return elems;
 }
@@ -600,137 +949,156 @@ std::vector<std::string> Parser::tokenize(const std::string &s, const char delim
     return elems;
 }
 
+/**
+ *  Split a token where it lies in the statement, only the pieces are copied
+ */
+std::vector<std::string> Parser::tokenize(const Token &token, const char delim) {
+    std::vector<std::string> elems;
+    const char* start = token.start;
+    const char* last = token.start + token.length;
+    const char* end;
+    while (start < last) {
+        end = std::find(start, last, delim);
+        elems.push_back(std::string(start, end));
+        start = end + 1;
+    }
+    return elems;
+}
+
 
 /**
  *  Parses the entity value.  If the input string contains subsequent fields these are also parsed.
  *
- *  @param s    input string
+ *  @param token    input token
  */
-void Parser::parseEntitySymbol(const std::string s) {
+void Parser::parseEntitySymbol(ParseContext& ctx, const Token& token) {
 
-    //   Check if s contains a left bracket .. split off the pre-string
-    std::string field;
-    std::vector<string> elems;
+    //   Check if the token contains a left bracket .. split off the pre-string
+    const char* last = token.start + token.length;
+    const char* bracket = std::find(token.start, last, '(');
+    const char* empty = "()";
+    Token fields;
     bool noFields = true;
 
-    // If the input contains
-    this->fieldsProcessed = false;
-    if (s.find("(") != std::string::npos && strstr(s.c_str(), "()") == NULL) {
+    // If the input contains fields they run to the next bracket
+    ctx.fieldsProcessed = false;
+    if (bracket != last && std::search(token.start, last, empty, empty + 2) == last) {
         noFields = false;
-        elems = this->tokenize(s, '(');
-        this->currEntity = *elems.begin();
+        ctx.currEntity = std::string(token.start, bracket);
+        fields = Token(bracket + 1, std::find(bracket + 1, last, '(') - (bracket + 1), KW_NONE);
 
     } else {
-        this->currEntity = s;
-        this->fieldsProcessed = true;
+        ctx.currEntity = token.str();
+        ctx.fieldsProcessed = true;
     }
 
     if (this->debug) {
-        emitCLINote(std::string("Reading entity: ") + this->currEntity);
+        emitCLINote(std::string("Reading entity: ") + ctx.currEntity);
         if (noFields)
-            emitCLINote(std::string("Entity has no fields.") + this->currEntity);
+            emitCLINote(std::string("Entity has no fields.") + ctx.currEntity);
     }
 
-    this->entityProcessed = true;
+    ctx.entityProcessed = true;
 
     // Process any fields
     if (!noFields)
-        this->parseFieldStatement(elems[1]);
+        this->parseFieldStatement(ctx, fields);
 }
 
 /**
  *  Parses a single attribute value of the form <entity>.<attribute>
  *  Allow read of entity only to be enforced
  *
- *  @param s    input string - e.g. "car.wheels"
+ *  @param token    input token - e.g. "car.wheels"
  */
-void Parser::parseAttributeSymbol(const std::string s, bool entityOnly) {
+void Parser::parseAttributeSymbol(ParseContext& ctx, const Token& token, bool entityOnly) {
 
     // Tokenize the string
     std::vector<std::string> elems;
-    elems = this->tokenize(s, '.');
+    elems = this->tokenize(token, '.');
 
     // Ensure that there are two tokens
     if (elems.size() == 2) {
-        this->currAttrEntity = elems[0];
-        this->currAttribute = elems[1];
+        ctx.currAttrEntity = elems[0];
+        ctx.currAttribute = elems[1];
     } else if (entityOnly && elems.size() == 1) {
-        this->currAttrEntity = elems[0];
+        ctx.currAttrEntity = elems[0];
     } else {
-        this->error = true;
-        this->errStr = ERR_PARSE_ATTR;
+        ctx.error = true;
+        ctx.errStr = ERR_PARSE_ATTR;
     }
 
     // Debug output
     if (this->debug)
         if (entityOnly)
-            emitCLINote(std::string("Reading entity/attribute: ") + this->currAttrEntity);
+            emitCLINote(std::string("Reading entity/attribute: ") + ctx.currAttrEntity);
         else
-            emitCLINote(std::string("Reading entity/attribute: ") + this->currAttrEntity + std::string(".") + this->currAttribute);
+            emitCLINote(std::string("Reading entity/attribute: ") + ctx.currAttrEntity + std::string(".") + ctx.currAttribute);
 
-    this->entityProcessed = true;
+    ctx.entityProcessed = true;
 }
 
 /**
  *  Fetches an attribute value from the input
  *
- *  @param s    input string - e.g. 55, "hello", 2.1
+ *  @param token    input token - e.g. 55, "hello", 2.1
  */
-void Parser::parseValue(const std::string s) {
+void Parser::parseValue(ParseContext& ctx, const Token& token) {
+    ctx.currValue = token.str();
+
     // Validate Field type
-    if (!this->indexHandler->validateEntityFieldType(this->currAttrEntity, this->currAttribute, s)) {
-        this->error = true;
-        this->errStr = ERR_BAD_VALUE_TYPE;
+    if (!this->indexHandler->validateEntityFieldType(ctx.currAttrEntity, ctx.currAttribute, ctx.currValue)) {
+        ctx.error = true;
+        ctx.errStr = ERR_BAD_VALUE_TYPE;
     }
-    this->currValue = s;
 }
 
 /**
  *  Handle entity fields
  *
- *  @param string& fieldStr     Consists of one or more comma separated fields possibly terminated with ')'
+ *  @param Token& fieldStr      Consists of one or more comma separated fields possibly terminated with ')'
  */
-void Parser::parseFieldStatement(const std::string &fieldStr) {
+void Parser::parseFieldStatement(ParseContext& ctx, const Token &fieldStr) {
     std::vector<string> fields = this->tokenize(fieldStr, ',');
     std::string field;
 
     if (this->debug)
-        emitCLINote(std::string("Reading field: ") + fieldStr);
+        emitCLINote(std::string("Reading field: ") + fieldStr.str());
 
     for (std::vector<string>::iterator it = fields.begin() ; it != fields.end(); ++it) {
         field = *it;
 
         // Processing should be complete
-        if (this->fieldsProcessed == true) {
-            this->error = true;
-            this->errStr = ERR_ALL_FIELDS_PROC;
+        if (ctx.fieldsProcessed == true) {
+            ctx.error = true;
+            ctx.errStr = ERR_ALL_FIELDS_PROC;
             return;
         }
 
         // Evaluate fields
         if (field.compare(")") == 0) {
-            this->fieldsProcessed = true;   // Done processing
+            ctx.fieldsProcessed = true;   // Done processing
 
         } else if (field.find(')') == field.length() - 1) { // e.g. <field>)
-            this->fieldsProcessed = true;
+            ctx.fieldsProcessed = true;
             field = field.substr(0, field.length() - 1);
 
         } else if (field.find(')') < field.length() - 1) { // no chars after '('
-            this->error = true;
-            this->errStr = ERR_NO_SYM_AFTER;
+            ctx.error = true;
+            ctx.errStr = ERR_NO_SYM_AFTER;
             return;
         }
 
         // PROCESS FIELD STATEMENT
-        if (this->macroState == STATE_DEF) { this->parseEntityDefinitionField(field); }
-        if (this->macroState == STATE_ADD ||
-            this->macroState == STATE_RM_REL ||
-            this->macroState == STATE_SET ||
-            this->macroState == STATE_DEC) {
-            this->parseEntityAssignField(field);
+        if (ctx.macroState == STATE_DEF) { this->parseEntityDefinitionField(ctx, field); }
+        if (ctx.macroState == STATE_ADD ||
+            ctx.macroState == STATE_RM_REL ||
+            ctx.macroState == STATE_SET ||
+            ctx.macroState == STATE_DEC) {
+            this->parseEntityAssignField(ctx, field);
         }
 
-        // this->error = this->error || this->indexHandler->fetch(IDX_TYPE_FIELD, field);
+        // ctx.error = ctx.error || this->indexHandler->fetch(IDX_TYPE_FIELD, field);
     }
 }
 
@@ -738,23 +1106,23 @@ void Parser::parseFieldStatement(const std::string &fieldStr) {
  *  Parses a comma seperated list of attribute value pairs
  *  Default is something like a_1=v_1,a_2=v_2,...,a_n=v_n
  *
- *  @param string& fieldStr     string storing a comma seperated list
+ *  @param Token& fieldStr      token holding a comma seperated list
  */
-void Parser::parseCommaSeparatedList(const string &fieldStr, const char fieldDelimiter) {
+void Parser::parseCommaSeparatedList(ParseContext& ctx, const Token &fieldStr, const char fieldDelimiter) {
     std::vector<string> fields = this->tokenize(fieldStr, ',');
     std::string field;
 
     if (this->debug)
-        emitCLINote(std::string("Reading field: ") + fieldStr);
+        emitCLINote(std::string("Reading field: ") + fieldStr.str());
 
     for (std::vector<string>::iterator it = fields.begin() ; it != fields.end(); ++it) {
         field = *it;
 
         // On Assignment
         if (fieldDelimiter == '=')
-            this->parseEntityAssignField(field);
+            this->parseEntityAssignField(ctx, field);
     }
-    this->fieldsProcessed == true;
+    ctx.fieldsProcessed == true;
 }
 
 /**
@@ -762,7 +1130,7 @@ void Parser::parseCommaSeparatedList(const string &fieldStr, const char fieldDel
  *
  *  @param string& field
  */
-void Parser::parseEntityDefinitionField(const std::string field) {
+void Parser::parseEntityDefinitionField(ParseContext& ctx, const std::string& field) {
     std::vector<string> fieldItems;
     std::string fieldType;
 
@@ -774,29 +1142,29 @@ void Parser::parseEntityDefinitionField(const std::string field) {
     }
 
     if (fieldItems.size() != 2) {
-        this->error = true;
-        this->errStr = ERR_INVALID_DEF_FMT;
+        ctx.error = true;
+        ctx.errStr = ERR_INVALID_DEF_FMT;
         return;
     }
 
     fieldType = fieldItems[1];
     if (!isValidType(fieldType)) {
-        this->error = true;
-        this->errStr = ERR_INVALID_FIELD_TYPE;
+        ctx.error = true;
+        ctx.errStr = ERR_INVALID_FIELD_TYPE;
         return;
     }
 
     // Assign the appropriate column
     // TODO - fold this into column_types lib
     if (fieldType.compare(COLTYPE_NAME_INT) == 0)
-        this->currFields->push_back(std::make_pair(new IntegerColumn(), fieldItems[0]));
+        ctx.currFields.push_back(std::make_pair(new IntegerColumn(), fieldItems[0]));
     else if (fieldType.compare(COLTYPE_NAME_FLOAT) == 0)
-        this->currFields->push_back(std::make_pair(new FloatColumn(), fieldItems[0]));
+        ctx.currFields.push_back(std::make_pair(new FloatColumn(), fieldItems[0]));
     else if (fieldType.compare(COLTYPE_NAME_STR) == 0)
-        this->currFields->push_back(std::make_pair(new StringColumn(), fieldItems[0]));
+        ctx.currFields.push_back(std::make_pair(new StringColumn(), fieldItems[0]));
     else {
-        this->error = true;
-        this->errStr = ERR_INVALID_FIELD_TYPE;
+        ctx.error = true;
+        ctx.errStr = ERR_INVALID_FIELD_TYPE;
         return;
     }
 }
@@ -806,49 +1174,50 @@ void Parser::parseEntityDefinitionField(const std::string field) {
  *
  *  @param string& field
  */
-void Parser::parseEntityAssignField(const std::string field) {
+void Parser::parseEntityAssignField(ParseContext& ctx, const std::string& field) {
     std::vector<std::string> fieldItems;
     fieldItems = this->tokenize(field, '=');
 
     // Verify that the entity has been defined
-    if (!this->indexHandler->existsEntity(this->currEntity)) {
-        this->error = true;
-        this->errStr = std::string(ERR_ENT_NOT_EXISTS) + std::string(" -> \"") + this->currEntity + std::string("\"");
+    if (!this->indexHandler->existsEntity(ctx.currEntity)) {
+        ctx.error = true;
+        ctx.errStr = std::string(ERR_ENT_NOT_EXISTS) + std::string(" -> \"") + ctx.currEntity + std::string("\"");
         return;
     }
 
     // Verify that the assignment has been properly formatted
     if (fieldItems.size() != 2) {
-        this->error = true;
-        this->errStr = ERR_ENT_BAD_FORMAT;
+        ctx.error = true;
+        ctx.errStr = ERR_ENT_BAD_FORMAT;
         return;
     }
 
     // Verify that the entity contains this attribute
-    if (!this->indexHandler->existsEntityField(this->currEntity, fieldItems[0])) {
-        this->error = true;
-        this->errStr = ERR_ENT_FIELD_NOT_EXIST;
+    if (!this->indexHandler->existsEntityField(ctx.currEntity, fieldItems[0])) {
+        ctx.error = true;
+        ctx.errStr = ERR_ENT_FIELD_NOT_EXIST;
         return;
     }
 
-    // Validate Type
-    if (!this->indexHandler->validateEntityFieldType(this->currEntity, fieldItems[0], fieldItems[1])) {
-        this->error = true;
-        this->errStr = ERR_BAD_FIELD_TYPE;
+    // Validate Type - placeholders of a statement being prepared are validated when values are bound
+    if (!(ctx.preparing && fieldItems[1].compare(PREPARED_PLACEHOLDER) == 0) &&
+            !this->indexHandler->validateEntityFieldType(ctx.currEntity, fieldItems[0], fieldItems[1])) {
+        ctx.error = true;
+        ctx.errStr = ERR_BAD_FIELD_TYPE;
         return;
     }
 
     // Push the current value
-    this->currValues->push_back(std::make_pair(fieldItems[0], fieldItems[1]));
+    ctx.currValues.push_back(std::make_pair(fieldItems[0], fieldItems[1]));
 
     // Fetch the field type from the entity - it must not be null type
-    std::string type = this->indexHandler->fetchEntityFieldType(this->currEntity, fieldItems[0]);
+    std::string type = this->indexHandler->fetchEntityFieldType(ctx.currEntity, fieldItems[0]);
     if (std::strcmp(type.c_str(), COLTYPE_NAME_NULL) != 0)
         // Push the current field type
-        this->currTypes->insert(std::make_pair(fieldItems[0], type));
+        ctx.currTypes.insert(std::make_pair(fieldItems[0], type));
     else {
-        this->error = true;
-        this->errStr = ERR_BAD_FIELD_TYPE;
+        ctx.error = true;
+        ctx.errStr = ERR_BAD_FIELD_TYPE;
         return;
     }
 }
@@ -857,60 +1226,58 @@ void Parser::parseEntityAssignField(const std::string field) {
 /**
  *  Stateless method for parsing a pair of entity descriptors defining a relation
  */
-void Parser::parseRelationPair(const std::string symbol) {
+void Parser::parseRelationPair(ParseContext& ctx, const Token& symbol) {
 
-    if (this->state == STATE_P3)
-        if (this->macroState == STATE_DEC || this->macroState == STATE_ADD) {
-            this->currValue = symbol;
-            this->state = STATE_FINISH;
+    if (ctx.state == STATE_P3)
+        if (ctx.macroState == STATE_DEC || ctx.macroState == STATE_ADD) {
+            ctx.currValue = symbol.str();
+            ctx.state = STATE_FINISH;
             return;
         }
 
     // Determine if entity or fields need to be processed
-    if (this->entityProcessed) {
-        this->parseFieldStatement(symbol);
+    if (ctx.entityProcessed) {
+        this->parseFieldStatement(ctx, symbol);
     } else {
-        if (this->currValues != NULL) delete this->currValues;
-        if (this->currTypes != NULL) delete this->currTypes;
-        this->currValues = new vector<std::pair<std::string, std::string>>;
-        this->currTypes = new std::unordered_map<std::string, std::string>;
-        this->parseEntitySymbol(symbol);
+        ctx.currValues.clear();
+        ctx.currTypes.clear();
+        this->parseEntitySymbol(ctx, symbol);
 
         // Ensure that entities exist if we are adding/removing  a new relation
-        if (this->macroState == STATE_ADD ||
-            this->macroState == STATE_RM_REL ||
-            this->macroState == STATE_SET)
+        if (ctx.macroState == STATE_ADD ||
+            ctx.macroState == STATE_RM_REL ||
+            ctx.macroState == STATE_SET)
 
-            if (!this->indexHandler->existsEntity(this->currEntity)) {
-                this->error = true;
-                this->errStr = std::string(ERR_ENT_NOT_EXISTS) +
+            if (!this->indexHandler->existsEntity(ctx.currEntity)) {
+                ctx.error = true;
+                ctx.errStr = std::string(ERR_ENT_NOT_EXISTS) +
                     std::string(" -> \"") +
-                    this->currEntity + std::string("\"");
+                    ctx.currEntity + std::string("\"");
                 return;
             }
     }
 
     // If all fields have been processed transition
-    if (this->fieldsProcessed)
-        if (this->state == STATE_P1) {
-            this->state = STATE_P2;
-            this->bufferEntity = this->currEntity;
-            this->bufferValues = this->currValues;
-            this->bufferTypes = this->currTypes;
-            this->currValues = new vector<std::pair<std::string, std::string>>;
-            this->currTypes = new std::unordered_map<std::string, std::string>;
-            this->fieldsProcessed = false;
-            this->entityProcessed = false;
-
-        } else if (this->state == STATE_P2) {
-            if (this->nSymbols > nSymbolIdx) { // Yet to process the symbols
-                if (this->macroState == STATE_DEC ||
-                        this->macroState == STATE_ADD) {
-                    this->state = STATE_P3;
+    if (ctx.fieldsProcessed)
+        if (ctx.state == STATE_P1) {
+            ctx.state = STATE_P2;
+            ctx.bufferEntity = ctx.currEntity;
+            ctx.bufferValues.swap(ctx.currValues);
+            ctx.bufferTypes.swap(ctx.currTypes);
+            ctx.currValues.clear();
+            ctx.currTypes.clear();
+            ctx.fieldsProcessed = false;
+            ctx.entityProcessed = false;
+
+        } else if (ctx.state == STATE_P2) {
+            if (ctx.nSymbols > ctx.nSymbolIdx) { // Yet to process the symbols
+                if (ctx.macroState == STATE_DEC ||
+                        ctx.macroState == STATE_ADD) {
+                    ctx.state = STATE_P3;
                 }
             } else {
-                this->state = STATE_FINISH;
-                this->currValue = "1";
+                ctx.state = STATE_FINISH;
+                ctx.currValue = "1";
             }
         }
 }
@@ -918,58 +1285,407 @@ void Parser::parseRelationPair(const std::string symbol) {
 /**
  *  Stateless method for parsing GEN or INF Commands
  *
- *  SYNTAX: GEN E1[.A_E1] GIVEN E2 [ATTR Ai=Vi[, ...]]
- *          INF E1.A_E1 GIVEN E2 [ATTR Ai=Vi[, ...]]
+ *  SYNTAX: GEN E1[.A_E1] GIVEN E2 [GIVEN E3 ...] [ATTR Ai=Vi[, ...]] [GROUP BY A_E2] [SAMPLES n [NOREPLACE]] [SEED s]
+ *          INF E1[.A_E1] GIVEN E2 [GIVEN E3 ...] [ATTR Ai=Vi[, ...]] [GROUP BY A_E2|VAR|STDDEV|PCT p|TOP k|APPROX|MC [PRECISION e] [BUDGET ms]]
  */
-void Parser::parseGenForm(const std::string inputToken, const std::string err) {
-    switch (this->state) {
-        case STATE_GENINF_E1:   // if E1 parse the first entity
-            this->parseAttributeSymbol(inputToken);
-            this->state = STATE_GENINF_E2;
-            this->parsedIDWord = false;
+void Parser::parseGenForm(ParseContext& ctx, const Token& inputToken, const std::string& err) {
+
+
+    switch (ctx.state) {
+        case STATE_GENINF_E1:   // if E1 parse the first entity - the attribute may be omitted
+            this->parseAttributeSymbol(ctx, inputToken, true);
+            ctx.state = STATE_GENINF_E2;
+            ctx.parsedIDWord = false;
             break;
 
         case STATE_GENINF_E2:  // if E2 parse the first entity
-            if (inputToken.compare(STR_CMD_GIV) == 0 && !this->parsedIDWord) {
-                this->parsedIDWord = true;
+            if (ctx.keyword == KW_GIVEN && !ctx.parsedIDWord) {
+                ctx.parsedIDWord = true;
                 break;
-            } else if (inputToken.compare(STR_CMD_GIV) == 0) {
-                this->error = true;
-                this->errStr = err;
+            } else if (ctx.keyword == KW_GIVEN) {
+                ctx.error = true;
+                ctx.errStr = err;
             }
 
             // Store the target entity and attribute
-            this->bufferAttrEntity = this->currAttrEntity;
-            this->bufferAttribute = this->currAttribute;
+            if (ctx.chainEntities.empty()) {
+                ctx.bufferAttrEntity = ctx.currAttrEntity;
+                ctx.bufferAttribute = ctx.currAttribute;
+            }
 
-            this->parseAttributeSymbol(inputToken, true);
-            this->currEntity = this->currAttrEntity;
-            this->state = STATE_GENINF_ATTR;
-            this->parsedIDWord = false;
+            ctx.currAttribute = "";
+            this->parseAttributeSymbol(ctx, inputToken, true);
+            ctx.currEntity = ctx.currAttrEntity;
+            ctx.state = STATE_GENINF_ATTR;
+            ctx.parsedIDWord = false;
+
+            // Initialize current value list - empty unless an attribute list follows
+            ctx.currValues.clear();
+            ctx.currTypes.clear();
             break;
 
         case STATE_GENINF_ATTR: // if ATTR parse the first entity
 
-            // Initialize current value list
-            if (this->currValues != NULL) delete this->currValues;
-            this->currValues = new vector<std::pair<std::string, std::string>>;
-            this->currTypes = new std::unordered_map<std::string, std::string>;
+            // A further GIVEN extends the chain, the entity before it is a hop
+            if (ctx.keyword == KW_GIVEN && !ctx.parsedIDWord &&
+                    ctx.currAttribute.compare("") == 0) {
+                ctx.chainEntities.push_back(ctx.currEntity);
+                ctx.state = STATE_GENINF_E2;
+                ctx.parsedIDWord = true;
+                break;
+            }
+
+            if (ctx.keyword == KW_ATTR && !ctx.parsedIDWord) {
+                ctx.parsedIDWord = true;
+                break;
+            } else if (ctx.keyword == KW_ATTR) {
+                ctx.error = true;
+                ctx.errStr = err;
+            }
 
-            if (inputToken.compare(STR_CMD_ATR) == 0 && !this->parsedIDWord) {
-                this->parsedIDWord = true;
+            if (ctx.parsedIDWord) {
+                this->parseCommaSeparatedList(ctx, inputToken);
+                ctx.parsedIDWord = false;
+                ctx.state = STATE_GENINF_MOD;
                 break;
-            } else if (inputToken.compare(STR_CMD_ATR) == 0) {
-                this->error = true;
-                this->errStr = err;
             }
-            this->state = STATE_FINISH;
-            this->parseCommaSeparatedList(inputToken);
-            this->parsedIDWord = false;
+
+            // No attribute list, the token is a modifier
+            ctx.state = STATE_GENINF_MOD;
+            this->parseGenModifier(ctx, inputToken, err);
+            break;
+
+        case STATE_GENINF_MOD: // trailing modifiers
+            this->parseGenModifier(ctx, inputToken, err);
             break;
 
         default:
-            this->error = true;
-            this->errStr = err;
+            ctx.error = true;
+            ctx.errStr = err;
+    }
+
+    // The statement may end after the conditioning entity, the attribute list or a complete modifier
+    if (ctx.nSymbolIdx == ctx.nSymbols && !ctx.error) {
+        if ((ctx.state == STATE_GENINF_ATTR && !ctx.parsedIDWord) ||
+                (ctx.state == STATE_GENINF_MOD && ctx.pendingModifier == KW_NONE))
+            ctx.state = STATE_FINISH;
+        else {
+            ctx.error = true;
+            ctx.errStr = err;
+        }
+    }
+}
+
+/**
+ *  Parses a modifier trailing a GEN or INF command.  Modifiers taking an argument are left pending
+ *  until the next token.
+ *
+ *  @param inputToken   input token
+ */
+void Parser::parseGenModifier(ParseContext& ctx, const Token& inputToken, const std::string& err) {
+
+    // Only the argument of a pending modifier is read as a value
+    std::string value = ctx.pendingModifier != KW_NONE ? inputToken.str() : std::string();
+
+    if (ctx.pendingModifier == KW_GROUP) {
+        if (ctx.keyword != KW_BY) {
+            ctx.error = true;
+            ctx.errStr = err;
+            return;
+        }
+        ctx.pendingModifier = KW_BY;
+
+    } else if (ctx.pendingModifier == KW_BY) {
+        // The attribute may be qualified by the given entity
+        std::vector<std::string> elems = this->tokenize(value, '.');
+        if (elems.size() == 2 && elems[0].compare(ctx.currEntity) == 0)
+            ctx.groupAttribute = elems[1];
+        else if (elems.size() == 1)
+            ctx.groupAttribute = elems[0];
+        else {
+            ctx.error = true;
+            ctx.errStr = ERR_BAD_GROUP;
+            return;
+        }
+        ctx.pendingModifier = KW_NONE;
+
+    } else if (ctx.pendingModifier == KW_PRECISION) {
+        if (!FloatColumn().validate(value) || std::atof(value.c_str()) <= 0.0) {
+            ctx.error = true;
+            ctx.errStr = ERR_BAD_PRECISION;
+            return;
+        }
+        ctx.mcPrecision = std::atof(value.c_str());
+        ctx.pendingModifier = KW_NONE;
+
+    } else if (ctx.pendingModifier == KW_BUDGET) {
+        if (!IntegerColumn().validate(value) || std::atol(value.c_str()) < 1) {
+            ctx.error = true;
+            ctx.errStr = ERR_BAD_BUDGET;
+            return;
+        }
+        ctx.mcBudget = std::atol(value.c_str());
+        ctx.pendingModifier = KW_NONE;
+
+    } else if (ctx.pendingModifier == KW_SAMPLES) {
+        if (!IntegerColumn().validate(value) || std::atol(value.c_str()) < 1) {
+            ctx.error = true;
+            ctx.errStr = ERR_BAD_SAMPLES;
+            return;
+        }
+        ctx.sampleCount = std::atol(value.c_str());
+        ctx.pendingModifier = KW_NONE;
+
+    } else if (ctx.pendingModifier == KW_PCT) {
+        if (!FloatColumn().validate(value) || std::atof(value.c_str()) < 0.0 ||
+                std::atof(value.c_str()) > 100.0) {
+            ctx.error = true;
+            ctx.errStr = ERR_BAD_PCT;
+            return;
+        }
+        ctx.infPercentile = std::atof(value.c_str());
+        ctx.pendingModifier = KW_NONE;
+
+    } else if (ctx.pendingModifier == KW_TOP) {
+        if (!IntegerColumn().validate(value) || std::atol(value.c_str()) < 1) {
+            ctx.error = true;
+            ctx.errStr = ERR_BAD_TOP;
+            return;
+        }
+        ctx.infTopCount = std::atol(value.c_str());
+        ctx.pendingModifier = KW_NONE;
+
+    } else if (ctx.pendingModifier == KW_SEED) {
+        if (value.length() == 0 || value.length() > 19 ||
+                value.find_first_not_of("0123456789") != std::string::npos) {
+            ctx.error = true;
+            ctx.errStr = ERR_BAD_SEED;
+            return;
+        }
+        ctx.sampleSeed = std::strtoull(value.c_str(), NULL, 10);
+        ctx.sampleSeeded = true;
+        ctx.pendingModifier = KW_NONE;
+
+    } else if (ctx.keyword == KW_SEED && ctx.macroState == STATE_GEN &&
+            !ctx.sampleSeeded) {
+        ctx.pendingModifier = KW_SEED;
+
+    } else if (ctx.keyword == KW_SAMPLES && ctx.macroState == STATE_GEN) {
+        ctx.pendingModifier = KW_SAMPLES;
+
+    } else if (ctx.keyword == KW_GROUP && ctx.groupAttribute.compare("") == 0 &&
+            ctx.infStatistic == KW_NONE && !ctx.infApprox && !ctx.infMonteCarlo &&
+            ctx.sampleCount == 0 && !ctx.sampleSeeded && ctx.chainEntities.empty()) {
+        ctx.pendingModifier = KW_GROUP;
+
+    } else if (ctx.keyword == KW_NOREPLACE && ctx.sampleCount > 0 &&
+            ctx.chainEntities.empty()) {
+        ctx.sampleReplace = false;
+
+    } else if ((ctx.keyword == KW_VAR || ctx.keyword == KW_STDDEV) &&
+            ctx.macroState == STATE_INF && ctx.infStatistic == KW_NONE &&
+            !ctx.infApprox && ctx.bufferAttribute.compare("") != 0 && ctx.chainEntities.empty() &&
+            ctx.groupAttribute.compare("") == 0 && !ctx.infMonteCarlo) {
+        ctx.infStatistic = ctx.keyword;
+
+    } else if ((ctx.keyword == KW_PCT || ctx.keyword == KW_TOP) &&
+            ctx.macroState == STATE_INF && ctx.infStatistic == KW_NONE && !ctx.infApprox &&
+            ctx.bufferAttribute.compare("") != 0 && ctx.chainEntities.empty() &&
+            ctx.groupAttribute.compare("") == 0 && !ctx.infMonteCarlo) {
+        ctx.infStatistic = ctx.keyword;
+        ctx.pendingModifier = ctx.keyword;
+
+    } else if (ctx.keyword == KW_APPROX && ctx.macroState == STATE_INF &&
+            !ctx.infApprox && ctx.infStatistic == KW_NONE && ctx.chainEntities.empty() &&
+            ctx.groupAttribute.compare("") == 0 && !ctx.infMonteCarlo) {
+        ctx.infApprox = true;
+
+    } else if (ctx.keyword == KW_MC && ctx.macroState == STATE_INF && !ctx.infMonteCarlo &&
+            !ctx.infApprox && ctx.infStatistic == KW_NONE && ctx.groupAttribute.compare("") == 0) {
+        ctx.infMonteCarlo = true;
+
+    } else if ((ctx.keyword == KW_PRECISION || ctx.keyword == KW_BUDGET) &&
+            ctx.infMonteCarlo) {
+        ctx.pendingModifier = ctx.keyword;
+
+    } else {
+        ctx.error = true;
+        ctx.errStr = err;
+    }
+}
+
+/**
+ *  Stateless method for parsing CPT Commands
+ *
+ *  SYNTAX: ADD CPT E1.A_E1 GIVEN E2.A_E2 [LIMIT n]
+ *          LST CPT [E1.A_E1 GIVEN E2.A_E2]
+ *          RM CPT E1.A_E1 GIVEN E2.A_E2
+ */
+void Parser::parseCptForm(ParseContext& ctx, const Token& inputToken) {
+
+    std::string value;
+
+    switch (ctx.state) {
+        case STATE_CPT_TARGET:
+            this->parseAttributeSymbol(ctx, inputToken);
+            ctx.bufferAttrEntity = ctx.currAttrEntity;
+            ctx.bufferAttribute = ctx.currAttribute;
+            ctx.state = STATE_CPT_GIVEN;
+            ctx.parsedIDWord = false;
+            break;
+
+        case STATE_CPT_GIVEN:
+            if (ctx.keyword == KW_GIVEN && !ctx.parsedIDWord) {
+                ctx.parsedIDWord = true;
+                break;
+            } else if (!ctx.parsedIDWord) {
+                ctx.error = true;
+                ctx.errStr = ERR_MAL_CPT;
+                return;
+            }
+            this->parseAttributeSymbol(ctx, inputToken);
+            ctx.state = ctx.macroState == STATE_ADD_CPT ? STATE_CPT_MOD : STATE_FINISH;
+            break;
+
+        case STATE_CPT_MOD:
+            if (ctx.pendingModifier == KW_LIMIT) {
+                value = inputToken.str();
+                if (!IntegerColumn().validate(value) || std::atol(value.c_str()) < 1) {
+                    ctx.error = true;
+                    ctx.errStr = ERR_BAD_LIMIT;
+                    return;
+                }
+                ctx.tableLimit = std::atol(value.c_str());
+                ctx.pendingModifier = KW_NONE;
+            } else if (ctx.keyword == KW_LIMIT) {
+                ctx.pendingModifier = KW_LIMIT;
+            } else {
+                ctx.error = true;
+                ctx.errStr = ERR_MAL_CPT;
+                return;
+            }
+            break;
+    }
+
+    // The declaration may end after the given attribute or a complete modifier
+    if (ctx.nSymbolIdx == ctx.nSymbols && !ctx.error) {
+        if (ctx.state == STATE_CPT_MOD && ctx.pendingModifier == KW_NONE)
+            ctx.state = STATE_FINISH;
+        else if (ctx.state != STATE_FINISH) {
+            ctx.error = true;
+            ctx.errStr = ERR_MAL_CPT;
+        }
+    }
+}
+
+/**
+ *  Parse the forms naming a classifier, followed by the instances to classify for CLASSIFY.  Each
+ *  instance is one token of attribute assignments on the given entity, values are taken as written
+ *  and attributes the classifier has not seen are ignored when scoring.
+ *
+ *  SYNTAX: [ADD|LST|RM] NB E1.A GIVEN E2, CLASSIFY E1.A GIVEN E2 x1=v1[,x2=v2,..] [...]
+ */
+void Parser::parseClassifierForm(ParseContext& ctx, const Token& inputToken) {
+
+    std::vector<std::string> fields, assignment;
+    valpair instance;
+
+    switch (ctx.state) {
+        case STATE_NB_TARGET:
+            this->parseAttributeSymbol(ctx, inputToken);
+            ctx.state = STATE_NB_GIVEN;
+            ctx.parsedIDWord = false;
+            break;
+
+        case STATE_NB_GIVEN:
+            if (ctx.keyword == KW_GIVEN && !ctx.parsedIDWord) {
+                ctx.parsedIDWord = true;
+                break;
+            } else if (!ctx.parsedIDWord || std::count(inputToken.start, inputToken.start + inputToken.length, '.') > 0) {
+                ctx.error = true;
+                ctx.errStr = ERR_MAL_NB;
+                return;
+            }
+            ctx.currEntity = inputToken.str();
+            ctx.state = ctx.macroState == STATE_CLASSIFY ? STATE_NB_INSTANCE : STATE_FINISH;
+            break;
+
+        case STATE_NB_INSTANCE:
+            fields = this->tokenize(inputToken, ',');
+            for (std::vector<std::string>::iterator it = fields.begin(); it != fields.end(); ++it) {
+                assignment = this->tokenize(*it, '=');
+                if (assignment.size() != 2 || assignment[0].length() == 0 || assignment[1].length() == 0) {
+                    ctx.error = true;
+                    ctx.errStr = ERR_ENT_BAD_FORMAT;
+                    return;
+                }
+                instance.push_back(std::make_pair(assignment[0], assignment[1]));
+            }
+            ctx.classifyInstances.push_back(instance);
+            break;
+    }
+
+    // CLASSIFY needs at least one instance, the other forms end after the given entity
+    if (ctx.nSymbolIdx == ctx.nSymbols && !ctx.error) {
+        if (ctx.state == STATE_NB_INSTANCE && ctx.classifyInstances.size() > 0)
+            ctx.state = STATE_FINISH;
+        else if (ctx.state != STATE_FINISH) {
+            ctx.error = true;
+            ctx.errStr = ERR_MAL_NB;
+        }
+    }
+}
+
+/**
+ *  Parse the forms naming a cube - a comma separated list of entity attributes followed, when
+ *  declaring, by an optional cell limit
+ *
+ *  SYNTAX: [ADD|LST|RM] CUBE E1.A1,E2.A2[,...] [LIMIT n]
+ */
+void Parser::parseCubeForm(ParseContext& ctx, const Token& inputToken) {
+
+    std::vector<std::string> attributes;
+    std::string value;
+
+    switch (ctx.state) {
+        case STATE_CUBE_ATTRS:
+            attributes = this->tokenize(inputToken, ',');
+            for (std::vector<std::string>::iterator it = attributes.begin(); it != attributes.end(); ++it) {
+                this->parseAttributeSymbol(ctx, Token(it->data(), it->length(), KW_NONE));
+                if (ctx.error) return;
+                ctx.cubeAttributes.push_back(*it);
+            }
+            ctx.state = ctx.macroState == STATE_ADD_CUBE ? STATE_CUBE_MOD : STATE_FINISH;
+            break;
+
+        case STATE_CUBE_MOD:
+            if (ctx.pendingModifier == KW_LIMIT) {
+                value = inputToken.str();
+                if (!IntegerColumn().validate(value) || std::atol(value.c_str()) < 1) {
+                    ctx.error = true;
+                    ctx.errStr = ERR_BAD_LIMIT;
+                    return;
+                }
+                ctx.cubeLimit = std::atol(value.c_str());
+                ctx.pendingModifier = KW_NONE;
+            } else if (ctx.keyword == KW_LIMIT) {
+                ctx.pendingModifier = KW_LIMIT;
+            } else {
+                ctx.error = true;
+                ctx.errStr = ERR_MAL_CUBE;
+                return;
+            }
+            break;
+    }
+
+    // The declaration may end after the attributes or a complete modifier
+    if (ctx.nSymbolIdx == ctx.nSymbols && !ctx.error) {
+        if (ctx.state == STATE_CUBE_MOD && ctx.pendingModifier == KW_NONE)
+            ctx.state = STATE_FINISH;
+        else if (ctx.state != STATE_FINISH) {
+            ctx.error = true;
+            ctx.errStr = ERR_MAL_CUBE;
+        }
     }
 }
 
@@ -978,25 +1694,25 @@ void Parser::parseGenForm(const std::string inputToken, const std::string err) {
  *
  *  SYNTAX: SET E.A FOR E1(x1=vx1[, x2=vx2, ..]) E2(y1=vy1[, y2=vy2, ..]) AS V *
  */
-void Parser::parseSet(const std::string inputToken) {
-    switch (this->state) {
+void Parser::parseSet(ParseContext& ctx, const Token& inputToken) {
+    switch (ctx.state) {
         case STATE_P0:  // Parse entity/attribute to set
-            this->parseAttributeSymbol(inputToken);
-            this->state = STATE_P1;
+            this->parseAttributeSymbol(ctx, inputToken);
+            ctx.state = STATE_P1;
             break;
         case STATE_P1:   // Parse first entity attribute settings
-            this->entityProcessed = false;
-            if (inputToken.compare(STR_CMD_FOR) == 0) break;
-            this->parseRelationPair(inputToken);    // handles transition to P2
+            ctx.entityProcessed = false;
+            if (ctx.keyword == KW_FOR) break;
+            this->parseRelationPair(ctx, inputToken);    // handles transition to P2
             break;
         case STATE_P2:   // Parse second entity attribute settings
-            this->parseRelationPair(inputToken);
-            this->state = STATE_P3;
+            this->parseRelationPair(ctx, inputToken);
+            ctx.state = STATE_P3;
             break;
         case STATE_P3:  // Parse value to set
-            if (inputToken.compare(STR_CMD_AS) == 0) break;
-            this->parseValue(inputToken);
-            this->state = STATE_FINISH;
+            if (ctx.keyword == KW_AS) break;
+            this->parseValue(ctx, inputToken);
+            ctx.state = STATE_FINISH;
             break;
     }
 }
@@ -1005,48 +1721,488 @@ void Parser::parseSet(const std::string inputToken) {
  *  Methods to process commands to be executed after successful parse
  */
 
-void Parser::processGEN() {
+void Parser::processGEN(ParseContext& ctx) {
     // Construct attribute bucket
     AttributeBucket ab;
-    ab.addAttributes(this->currAttrEntity,
-        *(this->currValues), *(this->currTypes));
+    ab.addAttributes(ctx.currAttrEntity,
+        ctx.currValues, ctx.currTypes);
+
+    // A seeded request draws the same samples from the same relations on every run, from a stream
+    // of its own so that later requests are not drawn from the seeded sequence
+    RandomStream seeded(ctx.sampleSeed);
+    RandomStream* rng = ctx.sampleSeeded ? &seeded : NULL;
+
+    // Paths along a chain of entities, one relation per hop
+    if (ctx.chainEntities.size() > 0) {
+        std::vector<std::string> chain(1, ctx.bufferAttrEntity);
+        chain.insert(chain.end(), ctx.chainEntities.begin(), ctx.chainEntities.end());
+        chain.push_back(ctx.currEntity);
+        std::vector<std::vector<Relation>> paths = this->bayes->sampleChain(chain, ab,
+            ATTR_TUPLE_COMPARE_EQ, ctx.sampleCount > 0 ? ctx.sampleCount : 1, rng);
+
+        Json::Value out(Json::arrayValue);
+        for (std::vector<std::vector<Relation>>::iterator it = paths.begin();
+                it != paths.end(); ++it) {
+            Json::Value path(Json::arrayValue);
+            for (std::vector<Relation>::iterator itRel = it->begin(); itRel != it->end(); ++itRel)
+                path.append(itRel->toJson());
+            out.append(path);
+        }
+        Json::FastWriter writer;
+        if (ctx.sampleCount > 0)
+            ctx.rspStr = writer.write(out);
+        else
+            ctx.rspStr = out.size() > 0 ? out[0].toStyledString() :
+                Json::Value(Json::arrayValue).toStyledString();
+        emitCLIGeneric(ctx.rspStr);
+        return;
+    }
+
+    // Samples per group of the given entity, drawn from one scan of its relations
+    if (ctx.groupAttribute.compare("") != 0) {
+        std::vector<std::pair<std::string, std::vector<Relation>>> groups = this->bayes->sampleGroups(
+            ctx.bufferAttrEntity, ctx.currEntity, ctx.groupAttribute, ab, ATTR_TUPLE_COMPARE_EQ,
+            ctx.sampleCount > 0 ? ctx.sampleCount : 1, ctx.sampleReplace, rng);
+
+        Json::Value out(Json::arrayValue), group;
+        for (std::vector<std::pair<std::string, std::vector<Relation>>>::iterator it = groups.begin();
+                it != groups.end(); ++it) {
+            group = Json::Value();
+            group[JSON_ATTR_GROUP_VALUE] = it->first;
+            group[JSON_ATTR_GROUP_SAMPLES] = Json::Value(Json::arrayValue);
+            for (std::vector<Relation>::iterator itRel = it->second.begin(); itRel != it->second.end(); ++itRel)
+                group[JSON_ATTR_GROUP_SAMPLES].append(itRel->toJson());
+            out.append(group);
+        }
+        Json::FastWriter writer;
+        ctx.rspStr = ctx.sampleCount > 0 ? writer.write(out) : out.toStyledString();
+        emitCLIGeneric(ctx.rspStr);
+        return;
+    }
+
+    // Batch of samples drawn from one materialized distribution, returned as a compact array
+    if (ctx.sampleCount > 0) {
+        std::vector<Relation> samples = this->bayes->samplePairwise(
+            ctx.bufferAttrEntity, ctx.currEntity, ab, ATTR_TUPLE_COMPARE_EQ,
+            ctx.sampleCount, ctx.sampleReplace, rng);
+        Json::Value out(Json::arrayValue);
+        for (std::vector<Relation>::iterator it = samples.begin();
+                it != samples.end(); ++it)
+            out.append(it->toJson());
+        Json::FastWriter writer;
+        ctx.rspStr = writer.write(out);
+        emitCLIGeneric(ctx.rspStr);
+        return;
+    }
 
     // Call sampling method from Bayes for relations
     // TODO - allow type of comparison to be specified
-    Relation r = this->bayes->samplePairwise(this->bufferAttrEntity,
-        this->currEntity, ab, ATTR_TUPLE_COMPARE_EQ);
+    Relation r = this->bayes->samplePairwise(ctx.bufferAttrEntity,
+        ctx.currEntity, ab, ATTR_TUPLE_COMPARE_EQ, rng);
 
     // Print the sample
-    emitCLIGeneric(r.toJson().toStyledString());
+    ctx.rspStr = r.toJson().toStyledString();
+    emitCLIGeneric(ctx.rspStr);
 }
 
-void Parser::processINF() {
+void Parser::processINF(ParseContext& ctx) {
 
     // Construct attribute bucket
     AttributeBucket ab;
-    ab.addAttributes(this->currAttrEntity, *(this->currValues),
-        *(this->currTypes));
+    ab.addAttributes(ctx.currAttrEntity, ctx.currValues,
+        ctx.currTypes);
+
+    // Estimates from parallel draws, a pair is a chain of two entities
+    if (ctx.infMonteCarlo) {
+        std::vector<std::string> chain(1, ctx.bufferAttrEntity);
+        chain.insert(chain.end(), ctx.chainEntities.begin(), ctx.chainEntities.end());
+        chain.push_back(ctx.currEntity);
+        AttributeTuple at(ctx.bufferAttrEntity, ctx.bufferAttribute, "", "");
+        MonteCarloEstimate estimate = this->bayes->monteCarloChain(at, chain, ab,
+            ATTR_TUPLE_COMPARE_EQ, ctx.mcPrecision, ctx.mcBudget);
+        ctx.rspStr = estimate.toJson(ctx.bufferAttribute.compare("") == 0 ?
+            "probability" : "expected").toStyledString();
+        emitCLIGeneric(ctx.rspStr);
+        return;
+    }
+
+    // Probability or expected value along a chain of entities
+    if (ctx.chainEntities.size() > 0) {
+        std::vector<std::string> chain(1, ctx.bufferAttrEntity);
+        chain.insert(chain.end(), ctx.chainEntities.begin(), ctx.chainEntities.end());
+        chain.push_back(ctx.currEntity);
+        if (ctx.bufferAttribute.compare("") == 0)
+            emitCLIGeneric(std::to_string(this->bayes->chainConditional(chain, ab,
+                ATTR_TUPLE_COMPARE_EQ)));
+        else {
+            AttributeTuple at(ctx.bufferAttrEntity, ctx.bufferAttribute, "", "");
+            emitCLIGeneric(std::to_string(this->bayes->chainExpected(at, chain, ab,
+                ATTR_TUPLE_COMPARE_EQ)));
+        }
+        return;
+    }
+
+    // Counts, probabilities and means per group of the given entity
+    if (ctx.groupAttribute.compare("") != 0) {
+        GroupTable groups = this->bayes->groupRelations(ctx.bufferAttrEntity, ctx.bufferAttribute,
+            ctx.currEntity, ctx.groupAttribute, ab, ATTR_TUPLE_COMPARE_EQ);
+        ctx.rspStr = groups.toJson().toStyledString();
+        emitCLIGeneric(ctx.rspStr);
+        return;
+    }
+
+    // Without an attribute infer the conditional probability of the entity
+    if (ctx.bufferAttribute.compare("") == 0) {
+        if (ctx.infApprox) {
+            Json::Value json = this->bayes->approxConditional(ctx.bufferAttrEntity,
+                ctx.currAttrEntity, ab, ATTR_TUPLE_COMPARE_EQ).toJson("probability");
+            ctx.rspStr = json.toStyledString();
+            emitCLIGeneric(ctx.rspStr);
+        } else
+            emitCLIGeneric(std::to_string(this->bayes->computeConditional(
+                ctx.bufferAttrEntity, ctx.currAttrEntity, ab, ATTR_TUPLE_COMPARE_EQ)));
+        return;
+    }
 
     // Call sampling method from Bayes for relations
-    AttributeTuple* at = new AttributeTuple(this->bufferAttrEntity,
-        this->bufferAttribute, "", "");
+    AttributeTuple* at = new AttributeTuple(ctx.bufferAttrEntity,
+        ctx.bufferAttribute, "", "");
+    // Estimate the expected value from the pair reservoirs
+    if (ctx.infApprox) {
+        Json::Value json = this->bayes->estimateExpected(*at, ab, ATTR_TUPLE_COMPARE_EQ).toJson("expected");
+        ctx.rspStr = json.toStyledString();
+        emitCLIGeneric(ctx.rspStr);
+        delete at;
+        return;
+    }
+
+    // The most frequent values with their instance counts
+    if (ctx.infStatistic == KW_TOP) {
+        std::vector<ValueCount> top = this->bayes->topAttribute(*at, ab, ATTR_TUPLE_COMPARE_EQ,
+            ctx.infTopCount);
+        Json::Value json(Json::arrayValue), item;
+        for (std::vector<ValueCount>::iterator it = top.begin(); it != top.end(); ++it) {
+            item = Json::Value();
+            item["value"] = it->value;
+            item["count"] = (Json::Int64)it->count;
+            json.append(item);
+        }
+        ctx.rspStr = json.toStyledString();
+        emitCLIGeneric(ctx.rspStr);
+        delete at;
+        return;
+    }
+
     // TODO - allow type of comparison to be specified
-    float exp = this->bayes->expectedAttribute(*at, ab, ATTR_TUPLE_COMPARE_EQ);
+    float exp;
+    if (ctx.infStatistic == KW_VAR)
+        exp = this->bayes->varianceAttribute(*at, ab, ATTR_TUPLE_COMPARE_EQ);
+    else if (ctx.infStatistic == KW_STDDEV)
+        exp = this->bayes->stddevAttribute(*at, ab, ATTR_TUPLE_COMPARE_EQ);
+    else if (ctx.infStatistic == KW_PCT)
+        exp = this->bayes->quantileAttribute(*at, ab, ATTR_TUPLE_COMPARE_EQ,
+            ctx.infPercentile / 100.0);
+    else
+        exp = this->bayes->expectedAttribute(*at, ab, ATTR_TUPLE_COMPARE_EQ);
 
-    // Print the expected value
+    // Print the expected value or the requested statistic
     emitCLIGeneric(std::to_string(exp));
     delete at;
 }
 
-void Parser::processSET() {
+void Parser::processCPT(ParseContext& ctx) {
+
+    // List all tables
+    if (ctx.macroState == STATE_LST_CPT && ctx.bufferAttrEntity.compare("") == 0) {
+        Json::Value tables(Json::arrayValue);
+        std::vector<Json::Value> definitions = this->indexHandler->fetchConditionalTables();
+        for (std::vector<Json::Value>::iterator it = definitions.begin(); it != definitions.end(); ++it)
+            tables.append(*it);
+        ctx.rspStr = tables.toStyledString();
+        emitCLIGeneric(ctx.rspStr);
+        return;
+    }
+
+    std::string name = ConditionalTable::tableName(ctx.bufferAttrEntity, ctx.bufferAttribute,
+        ctx.currAttrEntity, ctx.currAttribute);
+
+    if (ctx.macroState == STATE_ADD_CPT) {
+        if (this->indexHandler->writeConditionalTable(ctx.bufferAttrEntity, ctx.bufferAttribute,
+                ctx.currAttrEntity, ctx.currAttribute, ctx.tableLimit)) {
+            ctx.rspStr = std::string("Conditional table added: ") + name;
+            emitCLINote(ctx.rspStr);
+        } else {
+            ctx.error = true;
+            ctx.errStr = ERR_BAD_CPT;
+        }
+
+    } else if (ctx.macroState == STATE_LST_CPT) {
+        Json::Value table;
+        if (this->indexHandler->fetchConditionalTable(name, table)) {
+            ctx.rspStr = table.toStyledString();
+            emitCLIGeneric(ctx.rspStr);
+        } else {
+            ctx.error = true;
+            ctx.errStr = ERR_CPT_NOT_EXISTS;
+        }
+
+    } else if (this->indexHandler->removeConditionalTable(name)) {
+        ctx.rspStr = std::string("Conditional table removed: ") + name;
+        emitCLINote(ctx.rspStr);
+    } else {
+        ctx.error = true;
+        ctx.errStr = ERR_CPT_NOT_EXISTS;
+    }
+}
+
+void Parser::processNB(ParseContext& ctx) {
+
+    // List all classifiers
+    if (ctx.macroState == STATE_LST_NB && ctx.currAttrEntity.compare("") == 0) {
+        Json::Value classifiers(Json::arrayValue);
+        std::vector<Json::Value> definitions = this->indexHandler->fetchClassifiers();
+        for (std::vector<Json::Value>::iterator it = definitions.begin(); it != definitions.end(); ++it)
+            classifiers.append(*it);
+        ctx.rspStr = classifiers.toStyledString();
+        emitCLIGeneric(ctx.rspStr);
+        return;
+    }
+
+    std::string name = ClassifierRegistry::classifierName(ctx.currAttrEntity, ctx.currAttribute,
+        ctx.currEntity);
+
+    if (ctx.macroState == STATE_ADD_NB) {
+        if (this->indexHandler->writeClassifier(ctx.currAttrEntity, ctx.currAttribute, ctx.currEntity)) {
+            ctx.rspStr = std::string("Classifier added: ") + name;
+            emitCLINote(ctx.rspStr);
+        } else {
+            ctx.error = true;
+            ctx.errStr = ERR_BAD_NB;
+        }
+
+    } else if (ctx.macroState == STATE_LST_NB) {
+        Json::Value summary;
+        if (this->bayes->compileClassifier(name, summary)) {
+            ctx.rspStr = summary.toStyledString();
+            emitCLIGeneric(ctx.rspStr);
+        } else {
+            ctx.error = true;
+            ctx.errStr = ERR_NB_NOT_EXISTS;
+        }
+
+    } else if (ctx.macroState == STATE_CLASSIFY) {
+        std::vector<Classification> results;
+        Json::Value json(Json::arrayValue);
+        if (this->bayes->classify(name, ctx.classifyInstances, results)) {
+            for (std::vector<Classification>::iterator it = results.begin(); it != results.end(); ++it)
+                json.append(it->toJson());
+            ctx.rspStr = json.toStyledString();
+            emitCLIGeneric(ctx.rspStr);
+        } else {
+            ctx.error = true;
+            ctx.errStr = ERR_NB_NOT_EXISTS;
+        }
+
+    } else if (this->indexHandler->removeClassifier(name)) {
+        ctx.rspStr = std::string("Classifier removed: ") + name;
+        emitCLINote(ctx.rspStr);
+    } else {
+        ctx.error = true;
+        ctx.errStr = ERR_NB_NOT_EXISTS;
+    }
+}
+
+void Parser::processCUBE(ParseContext& ctx) {
+
+    // List all cubes
+    if (ctx.macroState == STATE_LST_CUBE && ctx.cubeAttributes.size() == 0) {
+        Json::Value cubes(Json::arrayValue);
+        std::vector<Json::Value> definitions = this->indexHandler->fetchCubes();
+        for (std::vector<Json::Value>::iterator it = definitions.begin(); it != definitions.end(); ++it)
+            cubes.append(*it);
+        ctx.rspStr = cubes.toStyledString();
+        emitCLIGeneric(ctx.rspStr);
+        return;
+    }
+
+    std::string name = AggregateCube::cubeName(ctx.cubeAttributes);
+
+    if (ctx.macroState == STATE_ADD_CUBE) {
+        if (this->indexHandler->writeCube(ctx.cubeAttributes, ctx.cubeLimit)) {
+            ctx.rspStr = std::string("Cube added: ") + name;
+            emitCLINote(ctx.rspStr);
+        } else {
+            ctx.error = true;
+            ctx.errStr = ERR_BAD_CUBE;
+        }
+
+    } else if (ctx.macroState == STATE_LST_CUBE) {
+        Json::Value cube;
+        if (this->indexHandler->fetchCube(name, cube)) {
+            ctx.rspStr = cube.toStyledString();
+            emitCLIGeneric(ctx.rspStr);
+        } else {
+            ctx.error = true;
+            ctx.errStr = ERR_CUBE_NOT_EXISTS;
+        }
+
+    } else if (this->indexHandler->removeCube(name)) {
+        ctx.rspStr = std::string("Cube removed: ") + name;
+        emitCLINote(ctx.rspStr);
+    } else {
+        ctx.error = true;
+        ctx.errStr = ERR_CUBE_NOT_EXISTS;
+    }
+}
+
+void Parser::processWATCH(ParseContext& ctx) {
+
+    // Register a standing query - chains, groups, statistics and estimates are not maintained
+    if (ctx.macroState == STATE_INF) {
+        if (ctx.chainEntities.size() > 0 || ctx.groupAttribute.compare("") != 0 ||
+                ctx.infStatistic != KW_NONE || ctx.infApprox || ctx.infMonteCarlo ||
+                ctx.sampleCount > 0 || ctx.sampleSeeded) {
+            ctx.error = true;
+            ctx.errStr = ERR_BAD_WATCH;
+            return;
+        }
+
+        AttributeBucket ab;
+        ab.addAttributes(ctx.currAttrEntity, ctx.currValues, ctx.currTypes);
+        std::string id = this->indexHandler->writeStandingQuery(ctx.bufferAttrEntity,
+            ctx.bufferAttribute, ctx.currAttrEntity, ab, ATTR_TUPLE_COMPARE_EQ);
+        Json::Value query;
+        if (id.compare("") != 0 && this->indexHandler->fetchStandingQuery(id, query)) {
+            ctx.rspStr = query.toStyledString();
+            emitCLIGeneric(ctx.rspStr);
+        } else {
+            ctx.error = true;
+            ctx.errStr = ERR_BAD_WATCH;
+        }
+        return;
+    }
+
+    // List all standing queries
+    if (ctx.macroState == STATE_LST_WATCH && ctx.currValue.compare("") == 0) {
+        Json::Value queries(Json::arrayValue);
+        std::vector<Json::Value> definitions = this->indexHandler->fetchStandingQueries();
+        for (std::vector<Json::Value>::iterator it = definitions.begin(); it != definitions.end(); ++it)
+            queries.append(*it);
+        ctx.rspStr = queries.toStyledString();
+        emitCLIGeneric(ctx.rspStr);
+        return;
+    }
+
+    if (ctx.macroState == STATE_LST_WATCH) {
+        Json::Value query;
+        if (this->indexHandler->fetchStandingQuery(ctx.currValue, query)) {
+            ctx.rspStr = query.toStyledString();
+            emitCLIGeneric(ctx.rspStr);
+        } else {
+            ctx.error = true;
+            ctx.errStr = ERR_WATCH_NOT_EXISTS;
+        }
+
+    } else if (this->indexHandler->removeStandingQuery(ctx.currValue)) {
+        ctx.rspStr = std::string("Standing query removed: ") + ctx.currValue;
+        emitCLINote(ctx.rspStr);
+    } else {
+        ctx.error = true;
+        ctx.errStr = ERR_WATCH_NOT_EXISTS;
+    }
+}
+
+void Parser::processPREPARE(ParseContext& ctx) {
+
+    if (ctx.macroState == STATE_RM_PREPARED) {
+        std::lock_guard<std::mutex> guard(this->preparedLock);
+        if (this->prepared.erase(ctx.preparedName) > 0) {
+            ctx.rspStr = std::string("Prepared statement removed: ") + ctx.preparedName;
+            emitCLINote(ctx.rspStr);
+        } else {
+            ctx.error = true;
+            ctx.errStr = ERR_PREPARED_NOT_EXISTS;
+        }
+        return;
+    }
+
+    // Relations only, standing queries are already maintained without parsing
+    if ((ctx.macroState != STATE_ADD && ctx.macroState != STATE_GEN &&
+            ctx.macroState != STATE_INF) || ctx.watching) {
+        ctx.error = true;
+        ctx.errStr = ERR_BAD_PREPARE;
+        return;
+    }
+
+    // The plan is the parsed context itself, detached from any batch
+    PreparedStatement plan;
+    plan.name = ctx.preparedName;
+    plan.statement = ctx.preparedText;
+    plan.context = ctx;
+    plan.context.batch = NULL;
+    plan.context.preparing = false;
+    plan.context.currFields.clear();
+
+    plan.resolve(*(this->indexHandler));
+    {
+        std::lock_guard<std::mutex> guard(this->preparedLock);
+        this->prepared[plan.name] = plan;
+    }
+    ctx.rspStr = plan.toJson().toStyledString();
+    emitCLIGeneric(ctx.rspStr);
+}
+
+void Parser::processEXECUTE(ParseContext& ctx, RedisHandler& redis) {
+
+    // Run a copy of the plan so it may be dropped or replaced while executing
+    PreparedStatement plan;
+    {
+        std::lock_guard<std::mutex> guard(this->preparedLock);
+        std::unordered_map<std::string, PreparedStatement>::iterator it = this->prepared.find(ctx.preparedName);
+        if (it == this->prepared.end()) {
+            ctx.error = true;
+            ctx.errStr = ERR_PREPARED_NOT_EXISTS;
+            return;
+        }
+        plan = it->second;
+    }
+
+    // A plan checked against entities since redefined is dropped, unless it was prepared again meanwhile
+    if (!plan.current(*(this->indexHandler))) {
+        std::lock_guard<std::mutex> guard(this->preparedLock);
+        std::unordered_map<std::string, PreparedStatement>::iterator it = this->prepared.find(plan.name);
+        if (it != this->prepared.end() && it->second.statement.compare(plan.statement) == 0 &&
+                it->second.schemas == plan.schemas)
+            this->prepared.erase(it);
+        ctx.error = true;
+        ctx.errStr = ERR_PREPARED_STALE;
+        return;
+    }
+
+    // Restore the parsed statement with the bound values and run it in the batch of the EXECUTE
+    BatchState* batch = ctx.batch;
+    ParseContext bound;
+    if (!plan.bind(ctx.executeValues, bound)) {
+        ctx.error = true;
+        ctx.errStr = ERR_BAD_BIND;
+        return;
+    }
+    ctx.cleanup();
+    ctx = bound;
+    ctx.batch = batch;
+
+    this->processStatement(ctx, redis);
+}
+
+void Parser::processSET(ParseContext& ctx) {
 
     // Construct attribute bucket
     AttributeBucket ab;
     bool goodSet = false;
-    ab.addAttributes(this->currAttrEntity, *(this->bufferValues), *(this->bufferTypes));
+    ab.addAttributes(ctx.currAttrEntity, ctx.bufferValues, ctx.bufferTypes);
 
     // Filter out candidate relations
-    std::vector<Json::Value> relations = this->indexHandler->fetchRelationPrefix(this->bufferEntity, this->currEntity);
+    std::vector<Json::Value> relations = this->indexHandler->fetchRelationPrefix(ctx.bufferEntity, ctx.currEntity);
     this->indexHandler->filterRelations(relations, ab, ATTR_TUPLE_COMPARE_EQ);
 
     // Iterate through relations to be set
@@ -1054,74 +2210,74 @@ void Parser::processSET() {
 
         // Each iteration should be atomic
         if (!this->indexHandler->removeRelation(*it)) {
-            this->error = true;
-            this->errStr = ERR_BAD_SET;
-            emitCLIError(std::string("Could not remove relation, aborting SET: ") + this->currAttrEntity + std::string(".") + this->currAttribute);
+            ctx.error = true;
+            ctx.errStr = ERR_BAD_SET;
+            emitCLIError(std::string("Could not remove relation, aborting SET: ") + ctx.currAttrEntity + std::string(".") + ctx.currAttribute);
             continue;
         }
 
         // Does the update entity match the left hand entity?
-        if (this->currAttrEntity.compare((*it)[JSON_ATTR_REL_ENTL].asCString()) == 0) {
+        if (ctx.currAttrEntity.compare((*it)[JSON_ATTR_REL_ENTL].asCString()) == 0) {
 
             // First ensure that the attribute in fact exists for the specified entity
-            if (!(*it)[JSON_ATTR_REL_FIELDSL].isMember(this->currAttribute)) {
+            if (!(*it)[JSON_ATTR_REL_FIELDSL].isMember(ctx.currAttribute)) {
                 this->indexHandler->writeRelation(*it);   // Write back the original relation
-                emitCLINote(std::string("Attribute not found in SET: ") + this->currAttrEntity + std::string(".") + this->currAttribute);
+                emitCLINote(std::string("Attribute not found in SET: ") + ctx.currAttrEntity + std::string(".") + ctx.currAttribute);
                 continue;
             }
 
             // Finally ensure that the field type matches the value before writing
-            if (this->indexHandler->validateEntityFieldType(this->currAttrEntity, this->currAttribute, this->currValue)) {
-                (*it)[JSON_ATTR_REL_FIELDSL][this->currAttribute] = this->currValue;
+            if (this->indexHandler->validateEntityFieldType(ctx.currAttrEntity, ctx.currAttribute, ctx.currValue)) {
+                (*it)[JSON_ATTR_REL_FIELDSL][ctx.currAttribute] = ctx.currValue;
                 goodSet = true;
             } else {
-                this->error = true;
-                this->errStr = ERR_BAD_SET;
-                emitCLIError(std::string("Invalid type: ") + this->currAttrEntity + std::string(".") + this->currAttribute + std::string(" to ") + this->currValue);
+                ctx.error = true;
+                ctx.errStr = ERR_BAD_SET;
+                emitCLIError(std::string("Invalid type: ") + ctx.currAttrEntity + std::string(".") + ctx.currAttribute + std::string(" to ") + ctx.currValue);
             }
 
         // Does it match the right-hand entity?
-        } else if (this->currAttrEntity.compare((*it)[
+        } else if (ctx.currAttrEntity.compare((*it)[
             JSON_ATTR_REL_ENTR].asCString()) == 0) {
 
             // First ensure that the attribute in fact exists for the
             // specified entity
-            if (!(*it)[JSON_ATTR_REL_FIELDSR].isMember(this->currAttribute)) {
+            if (!(*it)[JSON_ATTR_REL_FIELDSR].isMember(ctx.currAttribute)) {
                 // Write back the original relation
                 this->indexHandler->writeRelation(*it);
                 emitCLINote(std::string("Attribute not found in SET: ") +
-                    this->bufferAttrEntity + std::string(".") +
-                    this->currAttribute);
+                    ctx.bufferAttrEntity + std::string(".") +
+                    ctx.currAttribute);
                 continue;
             }
 
             // Finally ensure that the field type matches the value before
             // writing
             if (this->indexHandler->validateEntityFieldType(
-                this->currAttrEntity, this->currAttribute, this->currValue)) {
-                (*it)[JSON_ATTR_REL_FIELDSR][this->currAttribute] =
-                    this->currValue;
+                ctx.currAttrEntity, ctx.currAttribute, ctx.currValue)) {
+                (*it)[JSON_ATTR_REL_FIELDSR][ctx.currAttribute] =
+                    ctx.currValue;
                 goodSet = true;
             } else {
-                this->error = true;
-                this->errStr = ERR_BAD_SET;
+                ctx.error = true;
+                ctx.errStr = ERR_BAD_SET;
                 emitCLIError(std::string("Invalid type: ") +
-                    this->currAttrEntity + std::string(".") +
-                    this->currAttribute + std::string(" to ") +
-                    this->currValue);
+                    ctx.currAttrEntity + std::string(".") +
+                    ctx.currAttribute + std::string(" to ") +
+                    ctx.currValue);
             }
         }
 
         if (this->indexHandler->writeRelation(*it) && goodSet) {
-            emitCLINote(std::string("SET attribute: ") + this->currAttrEntity +
-                std::string(".") + this->currAttribute + std::string(" to ") +
-                this->currValue);
+            emitCLINote(std::string("SET attribute: ") + ctx.currAttrEntity +
+                std::string(".") + ctx.currAttribute + std::string(" to ") +
+                ctx.currValue);
         } else {
-            this->error = true;
-            this->errStr = ERR_BAD_SET;
+            ctx.error = true;
+            ctx.errStr = ERR_BAD_SET;
             emitCLIError(std::string("Could not write back relation: ") +
-                this->currAttrEntity + std::string(".") + this->currAttribute +
-                std::string(" to ") + this->currValue);
+                ctx.currAttrEntity + std::string(".") + ctx.currAttribute +
+                std::string(" to ") + ctx.currValue);
         }
 
         goodSet = false;
@@ -1134,10 +2290,10 @@ void Parser::processSET() {
  *
  * Emits an error if the key for this relation does not exist.
  */
-void Parser::processDEC(RedisHandler& redis) {
-    Relation r(this->bufferEntity, this->currEntity, *(this->bufferValues),
-        *(this->currValues), *(this->bufferTypes), *(this->currTypes));
-    if (r.decrementCount(redis, std::stoi(this->currValue)))
+void Parser::processDEC(ParseContext& ctx) {
+    Relation r(ctx.bufferEntity, ctx.currEntity, ctx.bufferValues,
+        ctx.currValues, ctx.bufferTypes, ctx.currTypes);
+    if (this->indexHandler->decrementRelation(r, std::stoi(ctx.currValue)))
         emitCLIGeneric(std::string("Decremented ") + r.generateKey());
     else
         emitCLIError(r.generateKey() + " does not exist in the index.");
@@ -0,0 +1,163 @@
+/*
+ *  pool.h
+ *
+ *  Defines a work-stealing thread pool.  Each worker owns a deque of tasks, runs its own tasks
+ *  newest first and, once out of work, steals the oldest task of another worker.  Tasks are passed
+ *  the index of the worker running them so they can use state owned by that worker, e.g. a random
+ *  stream or partial accumulators, without locking.
+ *
+ *  Created by Ryan Faulkner on 2015-12-26
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _pool_h
+#define _pool_h
+
+#include <deque>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+#define POOL_MAX_WORKERS 8
+
+
+/** Task run on the pool, passed the index of the worker running it */
+typedef std::function<void(long)> PoolTask;
+
+
+class WorkStealingPool {
+
+    /** Tasks owned by one worker */
+    struct WorkerQueue {
+        std::deque<PoolTask> tasks;
+        std::mutex lock;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::vector<std::thread> threads;
+    std::mutex stateLock;
+    std::condition_variable wake;       // signalled when tasks are queued or the pool stops
+    std::condition_variable idle;       // signalled when the last pending task completes
+    std::atomic<long> queued;
+    long pending;
+    long nextQueue;
+    bool stopping;
+
+    bool take(long, PoolTask&);
+    void run(long);
+
+public:
+    WorkStealingPool(long = 0);
+    ~WorkStealingPool();
+
+    static long defaultSize();
+
+    void submit(PoolTask);
+    void submit(long, PoolTask);
+    void wait();
+    long size() { return this->queues.size(); }
+};
+
+/** Start the workers, one per hardware thread up to POOL_MAX_WORKERS when no size is given */
+WorkStealingPool::WorkStealingPool(long workers) : queued(0), pending(0), nextQueue(0), stopping(false) {
+    if (workers <= 0) workers = WorkStealingPool::defaultSize();
+    for (long i = 0; i < workers; i++)
+        this->queues.push_back(std::unique_ptr<WorkerQueue>(new WorkerQueue()));
+    for (long i = 0; i < workers; i++)
+        this->threads.push_back(std::thread(&WorkStealingPool::run, this, i));
+}
+
+/** Stop the workers once the queued tasks are done */
+WorkStealingPool::~WorkStealingPool() {
+    this->wait();
+    {
+        std::lock_guard<std::mutex> guard(this->stateLock);
+        this->stopping = true;
+    }
+    this->wake.notify_all();
+    for (std::vector<std::thread>::iterator it = this->threads.begin(); it != this->threads.end(); ++it)
+        it->join();
+}
+
+/** Number of workers for a pool sized to the machine */
+long WorkStealingPool::defaultSize() {
+    long cores = std::thread::hardware_concurrency();
+    if (cores <= 0) cores = 1;
+    return std::min(cores, (long)POOL_MAX_WORKERS);
+}
+
+/** Queue a task, spreading tasks over the workers in turn */
+void WorkStealingPool::submit(PoolTask task) {
+    long worker;
+    {
+        std::lock_guard<std::mutex> guard(this->stateLock);
+        worker = this->nextQueue++ % this->queues.size();
+    }
+    this->submit(worker, task);
+}
+
+/** Queue a task on a given worker, others may still steal it */
+void WorkStealingPool::submit(long worker, PoolTask task) {
+    WorkerQueue& queue = *(this->queues[worker % this->queues.size()]);
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        queue.tasks.push_back(task);
+    }
+    {
+        std::lock_guard<std::mutex> guard(this->stateLock);
+        this->pending++;
+        this->queued++;
+    }
+    this->wake.notify_one();
+}
+
+/** Block until every task submitted so far has completed */
+void WorkStealingPool::wait() {
+    std::unique_lock<std::mutex> guard(this->stateLock);
+    this->idle.wait(guard, [this] { return this->pending == 0; });
+}
+
+/** Take the newest task of a worker or else steal the oldest task of another */
+bool WorkStealingPool::take(long worker, PoolTask& task) {
+    long n = this->queues.size();
+    for (long i = 0; i < n; i++) {
+        WorkerQueue& queue = *(this->queues[(worker + i) % n]);
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.tasks.empty()) continue;
+        if (i == 0) {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+        } else {
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+        }
+        this->queued--;
+        return true;
+    }
+    return false;
+}
+
+/** Worker body - runs tasks until the pool stops */
+void WorkStealingPool::run(long worker) {
+    PoolTask task;
+    while (true) {
+        if (this->take(worker, task)) {
+            task(worker);
+            std::lock_guard<std::mutex> guard(this->stateLock);
+            if (--this->pending == 0)
+                this->idle.notify_all();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(this->stateLock);
+        this->wake.wait(guard, [this] { return this->stopping || this->queued > 0; });
+        if (this->stopping && this->queued == 0) return;
+    }
+}
+
+#endif
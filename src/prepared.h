@@ -0,0 +1,155 @@
+/*
+ *  prepared.h
+ *
+ *  Defines prepared statements.  A statement is parsed and type checked once when prepared, the
+ *  parsed state is kept as a plan along with the attribute types of every placeholder and the
+ *  definitions of the entities it was checked against.  Executing the plan only validates the
+ *  bound values with the kept types, the entities are checked to be unchanged with one read each.
+ *
+ *  Created by Ryan Faulkner on 2015-12-28
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _prepared_h
+#define _prepared_h
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <json/json.h>
+
+#include "column_types.h"
+#include "context.h"
+#include "index.h"
+
+#define PREPARED_PLACEHOLDER "?"
+
+#define PREPARED_BIND_LEFT 0        // Attribute of the first entity of a relation
+#define PREPARED_BIND_RIGHT 1       // Attribute of the second entity, or of the given entity of GEN/INF
+#define PREPARED_BIND_COUNT 2       // Instance count of ADD REL
+
+#define JSON_ATTR_PREP_NAME "prepared"
+#define JSON_ATTR_PREP_STMT "statement"
+#define JSON_ATTR_PREP_PARAMS "parameters"
+
+
+/** A placeholder of a prepared statement, where its value is bound and the type it must have */
+struct PreparedParameter {
+    int target;
+    long index;
+    std::string attribute;
+    std::string type;
+
+    PreparedParameter(int target, long index, std::string attribute, std::string type) :
+        target(target), index(index), attribute(attribute), type(type) {}
+};
+
+
+/**
+ *  Parsed context of an ADD REL, GEN or INF statement.  The attribute lists of the context hold the
+ *  placeholder wherever a value is bound on execution.
+ */
+class PreparedStatement {
+
+public:
+
+    std::string name;
+    std::string statement;
+    ParseContext context;
+
+    std::vector<PreparedParameter> parameters;
+    std::unordered_map<std::string, Json::Value> schemas;  // Fields of each entity when prepared
+
+    void resolve(IndexHandler&);
+    bool current(IndexHandler&);
+    bool bind(std::vector<std::string>&, ParseContext&);
+    Json::Value toJson();
+};
+
+/**
+ *  Find the placeholders in the order they appear in the statement and keep the definitions of
+ *  the entities the statement was checked against
+ */
+void PreparedStatement::resolve(IndexHandler& ih) {
+    std::vector<std::string> entities;
+    Json::Value json;
+    ParseContext& ctx = this->context;
+
+    this->parameters.clear();
+    for (long i = 0; i < (long)ctx.bufferValues.size(); i++)
+        if (ctx.bufferValues[i].second.compare(PREPARED_PLACEHOLDER) == 0)
+            this->parameters.push_back(PreparedParameter(PREPARED_BIND_LEFT, i, ctx.bufferValues[i].first,
+                ctx.bufferTypes[ctx.bufferValues[i].first]));
+    for (long i = 0; i < (long)ctx.currValues.size(); i++)
+        if (ctx.currValues[i].second.compare(PREPARED_PLACEHOLDER) == 0)
+            this->parameters.push_back(PreparedParameter(PREPARED_BIND_RIGHT, i, ctx.currValues[i].first,
+                ctx.currTypes[ctx.currValues[i].first]));
+    if (ctx.currValue.compare(PREPARED_PLACEHOLDER) == 0)
+        this->parameters.push_back(PreparedParameter(PREPARED_BIND_COUNT, 0, "", COLTYPE_NAME_INT));
+
+    entities.push_back(ctx.bufferEntity);
+    entities.push_back(ctx.currEntity);
+    entities.push_back(ctx.bufferAttrEntity);
+    entities.insert(entities.end(), ctx.chainEntities.begin(), ctx.chainEntities.end());
+    this->schemas.clear();
+    for (std::vector<std::string>::iterator it = entities.begin(); it != entities.end(); ++it)
+        if (it->compare("") != 0 && this->schemas.find(*it) == this->schemas.end()) {
+            json = Json::Value();
+            ih.fetchEntity(*it, json);
+            this->schemas[*it] = json[JSON_ATTR_ENT_FIELDS];
+        }
+}
+
+/** Are the entities defined as they were when the statement was prepared? */
+bool PreparedStatement::current(IndexHandler& ih) {
+    Json::Value json;
+    for (std::unordered_map<std::string, Json::Value>::iterator it = this->schemas.begin();
+            it != this->schemas.end(); ++it) {
+        json = Json::Value();
+        ih.fetchEntity(it->first, json);
+        if (!(json[JSON_ATTR_ENT_FIELDS] == it->second)) return false;
+    }
+    return true;
+}
+
+/**
+ *  Bind values to the placeholders, each validated with the type of its attribute
+ *
+ *  @param values   one value per placeholder in order
+ *  @param ctx      context to run, the parsed context with the values bound
+ *  @return         false if the number of values differs or a value has the wrong type
+ */
+bool PreparedStatement::bind(std::vector<std::string>& values, ParseContext& ctx) {
+    if (values.size() != this->parameters.size()) return false;
+    for (long i = 0; i < (long)this->parameters.size(); i++)
+        if (!validateType(this->parameters[i].type, values[i])) return false;
+
+    ctx = this->context;
+    for (long i = 0; i < (long)this->parameters.size(); i++) {
+        PreparedParameter& param = this->parameters[i];
+        if (param.target == PREPARED_BIND_LEFT)
+            ctx.bufferValues[param.index].second = values[i];
+        else if (param.target == PREPARED_BIND_RIGHT)
+            ctx.currValues[param.index].second = values[i];
+        else
+            ctx.currValue = values[i];
+    }
+    return true;
+}
+
+/** Json form of the statement with the attribute and type of each placeholder */
+Json::Value PreparedStatement::toJson() {
+    Json::Value json, param;
+    json[JSON_ATTR_PREP_NAME] = this->name;
+    json[JSON_ATTR_PREP_STMT] = this->statement;
+    json[JSON_ATTR_PREP_PARAMS] = Json::Value(Json::arrayValue);
+    for (std::vector<PreparedParameter>::iterator it = this->parameters.begin(); it != this->parameters.end(); ++it) {
+        param = Json::Value();
+        param["attribute"] = it->target == PREPARED_BIND_COUNT ? std::string("count") : it->attribute;
+        param["type"] = it->type;
+        json[JSON_ATTR_PREP_PARAMS].append(param);
+    }
+    return json;
+}
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ *  random.h
+ *
+ *  Defines the random streams used by the samplers.  Streams are xoshiro256** generators, each
+ *  thread owns one and any number of independent streams can be split from it, e.g. one per
+ *  request or worker.  A stream seeded explicitly reproduces the same draws on every run.
+ *
+ *  Created by Ryan Faulkner on 2015-12-16
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _random_h
+#define _random_h
+
+#include <stdint.h>
+#include <atomic>
+#include <random>
+
+
+/**
+ *  xoshiro256** stream - 2^256 - 1 period, jump() advances 2^128 draws to give non-overlapping
+ *  streams.
+ */
+class RandomStream {
+
+    uint64_t s[4];
+
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+    static uint64_t splitmix(uint64_t&);
+    static uint64_t entropy();
+
+public:
+    RandomStream() { this->seed(RandomStream::entropy()); }
+    RandomStream(uint64_t seed) { this->seed(seed); }
+
+    static RandomStream& local();
+
+    void seed(uint64_t);
+    uint64_t next();
+    double uniform();
+    uint64_t below(uint64_t);
+    void jump();
+    RandomStream split();
+};
+
+/** splitmix64 - expands a single seed into the generator state */
+uint64_t RandomStream::splitmix(uint64_t& x) {
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/** Seed material for unseeded streams, distinct per call even where random_device is deterministic */
+uint64_t RandomStream::entropy() {
+    static std::atomic<uint64_t> counter(0);
+    std::random_device device;
+    uint64_t x = ((uint64_t)device() << 32) ^ device();
+    return x ^ (++counter * 0x9e3779b97f4a7c15ULL);
+}
+
+/** The stream owned by the calling thread */
+RandomStream& RandomStream::local() {
+    static thread_local RandomStream stream;
+    return stream;
+}
+
+/** Reset the stream from a seed */
+void RandomStream::seed(uint64_t seed) {
+    for (int i = 0; i < 4; i++)
+        this->s[i] = RandomStream::splitmix(seed);
+}
+
+/** Next 64 random bits */
+uint64_t RandomStream::next() {
+    uint64_t result = RandomStream::rotl(this->s[1] * 5, 7) * 9;
+    uint64_t t = this->s[1] << 17;
+    this->s[2] ^= this->s[0];
+    this->s[3] ^= this->s[1];
+    this->s[1] ^= this->s[2];
+    this->s[0] ^= this->s[3];
+    this->s[2] ^= t;
+    this->s[3] = RandomStream::rotl(this->s[3], 45);
+    return result;
+}
+
+/** Uniform double in [0, 1) with 53 bits of precision */
+double RandomStream::uniform() {
+    return (this->next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/** Uniform integer in [0, n) without modulo bias (Lemire's method), 0 if n is 0 */
+uint64_t RandomStream::below(uint64_t n) {
+    if (n == 0) return 0;
+    unsigned __int128 m = (unsigned __int128)this->next() * n;
+    uint64_t low = (uint64_t)m;
+    if (low < n) {
+        uint64_t threshold = (0 - n) % n;
+        while (low < threshold) {
+            m = (unsigned __int128)this->next() * n;
+            low = (uint64_t)m;
+        }
+    }
+    return (uint64_t)(m >> 64);
+}
+
+/** Advance the stream by 2^128 draws */
+void RandomStream::jump() {
+    static const uint64_t JUMP[] = { 0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+        0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+    uint64_t t[4] = {0, 0, 0, 0};
+
+    for (int i = 0; i < 4; i++)
+        for (int b = 0; b < 64; b++) {
+            if (JUMP[i] & ((uint64_t)1 << b))
+                for (int j = 0; j < 4; j++)
+                    t[j] ^= this->s[j];
+            this->next();
+        }
+    for (int j = 0; j < 4; j++)
+        this->s[j] = t[j];
+}
+
+/** Hand out the current stream and jump past it, the two never overlap */
+RandomStream RandomStream::split() {
+    RandomStream stream = *this;
+    this->jump();
+    return stream;
+}
+
+#endif
@@ -13,6 +13,8 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <unordered_map>
+#include <sstream>
 
 #include "hiredis/hiredis.h"
 
@@ -35,36 +37,76 @@ class RedisHandler {
 
     redisContext *context;
 
+    // Number of commands appended to the pipeline awaiting replies
+    int pendingReplies;
+
 public:
     RedisHandler() {
         this->host = REDISHOST;
         this->port = REDISPORT;
+        this->context = NULL;
+        this->pendingReplies = 0;
         this->connect();
     }
     RedisHandler(std::string host, int port) {
         this->host = host;
         this->port = port;
+        this->context = NULL;
+        this->pendingReplies = 0;
         this->connect();
     }
+    ~RedisHandler() { if (this->context != NULL) redisFree(this->context); }
+
+    // The handler owns its connection
+    RedisHandler(const RedisHandler&) = delete;
+    RedisHandler& operator=(const RedisHandler&) = delete;
 
     void connect();
 
     void write(std::string, std::string);
+    void writeMany(std::vector<std::string>&, std::vector<std::string>&);
     void writeHashMap(std::string, std::string, std::string);
+    bool writeHashMapIfAbsent(std::string, std::string, std::string);
     void incrementHashMap(std::string, std::string, int);
     void incrementKey(std::string, int);
     void decrementKey(std::string, int);
     void deleteKey(std::string);
+    std::vector<bool> deleteKeys(std::vector<std::string>&);
+    bool setIfAbsent(std::string, std::string, long);
+    void expire(std::string, long);
+    long incrementAndRead(std::string, int);
+    long incrementHashMapAndRead(std::string, std::string, int);
 
     bool exists(std::string);
 
     std::string read(std::string);
+    std::vector<std::string> readMany(std::vector<std::string>&);
     std::string readHashMap(std::string, std::string);
+    std::unordered_map<std::string, std::string> readHashMapAll(std::string);
+    void deleteHashMapField(std::string, std::string);
+    long hashMapLength(std::string);
     std::vector<std::string> keys(std::string);
+
+    void addSetMember(std::string, std::string);
+    void removeSetMember(std::string, std::string);
+    std::vector<std::string> setMembers(std::string);
+
+    std::vector<std::pair<std::string, double>> sortedSetTop(std::string, long);
+    std::vector<std::string> sortedSetWithScore(std::string, double, long);
+
+    void publish(std::string, std::string);
+
+    // Pipelining - commands are buffered until the pipeline is flushed
+    void appendCommand(std::vector<std::string>);
+    std::vector<std::string> flushPipeline();
 };
 
-/** Establishes a connection to a redis instance */
-void RedisHandler::connect() { this->context = redisConnect(REDISHOST, REDISPORT); }
+/** Establishes a connection to a redis instance, closing any previous one */
+void RedisHandler::connect() {
+    if (this->context != NULL) redisFree(this->context);
+    this->context = redisConnect(REDISHOST, REDISPORT);
+    this->pendingReplies = 0;
+}
 
 /** Writes a key value to redis */
 void RedisHandler::write(std::string key, std::string value) {
@@ -76,6 +118,17 @@ void RedisHandler::writeHashMap(std::string key, std::string hash, std::string v
     redisCommand(this->context, "HSET %s %s %s", key.c_str(), hash.c_str(), value.c_str());
 }
 
+/** Writes a value to a redis hash map field unless the field exists, true if it was written */
+bool RedisHandler::writeHashMapIfAbsent(std::string key, std::string hash, std::string value) {
+    bool written = false;
+    redisReply *reply = (redisReply*)redisCommand(this->context, "HSETNX %s %s %s", key.c_str(), hash.c_str(),
+        value.c_str());
+    if (reply != NULL && reply->type == REDIS_REPLY_INTEGER)
+        written = reply->integer == 1;
+    freeReplyObject(reply);
+    return written;
+}
+
 /** Writes a value to redis hash map */
 void RedisHandler::incrementHashMap(std::string key, std::string hash, int value) {
     redisCommand(this->context, "HINCRBY %s %s %s", key.c_str(), hash.c_str(), std::to_string(value).c_str());
@@ -100,21 +153,103 @@ std::string RedisHandler::read(std::string key) {
     return result;
 }
 
-/** Read a value from redis given a key */
+/** Read a value from redis hash map - missing fields map to "" */
 std::string RedisHandler::readHashMap(std::string key, std::string hash) {
     std::string result;
     redisReply *reply = (redisReply*)redisCommand(this->context, "HGET %s %s", key.c_str(), hash.c_str());
-    result = reply->str;
+    if (reply != NULL && reply->type == REDIS_REPLY_STRING)
+        result = reply->str;
     freeReplyObject(reply);
     return result;
 }
 
+/** Read all fields and values of a redis hash map */
+std::unordered_map<std::string, std::string> RedisHandler::readHashMapAll(std::string key) {
+    std::unordered_map<std::string, std::string> result;
+    redisReply *reply = (redisReply*)redisCommand(this->context, "HGETALL %s", key.c_str());
+    if (reply != NULL && reply->type == REDIS_REPLY_ARRAY)
+        for (int j = 0; j + 1 < reply->elements; j += 2)
+            result[reply->element[j]->str] = reply->element[j + 1]->str;
+    freeReplyObject(reply);
+    return result;
+}
+
+/** Remove a field from a redis hash map */
+void RedisHandler::deleteHashMapField(std::string key, std::string hash) {
+    freeReplyObject(redisCommand(this->context, "HDEL %s %s", key.c_str(), hash.c_str()));
+}
+
 /** Read a value from redis given a key */
 void RedisHandler::deleteKey(std::string key) {
     std::string result;
     (redisReply*)redisCommand(this->context, "DEL %s", key.c_str());
 }
 
+/**
+ * Removes a batch of keys with pipelined UNLINK calls, memory is reclaimed by redis off the main thread
+ *
+ * @returns     for each key whether it existed and was removed by this call
+ */
+std::vector<bool> RedisHandler::deleteKeys(std::vector<std::string>& keys) {
+    for (std::vector<std::string>::iterator it = keys.begin(); it != keys.end(); ++it) {
+        std::vector<std::string> args;
+        args.push_back("UNLINK");
+        args.push_back(*it);
+        this->appendCommand(args);
+    }
+    std::vector<std::string> replies = this->flushPipeline();
+    std::vector<bool> removed;
+    for (std::vector<std::string>::iterator it = replies.begin(); it != replies.end(); ++it)
+        removed.push_back(it->compare("1") == 0);
+    return removed;
+}
+
+/** Set a key expiring after "seconds" unless it exists - true if this call set it */
+bool RedisHandler::setIfAbsent(std::string key, std::string value, long seconds) {
+    bool set = false;
+    redisReply *reply = (redisReply*)redisCommand(this->context, "SET %s %s NX EX %s", key.c_str(), value.c_str(),
+        std::to_string(seconds).c_str());
+    if (reply != NULL && reply->type == REDIS_REPLY_STATUS)
+        set = true;
+    freeReplyObject(reply);
+    return set;
+}
+
+/** Let a key expire after "seconds" */
+void RedisHandler::expire(std::string key, long seconds) {
+    freeReplyObject(redisCommand(this->context, "EXPIRE %s %s", key.c_str(), std::to_string(seconds).c_str()));
+}
+
+/** Increments a key and returns the resulting value */
+long RedisHandler::incrementAndRead(std::string key, int value) {
+    long result = 0;
+    redisReply *reply = (redisReply*)redisCommand(this->context, "INCRBY %s %s", key.c_str(), std::to_string(value).c_str());
+    if (reply != NULL && reply->type == REDIS_REPLY_INTEGER)
+        result = reply->integer;
+    freeReplyObject(reply);
+    return result;
+}
+
+/** Increments a hash map field and returns the resulting value */
+long RedisHandler::incrementHashMapAndRead(std::string key, std::string hash, int value) {
+    long result = 0;
+    redisReply *reply = (redisReply*)redisCommand(this->context, "HINCRBY %s %s %s", key.c_str(), hash.c_str(), std::to_string(value).c_str());
+    if (reply != NULL && reply->type == REDIS_REPLY_INTEGER)
+        result = reply->integer;
+    freeReplyObject(reply);
+    return result;
+}
+
+/** Number of fields in a redis hash map */
+long RedisHandler::hashMapLength(std::string key) {
+    long result = 0;
+    redisReply *reply = (redisReply*)redisCommand(this->context, "HLEN %s", key.c_str());
+    if (reply != NULL && reply->type == REDIS_REPLY_INTEGER)
+        result = reply->integer;
+    freeReplyObject(reply);
+    return result;
+}
+
 /** Read a value from redis given a key */
 bool RedisHandler::exists(std::string key) {
     int result;
@@ -139,4 +274,119 @@ std::vector<std::string> RedisHandler::keys(std::string pattern) {
     return elems;
 }
 
+/** Write a batch of values with pipelined SET calls */
+void RedisHandler::writeMany(std::vector<std::string>& keys, std::vector<std::string>& values) {
+    for (size_t i = 0; i < keys.size(); i++) {
+        std::vector<std::string> args;
+        args.push_back("SET");
+        args.push_back(keys[i]);
+        args.push_back(values[i]);
+        this->appendCommand(args);
+    }
+    this->flushPipeline();
+}
+
+/** Read a batch of values with pipelined GET calls - missing keys map to "" */
+std::vector<std::string> RedisHandler::readMany(std::vector<std::string>& keys) {
+    for (std::vector<std::string>::iterator it = keys.begin(); it != keys.end(); ++it) {
+        std::vector<std::string> args;
+        args.push_back("GET");
+        args.push_back(*it);
+        this->appendCommand(args);
+    }
+    return this->flushPipeline();
+}
+
+/** Add a member to a redis set */
+void RedisHandler::addSetMember(std::string key, std::string member) {
+    freeReplyObject(redisCommand(this->context, "SADD %s %s", key.c_str(), member.c_str()));
+}
+
+/** Remove a member from a redis set */
+void RedisHandler::removeSetMember(std::string key, std::string member) {
+    freeReplyObject(redisCommand(this->context, "SREM %s %s", key.c_str(), member.c_str()));
+}
+
+/** Publish a message to the subscribers of a pub/sub channel */
+void RedisHandler::publish(std::string channel, std::string message) {
+    freeReplyObject(redisCommand(this->context, "PUBLISH %s %s", channel.c_str(), message.c_str()));
+}
+
+/** Read all members of a redis set */
+std::vector<std::string> RedisHandler::setMembers(std::string key) {
+    std::vector<string> elems;
+    redisReply *reply = (redisReply*)redisCommand(this->context, "SMEMBERS %s", key.c_str());
+    if (reply != NULL && reply->type == REDIS_REPLY_ARRAY)
+        for (int j = 0; j < reply->elements; j++)
+            elems.push_back(reply->element[j]->str);
+    freeReplyObject(reply);
+    return elems;
+}
+
+/** Read the members of a redis sorted set with the highest scores, highest first */
+std::vector<std::pair<std::string, double>> RedisHandler::sortedSetTop(std::string key, long count) {
+    std::vector<std::pair<std::string, double>> elems;
+    if (count < 1) return elems;
+    redisReply *reply = (redisReply*)redisCommand(this->context, "ZREVRANGE %s 0 %s WITHSCORES",
+        key.c_str(), std::to_string(count - 1).c_str());
+    if (reply != NULL && reply->type == REDIS_REPLY_ARRAY)
+        for (int j = 0; j + 1 < reply->elements; j += 2)
+            elems.push_back(std::make_pair(std::string(reply->element[j]->str, reply->element[j]->len),
+                std::atof(reply->element[j + 1]->str)));
+    freeReplyObject(reply);
+    return elems;
+}
+
+/** Read the first members of a redis sorted set with exactly the given score, in member order */
+std::vector<std::string> RedisHandler::sortedSetWithScore(std::string key, double score, long count) {
+    std::vector<std::string> elems;
+    if (count < 1) return elems;
+    std::ostringstream out;
+    out.precision(17);
+    out << score;
+    redisReply *reply = (redisReply*)redisCommand(this->context, "ZRANGEBYSCORE %s %s %s LIMIT 0 %s",
+        key.c_str(), out.str().c_str(), out.str().c_str(), std::to_string(count).c_str());
+    if (reply != NULL && reply->type == REDIS_REPLY_ARRAY)
+        for (int j = 0; j < reply->elements; j++)
+            elems.push_back(std::string(reply->element[j]->str, reply->element[j]->len));
+    freeReplyObject(reply);
+    return elems;
+}
+
+/** Buffers a command in the output pipeline, the reply is collected by flushPipeline */
+void RedisHandler::appendCommand(std::vector<std::string> args) {
+    std::vector<const char*> argv;
+    std::vector<size_t> argvlen;
+    for (std::vector<std::string>::iterator it = args.begin(); it != args.end(); ++it) {
+        argv.push_back(it->c_str());
+        argvlen.push_back(it->length());
+    }
+    redisAppendCommandArgv(this->context, argv.size(), &argv[0], &argvlen[0]);
+    this->pendingReplies++;
+}
+
+/**
+ * Sends all buffered commands and collects their replies in order.  String and integer
+ * replies are returned as strings, anything else maps to ""
+ */
+std::vector<std::string> RedisHandler::flushPipeline() {
+    std::vector<std::string> replies;
+    redisReply *reply;
+    while (this->pendingReplies > 0) {
+        this->pendingReplies--;
+        if (redisGetReply(this->context, (void**)&reply) != REDIS_OK || reply == NULL) {
+            replies.push_back("");
+            continue;
+        }
+        if (reply->type == REDIS_REPLY_STRING)
+            replies.push_back(std::string(reply->str, reply->len));
+        else if (reply->type == REDIS_REPLY_INTEGER)
+            replies.push_back(std::to_string(reply->integer));
+        else
+            replies.push_back("");
+        freeReplyObject(reply);
+    }
+    return replies;
+}
+
 #endif
@@ -0,0 +1,339 @@
+/*
+ *  reservoir.h
+ *
+ *  Defines the reservoirs used to estimate queries over large entity pairs.  Each reservoir is a
+ *  uniform sample of the relation instances on a pair, every instance holds a uniform key and the
+ *  reservoir keeps those under a threshold that is lowered as the pair grows, so at most
+ *  RESERVOIR_SIZE instances are sampled.  A relation hook keeps reservoirs current on write.
+ *
+ *  Estimates are ratios of totals over strata, one stratum per pair, with normal confidence
+ *  intervals from the linearized variance of the ratio.
+ *
+ *  Created by Ryan Faulkner on 2015-12-20
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _reservoir_h
+#define _reservoir_h
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <json/json.h>
+
+#include "redis.h"
+#include "hooks.h"
+#include "catalog.h"
+#include "random.h"
+#include "models/model_def.h"
+
+#define RESERVOIR_SIZE 1024             // Instances sampled per pair
+#define RESERVOIR_THRESHOLD 4096        // Pairs with at most this many distinct relations are read exactly
+#define RESERVOIR_CONFIDENCE 0.95
+#define RESERVOIR_Z 1.959963984540054   // Normal quantile of the confidence level
+
+
+/** A sampled instance, "key" is its uniform sort key and "relation" the relation key */
+struct ReservoirItem {
+    double key;
+    std::string relation;
+
+    ReservoirItem(double key, std::string relation) : key(key), relation(relation) {}
+    bool operator<(const ReservoirItem& other) const { return this->key < other.key; }
+};
+
+/**
+ *  Sample of the instances on a pair - all instances with a key under "threshold", kept as a
+ *  max-heap on the key.  Relations are stored once however many of their instances are sampled.
+ */
+struct Reservoir {
+    long version;
+    long total;
+    double threshold;
+    std::vector<ReservoirItem> heap;
+    std::unordered_map<std::string, Json::Value> relations;
+    std::unordered_map<std::string, long> sampled;
+
+    Reservoir() : version(0), total(0), threshold(1.0) {}
+};
+
+
+/**
+ *  Process wide registry of pair reservoirs.  As with the dynamic samplers, the version of the
+ *  pair in the catalog tells whether a reservoir missed changes made by another process.
+ */
+class ReservoirRegistry {
+
+    std::mutex lock;
+    std::unordered_map<std::string, Reservoir> reservoirs;
+    RandomStream rng;
+
+    void insert(Reservoir&, std::string, Json::Value&, long);
+    void remove(Reservoir&, std::string, long, long);
+
+public:
+    ReservoirRegistry() : rng(RandomStream::local().split()) {}
+
+    static ReservoirRegistry& instance() {
+        static ReservoirRegistry registry;
+        return registry;
+    }
+
+    static void relationHook(RedisHandler&, std::string, Json::Value&, int, int);
+    static void relationBatchHook(RedisHandler&, std::vector<RelationDelta>&);
+
+    bool isCurrent(std::string, long);
+    void build(std::string, long, std::vector<std::string>&, std::vector<Json::Value>&);
+    long sample(std::string, std::vector<Json::Value>&);
+    void drop(std::string);
+};
+
+/**
+ *  Offer "delta" new instances of a relation.  Each instance is kept with probability equal to the
+ *  threshold, the gaps between kept instances are geometric so a large delta costs only as many
+ *  draws as instances kept.  Past RESERVOIR_SIZE the largest key is evicted and becomes the threshold.
+ */
+void ReservoirRegistry::insert(Reservoir& reservoir, std::string key, Json::Value& relation, long delta) {
+    reservoir.total += delta;
+    reservoir.relations[key] = relation;
+
+    while (delta > 0) {
+        if (reservoir.threshold <= 0.0) break;
+        if (reservoir.threshold < 1.0) {
+            double skip = std::floor(std::log(1.0 - this->rng.uniform()) / std::log(1.0 - reservoir.threshold));
+            if (skip >= delta) break;
+            delta -= (long)skip;
+        }
+        delta--;
+
+        reservoir.heap.push_back(ReservoirItem(this->rng.uniform() * reservoir.threshold, key));
+        std::push_heap(reservoir.heap.begin(), reservoir.heap.end());
+        reservoir.sampled[key]++;
+
+        if (reservoir.heap.size() > RESERVOIR_SIZE) {
+            std::pop_heap(reservoir.heap.begin(), reservoir.heap.end());
+            reservoir.threshold = reservoir.heap.back().key;
+            if (--reservoir.sampled[reservoir.heap.back().relation] == 0) {
+                reservoir.sampled.erase(reservoir.heap.back().relation);
+                reservoir.relations.erase(reservoir.heap.back().relation);
+            }
+            reservoir.heap.pop_back();
+        }
+    }
+
+    if (reservoir.sampled.count(key) == 0) reservoir.relations.erase(key);
+}
+
+/**
+ *  Remove "delta" of the "count" instances of a relation.  Which instances go is uniform, so each
+ *  sampled instance is removed with the hypergeometric probability of having been among them.
+ */
+void ReservoirRegistry::remove(Reservoir& reservoir, std::string key, long count, long delta) {
+    reservoir.total -= delta;
+    if (reservoir.sampled.count(key) == 0) return;
+
+    std::vector<ReservoirItem> kept;
+    for (std::vector<ReservoirItem>::iterator it = reservoir.heap.begin(); it != reservoir.heap.end(); ++it) {
+        if (it->relation.compare(key) == 0 && delta > 0 && this->rng.below(count) < (uint64_t)delta) {
+            delta--;
+            count--;
+            reservoir.sampled[key]--;
+            continue;
+        }
+        if (it->relation.compare(key) == 0) count--;
+        kept.push_back(*it);
+    }
+    reservoir.heap = kept;
+    std::make_heap(reservoir.heap.begin(), reservoir.heap.end());
+
+    if (reservoir.sampled[key] <= 0) {
+        reservoir.sampled.erase(key);
+        reservoir.relations.erase(key);
+    }
+}
+
+/** Does the registry hold a reservoir for the pair built at this version? */
+bool ReservoirRegistry::isCurrent(std::string pair, long version) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    std::unordered_map<std::string, Reservoir>::iterator it = this->reservoirs.find(pair);
+    return it != this->reservoirs.end() && it->second.version == version;
+}
+
+/** Build the reservoir for a pair from its relations and their keys */
+void ReservoirRegistry::build(std::string pair, long version, std::vector<std::string>& keys,
+        std::vector<Json::Value>& relations) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    Reservoir& reservoir = this->reservoirs[pair];
+    reservoir = Reservoir();
+    reservoir.version = version;
+    for (long i = 0; i < keys.size(); i++)
+        this->insert(reservoir, keys[i], relations[i], relations[i][JSON_ATTR_REL_COUNT].asInt());
+}
+
+/**
+ *  Copy out the sampled relations of a pair, the instance count of each is the number of its
+ *  instances sampled.  Returns the number of instances on the pair.
+ */
+long ReservoirRegistry::sample(std::string pair, std::vector<Json::Value>& relations) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    std::unordered_map<std::string, Reservoir>::iterator it = this->reservoirs.find(pair);
+    if (it == this->reservoirs.end()) return 0;
+
+    for (std::unordered_map<std::string, long>::iterator itSampled = it->second.sampled.begin();
+            itSampled != it->second.sampled.end(); ++itSampled) {
+        relations.push_back(it->second.relations[itSampled->first]);
+        relations.back()[JSON_ATTR_REL_COUNT] = (Json::Int64)itSampled->second;
+    }
+    return it->second.total;
+}
+
+/** Forget the reservoir for a pair */
+void ReservoirRegistry::drop(std::string pair) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->reservoirs.erase(pair);
+}
+
+/** Relation hook - runs the batch hook on a chunk of one */
+void ReservoirRegistry::relationHook(RedisHandler& rds, std::string key, Json::Value& relation,
+        int oldCount, int newCount) {
+    std::vector<RelationDelta> deltas(1, RelationDelta(key, &relation, oldCount, newCount));
+    ReservoirRegistry::relationBatchHook(rds, deltas);
+}
+
+/**
+ *  Batch relation hook - offers new instances to the reservoirs of their pairs or removes those
+ *  taken away.  As with the samplers only a reservoir at the pair version before the chunk takes
+ *  its changes and the version the catalog returned, any other is dropped.  A reservoir drained
+ *  below half its size by removals is dropped too, both are rebuilt on the next query.
+ */
+void ReservoirRegistry::relationBatchHook(RedisHandler& rds, std::vector<RelationDelta>& deltas) {
+    ReservoirRegistry& registry = ReservoirRegistry::instance();
+    std::unordered_map<std::string, std::vector<RelationDelta*>> chunks;     // pair -> deltas
+    for (std::vector<RelationDelta>::iterator it = deltas.begin(); it != deltas.end(); ++it)
+        chunks[PairCatalog::pairFromKey(it->key)].push_back(&(*it));
+
+    std::lock_guard<std::mutex> guard(registry.lock);
+    for (std::unordered_map<std::string, std::vector<RelationDelta*>>::iterator itChunk = chunks.begin();
+            itChunk != chunks.end(); ++itChunk) {
+        std::unordered_map<std::string, Reservoir>::iterator it = registry.reservoirs.find(itChunk->first);
+        if (it == registry.reservoirs.end()) continue;
+
+        Reservoir& reservoir = it->second;
+        long version = itChunk->second.front()->version;
+        if (version == 0 || reservoir.version != version - 1) {
+            registry.reservoirs.erase(it);
+            continue;
+        }
+        for (std::vector<RelationDelta*>::iterator itDelta = itChunk->second.begin();
+                itDelta != itChunk->second.end(); ++itDelta) {
+            RelationDelta& delta = **itDelta;
+            if (delta.newCount > delta.oldCount)
+                registry.insert(reservoir, delta.key, *(delta.relation), delta.newCount - delta.oldCount);
+            else
+                registry.remove(reservoir, delta.key, delta.oldCount, delta.oldCount - delta.newCount);
+            if (reservoir.relations.count(delta.key) > 0) {
+                reservoir.relations[delta.key] = *(delta.relation);
+                reservoir.relations[delta.key][JSON_ATTR_REL_COUNT] = delta.newCount;
+            }
+        }
+        reservoir.version = version;
+
+        if (reservoir.total <= 0 ||
+                (reservoir.threshold < 1.0 && reservoir.heap.size() < RESERVOIR_SIZE / 2))
+            registry.reservoirs.erase(it);
+    }
+}
+
+static bool reservoirHookRegistered = registerRelationHook(ReservoirRegistry::relationHook, ReservoirRegistry::relationBatchHook);
+
+
+/**
+ *  Combined ratio estimator over strata.  Strata read in full add their totals exactly, sampled
+ *  strata add units (y, x) with a multiplicity.  The ratio of the estimated totals of y and x is
+ *  returned with the half width of its confidence interval.
+ */
+class RatioEstimator {
+
+    struct Unit {
+        double y;
+        double x;
+        long count;
+    };
+
+    struct Stratum {
+        long population;
+        std::vector<Unit> units;
+    };
+
+    double exactY;
+    double exactX;
+    std::vector<Stratum> strata;
+
+public:
+    RatioEstimator() : exactY(0.0), exactX(0.0) {}
+
+    void addExact(double y, double x) { this->exactY += y; this->exactX += x; }
+    void addStratum(long population) { this->strata.push_back(Stratum()); this->strata.back().population = population; }
+    void addUnit(double, double, long);
+
+    bool isSampled() { return this->strata.size() > 0; }
+    bool estimate(double&, double&);
+};
+
+/** Add a unit to the last stratum */
+void RatioEstimator::addUnit(double y, double x, long count) {
+    if (count <= 0) return;
+    Unit unit = { y, x, count };
+    this->strata.back().units.push_back(unit);
+}
+
+/**
+ *  Estimate the ratio and the half width of its confidence interval, false if the estimated total
+ *  of x is zero
+ */
+bool RatioEstimator::estimate(double& ratio, double& halfWidth) {
+    double totalY = this->exactY, totalX = this->exactX;
+    std::vector<long> sizes;
+
+    for (std::vector<Stratum>::iterator it = this->strata.begin(); it != this->strata.end(); ++it) {
+        double sumY = 0.0, sumX = 0.0;
+        long n = 0;
+        for (std::vector<Unit>::iterator unit = it->units.begin(); unit != it->units.end(); ++unit) {
+            sumY += unit->y * unit->count;
+            sumX += unit->x * unit->count;
+            n += unit->count;
+        }
+        sizes.push_back(n);
+        if (n == 0) continue;
+        totalY += it->population * sumY / n;
+        totalX += it->population * sumX / n;
+    }
+    if (totalX <= 0.0) return false;
+    ratio = totalY / totalX;
+
+    // Linearized variance - residuals d = y - ratio * x within each stratum
+    double variance = 0.0;
+    for (long h = 0; h < this->strata.size(); h++) {
+        Stratum& stratum = this->strata[h];
+        long n = sizes[h];
+        if (n < 2 || n >= stratum.population) continue;
+
+        double mean = 0.0, squares = 0.0, d;
+        for (std::vector<Unit>::iterator unit = stratum.units.begin(); unit != stratum.units.end(); ++unit)
+            mean += (unit->y - ratio * unit->x) * unit->count;
+        mean /= n;
+        for (std::vector<Unit>::iterator unit = stratum.units.begin(); unit != stratum.units.end(); ++unit) {
+            d = unit->y - ratio * unit->x - mean;
+            squares += d * d * unit->count;
+        }
+        variance += (double)stratum.population * stratum.population *
+            (1.0 - (double)n / stratum.population) * (squares / (n - 1)) / n;
+    }
+    halfWidth = RESERVOIR_Z * std::sqrt(variance) / totalX;
+    return true;
+}
+
+#endif
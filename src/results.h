@@ -0,0 +1,135 @@
+/*
+ *  results.h
+ *
+ *  Defines the cache of query results kept by Bayes.  Results are keyed by operation, entities,
+ *  canonical filter and comparator, and each holds the versions of the entity pairs it was computed
+ *  from.  A write bumps only the version of its own pair, so a cached result is returned only while
+ *  it is still exact.
+ *
+ *  The cache is bounded in bytes rather than entries and evicts the least recently used results.
+ *
+ *  Created by Ryan Faulkner on 2015-12-24
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _results_h
+#define _results_h
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <json/json.h>
+
+#define RESULT_CACHE_BYTES 4194304      // 4MB of keys, versions and values
+
+
+/** A cached result, numeric results leave "text" empty */
+struct ResultEntry {
+    std::string versions;
+    double number;
+    std::string text;
+    long bytes;
+};
+
+
+/**
+ *  LRU cache of query results bounded by the bytes held.  Hits, misses, results found stale and
+ *  evictions are counted.
+ */
+class ResultCache {
+
+    long capacity;
+    long bytes;
+    long hits;
+    long misses;
+    long stale;
+    long evictions;
+    std::list<std::string> order;   // most recently used first
+    std::unordered_map<std::string, std::pair<ResultEntry, std::list<std::string>::iterator>> entries;
+
+    void erase(std::string);
+
+public:
+    ResultCache() : capacity(RESULT_CACHE_BYTES), bytes(0), hits(0), misses(0), stale(0), evictions(0) {}
+    ResultCache(long capacity) : capacity(capacity), bytes(0), hits(0), misses(0), stale(0), evictions(0) {}
+
+    ResultEntry* fetch(std::string, std::string);
+    void store(std::string, std::string, double, std::string = "");
+    void clear();
+    long size() { return this->entries.size(); }
+    Json::Value stats();
+};
+
+/** Remove an entry and release its bytes */
+void ResultCache::erase(std::string key) {
+    std::unordered_map<std::string, std::pair<ResultEntry, std::list<std::string>::iterator>>::iterator it =
+        this->entries.find(key);
+    if (it == this->entries.end()) return;
+    this->bytes -= it->second.first.bytes;
+    this->order.erase(it->second.second);
+    this->entries.erase(it);
+}
+
+/** Fetch a result if one is cached for the key and it was computed from the current versions */
+ResultEntry* ResultCache::fetch(std::string key, std::string versions) {
+    std::unordered_map<std::string, std::pair<ResultEntry, std::list<std::string>::iterator>>::iterator it =
+        this->entries.find(key);
+    if (it == this->entries.end()) {
+        this->misses++;
+        return NULL;
+    }
+    if (it->second.first.versions.compare(versions) != 0) {
+        this->erase(key);
+        this->stale++;
+        this->misses++;
+        return NULL;
+    }
+    this->hits++;
+    this->order.splice(this->order.begin(), this->order, it->second.second);
+    return &(it->second.first);
+}
+
+/** Cache a result, evicting the least recently used entries until it fits */
+void ResultCache::store(std::string key, std::string versions, double number, std::string text) {
+    long size = sizeof(ResultEntry) + 2 * key.length() + versions.length() + text.length();
+    this->erase(key);
+    if (size > this->capacity) return;
+
+    while (this->bytes + size > this->capacity && !this->order.empty()) {
+        this->erase(this->order.back());
+        this->evictions++;
+    }
+
+    this->order.push_front(key);
+    ResultEntry& entry = this->entries[key].first;
+    this->entries[key].second = this->order.begin();
+    entry.versions = versions;
+    entry.number = number;
+    entry.text = text;
+    entry.bytes = size;
+    this->bytes += size;
+}
+
+/** Drop all results, the counters are kept */
+void ResultCache::clear() {
+    this->entries.clear();
+    this->order.clear();
+    this->bytes = 0;
+}
+
+/** Counters and occupancy of the cache */
+Json::Value ResultCache::stats() {
+    Json::Value json;
+    json["entries"] = (Json::Int64)this->entries.size();
+    json["bytes"] = (Json::Int64)this->bytes;
+    json["capacity"] = (Json::Int64)this->capacity;
+    json["hits"] = (Json::Int64)this->hits;
+    json["misses"] = (Json::Int64)this->misses;
+    json["stale"] = (Json::Int64)this->stale;
+    json["evictions"] = (Json::Int64)this->evictions;
+    json["hit_rate"] = this->hits + this->misses > 0 ?
+        (double)this->hits / (this->hits + this->misses) : 0.0;
+    return json;
+}
+
+#endif
@@ -0,0 +1,371 @@
+/*
+ *  sampler.h
+ *
+ *  Defines the samplers used to draw relations in proportion to their instance counts.  Alias
+ *  tables (Walker/Vose) give O(1) draws once built and are cached per entity pair and filter, the
+ *  cache entries are validated against the version counters of the pairs they were built from.
+ *
+ *  Unfiltered samplers over a single entity pair are kept as Fenwick trees instead.  These are
+ *  updated in place by a relation hook so that writes never force a rebuild.
+ *
+ *  Created by Ryan Faulkner on 2015-12-15
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _sampler_h
+#define _sampler_h
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <json/json.h>
+
+#include "redis.h"
+#include "hooks.h"
+#include "catalog.h"
+#include "models/model_def.h"
+
+#define SAMPLER_CACHE_SIZE 64
+
+
+/**
+ *  Walker/Vose alias table over a set of weights.  Construction is O(n), each draw is O(1) and
+ *  takes two uniform variates in [0, 1).
+ */
+class AliasTable {
+
+    std::vector<double> probability;
+    std::vector<long> alias;
+    double total;
+
+public:
+    AliasTable() { this->total = 0; }
+    AliasTable(std::vector<double>& weights) { this->build(weights); }
+
+    void build(std::vector<double>&);
+    long sample(double, double);
+    long size() { return this->probability.size(); }
+    double getTotal() { return this->total; }
+};
+
+/** Build the table with Vose's method */
+void AliasTable::build(std::vector<double>& weights) {
+    long n = weights.size();
+    std::vector<double> scaled(n);
+    std::vector<long> small, large;
+
+    this->probability.assign(n, 0.0);
+    this->alias.assign(n, 0);
+    this->total = 0;
+    for (long i = 0; i < n; i++)
+        this->total += weights[i];
+    if (n == 0 || this->total <= 0) return;
+
+    // Scale weights so the mean is 1 and split into under and over full columns
+    for (long i = 0; i < n; i++) {
+        scaled[i] = weights[i] * n / this->total;
+        if (scaled[i] < 1.0)
+            small.push_back(i);
+        else
+            large.push_back(i);
+    }
+
+    // Fill each under full column with the remainder of an over full one
+    while (!small.empty() && !large.empty()) {
+        long s = small.back(); small.pop_back();
+        long l = large.back(); large.pop_back();
+        this->probability[s] = scaled[s];
+        this->alias[s] = l;
+        scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+        if (scaled[l] < 1.0)
+            small.push_back(l);
+        else
+            large.push_back(l);
+    }
+
+    // Remaining columns are full up to rounding error
+    for (std::vector<long>::iterator it = large.begin(); it != large.end(); ++it)
+        this->probability[*it] = 1.0;
+    for (std::vector<long>::iterator it = small.begin(); it != small.end(); ++it)
+        this->probability[*it] = 1.0;
+}
+
+/** Draw an index - u1 picks the column and u2 decides between the column and its alias */
+long AliasTable::sample(double u1, double u2) {
+    long n = this->probability.size();
+    if (n == 0) return -1;
+    long column = (long)(u1 * n);
+    if (column >= n) column = n - 1;
+    return u2 < this->probability[column] ? column : this->alias[column];
+}
+
+
+/**
+ *  Cached sampler for a relation set - the relations, their alias table and the pair versions the
+ *  set was built from
+ */
+struct SamplerEntry {
+    std::string versions;
+    std::vector<Json::Value> relations;
+    std::vector<double> weights;
+    AliasTable table;
+};
+
+
+/**
+ *  LRU cache of samplers keyed by query signature.  Samplers are shared so those held by a draw
+ *  outlive their eviction.
+ */
+class SamplerCache {
+
+    long capacity;
+    std::list<std::string> order;   // most recently used first
+    std::unordered_map<std::string, std::pair<std::shared_ptr<SamplerEntry>, std::list<std::string>::iterator>> entries;
+
+public:
+    SamplerCache() { this->capacity = SAMPLER_CACHE_SIZE; }
+    SamplerCache(long capacity) { this->capacity = capacity; }
+
+    std::shared_ptr<SamplerEntry> fetch(std::string, std::string);
+    std::shared_ptr<SamplerEntry> store(std::string, std::string, std::vector<Json::Value>&, std::vector<double>&);
+    void clear() { this->entries.clear(); this->order.clear(); }
+    long size() { return this->entries.size(); }
+};
+
+/** Fetch a sampler if one is cached for the key and it was built from the current versions */
+std::shared_ptr<SamplerEntry> SamplerCache::fetch(std::string key, std::string versions) {
+    std::unordered_map<std::string, std::pair<std::shared_ptr<SamplerEntry>, std::list<std::string>::iterator>>::iterator it =
+        this->entries.find(key);
+    if (it == this->entries.end()) return std::shared_ptr<SamplerEntry>();
+    if (it->second.first->versions.compare(versions) != 0) {
+        this->order.erase(it->second.second);
+        this->entries.erase(it);
+        return std::shared_ptr<SamplerEntry>();
+    }
+    this->order.splice(this->order.begin(), this->order, it->second.second);
+    return it->second.first;
+}
+
+/** Build and cache a sampler, evicting the least recently used entry when full */
+std::shared_ptr<SamplerEntry> SamplerCache::store(std::string key, std::string versions,
+        std::vector<Json::Value>& relations, std::vector<double>& weights) {
+    std::unordered_map<std::string, std::pair<std::shared_ptr<SamplerEntry>, std::list<std::string>::iterator>>::iterator it =
+        this->entries.find(key);
+    if (it != this->entries.end()) {
+        this->order.erase(it->second.second);
+        this->entries.erase(it);
+    }
+    while (this->entries.size() >= this->capacity && !this->order.empty()) {
+        this->entries.erase(this->order.back());
+        this->order.pop_back();
+    }
+
+    std::shared_ptr<SamplerEntry> entry = std::make_shared<SamplerEntry>();
+    entry->versions = versions;
+    entry->relations = relations;
+    entry->weights = weights;
+    entry->table.build(weights);
+    this->order.push_front(key);
+    this->entries[key] = std::make_pair(entry, this->order.begin());
+    return entry;
+}
+
+
+
+/**
+ *  Fenwick (binary indexed) tree over integer weights.  Updates, appends and weighted draws are all
+ *  O(log n).
+ */
+class FenwickTree {
+
+    std::vector<long> tree;     // 1-based partial sums
+    std::vector<long> weights;
+
+    long prefix(long);
+
+public:
+    FenwickTree() { this->tree.push_back(0); }
+
+    long append(long);
+    void update(long, long);
+    long find(long);
+    long size() { return this->weights.size(); }
+    long total() { return this->prefix(this->weights.size()); }
+};
+
+/** Sum of the first n weights */
+long FenwickTree::prefix(long n) {
+    long sum = 0;
+    for (long i = n; i > 0; i -= i & (-i))
+        sum += this->tree[i];
+    return sum;
+}
+
+/** Add a weight at the end, returns its index */
+long FenwickTree::append(long weight) {
+    long i = this->weights.size() + 1;
+    this->weights.push_back(weight);
+    // The new node covers (i - lowbit(i), i]
+    this->tree.push_back(weight + this->prefix(i - 1) - this->prefix(i - (i & (-i))));
+    return i - 1;
+}
+
+/** Set the weight at an index */
+void FenwickTree::update(long index, long weight) {
+    long delta = weight - this->weights[index];
+    this->weights[index] = weight;
+    for (long i = index + 1; i < this->tree.size(); i += i & (-i))
+        this->tree[i] += delta;
+}
+
+/** Find the index whose cumulative weight range contains target, 0 <= target < total() */
+long FenwickTree::find(long target) {
+    long pos = 0;
+    long step = 1;
+    while (step * 2 < this->tree.size()) step *= 2;
+    for (; step > 0; step /= 2)
+        if (pos + step < this->tree.size() && this->tree[pos + step] <= target) {
+            pos += step;
+            target -= this->tree[pos];
+        }
+    return pos < this->weights.size() ? pos : -1;
+}
+
+
+/**
+ *  Dynamic sampler over the relations of one entity pair along with the pair version it reflects
+ */
+struct DynamicSampler {
+    long version;
+    FenwickTree tree;
+    std::vector<Json::Value> relations;
+    std::unordered_map<std::string, long> positions;
+};
+
+
+/**
+ *  Process wide registry of dynamic samplers keyed by pair.  Relation hooks keep the samplers
+ *  current for writes made by this process, writes made elsewhere show up as a version mismatch
+ *  and the sampler is rebuilt.
+ */
+class DynamicSamplerRegistry {
+
+    std::mutex lock;
+    std::unordered_map<std::string, DynamicSampler> samplers;
+
+public:
+    static DynamicSamplerRegistry& instance() {
+        static DynamicSamplerRegistry registry;
+        return registry;
+    }
+
+    static void relationHook(RedisHandler&, std::string, Json::Value&, int, int);
+    static void relationBatchHook(RedisHandler&, std::vector<RelationDelta>&);
+
+    bool isCurrent(std::string, long);
+    void build(std::string, long, std::vector<std::string>&, std::vector<Json::Value>&);
+    std::vector<Json::Value> sample(std::string, std::vector<double>&);
+    void drop(std::string);
+};
+
+/** Does the registry hold a sampler for the pair built at this version? */
+bool DynamicSamplerRegistry::isCurrent(std::string pair, long version) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    std::unordered_map<std::string, DynamicSampler>::iterator it = this->samplers.find(pair);
+    return it != this->samplers.end() && it->second.version == version;
+}
+
+/** Build the sampler for a pair from its relations and their keys */
+void DynamicSamplerRegistry::build(std::string pair, long version, std::vector<std::string>& keys,
+        std::vector<Json::Value>& relations) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    DynamicSampler& sampler = this->samplers[pair];
+    sampler = DynamicSampler();
+    sampler.version = version;
+    for (long i = 0; i < keys.size(); i++) {
+        sampler.positions[keys[i]] = sampler.tree.append(relations[i][JSON_ATTR_REL_COUNT].asInt());
+        sampler.relations.push_back(relations[i]);
+    }
+}
+
+/** Draw one relation per uniform variate in [0, 1), nothing is returned for an empty pair */
+std::vector<Json::Value> DynamicSamplerRegistry::sample(std::string pair, std::vector<double>& variates) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    std::vector<Json::Value> samples;
+    std::unordered_map<std::string, DynamicSampler>::iterator it = this->samplers.find(pair);
+    if (it == this->samplers.end()) return samples;
+
+    long total = it->second.tree.total();
+    if (total <= 0) return samples;
+    for (std::vector<double>::iterator itVar = variates.begin(); itVar != variates.end(); ++itVar) {
+        long index = it->second.tree.find((long)(*itVar * total));
+        if (index >= 0)
+            samples.push_back(it->second.relations[index]);
+    }
+    return samples;
+}
+
+/** Forget the sampler for a pair */
+void DynamicSamplerRegistry::drop(std::string pair) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->samplers.erase(pair);
+}
+
+/** Relation hook - runs the batch hook on a chunk of one */
+void DynamicSamplerRegistry::relationHook(RedisHandler& rds, std::string key, Json::Value& relation,
+        int oldCount, int newCount) {
+    std::vector<RelationDelta> deltas(1, RelationDelta(key, &relation, oldCount, newCount));
+    DynamicSamplerRegistry::relationBatchHook(rds, deltas);
+}
+
+/**
+ *  Batch relation hook - applies the changes in instance count to the samplers of their pairs in
+ *  O(log n) each.  The catalog hook runs first and bumps each pair once for the chunk, a sampler at
+ *  the version before takes the changes and the version the catalog returned.  A sampler at any
+ *  other version missed a change, as does one on a pair emptied by the chunk, and is dropped.
+ */
+void DynamicSamplerRegistry::relationBatchHook(RedisHandler& rds, std::vector<RelationDelta>& deltas) {
+    DynamicSamplerRegistry& registry = DynamicSamplerRegistry::instance();
+    std::unordered_map<std::string, std::vector<RelationDelta*>> chunks;     // pair -> deltas
+    for (std::vector<RelationDelta>::iterator it = deltas.begin(); it != deltas.end(); ++it)
+        chunks[PairCatalog::pairFromKey(it->key)].push_back(&(*it));
+
+    std::lock_guard<std::mutex> guard(registry.lock);
+    for (std::unordered_map<std::string, std::vector<RelationDelta*>>::iterator itChunk = chunks.begin();
+            itChunk != chunks.end(); ++itChunk) {
+        std::unordered_map<std::string, DynamicSampler>::iterator it = registry.samplers.find(itChunk->first);
+        if (it == registry.samplers.end()) continue;
+
+        DynamicSampler& sampler = it->second;
+        long version = itChunk->second.front()->version;
+        if (version == 0 || sampler.version != version - 1) {
+            registry.samplers.erase(it);
+            continue;
+        }
+        for (std::vector<RelationDelta*>::iterator itDelta = itChunk->second.begin();
+                itDelta != itChunk->second.end(); ++itDelta) {
+            RelationDelta& delta = **itDelta;
+            std::unordered_map<std::string, long>::iterator pos = sampler.positions.find(delta.key);
+            if (pos != sampler.positions.end()) {
+                sampler.tree.update(pos->second, delta.newCount);
+                sampler.relations[pos->second] = *(delta.relation);
+                sampler.relations[pos->second][JSON_ATTR_REL_COUNT] = delta.newCount;
+            } else if (delta.newCount > 0) {
+                sampler.positions[delta.key] = sampler.tree.append(delta.newCount);
+                sampler.relations.push_back(*(delta.relation));
+                sampler.relations.back()[JSON_ATTR_REL_COUNT] = delta.newCount;
+            }
+        }
+        sampler.version = version;
+
+        if (sampler.tree.total() <= 0)
+            registry.samplers.erase(it);
+    }
+}
+
+static bool dynamicSamplerHookRegistered = registerRelationHook(DynamicSamplerRegistry::relationHook, DynamicSamplerRegistry::relationBatchHook);
+
+#endif
@@ -0,0 +1,274 @@
+/*
+ *  sketch.h
+ *
+ *  Defines the count-min sketch behind approximate queries.  Items are attribute values in a
+ *  scope, either an entity pair or a single entity over all of its pairs, e.g. the number of
+ *  relation instances on pair "x+y" where y.b=2.  Instance totals per scope and the number of
+ *  instances carrying each attribute are small and kept exactly, only the value counts are
+ *  sketched.  An estimate never undercounts and overcounts by at most epsilon times the mass of
+ *  the sketch with probability 1 - delta.
+ *
+ *  Created by Ryan Faulkner on 2015-12-19
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _sketch_h
+#define _sketch_h
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <cmath>
+#include <stdint.h>
+#include <sstream>
+#include <json/json.h>
+
+#include "redis.h"
+#include "hooks.h"
+#include "catalog.h"
+#include "column_types.h"
+#include "models/model_def.h"
+
+#define KEY_SKETCH_CELLS "sketch"
+#define KEY_SKETCH_EXACT "sketch_exact"
+#define KEY_SKETCH_MASS "sketch_mass"
+#define KEY_SKETCH_BUILT "sketch_built"
+
+#define SKETCH_DEPTH 5          // delta = e^-5, under 0.7% failure probability per estimate
+#define SKETCH_WIDTH 2048       // epsilon = e / 2048, about 0.13% of the sketch mass
+
+#define SKETCH_SCOPE_PAIR "p:"
+#define SKETCH_SCOPE_ENTITY "e:"
+
+
+/**
+ *  Estimated instance count with its additive error bound - the true count lies in
+ *  [count - error, count]
+ */
+struct SketchEstimate {
+    long count;
+    long error;
+
+    SketchEstimate() : count(0), error(0) {}
+};
+
+
+/**
+ *  Interface to the count-min sketch.  The cells are one redis hash with fields "<row>:<column>",
+ *  the exact counters another with fields "<scope>" for instance totals and "<scope>|<entity>.<attr>"
+ *  for the instances carrying an attribute.
+ */
+class CountSketch {
+
+    static uint64_t hashItem(std::string);
+    static long column(uint64_t, int);
+    static std::string cellField(int, long);
+    static std::string itemName(std::string, std::string, std::string);
+    static std::string canonicalValue(std::string, std::string);
+
+public:
+
+    static std::string pairScope(std::string);
+    static std::string entityScope(std::string);
+    static double epsilon() { return std::exp(1.0) / SKETCH_WIDTH; }
+    static double confidence() { return 1.0 - std::exp(-(double)SKETCH_DEPTH); }
+
+    static void apply(RedisHandler&, std::string, Json::Value&, long, bool = true);
+    static void relationHook(RedisHandler&, std::string, Json::Value&, int, int);
+    static void relationBatchHook(RedisHandler&, std::vector<RelationDelta>&);
+    static bool estimate(RedisHandler&, std::string, std::string, std::string, std::string,
+        std::string, SketchEstimate&);
+    static long total(RedisHandler&, std::string);
+    static void clear(RedisHandler&);
+};
+
+/** FNV-1a hash of an item name */
+uint64_t CountSketch::hashItem(std::string item) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (std::string::iterator it = item.begin(); it != item.end(); ++it) {
+        hash ^= (unsigned char)*it;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/** Column of an item hash in a row, each row mixes the hash with its own seed */
+long CountSketch::column(uint64_t hash, int row) {
+    uint64_t z = hash + (row + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return (long)((z ^ (z >> 31)) % SKETCH_WIDTH);
+}
+
+std::string CountSketch::cellField(int row, long column) {
+    return std::to_string(row) + std::string(":") + std::to_string(column);
+}
+
+/** Sketch item of an attribute value in a scope */
+std::string CountSketch::itemName(std::string scope, std::string attribute, std::string value) {
+    return scope + std::string("|") + attribute + std::string("=") + value;
+}
+
+/** Numeric values are sketched by value so that e.g. "1.0" and "1" are the same item */
+std::string CountSketch::canonicalValue(std::string value, std::string type) {
+    if (type.compare(COLTYPE_NAME_INT) == 0)
+        return std::to_string(std::atol(value.c_str()));
+    if (type.compare(COLTYPE_NAME_FLOAT) == 0) {
+        std::ostringstream out;
+        out.precision(17);
+        out << std::atof(value.c_str());
+        return out.str();
+    }
+    return value;
+}
+
+/** Scope of the relations on a pair, named as in the pair catalog */
+std::string CountSketch::pairScope(std::string pair) { return std::string(SKETCH_SCOPE_PAIR) + pair; }
+
+/** Scope of the relations containing an entity on either side */
+std::string CountSketch::entityScope(std::string entity) { return std::string(SKETCH_SCOPE_ENTITY) + entity; }
+
+/**
+ *  Add a change in the instance count of a relation to the pair and entity scopes it belongs to.
+ *  An attribute carrying different values on the two sides of a relation on (e, e) never matches
+ *  an equality filter, so it is only counted as carried.  All updates are sent in one pipeline
+ *  unless the caller flushes it.
+ */
+void CountSketch::apply(RedisHandler& rds, std::string key, Json::Value& relation, long delta, bool flush) {
+    const char* sides[2][2] = { { JSON_ATTR_REL_ENTL, JSON_ATTR_REL_FIELDSL },
+        { JSON_ATTR_REL_ENTR, JSON_ATTR_REL_FIELDSR } };
+    std::map<std::string, std::set<std::string>> values;
+    std::vector<std::string> scopes, members, args;
+    std::string entity, type;
+    long mass = 0;
+
+    if (delta == 0) return;
+
+    scopes.push_back(CountSketch::pairScope(PairCatalog::pairFromKey(key)));
+    for (int i = 0; i < 2; i++) {
+        Json::Value& fields = relation[sides[i][1]];
+        entity = relation[sides[i][0]].asString();
+        if (i == 0 || entity.compare(relation[sides[0][0]].asString()) != 0)
+            scopes.push_back(CountSketch::entityScope(entity));
+
+        members = fields.getMemberNames();
+        for (std::vector<std::string>::iterator it = members.begin(); it != members.end(); ++it) {
+            if (it->compare(JSON_ATTR_FIELDS_COUNT) == 0 || it->find(JSON_ATTR_REL_TYPE_PREFIX) == 0) continue;
+            type = fields.get(std::string(JSON_ATTR_REL_TYPE_PREFIX) + *it, "").asString();
+            values[entity + std::string(".") + *it].insert(
+                CountSketch::canonicalValue(fields[*it].asString(), type));
+        }
+    }
+
+    for (std::vector<std::string>::iterator scope = scopes.begin(); scope != scopes.end(); ++scope) {
+        args.clear(); args.push_back("HINCRBY"); args.push_back(KEY_SKETCH_EXACT);
+        args.push_back(*scope); args.push_back(std::to_string(delta));
+        rds.appendCommand(args);
+
+        for (std::map<std::string, std::set<std::string>>::iterator it = values.begin(); it != values.end(); ++it) {
+            args.clear(); args.push_back("HINCRBY"); args.push_back(KEY_SKETCH_EXACT);
+            args.push_back(*scope + std::string("|") + it->first); args.push_back(std::to_string(delta));
+            rds.appendCommand(args);
+            if (it->second.size() != 1) continue;
+
+            uint64_t hash = CountSketch::hashItem(CountSketch::itemName(*scope, it->first, *(it->second.begin())));
+            for (int row = 0; row < SKETCH_DEPTH; row++) {
+                args.clear(); args.push_back("HINCRBY"); args.push_back(KEY_SKETCH_CELLS);
+                args.push_back(CountSketch::cellField(row, CountSketch::column(hash, row)));
+                args.push_back(std::to_string(delta));
+                rds.appendCommand(args);
+            }
+            mass += delta;
+        }
+    }
+
+    args.clear(); args.push_back("INCRBY"); args.push_back(KEY_SKETCH_MASS); args.push_back(std::to_string(mass));
+    rds.appendCommand(args);
+    if (flush) rds.flushPipeline();
+}
+
+/** Relation hook - applies the change in instance count to the sketch */
+void CountSketch::relationHook(RedisHandler& rds, std::string key, Json::Value& relation, int oldCount, int newCount) {
+    CountSketch::apply(rds, key, relation, newCount - oldCount);
+}
+
+/** Batch relation hook - the updates of the chunk are sent in one pipeline */
+void CountSketch::relationBatchHook(RedisHandler& rds, std::vector<RelationDelta>& deltas) {
+    for (std::vector<RelationDelta>::iterator it = deltas.begin(); it != deltas.end(); ++it)
+        CountSketch::apply(rds, it->key, *(it->relation), it->newCount - it->oldCount, false);
+    rds.flushPipeline();
+}
+
+static bool sketchHookRegistered = registerRelationHook(CountSketch::relationHook, CountSketch::relationBatchHook);
+
+/**
+ *  Estimate the instances in a scope passing an equality filter on one attribute.  As with
+ *  filtering relations, instances that do not carry the attribute pass the filter.
+ *
+ *  @param scope        pair or entity scope
+ *  @param entity       entity of the filtered attribute
+ *  @param attribute    filtered attribute, "" for the unfiltered total
+ *  @param value        value of the filter
+ *  @param type         type of the attribute
+ *
+ *  @returns            false if the sketch could not be read
+ */
+bool CountSketch::estimate(RedisHandler& rds, std::string scope, std::string entity, std::string attribute,
+    std::string value, std::string type, SketchEstimate& estimate) {
+
+    std::string carried = entity + std::string(".") + attribute;
+    uint64_t hash = CountSketch::hashItem(CountSketch::itemName(scope, carried,
+        CountSketch::canonicalValue(value, type)));
+    std::vector<std::string> args, replies;
+
+    args.push_back("HGET"); args.push_back(KEY_SKETCH_EXACT); args.push_back(scope);
+    rds.appendCommand(args);
+    if (attribute.length() > 0) {
+        args.clear(); args.push_back("HGET"); args.push_back(KEY_SKETCH_EXACT);
+        args.push_back(scope + std::string("|") + carried);
+        rds.appendCommand(args);
+        for (int row = 0; row < SKETCH_DEPTH; row++) {
+            args.clear(); args.push_back("HGET"); args.push_back(KEY_SKETCH_CELLS);
+            args.push_back(CountSketch::cellField(row, CountSketch::column(hash, row)));
+            rds.appendCommand(args);
+        }
+        args.clear(); args.push_back("GET"); args.push_back(KEY_SKETCH_MASS);
+        rds.appendCommand(args);
+    }
+    replies = rds.flushPipeline();
+    if (replies.size() != (attribute.length() > 0 ? SKETCH_DEPTH + 3 : 1)) return false;
+
+    estimate = SketchEstimate();
+    estimate.count = std::atol(replies[0].c_str());
+    if (attribute.length() == 0) return true;
+
+    // Instances carrying the attribute match only on the value, the minimum over rows bounds it.
+    // Counts are integers so an overcount of at most epsilon times the mass is at most its floor
+    long carriedCount = std::atol(replies[1].c_str());
+    long matching = carriedCount;
+    for (int row = 0; row < SKETCH_DEPTH; row++)
+        matching = std::min(matching, std::atol(replies[row + 2].c_str()));
+    if (matching < 0) matching = 0;
+
+    estimate.count = estimate.count - carriedCount + matching;
+    estimate.error = std::min(matching,
+        (long)std::floor(CountSketch::epsilon() * std::atol(replies[SKETCH_DEPTH + 2].c_str())));
+    return true;
+}
+
+/** Exact instance total of a scope */
+long CountSketch::total(RedisHandler& rds, std::string scope) {
+    SketchEstimate estimate;
+    CountSketch::estimate(rds, scope, "", "", "", "", estimate);
+    return estimate.count;
+}
+
+/** Remove the sketch and its exact counters */
+void CountSketch::clear(RedisHandler& rds) {
+    rds.deleteKey(KEY_SKETCH_CELLS);
+    rds.deleteKey(KEY_SKETCH_EXACT);
+    rds.deleteKey(KEY_SKETCH_MASS);
+}
+
+#endif
@@ -0,0 +1,332 @@
+/*
+ *  standing.h
+ *
+ *  Defines standing queries.  A standing query is an INF probability or expected value registered
+ *  once and kept current as relations change - the relation hook applies each change in instance
+ *  count to the counts and sums behind the answer, so maintaining it costs a handful of redis
+ *  increments per write rather than a scan.  When the answer changes it is published to the
+ *  channel of the query over redis pub/sub.
+ *
+ *  Definitions are a redis hash keyed by query id, the aggregates of each query are a hash of
+ *  their own holding the last answer published and its sequence number.
+ *
+ *  Created by Ryan Faulkner on 2015-12-27
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _standing_h
+#define _standing_h
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <json/json.h>
+
+#include "redis.h"
+#include "hooks.h"
+#include "moments.h"
+#include "column_types.h"
+#include "models/models.h"
+
+#define KEY_WATCH_DEFINITIONS "watches"
+#define KEY_WATCH_DEFINITIONS_VERSION "watches_version"
+#define KEY_WATCH_COUNTER "watchid"
+#define KEY_WATCH_PREFIX "watch"
+#define KEY_WATCH_DELIMETER "+"
+#define WATCH_CHANNEL_PREFIX "databayes:watch:"
+
+#define WATCH_FIELD_PAIRWISE "pairwise"
+#define WATCH_FIELD_MARGINAL "marginal"
+#define WATCH_FIELD_COUNT "count"
+#define WATCH_FIELD_SUM "sum"
+#define WATCH_FIELD_SUMSQ "sumsq"
+#define WATCH_FIELD_VALUE "value"
+#define WATCH_FIELD_SEQUENCE "sequence"
+
+#define JSON_ATTR_WATCH_ID "watch"
+#define JSON_ATTR_WATCH_TARGET_ENT "target_entity"
+#define JSON_ATTR_WATCH_TARGET_ATTR "target_attribute"
+#define JSON_ATTR_WATCH_GIVEN_ENT "given_entity"
+#define JSON_ATTR_WATCH_FILTER "filter"
+#define JSON_ATTR_WATCH_COMPARE "compare"
+#define JSON_ATTR_WATCH_CHANNEL "channel"
+
+
+/**
+ *  Interface to the standing queries.  A query without a target attribute maintains the instance
+ *  counts of the filtered relations between the two entities and of those on the given entity, as
+ *  Bayes::computeConditional counts them.  A query with one maintains the moments of the attribute
+ *  over the filtered relations on the target entity, as Bayes::expectedAttribute does.
+ */
+class StandingQuery {
+
+    static DefinitionCache& definitionCache();
+    static std::string aggregateKey(std::string);
+    static std::vector<AttributeTuple> parseFilter(Json::Value&);
+    static bool passes(Json::Value&, std::vector<AttributeTuple>&, std::string);
+    static Json::Value answer(Json::Value&, std::unordered_map<std::string, std::string>&);
+
+public:
+
+    static std::string channel(std::string);
+    static bool apply(RedisHandler&, Json::Value&, Json::Value&, long, bool = true);
+    static void relationHook(RedisHandler&, std::string, Json::Value&, int, int);
+    static void relationBatchHook(RedisHandler&, std::vector<RelationDelta>&);
+
+    static std::string declare(RedisHandler&, Json::Value&, std::vector<Json::Value>&);
+    static bool publish(RedisHandler&, Json::Value&, bool = false);
+    static bool fetchDefinition(RedisHandler&, std::string, Json::Value&);
+    static std::vector<Json::Value> fetchDefinitions(RedisHandler&);
+    static Json::Value fetchQuery(RedisHandler&, std::string);
+    static bool drop(RedisHandler&, std::string);
+    static void dropEntity(RedisHandler&, std::string);
+};
+
+/** Redis key of the aggregates of a query */
+std::string StandingQuery::aggregateKey(std::string id) {
+    return std::string(KEY_WATCH_PREFIX) + KEY_WATCH_DELIMETER + id;
+}
+
+/** Pub/sub channel the answers of a query are published to */
+std::string StandingQuery::channel(std::string id) {
+    return std::string(WATCH_CHANNEL_PREFIX) + id;
+}
+
+/** The filter of a query, stored as a list of attribute tuples */
+std::vector<AttributeTuple> StandingQuery::parseFilter(Json::Value& definition) {
+    std::vector<AttributeTuple> filter;
+    Json::FastWriter writer;
+    Json::Value& tuples = definition[JSON_ATTR_WATCH_FILTER];
+    for (Json::ArrayIndex i = 0; i < tuples.size(); i++)
+        filter.push_back(AttributeTuple(writer.write(tuples[i])));
+    return filter;
+}
+
+/**
+ *  Does a relation pass the filter?  As in IndexHandler::filterRelations a filter applies to the
+ *  attributes a relation carries for its entity, relations lacking the attribute pass.
+ */
+bool StandingQuery::passes(Json::Value& relation, std::vector<AttributeTuple>& filter, std::string compare) {
+    const char* sides[2][2] = { { JSON_ATTR_REL_ENTL, JSON_ATTR_REL_FIELDSL },
+        { JSON_ATTR_REL_ENTR, JSON_ATTR_REL_FIELDSR } };
+    AttributeTuple value;
+    std::string type;
+
+    for (std::vector<AttributeTuple>::iterator it = filter.begin(); it != filter.end(); ++it)
+        for (int i = 0; i < 2; i++) {
+            Json::Value& fields = relation[sides[i][1]];
+            if (relation[sides[i][0]].asString().compare(it->entity) != 0 || !fields.isMember(it->attribute))
+                continue;
+            type = fields.get(std::string(JSON_ATTR_REL_TYPE_PREFIX) + it->attribute, "").asString();
+            value = AttributeTuple(it->entity, it->attribute, fields[it->attribute].asString(), type);
+            if ((type.compare(COLTYPE_NAME_INT) == 0 && !AttributeTuple::compare<IntegerColumn>(value, *it, compare)) ||
+                    (type.compare(COLTYPE_NAME_FLOAT) == 0 && !AttributeTuple::compare<FloatColumn>(value, *it, compare)) ||
+                    (type.compare(COLTYPE_NAME_STR) == 0 && !AttributeTuple::compare<StringColumn>(value, *it, compare)))
+                return false;
+        }
+    return true;
+}
+
+/**
+ *  Apply a change in instance count for a relation to the aggregates of a query, the increments
+ *  are sent in one pipeline unless the caller flushes it.  Returns false if the relation does not
+ *  bear on the query.
+ */
+bool StandingQuery::apply(RedisHandler& rds, Json::Value& definition, Json::Value& relation, long delta, bool flush) {
+    std::string target = definition[JSON_ATTR_WATCH_TARGET_ENT].asString();
+    std::string attribute = definition[JSON_ATTR_WATCH_TARGET_ATTR].asString();
+    std::string given = definition[JSON_ATTR_WATCH_GIVEN_ENT].asString();
+    std::string left = relation[JSON_ATTR_REL_ENTL].asString();
+    std::string right = relation[JSON_ATTR_REL_ENTR].asString();
+    std::string key = StandingQuery::aggregateKey(definition[JSON_ATTR_WATCH_ID].asString());
+    std::vector<std::string> args;
+    bool pending = false;
+
+    if (delta == 0) return false;
+    std::string entity = attribute.compare("") == 0 ? given : target;
+    if (left.compare(entity) != 0 && right.compare(entity) != 0) return false;
+
+    std::vector<AttributeTuple> filter = StandingQuery::parseFilter(definition);
+    if (!StandingQuery::passes(relation, filter, definition[JSON_ATTR_WATCH_COMPARE].asString()))
+        return false;
+
+    if (attribute.compare("") == 0) {
+        args.push_back("HINCRBY"); args.push_back(key);
+        args.push_back(WATCH_FIELD_MARGINAL); args.push_back(std::to_string(delta));
+        rds.appendCommand(args);
+        if ((left.compare(target) == 0 && right.compare(given) == 0) ||
+                (left.compare(given) == 0 && right.compare(target) == 0)) {
+            args[2] = WATCH_FIELD_PAIRWISE;
+            rds.appendCommand(args);
+        }
+        if (flush) rds.flushPipeline();
+        return true;
+    }
+
+    // Values on either side carried by the target entity, as Bayes::momentsAttribute reads them
+    const char* sides[2][2] = { { JSON_ATTR_REL_ENTL, JSON_ATTR_REL_FIELDSL },
+        { JSON_ATTR_REL_ENTR, JSON_ATTR_REL_FIELDSR } };
+    double value;
+    for (int i = 0; i < 2; i++) {
+        if (relation[sides[i][0]].asString().compare(target) != 0 || !relation[sides[i][1]].isMember(attribute))
+            continue;
+        value = std::atof(relation[sides[i][1]][attribute].asCString());
+        args.clear(); args.push_back("HINCRBY"); args.push_back(key);
+        args.push_back(WATCH_FIELD_COUNT); args.push_back(std::to_string(delta));
+        rds.appendCommand(args);
+        args.clear(); args.push_back("HINCRBYFLOAT"); args.push_back(key);
+        args.push_back(WATCH_FIELD_SUM); args.push_back(MomentStore::formatValue(value * delta));
+        rds.appendCommand(args);
+        args.clear(); args.push_back("HINCRBYFLOAT"); args.push_back(key);
+        args.push_back(WATCH_FIELD_SUMSQ); args.push_back(MomentStore::formatValue(value * value * delta));
+        rds.appendCommand(args);
+        pending = true;
+    }
+    if (pending && flush) rds.flushPipeline();
+    return pending;
+}
+
+/** The answer of a query from its aggregates */
+Json::Value StandingQuery::answer(Json::Value& definition, std::unordered_map<std::string, std::string>& fields) {
+    Json::Value json;
+    json[JSON_ATTR_WATCH_ID] = definition[JSON_ATTR_WATCH_ID];
+    json[JSON_ATTR_WATCH_CHANNEL] = definition[JSON_ATTR_WATCH_CHANNEL];
+
+    if (definition[JSON_ATTR_WATCH_TARGET_ATTR].asString().compare("") == 0) {
+        long pairwise = std::atol(fields[WATCH_FIELD_PAIRWISE].c_str());
+        long marginal = std::atol(fields[WATCH_FIELD_MARGINAL].c_str());
+        json["probability"] = marginal > 0 ? (double)pairwise / marginal : 0.0;
+        json[WATCH_FIELD_PAIRWISE] = (Json::Int64)pairwise;
+        json[WATCH_FIELD_MARGINAL] = (Json::Int64)marginal;
+    } else {
+        Moments moments;
+        moments.count = std::atol(fields[WATCH_FIELD_COUNT].c_str());
+        moments.sum = std::atof(fields[WATCH_FIELD_SUM].c_str());
+        moments.sumsq = std::atof(fields[WATCH_FIELD_SUMSQ].c_str());
+        json["expected"] = moments.count > 0 ? moments.mean() : 0.0;
+        json["variance"] = moments.count > 0 ? moments.variance() : 0.0;
+        json[WATCH_FIELD_COUNT] = (Json::Int64)moments.count;
+    }
+    return json;
+}
+
+/**
+ *  Publish the answer of a query to its channel if it changed since the last one published, or
+ *  regardless when forced.  The answer published is kept with its sequence number.
+ */
+bool StandingQuery::publish(RedisHandler& rds, Json::Value& definition, bool force) {
+    std::string key = StandingQuery::aggregateKey(definition[JSON_ATTR_WATCH_ID].asString());
+    std::unordered_map<std::string, std::string> fields = rds.readHashMapAll(key);
+    Json::Value json = StandingQuery::answer(definition, fields);
+
+    Json::FastWriter writer;
+    std::string value = writer.write(json);
+    if (!force && value.compare(fields[WATCH_FIELD_VALUE]) == 0) return false;
+
+    json[WATCH_FIELD_SEQUENCE] = (Json::Int64)rds.incrementHashMapAndRead(key, WATCH_FIELD_SEQUENCE, 1);
+    rds.writeHashMap(key, WATCH_FIELD_VALUE, value);
+    rds.publish(definition[JSON_ATTR_WATCH_CHANNEL].asString(), writer.write(json));
+    return true;
+}
+
+/** Definitions of the queries, read once per version by the hooks */
+DefinitionCache& StandingQuery::definitionCache() {
+    static DefinitionCache cache(KEY_WATCH_DEFINITIONS, KEY_WATCH_DEFINITIONS_VERSION);
+    return cache;
+}
+
+/** Relation hook - applies the change in instance count to every query it bears on */
+void StandingQuery::relationHook(RedisHandler& rds, std::string key, Json::Value& relation, int oldCount, int newCount) {
+    std::vector<RelationDelta> deltas(1, RelationDelta(key, &relation, oldCount, newCount));
+    StandingQuery::relationBatchHook(rds, deltas);
+}
+
+/**
+ *  Batch relation hook - the increments of the chunk are sent in one pipeline and each query it
+ *  bears on is published once
+ */
+void StandingQuery::relationBatchHook(RedisHandler& rds, std::vector<RelationDelta>& deltas) {
+    std::vector<Json::Value> definitions = StandingQuery::fetchDefinitions(rds);
+    std::vector<bool> changed(definitions.size(), false);
+    bool pending = false;
+
+    for (std::vector<RelationDelta>::iterator it = deltas.begin(); it != deltas.end(); ++it)
+        for (size_t i = 0; i < definitions.size(); i++)
+            if (StandingQuery::apply(rds, definitions[i], *(it->relation), it->newCount - it->oldCount, false)) {
+                changed[i] = true;
+                pending = true;
+            }
+    if (pending) rds.flushPipeline();
+
+    for (size_t i = 0; i < definitions.size(); i++)
+        if (changed[i])
+            StandingQuery::publish(rds, definitions[i]);
+}
+
+static bool standingHookRegistered = registerRelationHook(StandingQuery::relationHook, StandingQuery::relationBatchHook);
+
+/**
+ *  Register a query, assigning its id, and build its aggregates from the relations currently on
+ *  the entity it counts over.  The first answer is published.  Returns the id.
+ */
+std::string StandingQuery::declare(RedisHandler& rds, Json::Value& definition, std::vector<Json::Value>& relations) {
+    std::string id = std::to_string(rds.incrementAndRead(KEY_WATCH_COUNTER, 1));
+    Json::FastWriter writer;
+
+    definition[JSON_ATTR_WATCH_ID] = id;
+    definition[JSON_ATTR_WATCH_CHANNEL] = StandingQuery::channel(id);
+    rds.deleteKey(StandingQuery::aggregateKey(id));
+    for (std::vector<Json::Value>::iterator it = relations.begin(); it != relations.end(); ++it)
+        StandingQuery::apply(rds, definition, *it, (*it)[JSON_ATTR_REL_COUNT].asInt());
+    rds.writeHashMap(KEY_WATCH_DEFINITIONS, id, writer.write(definition));
+    StandingQuery::definitionCache().bump(rds);
+    StandingQuery::publish(rds, definition, true);
+    return id;
+}
+
+/** Fetch the definition of a query */
+bool StandingQuery::fetchDefinition(RedisHandler& rds, std::string id, Json::Value& definition) {
+    Json::Reader reader;
+    std::string value = rds.readHashMap(KEY_WATCH_DEFINITIONS, id);
+    return value.length() > 0 && reader.parse(value, definition, false);
+}
+
+/** Fetch the definitions of all queries */
+std::vector<Json::Value> StandingQuery::fetchDefinitions(RedisHandler& rds) {
+    return StandingQuery::definitionCache().fetch(rds);
+}
+
+/** A query as json - its definition along with its current answer and sequence number */
+Json::Value StandingQuery::fetchQuery(RedisHandler& rds, std::string id) {
+    Json::Value json;
+    if (!StandingQuery::fetchDefinition(rds, id, json)) return json;
+
+    std::unordered_map<std::string, std::string> fields = rds.readHashMapAll(StandingQuery::aggregateKey(id));
+    Json::Value answer = StandingQuery::answer(json, fields);
+    std::vector<std::string> members = answer.getMemberNames();
+    for (std::vector<std::string>::iterator it = members.begin(); it != members.end(); ++it)
+        json[*it] = answer[*it];
+    json[WATCH_FIELD_SEQUENCE] = (Json::Int64)std::atol(fields[WATCH_FIELD_SEQUENCE].c_str());
+    return json;
+}
+
+/** Remove a query */
+bool StandingQuery::drop(RedisHandler& rds, std::string id) {
+    Json::Value definition;
+    if (!StandingQuery::fetchDefinition(rds, id, definition)) return false;
+    rds.deleteHashMapField(KEY_WATCH_DEFINITIONS, id);
+    StandingQuery::definitionCache().bump(rds);
+    rds.deleteKey(StandingQuery::aggregateKey(id));
+    return true;
+}
+
+/** Remove all queries on an entity, e.g. once it is removed */
+void StandingQuery::dropEntity(RedisHandler& rds, std::string entity) {
+    std::vector<Json::Value> definitions = StandingQuery::fetchDefinitions(rds);
+    for (std::vector<Json::Value>::iterator it = definitions.begin(); it != definitions.end(); ++it)
+        if ((*it)[JSON_ATTR_WATCH_TARGET_ENT].asString().compare(entity) == 0 ||
+                (*it)[JSON_ATTR_WATCH_GIVEN_ENT].asString().compare(entity) == 0)
+            StandingQuery::drop(rds, (*it)[JSON_ATTR_WATCH_ID].asString());
+}
+
+#endif
@@ -12,6 +12,8 @@
 #include <string>
 #include <vector>
 #include <regex>
+#include <thread>
+#include <future>
 #include <assert.h>
 #include <json/json.h>
 
@@ -21,6 +23,7 @@
 #include "index.h"
 #include "bayes.h"
 #include "parse.h"
+#include "loader.h"
 #include "models/models.h"
 
 #define REDISHOST "127.0.0.1"
@@ -727,6 +730,1821 @@ void testSamplePairwise() {
 
 }
 
+/**
+ *  Ensure alias table draws follow the weights
+ */
+void testAliasTable() {
+    std::vector<double> weights;
+    weights.push_back(1.0);
+    weights.push_back(3.0);
+    weights.push_back(0.0);
+    AliasTable table(weights);
+
+    // Sweep the unit square - each index is drawn in proportion to its weight
+    long counts[3] = {0, 0, 0};
+    int steps = 300;
+    for (int i = 0; i < steps; i++)
+        for (int j = 0; j < steps; j++)
+            counts[table.sample((i + 0.5) / steps, (j + 0.5) / steps)]++;
+    assert(counts[0] == 22500);
+    assert(counts[1] == 67500);
+    assert(counts[2] == 0);
+    assert(table.getTotal() == 4.0);
+}
+
+/**
+ *  Ensure a materialized relation set carries the filtered relations and their total, and that
+ *  relations on the pair (e, e) are counted once in the marginal set
+ */
+void testFetchRelationSet() {
+    Bayes bayes;
+    IndexHandler ih;
+    defpair fields_ent;
+    valpair fields_rel_1, fields_rel_2, fields_empty;
+    std::unordered_map<std::string, std::string> types;
+
+    fields_rel_1.push_back(std::make_pair("a", "1"));
+    fields_rel_2.push_back(std::make_pair("a", "2"));
+    types.insert(std::make_pair("a", COLTYPE_NAME_INT));
+
+    Entity e1("_m", fields_ent), e2("_n", fields_ent);
+    Relation r1("_m", "_n", fields_rel_1, fields_empty, types, types);
+    Relation r2("_m", "_n", fields_rel_2, fields_empty, types, types);
+    Relation r3("_m", "_m", fields_rel_1, fields_empty, types, types);
+    ih.writeEntity(e1);
+    ih.writeEntity(e2);
+    ih.writeRelation(r1, 2);
+    ih.writeRelation(r2, 3);
+    ih.writeRelation(r3, 1);
+
+    AttributeBucket ab;
+    RelationSet set = bayes.fetchRelationSet("_m", "_n", ab, ATTR_TUPLE_COMPARE_EQ);
+    assert(set.relations.size() == 2);
+    assert(set.total == 5);
+    assert(set.total == bayes.countRelations("_m", "_n", ab, ATTR_TUPLE_COMPARE_EQ));
+
+    set = bayes.fetchMarginalSet("_m", ab, ATTR_TUPLE_COMPARE_EQ);
+    assert(set.relations.size() == 3);
+    assert(set.total == 6);
+
+    assert(bayes.computeConditional("_m", "_n", ab, ATTR_TUPLE_COMPARE_EQ) == (float)1.0);
+
+    ih.removeEntity(e1);
+    ih.removeEntity(e2);
+}
+
+/**
+ *  Ensure conditional tables are built on declaration, follow writes and answer INF
+ */
+void testConditionalTable() {
+    Bayes bayes;
+    IndexHandler ih;
+    defpair fields_ent_1, fields_ent_2;
+    valpair fields_rel_1, fields_rel_2, fields_rel_3, fields_given_1, fields_given_2;
+    std::unordered_map<std::string, std::string> types_1, types_2;
+
+    ColumnBase* intCol = new IntegerColumn();
+    fields_ent_1.push_back(std::make_pair(intCol, "a"));
+    fields_ent_2.push_back(std::make_pair(intCol, "b"));
+    fields_rel_1.push_back(std::make_pair("a", "1"));
+    fields_rel_2.push_back(std::make_pair("a", "3"));
+    fields_rel_3.push_back(std::make_pair("a", "8"));
+    fields_given_1.push_back(std::make_pair("b", "1"));
+    fields_given_2.push_back(std::make_pair("b", "2"));
+    types_1.insert(std::make_pair("a", COLTYPE_NAME_INT));
+    types_2.insert(std::make_pair("b", COLTYPE_NAME_INT));
+
+    Entity e1("_t", fields_ent_1), e2("_g", fields_ent_2);
+    Relation r1("_t", "_g", fields_rel_1, fields_given_1, types_1, types_2);
+    Relation r2("_t", "_g", fields_rel_2, fields_given_1, types_1, types_2);
+    Relation r3("_t", "_g", fields_rel_3, fields_given_2, types_1, types_2);
+    ih.writeEntity(e1);
+    ih.writeEntity(e2);
+    ih.writeRelation(r1, 1);
+    ih.writeRelation(r2, 3);
+
+    std::string name = ConditionalTable::tableName("_t", "a", "_g", "b");
+    std::vector<TableCell> cells;
+    assert(!ih.writeConditionalTable("_t", "a", "_t", "a", 10));
+    assert(ih.writeConditionalTable("_t", "a", "_g", "b", 10));
+    assert(ih.fetchTableCells(name, cells));
+    assert(cells.size() == 2);
+
+    // Writes are applied to the table
+    ih.writeRelation(r3, 2);
+    cells.clear();
+    ih.fetchTableCells(name, cells);
+    assert(cells.size() == 3);
+
+    AttributeTuple attr("_t", "a", "", "");
+    AttributeBucket filter("_g", fields_given_1, types_2);
+    assert(bayes.expectedAttribute(attr, filter, ATTR_TUPLE_COMPARE_EQ) == (float)2.5);
+    assert(bayes.modeAttribute(attr, filter, ATTR_TUPLE_COMPARE_EQ).compare("3") == 0);
+
+    // A table over its limit is no longer used
+    assert(ih.writeConditionalTable("_t", "a", "_g", "b", 2));
+    assert(!ih.fetchTableCells(name, cells));
+    assert(bayes.expectedAttribute(attr, filter, ATTR_TUPLE_COMPARE_EQ) == (float)2.5);
+
+    // Removing an entity drops its tables
+    assert(ih.writeConditionalTable("_t", "a", "_g", "b", 10));
+    ih.removeEntity(e1);
+    ih.removeEntity(e2);
+    assert(!ih.fetchTableCells(name, cells));
+    delete intCol;
+}
+
+/**
+ *  Ensure moment accumulators follow writes, decrements and removals and agree with the filtered path
+ */
+void testMomentAccumulators() {
+    Bayes bayes;
+    IndexHandler ih;
+    defpair fields_ent_1, fields_ent_2;
+    valpair fields_rel_1, fields_rel_2, fields_given_1, fields_given_2;
+    std::unordered_map<std::string, std::string> types_1, types_2;
+    Moments moments;
+    RedisHandler rds(REDISDBTEST, REDISPORT);
+
+    ColumnBase* floatCol = new FloatColumn();
+    ColumnBase* intCol = new IntegerColumn();
+    fields_ent_1.push_back(std::make_pair(floatCol, "x"));
+    fields_ent_2.push_back(std::make_pair(intCol, "y"));
+    fields_rel_1.push_back(std::make_pair("x", "1.0"));
+    fields_rel_2.push_back(std::make_pair("x", "4.0"));
+    fields_given_1.push_back(std::make_pair("y", "1"));
+    fields_given_2.push_back(std::make_pair("y", "2"));
+    types_1.insert(std::make_pair("x", COLTYPE_NAME_FLOAT));
+    types_2.insert(std::make_pair("y", COLTYPE_NAME_INT));
+
+    Entity e1("_m", fields_ent_1), e2("_n", fields_ent_2);
+    Relation r1("_m", "_n", fields_rel_1, fields_given_1, types_1, types_2);
+    Relation r2("_m", "_n", fields_rel_2, fields_given_2, types_1, types_2);
+    ih.writeEntity(e1);
+    ih.writeEntity(e2);
+    // Writes keep the accumulators current but only a rebuild marks them built
+    rds.deleteKey(KEY_MOMENTS_BUILT);
+    ih.writeRelation(r1, 2);
+    ih.writeRelation(r2, 1);
+    assert(!rds.exists(KEY_MOMENTS_BUILT));
+    std::vector<std::string> built = ih.rebuildMissing();
+    assert(std::find(built.begin(), built.end(), "attribute moment accumulators") != built.end());
+    assert(rds.exists(KEY_MOMENTS_BUILT));
+
+    // Values 1, 1, 4
+    AttributeTuple attr("_m", "x", "", "");
+    AttributeBucket none, filter("_n", fields_given_1, types_2);
+    assert(ih.fetchMoments("_m", "x", moments) && moments.count == 3);
+    assert(bayes.expectedAttribute(attr, none, ATTR_TUPLE_COMPARE_EQ) == (float)2.0);
+    assert(bayes.varianceAttribute(attr, none, ATTR_TUPLE_COMPARE_EQ) == (float)2.0);
+    assert(bayes.expectedAttribute(attr, filter, ATTR_TUPLE_COMPARE_EQ) == (float)1.0);
+    assert(bayes.varianceAttribute(attr, filter, ATTR_TUPLE_COMPARE_EQ) == (float)0.0);
+
+    // No matching relations
+    valpair fields_given_3;
+    fields_given_3.push_back(std::make_pair("y", "3"));
+    AttributeBucket unmatched("_n", fields_given_3, types_2);
+    assert(bayes.expectedAttribute(attr, unmatched, ATTR_TUPLE_COMPARE_EQ) == (float)0.0);
+    assert(bayes.varianceAttribute(attr, unmatched, ATTR_TUPLE_COMPARE_EQ) == (float)0.0);
+    assert(bayes.stddevAttribute(attr, unmatched, ATTR_TUPLE_COMPARE_EQ) == (float)0.0);
+
+    // Values 1, 4
+    ih.writeRelation(r1, -1);
+    assert(bayes.expectedAttribute(attr, none, ATTR_TUPLE_COMPARE_EQ) == (float)2.5);
+    assert(bayes.stddevAttribute(attr, none, ATTR_TUPLE_COMPARE_EQ) == (float)1.5);
+
+    // Values 1
+    ih.removeRelation(r2);
+    assert(bayes.expectedAttribute(attr, none, ATTR_TUPLE_COMPARE_EQ) == (float)1.0);
+
+    // The cascade takes the partner's relations out of the accumulators
+    ih.removeEntity(e2);
+    assert(!ih.fetchMoments("_m", "x", moments));
+    ih.removeEntity(e1);
+    delete floatCol;
+    delete intCol;
+}
+
+/**
+ *  Ensure sketch estimates bound the exact filtered probabilities and follow removals
+ */
+void testCountSketch() {
+    Bayes bayes;
+    IndexHandler ih;
+    defpair fields_ent_1, fields_ent_2;
+    std::unordered_map<std::string, std::string> types_1, types_2;
+    std::vector<Relation> relations;
+    RedisHandler rds(REDISDBTEST, REDISPORT);
+
+    ColumnBase* intCol = new IntegerColumn();
+    fields_ent_1.push_back(std::make_pair(intCol, "a"));
+    fields_ent_2.push_back(std::make_pair(intCol, "b"));
+    types_1.insert(std::make_pair("a", COLTYPE_NAME_INT));
+    types_2.insert(std::make_pair("b", COLTYPE_NAME_INT));
+
+    Entity e1("_s", fields_ent_1), e2("_u", fields_ent_2), e3("_v", fields_ent_1);
+    ih.writeEntity(e1);
+    ih.writeEntity(e2);
+    ih.writeEntity(e3);
+    rds.deleteKey(KEY_SKETCH_BUILT);
+    for (int i = 0; i < 20; i++) {
+        valpair left, right;
+        left.push_back(std::make_pair("a", std::to_string(i)));
+        right.push_back(std::make_pair("b", std::to_string(i % 4)));
+        relations.push_back(Relation(i % 3 == 0 ? "_v" : "_s", "_u", left, right, types_1, types_2));
+        ih.writeRelation(relations.back(), 1 + i % 5);
+    }
+
+    // Writes keep the sketch current but only a rebuild marks it built
+    assert(!rds.exists(KEY_SKETCH_BUILT));
+    std::vector<std::string> built = ih.rebuildMissing();
+    assert(std::find(built.begin(), built.end(), "count-min sketch") != built.end());
+    assert(rds.exists(KEY_SKETCH_BUILT));
+
+    for (int value = 0; value < 5; value++) {
+        valpair fields_filter;
+        fields_filter.push_back(std::make_pair("b", std::to_string(value)));
+        AttributeBucket filter("_u", fields_filter, types_2);
+        float exact = bayes.computeConditional("_s", "_u", filter, ATTR_TUPLE_COMPARE_EQ);
+        Estimate estimate = bayes.approxConditional("_s", "_u", filter, ATTR_TUPLE_COMPARE_EQ);
+        assert(estimate.approximate);
+        assert(estimate.lower <= exact + 1e-6 && exact <= estimate.upper + 1e-6);
+
+        exact = bayes.computeMarginal("_u", filter, ATTR_TUPLE_COMPARE_EQ);
+        estimate = bayes.approxMarginal("_u", filter, ATTR_TUPLE_COMPARE_EQ);
+        assert(estimate.lower <= exact + 1e-6 && exact <= estimate.upper + 1e-6);
+    }
+
+    // Filters the sketch cannot answer are computed exactly
+    AttributeBucket none;
+    Estimate estimate = bayes.approxConditional("_s", "_u", none, ATTR_TUPLE_COMPARE_GT);
+    assert(!estimate.approximate && estimate.lower == estimate.upper);
+
+    // The cascade takes the removed entity's relations out of the sketch
+    SketchEstimate count;
+    AttributeTuple unfiltered;
+    ih.removeEntity(e3);
+    assert(ih.estimateCount(CountSketch::entityScope("_u"), unfiltered, count));
+    assert(count.count == bayes.countEntityInRelations("_u", none, ATTR_TUPLE_COMPARE_EQ, false));
+    ih.removeEntity(e1);
+    ih.removeEntity(e2);
+    assert(ih.estimateCount(CountSketch::entityScope("_u"), unfiltered, count) && count.count == 0);
+    delete intCol;
+}
+
+/**
+ *  Ensure reservoir estimates follow writes and cover the exact answers over a pair too large to read
+ */
+void testReservoirEstimate() {
+    Bayes bayes;
+    IndexHandler ih;
+    defpair fields_ent_1, fields_ent_2;
+    std::unordered_map<std::string, std::string> types_1, types_2;
+    std::vector<Relation> relations;
+
+    ColumnBase* intCol = new IntegerColumn();
+    fields_ent_1.push_back(std::make_pair(intCol, "a"));
+    fields_ent_2.push_back(std::make_pair(intCol, "b"));
+    types_1.insert(std::make_pair("a", COLTYPE_NAME_INT));
+    types_2.insert(std::make_pair("b", COLTYPE_NAME_INT));
+
+    Entity e1("_w", fields_ent_1), e2("_z", fields_ent_2);
+    ih.writeEntity(e1);
+    ih.writeEntity(e2);
+    for (int i = 0; i < 30; i++) {
+        valpair left, right;
+        left.push_back(std::make_pair("a", std::to_string(i)));
+        right.push_back(std::make_pair("b", std::to_string(i % 2)));
+        relations.push_back(Relation("_w", "_z", left, right, types_1, types_2));
+        ih.writeRelation(relations.back(), 100);
+    }
+
+    // Below the threshold answers are exact
+    AttributeTuple attr("_w", "a", "", "");
+    AttributeBucket none;
+    assert(!bayes.estimateExpected(attr, none, ATTR_TUPLE_COMPARE_EQ).approximate);
+
+    bayes.setSampleThreshold(10);
+    std::string pair = ih.orderPairAlphaNumeric("_w", "_z");
+    std::vector<Json::Value> sample;
+    long n;
+    assert(bayes.estimateExpected(attr, none, ATTR_TUPLE_COMPARE_EQ).approximate);
+    ReservoirRegistry::instance().sample(pair, sample);
+    assert(sample.size() > 0);
+
+    // Writes are applied to the reservoir in place and removed relations leave it
+    ih.writeRelation(relations[0], 1000);
+    ih.removeRelation(relations[1]);
+    assert(ReservoirRegistry::instance().isCurrent(pair, ih.fetchPairVersion(pair)));
+    sample.clear();
+    assert(ReservoirRegistry::instance().sample(pair, sample) == 29 * 100 + 1000);
+    n = 0;
+    for (std::vector<Json::Value>::iterator it = sample.begin(); it != sample.end(); ++it) {
+        assert((*it)[JSON_ATTR_REL_FIELDSL]["a"].asString().compare("1") != 0);
+        n += (*it)[JSON_ATTR_REL_COUNT].asInt();
+    }
+    assert(n <= RESERVOIR_SIZE);
+
+    // A chunk bumps the pair once and the reservoir takes the new version
+    std::vector<std::pair<Json::Value, int>> chunk;
+    chunk.push_back(std::make_pair(relations[2].toJson(), 10));
+    chunk.push_back(std::make_pair(relations[3].toJson(), 10));
+    ih.writeRelations(chunk);
+    assert(ReservoirRegistry::instance().isCurrent(pair, ih.fetchPairVersion(pair)));
+    sample.clear();
+    assert(ReservoirRegistry::instance().sample(pair, sample) == 29 * 100 + 1000 + 20);
+
+    // Estimates are within a wide margin of the exact answers
+    bayes.setSampleThreshold(-1);
+    float exact = bayes.expectedAttribute(attr, none, ATTR_TUPLE_COMPARE_EQ);
+    bayes.setSampleThreshold(10);
+    Estimate estimate = bayes.estimateExpected(attr, none, ATTR_TUPLE_COMPARE_EQ);
+    assert(estimate.upper > estimate.lower);
+    assert(std::fabs(estimate.value - exact) <= 2 * (estimate.upper - estimate.lower));
+
+    valpair fields_filter;
+    fields_filter.push_back(std::make_pair("b", "0"));
+    AttributeBucket filter("_z", fields_filter, types_2);
+    exact = bayes.computeConditional("_w", "_z", filter, ATTR_TUPLE_COMPARE_GT);
+    estimate = bayes.estimateConditional("_w", "_z", filter, ATTR_TUPLE_COMPARE_GT);
+    assert(estimate.approximate && estimate.lower <= estimate.upper);
+    assert(std::fabs(estimate.value - exact) <= 2 * (estimate.upper - estimate.lower) + 1e-6);
+
+    ih.removeEntity(e1);
+    ih.removeEntity(e2);
+    delete intCol;
+}
+
+/**
+ *  Ensure t-digest quantiles are accurate, survive serialization and merge across pairs
+ */
+void testQuantileDigest() {
+    TDigest digest, low, high, parsed;
+    for (int i = 1; i <= 10000; i++) {
+        digest.add(i, 1.0);
+        (i <= 5000 ? low : high).add(i, 1.0);
+    }
+    assert(std::fabs(digest.quantile(0.5) - 5000) < 50);
+    assert(std::fabs(digest.quantile(0.99) - 9900) < 10);
+    assert(parsed.parse(digest.serialize()));
+    assert(parsed.quantile(0.95) == digest.quantile(0.95));
+    low.merge(high);
+    assert(std::fabs(low.quantile(0.5) - 5000) < 50);
+
+    Bayes bayes;
+    IndexHandler ih;
+    defpair fields_ent_1, fields_ent_2;
+    std::unordered_map<std::string, std::string> types_1, types_2;
+    std::vector<Relation> relations;
+
+    ColumnBase* floatCol = new FloatColumn();
+    fields_ent_1.push_back(std::make_pair(floatCol, "x"));
+    types_1.insert(std::make_pair("x", COLTYPE_NAME_FLOAT));
+
+    Entity e1("_q", fields_ent_1), e2("_r", fields_ent_2), e3("_t", fields_ent_2);
+    ih.writeEntity(e1);
+    ih.writeEntity(e2);
+    ih.writeEntity(e3);
+    for (int i = 1; i <= 9; i++) {
+        valpair left, right;
+        left.push_back(std::make_pair("x", std::to_string(i)));
+        relations.push_back(Relation("_q", i % 2 ? "_r" : "_t", left, right, types_1, types_2));
+        ih.writeRelation(relations.back(), 10);
+    }
+
+    // Values 1 to 9 over two pairs
+    AttributeTuple attr("_q", "x", "", "");
+    AttributeBucket none;
+    assert(std::fabs(bayes.quantileAttribute(attr, none, ATTR_TUPLE_COMPARE_EQ, 0.5) - 5.0) < 0.5);
+
+    // Writes after the digests are built are added in place
+    ih.writeRelation(relations[8], 1000);
+    assert(std::fabs(bayes.quantileAttribute(attr, none, ATTR_TUPLE_COMPARE_EQ, 0.5) - 9.0) < 0.5);
+
+    // A chunk bumps the pair once and is added in place, the digest carries the new version
+    RedisHandler rds(REDISDBTEST, REDISPORT);
+    std::vector<std::pair<Json::Value, int>> chunk;
+    chunk.push_back(std::make_pair(relations[0].toJson(), 1000));
+    chunk.push_back(std::make_pair(relations[2].toJson(), 1000));
+    ih.writeRelations(chunk);
+    TDigest stored, bogus;
+    assert(QuantileStore::fetch(rds, "_q+_r", "_q", "x", ih.fetchPairVersion("_q+_r"), stored));
+    assert(std::fabs(bayes.quantileAttribute(attr, none, ATTR_TUPLE_COMPARE_EQ, 0.5) - 3.0) < 0.5);
+
+    // A digest left behind by a change to the pair is rebuilt rather than used
+    bogus.add(100.0, 100000.0);
+    QuantileStore::store(rds, "_q+_r", "_q", "x", ih.fetchPairVersion("_q+_r"), bogus);
+    PairCatalog::bumpVersion(rds, "_q+_r");
+    assert(std::fabs(bayes.quantileAttribute(attr, none, ATTR_TUPLE_COMPARE_EQ, 0.5) - 3.0) < 0.5);
+    for (std::vector<std::pair<Json::Value, int>>::iterator it = chunk.begin(); it != chunk.end(); ++it)
+        it->second = -it->second;
+    ih.writeRelations(chunk);
+
+    // Decrements drop the digests and they are rebuilt
+    ih.writeRelation(relations[8], -1000);
+    ih.removeRelation(relations[0]);
+    assert(std::fabs(bayes.quantileAttribute(attr, none, ATTR_TUPLE_COMPARE_EQ, 0.5) - 5.5) < 0.75);
+
+    // Filtered quantiles are exact
+    valpair fields_filter;
+    fields_filter.push_back(std::make_pair("x", "4"));
+    AttributeBucket filter("_q", fields_filter, types_1);
+    assert(bayes.quantileAttribute(attr, filter, ATTR_TUPLE_COMPARE_GT, 0.5) == (float)7.0);
+
+    ih.removeEntity(e1);
+    ih.removeEntity(e2);
+    ih.removeEntity(e3);
+    delete floatCol;
+}
+
+/**
+ *  Ensure the value counts rank attribute values and follow decrements and removals
+ */
+void testTopValues() {
+    Bayes bayes;
+    IndexHandler ih;
+    defpair fields_ent_1, fields_ent_2;
+    std::unordered_map<std::string, std::string> types_1, types_2;
+    std::vector<Relation> relations;
+    std::vector<ValueCount> top;
+    RedisHandler rds(REDISDBTEST, REDISPORT);
+
+    ColumnBase* strCol = new StringColumn();
+    ColumnBase* intCol = new IntegerColumn();
+    fields_ent_1.push_back(std::make_pair(strCol, "s"));
+    fields_ent_2.push_back(std::make_pair(intCol, "y"));
+    types_1.insert(std::make_pair("s", COLTYPE_NAME_STR));
+    types_2.insert(std::make_pair("y", COLTYPE_NAME_INT));
+
+    Entity e1("_k", fields_ent_1), e2("_l", fields_ent_2);
+    ih.writeEntity(e1);
+    ih.writeEntity(e2);
+    rds.deleteKey(KEY_TOPK_BUILT);
+    const char* values[4] = { "\"a\"", "\"b\"", "\"c\"", "\"d\"" };
+    int counts[4] = { 3, 5, 5, 1 };
+    for (int i = 0; i < 4; i++) {
+        valpair left, right;
+        left.push_back(std::make_pair("s", values[i]));
+        right.push_back(std::make_pair("y", std::to_string(i % 2)));
+        relations.push_back(Relation("_k", "_l", left, right, types_1, types_2));
+        ih.writeRelation(relations.back(), counts[i]);
+    }
+
+    // Writes keep the counts current but only a rebuild marks them built
+    assert(!rds.exists(KEY_TOPK_BUILT));
+    std::vector<std::string> built = ih.rebuildMissing();
+    assert(std::find(built.begin(), built.end(), "attribute value counts") != built.end());
+    assert(rds.exists(KEY_TOPK_BUILT));
+
+    // Counts b 5, c 5, a 3, d 1 - ties in value order
+    AttributeTuple attr("_k", "s", "", "");
+    AttributeBucket none;
+    top = bayes.topAttribute(attr, none, ATTR_TUPLE_COMPARE_EQ, 2);
+    assert(top.size() == 2 && top[0].value.compare("\"b\"") == 0 && top[0].count == 5 &&
+        top[1].value.compare("\"c\"") == 0);
+    assert(bayes.modeAttribute(attr, none, ATTR_TUPLE_COMPARE_EQ).compare("\"b\"") == 0);
+    assert(bayes.topAttribute(attr, none, ATTR_TUPLE_COMPARE_EQ, 10).size() == 4);
+
+    // Filtered counts agree with the lookup on the matching relations, y=0 holds a and c
+    valpair fields_filter;
+    fields_filter.push_back(std::make_pair("y", "0"));
+    AttributeBucket filter("_l", fields_filter, types_2);
+    top = bayes.topAttribute(attr, filter, ATTR_TUPLE_COMPARE_EQ, 10);
+    assert(top.size() == 2 && top[0].value.compare("\"c\"") == 0 && top[1].count == 3);
+
+    // Decrements re-rank and values counted down to zero are dropped
+    ih.writeRelation(relations[1], -5);
+    ih.writeRelation(relations[2], -1);
+    top = ih.fetchTopValues("_k", "s", 10);
+    assert(top.size() == 3 && top[0].value.compare("\"c\"") == 0 && top[0].count == 4);
+
+    // The cascade takes the partner's relations out of the counts
+    ih.removeEntity(e2);
+    assert(ih.fetchTopValues("_k", "s", 10).size() == 0);
+    ih.removeEntity(e1);
+    delete strCol;
+    delete intCol;
+}
+
+/**
+ *  Ensure chain queries match the hop by hop computation and follow writes
+ */
+void testChainInference() {
+    Bayes bayes;
+    IndexHandler ih;
+    defpair fields_a, fields_b, fields_c;
+    std::unordered_map<std::string, std::string> types_a, types_b, types_c;
+
+    ColumnBase* floatCol = new FloatColumn();
+    ColumnBase* intCol = new IntegerColumn();
+    fields_a.push_back(std::make_pair(floatCol, "x"));
+    fields_b.push_back(std::make_pair(intCol, "y"));
+    fields_c.push_back(std::make_pair(intCol, "z"));
+    types_a.insert(std::make_pair("x", COLTYPE_NAME_FLOAT));
+    types_b.insert(std::make_pair("y", COLTYPE_NAME_INT));
+    types_c.insert(std::make_pair("z", COLTYPE_NAME_INT));
+
+    Entity ea("chna", fields_a), eb("chnb", fields_b), ec("chnc", fields_c);
+    ih.writeEntity(ea);
+    ih.writeEntity(eb);
+    ih.writeEntity(ec);
+
+    // c-b: (z=1, y=1) x3, (z=1, y=2) x1, (z=2, y=2) x4
+    // b-a: (y=1, x=10) x2, (y=2, x=20) x1, (y=2, x=30) x1
+    const char* cb[3][3] = { { "1", "1", "3" }, { "1", "2", "1" }, { "2", "2", "4" } };
+    const char* ba[3][3] = { { "1", "10", "2" }, { "2", "20", "1" }, { "2", "30", "1" } };
+    std::vector<Relation> relations;
+    for (int i = 0; i < 3; i++) {
+        valpair c, b, b2, a;
+        c.push_back(std::make_pair("z", cb[i][0]));
+        b.push_back(std::make_pair("y", cb[i][1]));
+        relations.push_back(Relation("chnc", "chnb", c, b, types_c, types_b));
+        ih.writeRelation(relations.back(), std::atoi(cb[i][2]));
+        b2.push_back(std::make_pair("y", ba[i][0]));
+        a.push_back(std::make_pair("x", ba[i][1]));
+        relations.push_back(Relation("chnb", "chna", b2, a, types_b, types_a));
+        ih.writeRelation(relations.back(), std::atoi(ba[i][2]));
+    }
+
+    // Given z=1: y=1 with 3/4 and y=2 with 1/4, then x=10 with 2/5 from y=1 and x=20, x=30 with
+    // 1/7 each from y=2
+    std::vector<std::string> chain;
+    chain.push_back("chna");
+    chain.push_back("chnb");
+    chain.push_back("chnc");
+    valpair evidence_vals;
+    evidence_vals.push_back(std::make_pair("z", "1"));
+    AttributeBucket evidence("chnc", evidence_vals, types_c);
+    AttributeTuple attr("chna", "x", "", "");
+    double reach = 0.75 * 2 / 5 + 0.25 * 2 / 7;
+    assert(std::fabs(bayes.chainConditional(chain, evidence, ATTR_TUPLE_COMPARE_EQ) - reach) < 1e-5);
+    assert(std::fabs(bayes.chainExpected(attr, chain, evidence, ATTR_TUPLE_COMPARE_EQ) -
+        (0.3 * 10 + 0.25 / 7 * 50) / reach) < 1e-4);
+
+    // Two entity chains are the pairwise conditional
+    std::vector<std::string> pair(chain.begin() + 1, chain.end());
+    assert(std::fabs(bayes.chainConditional(pair, evidence, ATTR_TUPLE_COMPARE_EQ) -
+        bayes.computeConditional("chnb", "chnc", evidence, ATTR_TUPLE_COMPARE_EQ)) < 1e-6);
+
+    // Sampled paths hold one relation per hop and agree on the state of "chnb"
+    bayes.seed(11);
+    std::vector<std::vector<Relation>> paths = bayes.sampleChain(chain, evidence, ATTR_TUPLE_COMPARE_EQ, 4000);
+    assert(paths.size() == 4000);
+    long tens = 0;
+    for (std::vector<std::vector<Relation>>::iterator it = paths.begin(); it != paths.end(); ++it) {
+        assert(it->size() == 2);
+        Json::Value first = (*it)[0].toJson(), second = (*it)[1].toJson();
+        assert(first[JSON_ATTR_REL_FIELDSL]["y"].asString().compare(
+            second[JSON_ATTR_REL_FIELDSR]["y"].asString()) == 0);
+        assert(second[JSON_ATTR_REL_FIELDSL]["z"].asString().compare("1") == 0);
+        if (first[JSON_ATTR_REL_FIELDSR]["x"].asString().compare("10") == 0) tens++;
+    }
+    assert(std::fabs(tens / 4000.0 - 0.3 / reach) < 0.03);
+
+    // Memoized hops are rebuilt once their pairs change
+    ih.writeRelation(relations[1], 2);
+    reach = 0.75 * 4 / 7 + 0.25 * 2 / 7;
+    assert(std::fabs(bayes.chainConditional(chain, evidence, ATTR_TUPLE_COMPARE_EQ) - reach) < 1e-5);
+
+    // Chains repeating an entity on consecutive hops are rejected
+    chain.push_back("chnc");
+    assert(bayes.chainConditional(chain, evidence, ATTR_TUPLE_COMPARE_EQ) == 0);
+
+    ih.removeEntity(ea);
+    ih.removeEntity(eb);
+    ih.removeEntity(ec);
+    delete floatCol;
+    delete intCol;
+}
+
+/**
+ *  Ensure cached results are served until a write to their pairs and the cache stays in its bytes
+ */
+void testResultCache() {
+    Bayes bayes;
+    IndexHandler ih;
+    defpair fields_a, fields_b;
+    std::unordered_map<std::string, std::string> types_a, types_b;
+
+    ColumnBase* floatCol = new FloatColumn();
+    ColumnBase* intCol = new IntegerColumn();
+    fields_a.push_back(std::make_pair(floatCol, "x"));
+    fields_b.push_back(std::make_pair(intCol, "y"));
+    types_a.insert(std::make_pair("x", COLTYPE_NAME_FLOAT));
+    types_b.insert(std::make_pair("y", COLTYPE_NAME_INT));
+
+    Entity ea("rsca", fields_a), eb("rscb", fields_b);
+    ih.writeEntity(ea);
+    ih.writeEntity(eb);
+
+    valpair a1, a2, b1;
+    a1.push_back(std::make_pair("x", "1.0"));
+    a2.push_back(std::make_pair("x", "3.0"));
+    b1.push_back(std::make_pair("y", "1"));
+    Relation r1("rsca", "rscb", a1, b1, types_a, types_b);
+    Relation r2("rsca", "rscb", a2, b1, types_a, types_b);
+    ih.writeRelation(r1, 1);
+    ih.writeRelation(r2, 1);
+
+    valpair filter_vals;
+    AttributeBucket filter("rscb", filter_vals, types_b);
+    AttributeTuple attr("rsca", "x", "", "");
+
+    // The second query of each kind is a hit
+    float expected = bayes.expectedAttribute(attr, filter, ATTR_TUPLE_COMPARE_EQ);
+    float conditional = bayes.computeConditional("rsca", "rscb", filter, ATTR_TUPLE_COMPARE_EQ);
+    assert(std::fabs(expected - 2.0) < 1e-6);
+    assert(bayes.expectedAttribute(attr, filter, ATTR_TUPLE_COMPARE_EQ) == expected);
+    assert(bayes.computeConditional("rsca", "rscb", filter, ATTR_TUPLE_COMPARE_EQ) == conditional);
+    Json::Value stats = bayes.resultCacheStats();
+    assert(stats["hits"].asInt() == 2 && stats["misses"].asInt() == 2 && stats["entries"].asInt() == 2);
+
+    // A write to the pair makes the cached results stale
+    ih.writeRelation(r2, 2);
+    assert(std::fabs(bayes.expectedAttribute(attr, filter, ATTR_TUPLE_COMPARE_EQ) - 2.5) < 1e-6);
+    stats = bayes.resultCacheStats();
+    assert(stats["stale"].asInt() == 1 && stats["hits"].asInt() == 2);
+
+    // Results are evicted least recently used first once over capacity
+    ResultCache cache(3 * (sizeof(ResultEntry) + 2 + 1));
+    cache.store("a", "1", 1.0);
+    cache.store("b", "1", 2.0);
+    cache.store("c", "1", 3.0);
+    assert(cache.fetch("a", "1") != NULL);
+    cache.store("d", "1", 4.0);
+    assert(cache.size() == 3);
+    assert(cache.fetch("b", "1") == NULL);
+    assert(cache.fetch("a", "1")->number == 1.0);
+    assert(cache.fetch("c", "2") == NULL);
+    stats = cache.stats();
+    assert(stats["evictions"].asInt() == 1 && stats["stale"].asInt() == 1);
+    assert(stats["bytes"].asInt64() <= stats["capacity"].asInt64());
+
+    ih.removeEntity(ea);
+    ih.removeEntity(eb);
+    delete floatCol;
+    delete intCol;
+}
+
+/**
+ *  Ensure grouped queries agree with one query per group and samples stay in their group
+ */
+void testGroupBy() {
+    Bayes bayes;
+    IndexHandler ih;
+    defpair fields_a, fields_b, fields_c;
+    std::unordered_map<std::string, std::string> types_a, types_b, types_c;
+
+    ColumnBase* floatCol = new FloatColumn();
+    ColumnBase* intCol = new IntegerColumn();
+    fields_a.push_back(std::make_pair(floatCol, "x"));
+    fields_b.push_back(std::make_pair(intCol, "y"));
+    fields_c.push_back(std::make_pair(intCol, "w"));
+    types_a.insert(std::make_pair("x", COLTYPE_NAME_FLOAT));
+    types_b.insert(std::make_pair("y", COLTYPE_NAME_INT));
+    types_c.insert(std::make_pair("w", COLTYPE_NAME_INT));
+
+    Entity ea("grpa", fields_a), eb("grpb", fields_b), ec("grpc", fields_c);
+    ih.writeEntity(ea);
+    ih.writeEntity(eb);
+    ih.writeEntity(ec);
+
+    // y=1: (x=10) x2, (x=20) x2 and grpc x4, y=2: (x=30) x1, y=10: grpc x3
+    const char* ab[3][3] = { { "1", "10", "2" }, { "1", "20", "2" }, { "2", "30", "1" } };
+    const char* cb[2][2] = { { "1", "4" }, { "10", "3" } };
+    for (int i = 0; i < 3; i++) {
+        valpair a, b;
+        a.push_back(std::make_pair("x", ab[i][1]));
+        b.push_back(std::make_pair("y", ab[i][0]));
+        Relation r("grpa", "grpb", a, b, types_a, types_b);
+        ih.writeRelation(r, std::atoi(ab[i][2]));
+    }
+    for (int i = 0; i < 2; i++) {
+        valpair b, c;
+        b.push_back(std::make_pair("y", cb[i][0]));
+        c.push_back(std::make_pair("w", "5"));
+        Relation r("grpb", "grpc", b, c, types_b, types_c);
+        ih.writeRelation(r, std::atoi(cb[i][1]));
+    }
+
+    valpair filter_vals;
+    AttributeBucket filter("grpb", filter_vals, types_b);
+    GroupTable groups = bayes.groupRelations("grpa", "x", "grpb", "y", filter, ATTR_TUPLE_COMPARE_EQ);
+    Json::Value json = groups.toJson();
+
+    // Groups in numeric order, each as a filtered query would answer
+    assert(json.size() == 3);
+    const char* values[3] = { "1", "2", "10" };
+    const long counts[3] = { 8, 1, 3 };
+    const double means[3] = { 15.0, 30.0, -1.0 };
+    for (int i = 0; i < 3; i++) {
+        assert(json[i][JSON_ATTR_GROUP_VALUE].asString().compare(values[i]) == 0);
+        assert(json[i][JSON_ATTR_GROUP_COUNT].asInt64() == counts[i]);
+        assert(std::fabs(json[i][JSON_ATTR_GROUP_MEAN].asDouble() - means[i]) < 1e-6);
+
+        valpair vals;
+        vals.push_back(std::make_pair("y", values[i]));
+        AttributeBucket group("grpb", vals, types_b);
+        assert(std::fabs(json[i][JSON_ATTR_GROUP_PROB].asDouble() -
+            bayes.computeConditional("grpa", "grpb", group, ATTR_TUPLE_COMPARE_EQ)) < 1e-6);
+    }
+
+    // Samples are drawn within their group, groups without relations on the target have none
+    bayes.seed(5);
+    std::vector<std::pair<std::string, std::vector<Relation>>> samples =
+        bayes.sampleGroups("grpa", "grpb", "y", filter, ATTR_TUPLE_COMPARE_EQ, 50);
+    assert(samples.size() == 3);
+    assert(samples[0].second.size() == 50 && samples[1].second.size() == 50);
+    assert(samples[2].second.size() == 0);
+    for (std::vector<Relation>::iterator it = samples[0].second.begin(); it != samples[0].second.end(); ++it)
+        assert(it->toJson()[JSON_ATTR_REL_FIELDSR]["y"].asString().compare("1") == 0);
+
+    // Without replacement a group yields at most its instances
+    samples = bayes.sampleGroups("grpa", "grpb", "y", filter, ATTR_TUPLE_COMPARE_EQ, 50, false);
+    assert(samples[0].second.size() == 4 && samples[1].second.size() == 1);
+
+    ih.removeEntity(ea);
+    ih.removeEntity(eb);
+    ih.removeEntity(ec);
+    delete floatCol;
+    delete intCol;
+}
+
+/**
+ *  Ensure the pool runs every task with stealing and Monte Carlo estimates agree with exact answers
+ */
+void testMonteCarlo() {
+    // Tasks queued on one worker are stolen by the others
+    WorkStealingPool pool(4);
+    std::atomic<long> done(0);
+    std::vector<long> ran(pool.size(), 0);
+    for (long i = 0; i < 200; i++)
+        pool.submit(0, [&done, &ran](long worker) {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            ran[worker]++;
+            done++;
+        });
+    pool.wait();
+    assert(done == 200);
+    long busy = 0;
+    for (std::vector<long>::iterator it = ran.begin(); it != ran.end(); ++it)
+        if (*it > 0) busy++;
+    assert(busy > 1);
+
+    Bayes bayes;
+    IndexHandler ih;
+    defpair fields_a, fields_b, fields_c;
+    std::unordered_map<std::string, std::string> types_a, types_b, types_c;
+
+    ColumnBase* floatCol = new FloatColumn();
+    ColumnBase* intCol = new IntegerColumn();
+    fields_a.push_back(std::make_pair(floatCol, "x"));
+    fields_b.push_back(std::make_pair(intCol, "y"));
+    fields_c.push_back(std::make_pair(intCol, "z"));
+    types_a.insert(std::make_pair("x", COLTYPE_NAME_FLOAT));
+    types_b.insert(std::make_pair("y", COLTYPE_NAME_INT));
+    types_c.insert(std::make_pair("z", COLTYPE_NAME_INT));
+
+    Entity ea("mcra", fields_a), eb("mcrb", fields_b), ec("mcrc", fields_c);
+    ih.writeEntity(ea);
+    ih.writeEntity(eb);
+    ih.writeEntity(ec);
+
+    const char* cb[3][3] = { { "1", "1", "3" }, { "1", "2", "1" }, { "2", "2", "4" } };
+    const char* ba[3][3] = { { "1", "10", "2" }, { "2", "20", "1" }, { "2", "30", "1" } };
+    for (int i = 0; i < 3; i++) {
+        valpair c, b, b2, a;
+        c.push_back(std::make_pair("z", cb[i][0]));
+        b.push_back(std::make_pair("y", cb[i][1]));
+        Relation rcb("mcrc", "mcrb", c, b, types_c, types_b);
+        ih.writeRelation(rcb, std::atoi(cb[i][2]));
+        b2.push_back(std::make_pair("y", ba[i][0]));
+        a.push_back(std::make_pair("x", ba[i][1]));
+        Relation rba("mcrb", "mcra", b2, a, types_b, types_a);
+        ih.writeRelation(rba, std::atoi(ba[i][2]));
+    }
+
+    std::vector<std::string> chain;
+    chain.push_back("mcra");
+    chain.push_back("mcrb");
+    chain.push_back("mcrc");
+    valpair evidence_vals;
+    evidence_vals.push_back(std::make_pair("z", "1"));
+    AttributeBucket evidence("mcrc", evidence_vals, types_c);
+    AttributeTuple attr("mcra", "x", "", ""), none("mcra", "", "", "");
+
+    // Estimates converge on the exact chain answers
+    bayes.seed(3);
+    MonteCarloEstimate estimate = bayes.monteCarloChain(none, chain, evidence, ATTR_TUPLE_COMPARE_EQ,
+        0.002, 5000, 4);
+    assert(estimate.converged && estimate.workers == 4 && estimate.draws >= MC_MIN_DRAWS);
+    assert(std::fabs(estimate.value - bayes.chainConditional(chain, evidence, ATTR_TUPLE_COMPARE_EQ)) <
+        4 * estimate.error + 1e-6);
+
+    estimate = bayes.monteCarloChain(attr, chain, evidence, ATTR_TUPLE_COMPARE_EQ, 0.05, 5000, 4);
+    assert(estimate.converged);
+    assert(std::fabs(estimate.value - bayes.chainExpected(attr, chain, evidence, ATTR_TUPLE_COMPARE_EQ)) <
+        4 * estimate.error + 1e-6);
+
+    // A pair is a chain of two entities
+    std::vector<std::string> pair(chain.begin() + 1, chain.end());
+    estimate = bayes.monteCarloChain(none, pair, evidence, ATTR_TUPLE_COMPARE_EQ, 0.002, 5000, 2);
+    assert(std::fabs(estimate.value - bayes.computeConditional("mcrb", "mcrc", evidence,
+        ATTR_TUPLE_COMPARE_EQ)) < 4 * estimate.error + 1e-6);
+
+    // Without a precision the budget bounds the run
+    estimate = bayes.monteCarloChain(none, chain, evidence, ATTR_TUPLE_COMPARE_EQ, 0.0, 50, 2);
+    assert(!estimate.converged && estimate.elapsed < 1000);
+
+    ih.removeEntity(ea);
+    ih.removeEntity(eb);
+    ih.removeEntity(ec);
+    delete floatCol;
+    delete intCol;
+}
+
+/**
+ *  Ensure naive Bayes classifiers score batches with smoothed counts and follow writes
+ */
+void testNaiveBayes() {
+    Bayes bayes;
+    IndexHandler ih;
+    defpair fields_a, fields_b;
+    std::unordered_map<std::string, std::string> types_a, types_b;
+
+    ColumnBase* intCol = new IntegerColumn();
+    fields_a.push_back(std::make_pair(intCol, "c"));
+    fields_b.push_back(std::make_pair(intCol, "f"));
+    fields_b.push_back(std::make_pair(intCol, "g"));
+    types_a.insert(std::make_pair("c", COLTYPE_NAME_INT));
+    types_b.insert(std::make_pair("f", COLTYPE_NAME_INT));
+    types_b.insert(std::make_pair("g", COLTYPE_NAME_INT));
+
+    Entity ea("nbca", fields_a), eb("nbcb", fields_b);
+    ih.writeEntity(ea);
+    ih.writeEntity(eb);
+
+    const char* rows[3][4] = { { "1", "1", "1", "3" }, { "1", "2", "1", "1" }, { "2", "2", "2", "2" } };
+    for (int i = 0; i < 3; i++) {
+        valpair a, b;
+        a.push_back(std::make_pair("c", rows[i][0]));
+        b.push_back(std::make_pair("f", rows[i][1]));
+        b.push_back(std::make_pair("g", rows[i][2]));
+        Relation r("nbca", "nbcb", a, b, types_a, types_b);
+        ih.writeRelation(r, std::atoi(rows[i][3]));
+    }
+
+    // Only distinct entities with an existing class attribute are accepted
+    assert(!ih.writeClassifier("nbca", "c", "nbca"));
+    assert(!ih.writeClassifier("nbca", "q", "nbcb"));
+    assert(ih.writeClassifier("nbca", "c", "nbcb"));
+    std::string name = ClassifierRegistry::classifierName("nbca", "c", "nbcb");
+
+    Json::Value summary;
+    assert(bayes.compileClassifier(name, summary));
+    assert(summary["classes"].asInt() == 2 && summary["features"].asInt() == 2);
+
+    // Classes 1 and 2 hold 4 and 2 instances, f and g each have two values
+    std::vector<valpair> instances(3);
+    instances[0].push_back(std::make_pair("f", "1"));
+    instances[0].push_back(std::make_pair("g", "1"));
+    instances[1].push_back(std::make_pair("f", "2"));
+    instances[1].push_back(std::make_pair("g", "2"));
+    instances[2].push_back(std::make_pair("f", "9"));
+    instances[2].push_back(std::make_pair("h", "1"));
+
+    std::vector<Classification> results;
+    assert(bayes.classify(name, instances, results) && results.size() == 3);
+    double s1 = 5.0 / 8 * 4.0 / 7 * 5.0 / 7, s2 = 3.0 / 8 * 1.0 / 5 * 1.0 / 5;
+    assert(results[0].label.compare("1") == 0);
+    assert(std::fabs(results[0].probability - s1 / (s1 + s2)) < 1e-9);
+    s1 = 5.0 / 8 * 2.0 / 7 * 1.0 / 7, s2 = 3.0 / 8 * 3.0 / 5 * 3.0 / 5;
+    assert(results[1].label.compare("2") == 0);
+    assert(std::fabs(results[1].probability - s2 / (s1 + s2)) < 1e-9);
+
+    // Unseen values fall back on the smoothing mass, unknown attributes are ignored
+    s1 = 5.0 / 8 * 1.0 / 7, s2 = 3.0 / 8 * 1.0 / 5;
+    assert(std::fabs(results[2].posterior[0].second - s1 / (s1 + s2)) < 1e-9);
+    assert(std::fabs(results[2].posterior[0].second + results[2].posterior[1].second - 1.0) < 1e-9);
+
+    // Writes are applied to the resident model without a rebuild
+    valpair a, b;
+    a.push_back(std::make_pair("c", "2"));
+    b.push_back(std::make_pair("f", "1"));
+    b.push_back(std::make_pair("g", "1"));
+    Relation r("nbca", "nbcb", a, b, types_a, types_b);
+    ih.writeRelation(r, 5);
+    long version = ih.fetchPairVersion(ih.orderPairAlphaNumeric("nbca", "nbcb"));
+    assert(ClassifierRegistry::instance().isCurrent(name, version));
+
+    std::vector<Classification> updated, rebuilt;
+    assert(bayes.classify(name, instances, updated));
+    ClassifierRegistry::instance().forget(name);
+    assert(bayes.classify(name, instances, rebuilt));
+    for (int i = 0; i < 3; i++) {
+        assert(updated[i].label.compare(rebuilt[i].label) == 0);
+        assert(std::fabs(updated[i].probability - rebuilt[i].probability) < 1e-12);
+    }
+    s1 = 5.0 / 13 * 4.0 / 7 * 5.0 / 7, s2 = 8.0 / 13 * 6.0 / 10 * 6.0 / 10;
+    assert(updated[0].label.compare("2") == 0);
+    assert(std::fabs(updated[0].probability - s2 / (s1 + s2)) < 1e-9);
+
+    assert(ih.removeClassifier(name));
+    assert(!bayes.classify(name, instances, results));
+    assert(!ih.removeClassifier(name));
+}
+
+/**
+ *  Ensure aggregate cubes answer filtered counts from their slices and follow writes
+ */
+void testCube() {
+    Bayes bayes;
+    IndexHandler ih;
+    defpair fields_a, fields_b, fields_c, fields_d;
+    std::unordered_map<std::string, std::string> types_a, types_b, types_c, types_d;
+
+    ColumnBase* intCol = new IntegerColumn();
+    fields_a.push_back(std::make_pair(intCol, "a"));
+    fields_b.push_back(std::make_pair(intCol, "b"));
+    fields_b.push_back(std::make_pair(intCol, "c"));
+    fields_c.push_back(std::make_pair(intCol, "p"));
+    fields_d.push_back(std::make_pair(intCol, "q"));
+    types_a.insert(std::make_pair("a", COLTYPE_NAME_INT));
+    types_b.insert(std::make_pair("b", COLTYPE_NAME_INT));
+    types_b.insert(std::make_pair("c", COLTYPE_NAME_INT));
+    types_c.insert(std::make_pair("p", COLTYPE_NAME_INT));
+    types_d.insert(std::make_pair("q", COLTYPE_NAME_INT));
+
+    Entity ea("cuba", fields_a), eb("cubb", fields_b), ec("cubc", fields_c), ed("cubd", fields_d);
+    ih.writeEntity(ea);
+    ih.writeEntity(eb);
+    ih.writeEntity(ec);
+    ih.writeEntity(ed);
+
+    // The last relation lacks c
+    const char* rows[5][4] = { { "1", "1", "1", "2" }, { "1", "2", "1", "3" }, { "2", "1", "2", "1" },
+        { "2", "2", "2", "4" }, { "1", "1", "", "5" } };
+    std::vector<Relation> relations;
+    for (int i = 0; i < 5; i++) {
+        valpair a, b;
+        a.push_back(std::make_pair("a", rows[i][0]));
+        b.push_back(std::make_pair("b", rows[i][1]));
+        if (std::strlen(rows[i][2]) > 0) b.push_back(std::make_pair("c", rows[i][2]));
+        relations.push_back(Relation("cuba", "cubb", a, b, types_a, types_b));
+        ih.writeRelation(relations.back(), std::atoi(rows[i][3]));
+    }
+
+    // Attributes must exist, be distinct and span two entities
+    std::vector<std::string> dims;
+    dims.push_back("cubb.b");
+    dims.push_back("cubb.c");
+    assert(!ih.writeCube(dims, CUBE_DEFAULT_LIMIT));
+    dims.push_back("cuba.z");
+    assert(!ih.writeCube(dims, CUBE_DEFAULT_LIMIT));
+    dims.back() = "cubb.b";
+    assert(!ih.writeCube(dims, CUBE_DEFAULT_LIMIT));
+    dims.back() = "cuba.a";
+    assert(ih.writeCube(dims, CUBE_DEFAULT_LIMIT));
+    std::string name = AggregateCube::cubeName(dims);
+
+    AggregateCube cube;
+    assert(ih.loadCube(name, cube) && cube.isDense() && cube.size() == 3);
+    std::vector<std::vector<bool>> masks = cube.masks();
+    assert(cube.sum(masks) == 15);
+
+    valpair b1, c1, b2;
+    b1.push_back(std::make_pair("b", "1"));
+    c1.push_back(std::make_pair("c", "1"));
+    b2.push_back(std::make_pair("b", "2"));
+    valpair a2;
+    a2.push_back(std::make_pair("a", "2"));
+    AttributeBucket byB1("cubb", b1, types_b), byC1("cubb", c1, types_b), byA2B2("cubb", b2, types_b);
+    byA2B2.addAttributes("cuba", a2, types_a);
+
+    // Relations lacking a filtered attribute pass the filter
+    assert(bayes.countRelations("cuba", "cubb", byB1, ATTR_TUPLE_COMPARE_EQ) == 8);
+    assert(bayes.countRelations("cubb", "cuba", byC1, ATTR_TUPLE_COMPARE_EQ) == 10);
+    assert(bayes.countRelations("cuba", "cubb", byA2B2, ATTR_TUPLE_COMPARE_EQ) == 4);
+    assert(bayes.countRelations("cuba", "cubb", byB1, ATTR_TUPLE_COMPARE_GT) == 7);
+    assert(bayes.countEntityInRelations("cubb", byB1, ATTR_TUPLE_COMPARE_EQ, false) == 8);
+
+    // Writes and removals are applied to the cells
+    ih.writeRelation(relations[2], 2);
+    ih.removeRelation(relations[4]);
+    assert(bayes.countRelations("cuba", "cubb", byB1, ATTR_TUPLE_COMPARE_EQ) == 5);
+    assert(bayes.countRelations("cuba", "cubb", byC1, ATTR_TUPLE_COMPARE_EQ) == 5);
+    assert(ih.loadCube(name, cube));
+    masks = cube.masks();
+    assert(cube.sum(masks) == 12);
+
+    // A cube past its limit overflows and counts go back to the relations
+    std::vector<std::string> small(dims.begin(), dims.begin() + 1);
+    small.push_back("cuba.a");
+    assert(ih.writeCube(small, 2));
+    assert(!ih.loadCube(AggregateCube::cubeName(small), cube));
+    assert(ih.removeCube(name));
+    assert(bayes.countRelations("cuba", "cubb", byB1, ATTR_TUPLE_COMPARE_EQ) == 5);
+
+    // Large dimensions are kept as sparse cells
+    for (int i = 0; i < 300; i++) {
+        valpair p, q;
+        p.push_back(std::make_pair("p", std::to_string(i)));
+        q.push_back(std::make_pair("q", std::to_string(i)));
+        Relation r("cubc", "cubd", p, q, types_c, types_d);
+        ih.writeRelation(r, 1);
+    }
+    std::vector<std::string> wide;
+    wide.push_back("cubc.p");
+    wide.push_back("cubd.q");
+    assert(ih.writeCube(wide, CUBE_DEFAULT_LIMIT));
+    assert(ih.loadCube(AggregateCube::cubeName(wide), cube) && !cube.isDense());
+    valpair p10;
+    p10.push_back(std::make_pair("p", "10"));
+    AttributeBucket belowTen("cubc", p10, types_c);
+    assert(bayes.countRelations("cubc", "cubd", belowTen, ATTR_TUPLE_COMPARE_LT) == 10);
+    assert(bayes.countEntityInRelations("cubd", belowTen, ATTR_TUPLE_COMPARE_LT, false) == 10);
+
+    // Cubes are dropped with their entities
+    ih.invalidateEntityPairs("cubc");
+    assert(ih.fetchCubes().size() == 1);
+    assert(ih.removeCube(AggregateCube::cubeName(small)));
+}
+
+/**
+ *  Ensure standing queries follow writes with the answers computed from the relations
+ */
+void testStandingQuery() {
+    Bayes bayes;
+    IndexHandler ih;
+    defpair fields_a, fields_b, fields_c;
+    std::unordered_map<std::string, std::string> types_a, types_b, types_c;
+
+    ColumnBase* intCol = new IntegerColumn();
+    fields_a.push_back(std::make_pair(intCol, "x"));
+    fields_b.push_back(std::make_pair(intCol, "y"));
+    fields_c.push_back(std::make_pair(intCol, "z"));
+    types_a.insert(std::make_pair("x", COLTYPE_NAME_INT));
+    types_b.insert(std::make_pair("y", COLTYPE_NAME_INT));
+    types_c.insert(std::make_pair("z", COLTYPE_NAME_INT));
+
+    Entity ea("stqa", fields_a), eb("stqb", fields_b), ec("stqc", fields_c);
+    ih.writeEntity(ea);
+    ih.writeEntity(eb);
+    ih.writeEntity(ec);
+
+    valpair x1, x3, x5, y1, y2, z1;
+    x1.push_back(std::make_pair("x", "1"));
+    x3.push_back(std::make_pair("x", "3"));
+    x5.push_back(std::make_pair("x", "5"));
+    y1.push_back(std::make_pair("y", "1"));
+    y2.push_back(std::make_pair("y", "2"));
+    z1.push_back(std::make_pair("z", "1"));
+    Relation r1("stqa", "stqb", x1, y1, types_a, types_b), r2("stqa", "stqb", x3, y2, types_a, types_b),
+        r3("stqc", "stqb", z1, y1, types_c, types_b), r4("stqa", "stqb", x5, y1, types_a, types_b);
+    ih.writeRelation(r1, 2);
+    ih.writeRelation(r2, 1);
+    ih.writeRelation(r3, 3);
+
+    AttributeBucket filter("stqb", y1, types_b);
+    AttributeTuple attr("stqa", "x", "", "");
+    assert(ih.writeStandingQuery("stqa", "q", "stqb", filter, ATTR_TUPLE_COMPARE_EQ).compare("") == 0);
+    std::string conditional = ih.writeStandingQuery("stqa", "", "stqb", filter, ATTR_TUPLE_COMPARE_EQ);
+    std::string expected = ih.writeStandingQuery("stqa", "x", "stqb", filter, ATTR_TUPLE_COMPARE_EQ);
+    assert(conditional.compare("") != 0 && expected.compare("") != 0);
+
+    // The first answers are published on registration
+    Json::Value query;
+    assert(ih.fetchStandingQuery(conditional, query));
+    assert(query["sequence"].asInt() == 1 && query["pairwise"].asInt() == 2 && query["marginal"].asInt() == 5);
+    assert(std::fabs(query["probability"].asDouble() -
+        bayes.computeConditional("stqa", "stqb", filter, ATTR_TUPLE_COMPARE_EQ)) < 1e-6);
+    assert(ih.fetchStandingQuery(expected, query));
+    assert(query["count"].asInt() == 2 && std::fabs(query["expected"].asDouble() - 1.0) < 1e-9);
+
+    // Each write updates and republishes the queries it bears on
+    ih.writeRelation(r4, 2);
+    assert(ih.fetchStandingQuery(conditional, query));
+    assert(query["sequence"].asInt() == 2 && query["pairwise"].asInt() == 4 && query["marginal"].asInt() == 7);
+    assert(std::fabs(query["probability"].asDouble() -
+        bayes.computeConditional("stqa", "stqb", filter, ATTR_TUPLE_COMPARE_EQ)) < 1e-6);
+    assert(ih.fetchStandingQuery(expected, query));
+    assert(query["sequence"].asInt() == 2);
+    assert(std::fabs(query["expected"].asDouble() -
+        bayes.expectedAttribute(attr, filter, ATTR_TUPLE_COMPARE_EQ)) < 1e-5);
+
+    // Writes failing the filter or away from the entities leave the answers alone
+    ih.writeRelation(r2, 4);
+    ih.writeRelation(r3, 1);
+    assert(ih.fetchStandingQuery(expected, query) && query["sequence"].asInt() == 2);
+    assert(ih.fetchStandingQuery(conditional, query));
+    assert(query["sequence"].asInt() == 3 && query["marginal"].asInt() == 8);
+
+    // Removals are applied as negative changes
+    ih.removeRelation(r4);
+    assert(ih.fetchStandingQuery(conditional, query));
+    assert(query["pairwise"].asInt() == 2 && query["marginal"].asInt() == 6);
+    assert(std::fabs(query["probability"].asDouble() -
+        bayes.computeConditional("stqa", "stqb", filter, ATTR_TUPLE_COMPARE_EQ)) < 1e-6);
+    assert(ih.fetchStandingQuery(expected, query) && std::fabs(query["expected"].asDouble() - 1.0) < 1e-9);
+
+    // Removing a third entity takes its relations out of the queries on the given entity, published once
+    AttributeBucket none;
+    AttributeTuple given("stqb", "y", "", "");
+    std::string partner = ih.writeStandingQuery("stqb", "y", "stqa", none, ATTR_TUPLE_COMPARE_EQ);
+    assert(ih.fetchStandingQuery(partner, query) && query["count"].asInt() == 11);
+    assert(ih.fetchStandingQuery(conditional, query));
+    int sequence = query["sequence"].asInt();
+    ih.removeEntity(ec);
+    assert(ih.fetchStandingQuery(conditional, query) && query["sequence"].asInt() == sequence + 1);
+    assert(query["pairwise"].asInt() == 2 && query["marginal"].asInt() == 2);
+    assert(std::fabs(query["probability"].asDouble() -
+        bayes.computeConditional("stqa", "stqb", filter, ATTR_TUPLE_COMPARE_EQ)) < 1e-6);
+    assert(ih.fetchStandingQuery(partner, query) && query["count"].asInt() == 7);
+    assert(std::fabs(query["expected"].asDouble() -
+        bayes.expectedAttribute(given, none, ATTR_TUPLE_COMPARE_EQ)) < 1e-5);
+    assert(ih.removeStandingQuery(partner));
+
+    assert(ih.removeStandingQuery(conditional));
+    assert(!ih.fetchStandingQuery(conditional, query));
+    ih.invalidateEntityPairs("stqa");
+    assert(!ih.fetchStandingQuery(expected, query));
+}
+
+/**
+ *  Ensure the lexer splits statements in place and recognizes keywords in any case
+ */
+void testLexer() {
+    std::string statement = "  ADD rel\t_x(a=1)  Given givens gIVEN\r\n";
+    std::vector<Token> tokens;
+
+    assert(Lexer::scan(statement, tokens) == 6);
+    assert(tokens[0].keyword == KW_ADD && tokens[1].keyword == KW_REL);
+    assert(tokens[2].keyword == KW_NONE && tokens[2].str().compare("_x(a=1)") == 0);
+    assert(tokens[2].start == statement.data() + 10);
+    assert(tokens[3].keyword == KW_GIVEN && tokens[3].str().compare("Given") == 0);
+    assert(tokens[4].keyword == KW_NONE && tokens[4].length == 6 && tokens[5].keyword == KW_GIVEN);
+
+    // Every keyword is found from its own text and no keyword from a near miss
+    for (size_t i = 0; i < KEYWORD_COUNT; i++) {
+        std::string text(KEYWORDS[i].text);
+        assert(Lexer::keyword(text.data(), text.length()) == KEYWORDS[i].keyword);
+        text[0] = text[0] - 'a' + 'A';
+        assert(Lexer::keyword(text.data(), text.length()) == KEYWORDS[i].keyword);
+        text += "s";
+        assert(Lexer::keyword(text.data(), text.length()) != KEYWORDS[i].keyword);
+    }
+    assert(Lexer::keyword("", 0) == KW_NONE && Lexer::keyword("a@d", 3) == KW_NONE);
+
+    tokens.clear();
+    assert(Lexer::scan(" \t ", tokens) == 0 && tokens.empty());
+
+    // Splitting on a delimeter keeps empty elements except a trailing one
+    Parser parser;
+    std::vector<std::string> elems = parser.tokenize("a,,b,", ',');
+    assert(elems.size() == 3 && elems[1].compare("") == 0 && elems[2].compare("b") == 0);
+    assert(parser.tokenize("", ',').empty());
+
+    // Tokens split where they lie in the statement, with the same elements
+    statement = "x a.b,,c, y";
+    tokens.clear();
+    assert(Lexer::scan(statement, tokens) == 3);
+    elems = parser.tokenize(tokens[1], ',');
+    assert(elems.size() == 3 && elems[0].compare("a.b") == 0 && elems[1].compare("") == 0);
+    assert(parser.tokenize(tokens[1], '.').size() == 2);
+}
+
+/**
+ *  Ensure prepared statements bind values checked against the types kept in the plan
+ */
+void testPreparedStatement() {
+    IndexHandler ih;
+    Parser parser;
+    defpair fields_a, fields_b;
+    std::unordered_map<std::string, std::string> types_a, types_b;
+
+    fields_a.push_back(std::make_pair(new IntegerColumn(), "x"));
+    fields_b.push_back(std::make_pair(new FloatColumn(), "y"));
+    types_a.insert(std::make_pair("x", COLTYPE_NAME_INT));
+    types_b.insert(std::make_pair("y", COLTYPE_NAME_FLOAT));
+    Entity ea("prpa", fields_a), eb("prpb", fields_b);
+    ih.writeEntity(ea);
+    ih.writeEntity(eb);
+
+    valpair x1, y1;
+    x1.push_back(std::make_pair("x", "1"));
+    y1.push_back(std::make_pair("y", "2.5"));
+    Relation r("prpa", "prpb", x1, y1, types_a, types_b);
+    Json::Value json;
+
+    // Placeholders are typed from the entities when prepared
+    Json::Reader reader;
+    assert(reader.parse(parser.parse("PREPARE addab AS ADD REL prpa(x=?) prpb(y=?) ?"), json));
+    assert(json[JSON_ATTR_PREP_PARAMS].size() == 3);
+    assert(json[JSON_ATTR_PREP_PARAMS][0]["type"].asString().compare(COLTYPE_NAME_INT) == 0);
+    assert(json[JSON_ATTR_PREP_PARAMS][1]["type"].asString().compare(COLTYPE_NAME_FLOAT) == 0);
+    parser.resetState();
+
+    parser.parse("EXECUTE addab 1 2.5 3");
+    parser.resetState();
+    parser.parse("execute addab 1 2.5 2");
+    parser.resetState();
+    assert(ih.fetchRaw(r.generateKey(), json) && json[JSON_ATTR_REL_COUNT].asInt() == 5);
+
+    // Values are validated with the kept types and must match the placeholders
+    assert(parser.parse("EXECUTE addab 1.5 2.5 1").compare(ERR_BAD_BIND) == 0);
+    parser.resetState();
+    assert(parser.parse("EXECUTE addab 1 2.5").compare(ERR_BAD_BIND) == 0);
+    parser.resetState();
+    assert(parser.parse("EXECUTE other 1").compare(ERR_PREPARED_NOT_EXISTS) == 0);
+    parser.resetState();
+    assert(parser.parse("PREPARE lst AS LST ENT").compare(ERR_BAD_PREPARE) == 0);
+    parser.resetState();
+
+    // Queries run with the bound filter
+    parser.parse("PREPARE infab AS INF prpa.x GIVEN prpb ATTR y=?");
+    parser.resetState();
+    assert(parser.parse("EXECUTE infab 2.5").compare(0, 4, "ERR:") != 0);
+    parser.resetState();
+    assert(parser.parse("RM PREPARE infab").compare(0, 4, "ERR:") != 0);
+    parser.resetState();
+    assert(parser.parse("RM PREPARE infab").compare(ERR_PREPARED_NOT_EXISTS) == 0);
+    parser.resetState();
+
+    // A plan does not outlive the definitions it was checked against
+    ih.removeEntity("prpb");
+    fields_b.clear();
+    fields_b.push_back(std::make_pair(new IntegerColumn(), "y"));
+    Entity eb2("prpb", fields_b);
+    ih.writeEntity(eb2);
+    assert(parser.parse("EXECUTE addab 1 2 1").compare(ERR_PREPARED_STALE) == 0);
+    parser.resetState();
+    assert(parser.parse("EXECUTE addab 1 2 1").compare(ERR_PREPARED_NOT_EXISTS) == 0);
+
+    ih.removeEntity("prpa");
+    ih.removeEntity("prpb");
+    ih.removeRelation(r);
+}
+
+/**
+ *  Ensure batches coalesce relations, keep statement order and report each result
+ */
+void testBatch() {
+    IndexHandler ih;
+    Parser parser;
+    defpair fields_a, fields_b;
+    std::unordered_map<std::string, std::string> types_a, types_b;
+
+    fields_a.push_back(std::make_pair(new IntegerColumn(), "x"));
+    fields_b.push_back(std::make_pair(new IntegerColumn(), "y"));
+    types_a.insert(std::make_pair("x", COLTYPE_NAME_INT));
+    types_b.insert(std::make_pair("y", COLTYPE_NAME_INT));
+    Entity ea("bata", fields_a), eb("batb", fields_b);
+    ih.writeEntity(ea);
+    ih.writeEntity(eb);
+
+    valpair x1, y2;
+    x1.push_back(std::make_pair("x", "1"));
+    y2.push_back(std::make_pair("y", "2"));
+    Relation r("bata", "batb", x1, y2, types_a, types_b);
+    Json::Value json, results;
+    long total = ih.getRelationCountTotal();
+
+    results = parser.parseBatch("ADD REL bata(x=1) batb(y=2); ADD REL bata(x=1) batb(y=2) 3\n\n"
+        "ADD REL bata(x=1) nobat(y=2)\nLST REL bata batb; ADD REL bata(x=1) batb(y=2)");
+
+    // One result per statement, empty statements skipped, failures marked
+    assert(results.size() == 5);
+    assert(!results[0][JSON_ATTR_BATCH_ERROR].asBool());
+    assert(results[2][JSON_ATTR_BATCH_ERROR].asBool());
+    assert(results[3][JSON_ATTR_BATCH_STMT].asString().compare("LST REL bata batb") == 0);
+
+    // Repeats are summed, the listing ran after the relations before it were written
+    assert(results[3][JSON_ATTR_BATCH_RESULT].asString().find("\"instance_count\" : 4") != std::string::npos);
+    assert(ih.fetchRaw(r.generateKey(), json) && json[JSON_ATTR_REL_COUNT].asInt() == 5);
+    assert(ih.getRelationCountTotal() == total + 5);
+
+    ih.removeEntity("bata");
+    ih.removeEntity("batb");
+    ih.removeRelation(r);
+}
+
+/**
+ *  Ensure bulk loads validate rows, sum repeated relations and write snapshots
+ */
+void testBulkLoader() {
+    IndexHandler ih;
+    defpair fields_a, fields_b;
+    std::unordered_map<std::string, std::string> types_a, types_b;
+
+    fields_a.push_back(std::make_pair(new IntegerColumn(), "x"));
+    fields_b.push_back(std::make_pair(new StringColumn(), "y"));
+    types_a.insert(std::make_pair("x", COLTYPE_NAME_INT));
+    types_b.insert(std::make_pair("y", COLTYPE_NAME_STR));
+    Entity ea("ldra", fields_a), eb("ldrb", fields_b);
+    ih.writeEntity(ea);
+    ih.writeEntity(eb);
+
+    valpair x1, yred;
+    x1.push_back(std::make_pair("x", "1"));
+    yred.push_back(std::make_pair("y", "red"));
+    Relation r("ldra", "ldrb", x1, yred, types_a, types_b);
+    Json::Value json;
+    long total = ih.getRelationCountTotal();
+
+    // Rows of CSV, repeats summed across slices and chunks, bad rows rejected
+    std::stringstream csv;
+    csv << "ldra.x,ldrb.y,count\n";
+    for (long i = 0; i < 3000; i++)
+        csv << "1,\"red\",1\n";
+    csv << "1.5,red,1\n1,red\n1,,2\n";
+    LoaderStats stats;
+    BulkLoader loader(ih, "ldra", "ldrb", LOADER_FORMAT_CSV, 4);
+    assert(loader.load(csv, stats));
+    assert(stats.rows == 3003 && stats.loaded == 3001 && stats.rejected == 2 && stats.relations == 2);
+    assert(ih.fetchRaw(r.generateKey(), json) && json[JSON_ATTR_REL_COUNT].asInt() == 3000);
+    assert(ih.getRelationCountTotal() == total + 3002);
+
+    // JSON lines add to the stored counts
+    std::stringstream jsonl("{\"ldra.x\": 1, \"ldrb.y\": \"red\", \"count\": 5}\n{\"ldra.z\": 1}\n");
+    stats = LoaderStats();
+    BulkLoader jsonLoader(ih, "ldra", "ldrb", LOADER_FORMAT_JSONL);
+    assert(jsonLoader.load(jsonl, stats));
+    assert(stats.loaded == 1 && stats.rejected == 1);
+    assert(ih.fetchRaw(r.generateKey(), json) && json[JSON_ATTR_REL_COUNT].asInt() == 3005);
+
+    // Repeats summed past INT_MAX fail rather than wrap
+    std::stringstream large("ldra.x,ldrb.y,count\n3,green,2000000000\n3,green,2000000000\n");
+    stats = LoaderStats();
+    assert(loader.load(large, stats) && stats.loaded == 2 && stats.relations == 0 && stats.failed == 1);
+    assert(stats.errors.size() == 1 && stats.errors[0].find(ERR_LOADER_COUNT) == 0);
+    assert(ih.getRelationCountTotal() == total + 3007);
+
+    // Unknown columns fail the load
+    std::stringstream bad("ldra.x,ldrc.y\n1,red\n");
+    stats = LoaderStats();
+    assert(!loader.load(bad, stats) && loader.error.compare(std::string(ERR_LOADER_COLUMN) + "ldrc.y") == 0);
+
+    // Snapshots hold redis commands instead of writing to the index
+    std::stringstream rows("ldra.x,ldrb.y\n2,blue\n2,blue\n");
+    std::string path("/tmp/databayes_test_snapshot.resp");
+    stats = LoaderStats();
+    assert(loader.load(rows, stats, path) && stats.relations == 1);
+    std::ifstream in(path.c_str());
+    std::stringstream snapshot;
+    snapshot << in.rdbuf();
+    assert(snapshot.str().compare(0, 13, "*3\r\n$3\r\nSET\r\n") == 0);
+    assert(snapshot.str().find("\"instance_count\" : 2") != std::string::npos);
+    assert(ih.getRelationCountTotal() == total + 3007);
+    std::remove(path.c_str());
+
+    ih.removeEntity("ldra");
+    ih.removeEntity("ldrb");
+    ih.removeRelation(r);
+}
+
+/**
+ *  Ensure a chunk written through the batch hooks keeps the derived structures as relation by relation writes do
+ */
+void testBatchHooks() {
+    IndexHandler ih;
+    RedisHandler rds(REDISDBTEST, REDISPORT);
+    defpair fields_a, fields_b;
+    std::unordered_map<std::string, std::string> types_a, types_b;
+    std::vector<std::pair<Json::Value, int>> chunk;
+    std::vector<Relation> relations;
+
+    ColumnBase* intCol = new IntegerColumn();
+    fields_a.push_back(std::make_pair(intCol, "x"));
+    fields_b.push_back(std::make_pair(intCol, "y"));
+    types_a.insert(std::make_pair("x", COLTYPE_NAME_INT));
+    types_b.insert(std::make_pair("y", COLTYPE_NAME_INT));
+    Entity ea("bha", fields_a), eb("bhb", fields_b);
+    ih.writeEntity(ea);
+    ih.writeEntity(eb);
+
+    // Declaring moves the version the hooks read the definitions behind
+    std::vector<std::string> versionKeys(1, KEY_CPT_DEFINITIONS_VERSION);
+    long version = std::atol(rds.readMany(versionKeys)[0].c_str());
+    assert(ih.writeConditionalTable("bha", "x", "bhb", "y", 100));
+    assert(std::atol(rds.readMany(versionKeys)[0].c_str()) > version);
+    AttributeBucket none;
+    std::string watch = ih.writeStandingQuery("bha", "", "bhb", none, ATTR_TUPLE_COMPARE_EQ);
+
+    // Counts 1 to 6, 21 instances over 6 relations
+    for (int i = 0; i < 6; i++) {
+        valpair left, right;
+        left.push_back(std::make_pair("x", std::to_string(i % 3)));
+        right.push_back(std::make_pair("y", std::to_string(i / 3)));
+        relations.push_back(Relation("bha", "bhb", left, right, types_a, types_b));
+        chunk.push_back(std::make_pair(relations.back().toJson(), i + 1));
+    }
+    ih.writeRelations(chunk);
+
+    std::string pair = PairCatalog::pairFromKey(relations[0].generateKey());
+    assert(PairCatalog::fetchPairCount(rds, pair) == 21 && PairCatalog::fetchPairDistinct(rds, pair) == 6);
+    Moments moments;
+    assert(ih.fetchMoments("bha", "x", moments) && moments.count == 21);
+    std::vector<TableCell> cells;
+    long cellTotal = 0;
+    assert(ih.fetchTableCells(ConditionalTable::tableName("bha", "x", "bhb", "y"), cells) && cells.size() == 6);
+    for (std::vector<TableCell>::iterator it = cells.begin(); it != cells.end(); ++it)
+        cellTotal += it->count;
+    assert(cellTotal == 21);
+
+    // The query is published once for the chunk
+    Json::Value query;
+    assert(ih.fetchStandingQuery(watch, query));
+    assert(query["pairwise"].asInt() == 21 && query["sequence"].asInt() == 2);
+
+    // Counting every relation down to zero drops the pair
+    for (std::vector<std::pair<Json::Value, int>>::iterator it = chunk.begin(); it != chunk.end(); ++it)
+        it->second = -it->second;
+    ih.writeRelations(chunk);
+    assert(PairCatalog::fetchPairCount(rds, pair) == 0 && PairCatalog::fetchPairDistinct(rds, pair) == 0);
+    assert(!rds.exists(std::string(KEY_CATALOG_PAIR_KEYS) + KEY_CATALOG_DELIMETER + pair));
+    assert(!ih.fetchMoments("bha", "x", moments) || moments.count == 0);
+    assert(ih.fetchStandingQuery(watch, query) && query["pairwise"].asInt() == 0);
+
+    ih.removeEntity(ea);
+    ih.removeEntity(eb);
+    delete intCol;
+}
+
+/**
+ *  Ensure one parser serves several threads each parsing with its own context
+ */
+void testReentrantParser() {
+    IndexHandler ih;
+    Parser parser;
+    defpair fields_a, fields_b;
+    std::unordered_map<std::string, std::string> types_a, types_b;
+    std::vector<std::thread> threads;
+    std::vector<int> failures(4, 0);
+
+    fields_a.push_back(std::make_pair(new IntegerColumn(), "x"));
+    fields_b.push_back(std::make_pair(new IntegerColumn(), "y"));
+    types_a.insert(std::make_pair("x", COLTYPE_NAME_INT));
+    types_b.insert(std::make_pair("y", COLTYPE_NAME_INT));
+    Entity ea("rena", fields_a), eb("renb", fields_b);
+    ih.writeEntity(ea);
+    ih.writeEntity(eb);
+    long total = ih.getRelationCountTotal();
+
+    // Each thread writes relations of its own and answers queries between writes
+    for (int t = 0; t < (int)failures.size(); t++)
+        threads.push_back(std::thread([&parser, &failures, t] {
+            ParseContext ctx;
+            std::string add = "ADD REL rena(x=" + std::to_string(t) + ") renb(y=1)";
+            for (int i = 0; i < 10; i++) {
+                parser.parse(add, ctx);
+                if (ctx.error) failures[t]++;
+                ctx.reset();
+                parser.parse("INF rena.x GIVEN renb(y=1)", ctx);
+                if (ctx.error) failures[t]++;
+                ctx.reset();
+            }
+        }));
+    for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+
+    Json::Value json;
+    valpair y1;
+    y1.push_back(std::make_pair("y", "1"));
+    assert(ih.getRelationCountTotal() == total + 10 * (long)failures.size());
+    for (int t = 0; t < (int)failures.size(); t++) {
+        valpair x;
+        x.push_back(std::make_pair("x", std::to_string(t)));
+        Relation r("rena", "renb", x, y1, types_a, types_b);
+        assert(failures[t] == 0);
+        assert(ih.fetchRaw(r.generateKey(), json) && json[JSON_ATTR_REL_COUNT].asInt() == 10);
+        ih.removeRelation(r);
+    }
+
+    ih.removeEntity("rena");
+    ih.removeEntity("renb");
+}
+
+/**
+ *  Ensure threads writing the same relation through one handler lose none of its instances
+ */
+void testConcurrentRelationWrites() {
+    IndexHandler ih;
+    RedisHandler rds(REDISDBTEST, REDISPORT);
+    defpair fields_a, fields_b;
+    std::unordered_map<std::string, std::string> types_a, types_b;
+    std::vector<std::thread> threads;
+
+    fields_a.push_back(std::make_pair(new IntegerColumn(), "x"));
+    fields_b.push_back(std::make_pair(new IntegerColumn(), "y"));
+    types_a.insert(std::make_pair("x", COLTYPE_NAME_INT));
+    types_b.insert(std::make_pair("y", COLTYPE_NAME_INT));
+    Entity ea("crwa", fields_a), eb("crwb", fields_b);
+    ih.writeEntity(ea);
+    ih.writeEntity(eb);
+    valpair x, y;
+    x.push_back(std::make_pair("x", "1"));
+    y.push_back(std::make_pair("y", "1"));
+    Relation r("crwa", "crwb", x, y, types_a, types_b);
+    long total = ih.getRelationCountTotal();
+    ih.writeRelation(r, 100);
+
+    // Half the threads write one instance at a time, the others write chunks repeating the relation,
+    // while two more take instances off with DEC
+    Parser parser;
+    for (int t = 0; t < 2; t++)
+        threads.push_back(std::thread([&parser] {
+            ParseContext ctx;
+            for (int i = 0; i < 20; i++) {
+                parser.parse("DEC crwa(x=1) crwb(y=1)", ctx);
+                ctx.reset();
+            }
+        }));
+    for (int t = 0; t < 6; t++)
+        threads.push_back(std::thread([&ih, &r, t] {
+            for (int i = 0; i < 20; i++) {
+                if (t % 2 == 0) {
+                    Json::Value json = r.toJson();
+                    ih.writeRelation(json, 1);
+                } else {
+                    std::vector<std::pair<Json::Value, int>> chunk;
+                    chunk.push_back(std::make_pair(r.toJson(), 1));
+                    chunk.push_back(std::make_pair(r.toJson(), 2));
+                    ih.writeRelations(chunk);
+                }
+            }
+        }));
+    for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+
+    Json::Value json;
+    long written = 100 + 3 * 20 * 1 + 3 * 20 * 3 - 2 * 20;
+    assert(ih.fetchRaw(r.generateKey(), json) && json[JSON_ATTR_REL_COUNT].asInt() == written);
+    assert(ih.getRelationCountTotal() == total + written);
+    assert(PairCatalog::fetchPairCount(rds, PairCatalog::pairFromKey(r.generateKey())) == written);
+
+    // The writers released their state as they exited, as does a thread outliving the handler it used
+    assert(ih.countThreadStates() == 1);
+    IndexHandler* shortLived = new IndexHandler();
+    std::promise<void> used, deleted;
+    std::future<void> done = deleted.get_future();
+    std::thread outliving([shortLived, &used, &done] {
+        shortLived->getRelationCountTotal();
+        used.set_value();
+        done.wait();
+    });
+    used.get_future().wait();
+    assert(shortLived->countThreadStates() == 2);
+    delete shortLived;
+    deleted.set_value();
+    outliving.join();
+
+    ih.removeRelation(r);
+    ih.removeEntity("crwa");
+    ih.removeEntity("crwb");
+}
+
+/**
+ *  Ensure threads sharing one Bayes instance draw samples and read cached results without a lock of
+ *  their own
+ */
+void testConcurrentSampling() {
+    IndexHandler ih;
+    Bayes bayes;
+    defpair fields_a, fields_b;
+    std::unordered_map<std::string, std::string> types_a, types_b;
+    std::vector<std::thread> threads;
+    std::vector<int> failures(4, 0);
+
+    fields_a.push_back(std::make_pair(new IntegerColumn(), "x"));
+    fields_b.push_back(std::make_pair(new IntegerColumn(), "y"));
+    types_a.insert(std::make_pair("x", COLTYPE_NAME_INT));
+    types_b.insert(std::make_pair("y", COLTYPE_NAME_INT));
+    Entity ea("csma", fields_a), eb("csmb", fields_b);
+    ih.writeEntity(ea);
+    ih.writeEntity(eb);
+    std::vector<Relation> relations;
+    for (int i = 0; i < 4; i++) {
+        valpair x, y;
+        x.push_back(std::make_pair("x", std::to_string(i)));
+        y.push_back(std::make_pair("y", "1"));
+        relations.push_back(Relation("csma", "csmb", x, y, types_a, types_b));
+        ih.writeRelation(relations.back());
+    }
+
+    for (int t = 0; t < (int)failures.size(); t++)
+        threads.push_back(std::thread([&bayes, &failures, t] {
+            AttributeBucket none;
+            for (int i = 0; i < 25; i++) {
+                Json::Value json = bayes.samplePairwise("csma", "csmb", none, ATTR_TUPLE_COMPARE_EQ).toJson();
+                if (json[JSON_ATTR_REL_ENTL].asString().compare("csma") != 0) failures[t]++;
+                if (bayes.computeConditional("csma", "csmb", none, ATTR_TUPLE_COMPARE_EQ) != (float)1.0)
+                    failures[t]++;
+            }
+        }));
+    for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+
+    // Every lookup of the result was counted once
+    Json::Value stats = bayes.resultCacheStats();
+    assert(stats["hits"].asInt() + stats["misses"].asInt() == 25 * (int)failures.size());
+    for (int t = 0; t < (int)failures.size(); t++)
+        assert(failures[t] == 0);
+
+    for (std::vector<Relation>::iterator it = relations.begin(); it != relations.end(); ++it)
+        ih.removeRelation(*it);
+    ih.removeEntity("csma");
+    ih.removeEntity("csmb");
+}
+
+/**
+ *  Ensure a seeded GEN reproduces its draws without seeding the draws of later requests
+ */
+void testSeededGen() {
+    IndexHandler ih;
+    defpair fields_a, fields_b;
+    std::unordered_map<std::string, std::string> types_a, types_b;
+
+    fields_a.push_back(std::make_pair(new IntegerColumn(), "a"));
+    types_a.insert(std::make_pair("a", COLTYPE_NAME_INT));
+    Entity ex("_gx", fields_a), ey("_gy", fields_b);
+    ih.writeEntity(ex);
+    ih.writeEntity(ey);
+    for (int i = 0; i < 4; i++) {
+        valpair x, y;
+        x.push_back(std::make_pair("a", std::to_string(i)));
+        Relation r("_gx", "_gy", x, y, types_a, types_b);
+        ih.writeRelation(r);
+    }
+
+    // Two parsers each run a seeded request and then an unseeded one
+    std::vector<std::string> seeded, unseeded;
+    for (int p = 0; p < 2; p++) {
+        Parser parser;
+        ParseContext ctx;
+        parser.parse("GEN _gx GIVEN _gy SAMPLES 20 SEED 42", ctx);
+        assert(!ctx.error);
+        seeded.push_back(ctx.rspStr);
+        ctx.reset();
+        parser.parse("GEN _gx GIVEN _gy SAMPLES 20", ctx);
+        assert(!ctx.error);
+        unseeded.push_back(ctx.rspStr);
+    }
+    assert(seeded[0].compare(seeded[1]) == 0);
+    assert(unseeded[0].compare(unseeded[1]) != 0);
+
+    ih.removeEntity(ex);
+    ih.removeEntity(ey);
+}
+
+/**
+ *  Ensure random streams are reproducible from a seed and split streams differ
+ */
+void testRandomStream() {
+    RandomStream a(7), b(7);
+    for (int i = 0; i < 100; i++)
+        assert(a.next() == b.next());
+
+    double u;
+    for (int i = 0; i < 1000; i++) {
+        u = a.uniform();
+        assert(u >= 0.0 && u < 1.0);
+        assert(a.below(3) < 3);
+    }
+    assert(a.below(0) == 0);
+
+    RandomStream c = a.split();
+    assert(c.next() != a.next());
+}
+
+/**
+ *  Ensure the Fenwick tree locates weights correctly through updates and appends
+ */
+void testFenwickTree() {
+    FenwickTree tree;
+    tree.append(1);
+    tree.append(3);
+    tree.append(0);
+    assert(tree.total() == 4);
+    assert(tree.find(0) == 0);
+    assert(tree.find(1) == 1);
+    assert(tree.find(3) == 1);
+
+    tree.update(0, 0);
+    tree.update(2, 2);
+    tree.append(5);
+    assert(tree.total() == 10);
+    assert(tree.find(0) == 1);
+    assert(tree.find(3) == 2);
+    assert(tree.find(4) == 2);
+    assert(tree.find(5) == 3);
+    assert(tree.find(9) == 3);
+}
+
+/**
+ *  Ensure the dynamic sampler follows writes to its pair without a rebuild
+ */
+void testDynamicSampler() {
+    Bayes bayes;
+    IndexHandler ih;
+    defpair fields_ent;
+    valpair fields_rel_1, fields_rel_2, fields_empty;
+    std::unordered_map<std::string, std::string> types;
+
+    fields_rel_1.push_back(std::make_pair("a", "1"));
+    fields_rel_2.push_back(std::make_pair("a", "2"));
+    types.insert(std::make_pair("a", COLTYPE_NAME_INT));
+
+    Entity e1("_p", fields_ent), e2("_q", fields_ent);
+    Relation r1("_p", "_q", fields_rel_1, fields_empty, types, types);
+    Relation r2("_p", "_q", fields_rel_2, fields_empty, types, types);
+    ih.writeEntity(e1);
+    ih.writeEntity(e2);
+    ih.writeRelation(r1, 1);
+
+    AttributeBucket ab;
+    DynamicSamplerRegistry& registry = DynamicSamplerRegistry::instance();
+    std::string pair = ih.orderPairAlphaNumeric("_p", "_q");
+    Relation sample = bayes.samplePairwise("_p", "_q", ab, ATTR_TUPLE_COMPARE_EQ);
+    assert(sample.getValue("_p", "a").compare("1") == 0);
+    assert(registry.isCurrent(pair, ih.fetchPairVersion(pair)));
+
+    // New relations are applied in place
+    ih.writeRelation(r2, 3);
+    assert(registry.isCurrent(pair, ih.fetchPairVersion(pair)));
+
+    std::vector<double> variates;
+    for (int i = 0; i < 100; i++)
+        variates.push_back((i + 0.5) / 100);
+    std::vector<Json::Value> relations = registry.sample(pair, variates);
+    assert(relations.size() == 100);
+    int ones = 0;
+    for (std::vector<Json::Value>::iterator it = relations.begin(); it != relations.end(); ++it)
+        if ((*it)[JSON_ATTR_REL_FIELDSL]["a"].asString().compare("1") == 0) ones++;
+    assert(ones == 25);
+
+    // A chunk bumps the pair once and the sampler takes the new version
+    std::vector<std::pair<Json::Value, int>> chunk;
+    chunk.push_back(std::make_pair(r1.toJson(), 2));
+    chunk.push_back(std::make_pair(r2.toJson(), 2));
+    ih.writeRelations(chunk);
+    assert(registry.isCurrent(pair, ih.fetchPairVersion(pair)));
+    relations = registry.sample(pair, variates);
+    ones = 0;
+    for (std::vector<Json::Value>::iterator it = relations.begin(); it != relations.end(); ++it)
+        if ((*it)[JSON_ATTR_REL_FIELDSL]["a"].asString().compare("1") == 0) ones++;
+    assert(ones == 37);
+
+    ih.removeEntity(e1);
+    ih.removeEntity(e2);
+}
+
+/**
+ *  Ensure batch sampling without replacement consumes relation instances
+ */
+void testSamplePairwiseBatch() {
+    Bayes bayes;
+    IndexHandler ih;
+    defpair fields_ent;
+    valpair fields_rel_1, fields_rel_2, fields_empty;
+    std::unordered_map<std::string, std::string> types;
+
+    fields_rel_1.push_back(std::make_pair("a", "1"));
+    fields_rel_2.push_back(std::make_pair("a", "2"));
+    types.insert(std::make_pair("a", COLTYPE_NAME_INT));
+
+    Entity e1("_x", fields_ent), e2("_y", fields_ent);
+    Relation r1("_x", "_y", fields_rel_1, fields_empty, types, types);
+    Relation r2("_x", "_y", fields_rel_2, fields_empty, types, types);
+    ih.writeEntity(e1);
+    ih.writeEntity(e2);
+    ih.writeRelation(r1, 3);
+    ih.writeRelation(r2, 1);
+
+    AttributeBucket ab;
+    std::vector<Relation> samples = bayes.samplePairwise("_x", "_y", ab,
+        ATTR_TUPLE_COMPARE_EQ, 10, false);
+    assert(samples.size() == 4);
+    int ones = 0;
+    for (std::vector<Relation>::iterator it = samples.begin(); it != samples.end(); ++it)
+        if (it->getValue("_x", "a").compare("1") == 0) ones++;
+    assert(ones == 3);
+
+    samples = bayes.samplePairwise("_x", "_y", ab, ATTR_TUPLE_COMPARE_EQ, 10);
+    assert(samples.size() == 10);
+
+    // Seeded batches are reproducible
+    std::vector<Relation> seeded;
+    bayes.seed(42);
+    samples = bayes.samplePairwise("_x", "_y", ab, ATTR_TUPLE_COMPARE_EQ, 20);
+    bayes.seed(42);
+    seeded = bayes.samplePairwise("_x", "_y", ab, ATTR_TUPLE_COMPARE_EQ, 20);
+    for (int i = 0; i < 20; i++)
+        assert(samples[i].getValue("_x", "a").compare(seeded[i].getValue("_x", "a")) == 0);
+
+    ih.removeEntity(e1);
+    ih.removeEntity(e2);
+}
+
 /**
  *  Ensure sample marginal returns a valid sample
  */
@@ -1054,7 +2872,254 @@ void testRelationWrite() {
  *  Tests that removal of relations cascading on entities functions properly
  */
 void testEntityCascadeRemoval() {
-    // TODO - implement
+    IndexHandler ih;
+    defpair fields_ent;
+    valpair fields_rel;
+    std::unordered_map<std::string, std::string> types;
+
+    Entity e1("_x", fields_ent), e2("_y", fields_ent), e3("_z", fields_ent);
+    Relation r1("_x", "_y", fields_rel, fields_rel, types, types);
+    Relation r2("_z", "_x", fields_rel, fields_rel, types, types);
+    Relation r3("_y", "_z", fields_rel, fields_rel, types, types);
+
+    ih.writeEntity(e1);
+    ih.writeEntity(e2);
+    ih.writeEntity(e3);
+    ih.writeRelation(r1);
+    ih.writeRelation(r2, 3);
+    ih.writeRelation(r3);
+
+    long total = ih.getRelationCountTotal();
+
+    // Relations on both sides of "_x" are removed, the rest are untouched
+    assert(ih.removeEntity(e1));
+    assert(!ih.existsEntity(e1));
+    assert(!ih.isTombstoned(e1.name));
+    assert(ih.fetchEntityRelationKeys(e1.name).size() == 0);
+    assert(ih.fetchEntityRelationKeys(e3.name).size() == 1);
+    assert(ih.getRelationCountTotal() == total - 4);
+
+    ih.removeEntity(e2);
+    ih.removeEntity(e3);
+}
+
+/**
+ *  Ensure background cascades report through LST JOB and interrupted cascades are resumed
+ */
+void testAsyncCascadeRemoval() {
+    IndexHandler ih;
+    Parser parser;
+    RedisHandler rds(REDISDBTEST, REDISPORT);
+    ParseContext ctx;
+    defpair fields_ent;
+    valpair fields_rel;
+    std::unordered_map<std::string, std::string> types;
+
+    Entity e1("_ax", fields_ent), e2("_ay", fields_ent), e3("_az", fields_ent);
+    Relation r1("_ax", "_ay", fields_rel, fields_rel, types, types);
+    Relation r2("_az", "_ay", fields_rel, fields_rel, types, types);
+    ih.writeEntity(e1);
+    ih.writeEntity(e2);
+    ih.writeEntity(e3);
+    ih.writeRelation(r1, 2);
+    ih.writeRelation(r2, 3);
+    long total = ih.getRelationCountTotal();
+
+    // The job reports progress until done, the tombstone is then cleared
+    std::string jobId = ih.removeEntityAsync(e1.name);
+    assert(jobId.compare("") != 0);
+    assert(!ih.existsEntity(e1));
+    IndexHandler::waitForJobs();
+    parser.parse(std::string("LST JOB ") + jobId, ctx);
+    assert(!ctx.error);
+    Json::Value job;
+    assert(ih.composeJSON(ctx.rspStr, job));
+    assert(job[JOB_FIELD_STATUS].asString().compare(JOB_STATUS_DONE) == 0);
+    assert(job[JOB_FIELD_TOTAL].asInt() == 1 && job[JOB_FIELD_REMOVED].asInt() == 1);
+    assert(!ih.isTombstoned(e1.name));
+    assert(ih.getRelationCountTotal() == total - 2);
+
+    ctx.reset();
+    parser.parse("LST JOB 0", ctx);
+    assert(ctx.error);
+
+    // An entity left tombstoned by an exited process has its relations cleared on resuming.  Its job
+    // had removed one relation whose key is still listed, which is not counted again
+    e3.remove(rds);
+    rds.addSetMember(KEY_TOMBSTONES, e3.name);
+    std::string staleKey = r2.generateKey() + "0";
+    std::string jobKey = std::string(KEY_JOB_PREFIX) + KEY_DELIMETER + "resumed";
+    rds.addSetMember(std::string(KEY_CATALOG_PAIR_KEYS) + KEY_CATALOG_DELIMETER + PairCatalog::pairFromKey(staleKey), staleKey);
+    rds.writeHashMap(jobKey, JOB_FIELD_REMOVED, "1");
+    rds.writeHashMap(KEY_TOMBSTONE_JOBS, e3.name, jobKey);
+    assert(ih.fetchEntityRelationKeys(e3.name).size() == 2);
+    assert(ih.resumeCascadeJobs() == 1);
+    IndexHandler::waitForJobs();
+    assert(!ih.isTombstoned(e3.name));
+    assert(ih.fetchEntityRelationKeys(e3.name).size() == 0);
+    assert(ih.getRelationCountTotal() == total - 5);
+    assert(ih.fetchJobStatus("resumed", job));
+    assert(job[JOB_FIELD_TOTAL].asInt() == 2 && job[JOB_FIELD_REMOVED].asInt() == 2);
+    rds.deleteKey(jobKey);
+
+    ih.removeEntity(e2);
+}
+
+/**
+ *  Ensure cascades run at once on one tombstone take each relation out of the total and the
+ *  summaries once, and that a cascade whose lease is held elsewhere leaves the entity alone
+ */
+void testConcurrentCascades() {
+    IndexHandler ih;
+    RedisHandler rds(REDISDBTEST, REDISPORT);
+    IntegerColumn* intCol = new IntegerColumn();
+    defpair fields_x, fields_y;
+    valpair none;
+    std::unordered_map<std::string, std::string> types_x, types_y;
+    std::vector<Relation> relations;
+
+    fields_y.push_back(std::make_pair(intCol, "y"));
+    types_y.insert(std::make_pair("y", COLTYPE_NAME_INT));
+    Entity ex("ccx", fields_x), ey("ccy", fields_y), ez("ccz", fields_x);
+    ih.writeEntity(ex);
+    ih.writeEntity(ey);
+    ih.writeEntity(ez);
+
+    // 15 instances over 5 relations on "ccx", 2 on "ccz" keep the moments of "ccy" alive
+    for (int i = 0; i < 5; i++) {
+        valpair y;
+        y.push_back(std::make_pair("y", std::to_string(i)));
+        relations.push_back(Relation("ccx", "ccy", none, y, types_x, types_y));
+        ih.writeRelation(relations.back(), i + 1);
+    }
+    valpair y9;
+    y9.push_back(std::make_pair("y", "9"));
+    Relation kept("ccz", "ccy", none, y9, types_x, types_y);
+    ih.writeRelation(kept, 2);
+    long total = ih.getRelationCountTotal();
+
+    // A lease held by another process leaves the tombstone in place
+    ex.remove(rds);
+    rds.addSetMember(KEY_TOMBSTONES, ex.name);
+    std::string leaseKey = std::string(KEY_CASCADE_LEASE) + KEY_DELIMETER + ex.name;
+    assert(rds.setIfAbsent(leaseKey, "elsewhere", CASCADE_LEASE_SECONDS));
+    assert(ih.removeEntityRelations(ex.name) == 0);
+    assert(ih.isTombstoned(ex.name) && ih.getRelationCountTotal() == total);
+    rds.deleteKey(leaseKey);
+
+    std::vector<long> removed(2, 0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < (int)removed.size(); t++)
+        threads.push_back(std::thread([&removed, &ex, t] {
+            IndexHandler cascade;
+            removed[t] = cascade.removeEntityRelations(ex.name);
+        }));
+    for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+
+    Moments moments;
+    assert(removed[0] + removed[1] == 5);
+    assert(!ih.isTombstoned(ex.name));
+    assert(ih.getRelationCountTotal() == total - 15);
+    assert(ih.fetchMoments("ccy", "y", moments) && moments.count == 2 && moments.mean() == 9.0);
+
+    // Running the cascade again finds nothing left to subtract
+    assert(ih.removeEntityRelations(ex.name) == 0);
+    assert(ih.getRelationCountTotal() == total - 15);
+
+    ih.removeEntity(ey);
+    ih.removeEntity(ez);
+    delete intCol;
+}
+
+/**
+ *  Tests that the pair catalog tracks relation counts on write and remove
+ */
+void testPairCatalog() {
+    IndexHandler ih;
+    RedisHandler rds(REDISDBTEST, REDISPORT);
+    defpair fields_ent;
+    valpair fields_rel, fields_rel_2;
+    std::unordered_map<std::string, std::string> types;
+
+    fields_rel_2.push_back(std::make_pair("a", "1"));
+    Entity e1("_x", fields_ent), e2("_y", fields_ent);
+    Relation r1("_x", "_y", fields_rel, fields_rel, types, types);
+    Relation r2("_x", "_y", fields_rel_2, fields_rel, types, types);
+
+    ih.writeEntity(e1);
+    ih.writeEntity(e2);
+    ih.writeRelation(r1, 2);
+    ih.writeRelation(r2);
+
+    std::string pair = PairCatalog::pairFromKey(r1.generateKey());
+    assert(PairCatalog::fetchPairCount(rds, pair) == 3);
+    assert(PairCatalog::fetchPairDistinct(rds, pair) == 2);
+    assert(ih.fetchRelationPrefix("_x", "_y").size() == 2);
+    assert(ih.computeRelationsCount("_x", "_y") == 3);
+
+    ih.removeRelation(r1);
+    assert(PairCatalog::fetchPairCount(rds, pair) == 1);
+    assert(PairCatalog::fetchPairDistinct(rds, pair) == 1);
+
+    // Removing the last relation drops the pair
+    r2.remove(rds);
+    assert(PairCatalog::fetchPairCount(rds, pair) == 0);
+    assert(PairCatalog::fetchPairDistinct(rds, pair) == 0);
+    assert(!rds.exists(std::string(KEY_CATALOG_PAIR_KEYS) + KEY_CATALOG_DELIMETER + pair));
+    assert(ih.fetchPairSummaries("_x", "_y").size() == 0);
+
+    ih.removeEntity(e1);
+    ih.removeEntity(e2);
+}
+
+/**
+ *  Ensure relations written before the catalog was built are indexed once it is, even after later writes
+ */
+void testRebuildMissing() {
+    IndexHandler ih;
+    RedisHandler rds(REDISDBTEST, REDISPORT);
+    defpair fields_ent;
+    valpair fields_rel;
+    std::unordered_map<std::string, std::string> types;
+
+    Entity e1("_mx", fields_ent), e2("_my", fields_ent), e3("_mz", fields_ent);
+    Relation r1("_mx", "_my", fields_rel, fields_rel, types, types);
+    Relation r2("_mx", "_mz", fields_rel, fields_rel, types, types);
+    ih.writeEntity(e1);
+    ih.writeEntity(e2);
+    ih.writeEntity(e3);
+
+    // A relation stored without the hooks, then a write through them before any process starts
+    rds.deleteKey(KEY_CATALOG_BUILT);
+    Json::Value json = r1.toJson();
+    json[JSON_ATTR_REL_COUNT] = 2;
+    rds.write(r1.generateKey(), json.toStyledString());
+    ih.writeRelation(r2);
+    assert(ih.fetchRelationPrefix("_mx", "_my").size() == 0);
+
+    // Processes starting together build the catalog once, the others wait for it
+    std::vector<std::vector<std::string>> built(3);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < (int)built.size(); t++)
+        threads.push_back(std::thread([&built, t] { built[t] = IndexHandler().rebuildMissing(); }));
+    for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+    int builders = 0;
+    for (int t = 0; t < (int)built.size(); t++)
+        if (std::find(built[t].begin(), built[t].end(), "entity pair catalog") != built[t].end())
+            builders++;
+    assert(builders == 1);
+    assert(rds.exists(KEY_CATALOG_BUILT) && !rds.exists(KEY_REBUILD_LEASE));
+    assert(ih.fetchRelationPrefix("_mx", "_my").size() == 1);
+    assert(ih.fetchRelationPrefix("_mx", "_mz").size() == 1);
+    assert(PairCatalog::fetchPairCount(rds, PairCatalog::pairFromKey(r1.generateKey())) == 2);
+    assert(PairCatalog::fetchPairCount(rds, PairCatalog::pairFromKey(r2.generateKey())) == 1);
+    assert(ih.rebuildMissing().size() == 0);
+
+    ih.removeEntity(e1);
+    ih.removeEntity(e2);
+    ih.removeEntity(e3);
 }
 
 /**
@@ -1188,6 +3253,62 @@ void initTests() {
         std::make_pair(true, testIndexFilterRelationsLTE)));
     tests.insert(std::make_pair("testRelation_toJson",
         std::make_pair(true, testRelation_toJson)));
+    tests.insert(std::make_pair("testAliasTable",
+        std::make_pair(true, testAliasTable)));
+    tests.insert(std::make_pair("testSamplePairwiseBatch",
+        std::make_pair(true, testSamplePairwiseBatch)));
+    tests.insert(std::make_pair("testFetchRelationSet",
+        std::make_pair(true, testFetchRelationSet)));
+    tests.insert(std::make_pair("testConditionalTable",
+        std::make_pair(true, testConditionalTable)));
+    tests.insert(std::make_pair("testMomentAccumulators",
+        std::make_pair(true, testMomentAccumulators)));
+    tests.insert(std::make_pair("testCountSketch",
+        std::make_pair(true, testCountSketch)));
+    tests.insert(std::make_pair("testReservoirEstimate",
+        std::make_pair(true, testReservoirEstimate)));
+    tests.insert(std::make_pair("testQuantileDigest",
+        std::make_pair(true, testQuantileDigest)));
+    tests.insert(std::make_pair("testTopValues",
+        std::make_pair(true, testTopValues)));
+    tests.insert(std::make_pair("testChainInference",
+        std::make_pair(true, testChainInference)));
+    tests.insert(std::make_pair("testResultCache",
+        std::make_pair(true, testResultCache)));
+    tests.insert(std::make_pair("testGroupBy",
+        std::make_pair(true, testGroupBy)));
+    tests.insert(std::make_pair("testMonteCarlo",
+        std::make_pair(true, testMonteCarlo)));
+    tests.insert(std::make_pair("testNaiveBayes",
+        std::make_pair(true, testNaiveBayes)));
+    tests.insert(std::make_pair("testCube",
+        std::make_pair(true, testCube)));
+    tests.insert(std::make_pair("testStandingQuery",
+        std::make_pair(true, testStandingQuery)));
+    tests.insert(std::make_pair("testLexer",
+        std::make_pair(true, testLexer)));
+    tests.insert(std::make_pair("testPreparedStatement",
+        std::make_pair(true, testPreparedStatement)));
+    tests.insert(std::make_pair("testBatch",
+        std::make_pair(true, testBatch)));
+    tests.insert(std::make_pair("testBulkLoader",
+        std::make_pair(true, testBulkLoader)));
+    tests.insert(std::make_pair("testBatchHooks",
+        std::make_pair(true, testBatchHooks)));
+    tests.insert(std::make_pair("testReentrantParser",
+        std::make_pair(true, testReentrantParser)));
+    tests.insert(std::make_pair("testConcurrentRelationWrites",
+        std::make_pair(true, testConcurrentRelationWrites)));
+    tests.insert(std::make_pair("testConcurrentSampling",
+        std::make_pair(true, testConcurrentSampling)));
+    tests.insert(std::make_pair("testRandomStream",
+        std::make_pair(true, testRandomStream)));
+    tests.insert(std::make_pair("testSeededGen",
+        std::make_pair(true, testSeededGen)));
+    tests.insert(std::make_pair("testFenwickTree",
+        std::make_pair(true, testFenwickTree)));
+    tests.insert(std::make_pair("testDynamicSampler",
+        std::make_pair(true, testDynamicSampler)));
 
     // Tests for Counting and Distributions
     tests.insert(std::make_pair("testCountEntityInRelations",
@@ -1204,9 +3325,17 @@ void initTests() {
     tests.insert(std::make_pair("testRelationWrite",
         std::make_pair(true, testRelationWrite)));
     tests.insert(std::make_pair("testEntityCascadeRemoval",
-        std::make_pair(false, testEntityCascadeRemoval)));
+        std::make_pair(true, testEntityCascadeRemoval)));
+    tests.insert(std::make_pair("testAsyncCascadeRemoval",
+        std::make_pair(true, testAsyncCascadeRemoval)));
+    tests.insert(std::make_pair("testConcurrentCascades",
+        std::make_pair(true, testConcurrentCascades)));
     tests.insert(std::make_pair("testRelationInstanceCount",
         std::make_pair(true, testRelationInstanceCount)));
+    tests.insert(std::make_pair("testPairCatalog",
+        std::make_pair(true, testPairCatalog)));
+    tests.insert(std::make_pair("testRebuildMissing",
+        std::make_pair(true, testRebuildMissing)));
 
     // Test CLI Commands
     tests.insert(std::make_pair("testADDREL",
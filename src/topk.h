@@ -0,0 +1,142 @@
+/*
+ *  topk.h
+ *
+ *  Defines the value counts kept for entity attributes.  For each entity and attribute the store
+ *  keeps the number of relation instances carrying each value, ranked, so the most frequent values
+ *  of an attribute are a lookup rather than a scan over its relations.  A relation hook keeps the
+ *  counts current for every write path.
+ *
+ *  Counts are exact rather than a Space-Saving summary since decrements and removals have to be
+ *  taken back out, and the store holds one entry per distinct value rather than per relation.
+ *
+ *  Created by Ryan Faulkner on 2015-12-22
+ *  Copyright (c) 2015. All rights reserved.
+ */
+
+#ifndef _topk_h
+#define _topk_h
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <json/json.h>
+
+#include "redis.h"
+#include "hooks.h"
+#include "models/model_def.h"
+
+#define KEY_TOPK_PREFIX "topk"
+#define KEY_TOPK_DELIMETER "+"
+#define KEY_TOPK_BUILT "topk_built"
+
+
+/** An attribute value with the number of instances carrying it */
+struct ValueCount {
+    std::string value;
+    long count;
+
+    ValueCount(std::string value, long count) : value(value), count(count) {}
+
+    /** Most frequent first, ties in value order */
+    bool operator<(const ValueCount& other) const {
+        return this->count != other.count ? this->count > other.count : this->value < other.value;
+    }
+};
+
+
+/**
+ *  Interface to the value counts.  The counts of an entity attribute are one redis sorted set with
+ *  a member per value scored by its instance count.
+ */
+class TopKStore {
+
+    static std::string attributeKey(std::string, std::string);
+
+public:
+
+    static void apply(RedisHandler&, Json::Value&, long, bool = true);
+    static void relationHook(RedisHandler&, std::string, Json::Value&, int, int);
+    static void relationBatchHook(RedisHandler&, std::vector<RelationDelta>&);
+    static std::vector<ValueCount> fetch(RedisHandler&, std::string, std::string, long);
+};
+
+/** Redis key of the value counts of an entity attribute */
+std::string TopKStore::attributeKey(std::string entity, std::string attribute) {
+    return std::string(KEY_TOPK_PREFIX) + KEY_TOPK_DELIMETER + entity + std::string(".") + attribute;
+}
+
+/**
+ *  Add the attribute values of a relation to the counts of its entities, weighted by a change in
+ *  instance count.  Values whose count drops to zero are removed so an emptied set is deleted.
+ *  All updates for the relation are sent in one pipeline unless the caller flushes it.
+ */
+void TopKStore::apply(RedisHandler& rds, Json::Value& relation, long delta, bool flush) {
+    const char* sides[2][2] = { { JSON_ATTR_REL_ENTL, JSON_ATTR_REL_FIELDSL },
+        { JSON_ATTR_REL_ENTR, JSON_ATTR_REL_FIELDSR } };
+    std::vector<std::string> members, args;
+    std::string key;
+    bool pending = false;
+
+    if (delta == 0) return;
+
+    for (int i = 0; i < 2; i++) {
+        Json::Value& fields = relation[sides[i][1]];
+        members = fields.getMemberNames();
+
+        for (std::vector<std::string>::iterator it = members.begin(); it != members.end(); ++it) {
+            if (it->compare(JSON_ATTR_FIELDS_COUNT) == 0 || it->find(JSON_ATTR_REL_TYPE_PREFIX) == 0) continue;
+            key = TopKStore::attributeKey(relation[sides[i][0]].asString(), *it);
+
+            args.clear(); args.push_back("ZINCRBY"); args.push_back(key);
+            args.push_back(std::to_string(delta)); args.push_back(fields[*it].asString());
+            rds.appendCommand(args);
+            if (delta < 0) {
+                args.clear(); args.push_back("ZREMRANGEBYSCORE"); args.push_back(key);
+                args.push_back("-inf"); args.push_back("0");
+                rds.appendCommand(args);
+            }
+            pending = true;
+        }
+    }
+
+    if (pending && flush) rds.flushPipeline();
+}
+
+/** Relation hook - applies the change in instance count to the value counts */
+void TopKStore::relationHook(RedisHandler& rds, std::string key, Json::Value& relation, int oldCount, int newCount) {
+    TopKStore::apply(rds, relation, newCount - oldCount);
+}
+
+/** Batch relation hook - the updates of the chunk are sent in one pipeline */
+void TopKStore::relationBatchHook(RedisHandler& rds, std::vector<RelationDelta>& deltas) {
+    for (std::vector<RelationDelta>::iterator it = deltas.begin(); it != deltas.end(); ++it)
+        TopKStore::apply(rds, *(it->relation), it->newCount - it->oldCount, false);
+    rds.flushPipeline();
+}
+
+static bool topkHookRegistered = registerRelationHook(TopKStore::relationHook, TopKStore::relationBatchHook);
+
+/**
+ *  Fetch the k most frequent values of an entity attribute.  Redis orders equal counts in reverse
+ *  value order, so values tied with the last one returned are read again in value order.
+ */
+std::vector<ValueCount> TopKStore::fetch(RedisHandler& rds, std::string entity, std::string attribute, long k) {
+    std::string key = TopKStore::attributeKey(entity, attribute);
+    std::vector<std::pair<std::string, double>> members = rds.sortedSetTop(key, k);
+    std::vector<ValueCount> top;
+    if (members.size() == 0) return top;
+
+    double last = members.back().second;
+    for (std::vector<std::pair<std::string, double>>::iterator it = members.begin(); it != members.end(); ++it)
+        if (it->second > last)
+            top.push_back(ValueCount(it->first, std::lround(it->second)));
+
+    std::vector<std::string> tied = rds.sortedSetWithScore(key, last, members.size() - top.size());
+    for (std::vector<std::string>::iterator it = tied.begin(); it != tied.end(); ++it)
+        top.push_back(ValueCount(*it, std::lround(last)));
+    std::sort(top.begin(), top.end());
+    return top;
+}
+
+#endif